@@ -0,0 +1,22 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <sched.h>
+#include <pthread.h>
+
+// CPU placement of the reactor and worker threads
+
+// Parse a CPU list such as "0-3,8,10-11" into set, false when it is malformed or names no CPU
+bool parse_cpu_list(const char *text, cpu_set_t *set);
+// The n-th CPU of set in ascending order, wrapping around, -1 for an empty set
+int nth_cpu(const cpu_set_t *set, int n);
+// Restrict thread to one CPU, or to a set of CPUs
+bool pin_thread(pthread_t thread, int cpu);
+bool pin_thread(pthread_t thread, const cpu_set_t *set);
+// NUMA node of cpu as listed in sysfs, -1 when unknown
+int cpu_node(int cpu);
+// CPU that processed the last packet received on sockfd (SO_INCOMING_CPU), -1 when unknown. With RSS every
+// packet of a connection hashes to the same queue, so this is the CPU taking its interrupts.
+int incoming_cpu(int sockfd);
+
+#endif
@@ -0,0 +1,127 @@
+#ifdef ALLOC_STATS
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "alloc_stats.h"
+
+__thread alloc_shard *alloc_stats::t_shard = NULL;
+__thread alloc_tag alloc_stats::t_tag = A_OTHER;
+alloc_shard *alloc_stats::m_shards = NULL;
+pthread_key_t alloc_stats::m_exit_key;
+pthread_once_t alloc_stats::m_key_once = PTHREAD_ONCE_INIT;
+
+static const char *tag_names[A_TAG_NUM] = {"other", "reactor", "queue", "request", "store", "log", "debug"};
+
+void alloc_stats::create_key() {
+    pthread_key_create(&m_exit_key, release_shard);
+}
+
+alloc_shard *alloc_stats::add_shard() {
+    pthread_once(&m_key_once, create_key);
+    alloc_shard *s;
+    for (s = __atomic_load_n(&m_shards, __ATOMIC_ACQUIRE); s; s = s->next) {
+        int free = 0;
+        if (__atomic_compare_exchange_n(&s->owned, &free, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (!s) {
+        s = (alloc_shard *)calloc(1, sizeof(alloc_shard));
+        if (!s) {
+            abort();
+        }
+        s->owned = 1;
+        s->next = __atomic_load_n(&m_shards, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&m_shards, &s->next, s, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+    pthread_setspecific(m_exit_key, s);
+    return s;
+}
+
+void alloc_stats::release_shard(void *shard) {
+    t_shard = NULL;
+    __atomic_store_n(&((alloc_shard *)shard)->owned, 0, __ATOMIC_RELEASE);
+}
+
+void alloc_stats::render(string &out, unsigned long long requests) {
+    unsigned long long allocs[A_TAG_NUM] = {0};
+    unsigned long long bytes[A_TAG_NUM] = {0};
+    unsigned long long frees = 0;
+    for (alloc_shard *s = __atomic_load_n(&m_shards, __ATOMIC_ACQUIRE); s; s = s->next) {
+        for (int t = 0; t < A_TAG_NUM; ++t) {
+            allocs[t] += __atomic_load_n(&s->allocs[t], __ATOMIC_RELAXED);
+            bytes[t] += __atomic_load_n(&s->bytes[t], __ATOMIC_RELAXED);
+        }
+        frees += __atomic_load_n(&s->frees, __ATOMIC_RELAXED);
+    }
+
+    char line[128];
+    double per = requests ? (double)requests : 1.0;
+    unsigned long long steady = 0;
+    snprintf(line, sizeof(line), "%-10s %14s %16s %12s %12s\n", "subsystem", "allocs", "bytes", "allocs/req",
+             "bytes/req");
+    out += line;
+    for (int t = 0; t < A_TAG_NUM; ++t) {
+        snprintf(line, sizeof(line), "%-10s %14llu %16llu %12.3f %12.1f\n", tag_names[t], allocs[t], bytes[t],
+                 allocs[t] / per, bytes[t] / per);
+        out += line;
+        if (t != A_DEBUG) {
+            steady += allocs[t];
+        }
+    }
+    snprintf(line, sizeof(line), "requests %llu\nfrees %llu\nsteady_state_allocs %llu\n", requests, frees, steady);
+    out += line;
+}
+
+// Replacement global allocator, every form forwards to malloc and free
+void *operator new(size_t size) {
+    alloc_stats::allocated(size);
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    alloc_stats::allocated(size);
+    return malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &tag) noexcept {
+    return operator new(size, tag);
+}
+
+void operator delete(void *p) noexcept {
+    if (p) {
+        alloc_stats::freed();
+        free(p);
+    }
+}
+
+void operator delete[](void *p) noexcept {
+    operator delete(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    operator delete(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    operator delete(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+    operator delete(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+    operator delete(p);
+}
+#endif
@@ -0,0 +1,88 @@
+#ifndef ALLOC_STATS_H
+#define ALLOC_STATS_H
+
+#include <pthread.h>
+#include <string>
+
+using namespace std;
+
+// Subsystems heap allocations are charged to, set on the calling thread by ALLOC_SCOPE
+enum alloc_tag {
+    A_OTHER = 0,    // start-up and anything outside a scope
+    A_REACTOR,      // event loop: accept, timers, socket reads and writes
+    A_QUEUE,        // threadpool append and dequeue
+    A_REQUEST,      // httpHandler::process
+    A_STORE,        // user store lookups and registrations
+    A_LOG,          // Log::write_log
+    A_DEBUG,        // /metrics and /debug pages
+    A_TAG_NUM
+};
+
+// Allocation accounting, built with -DALLOC_STATS. The global operator new and delete are replaced by
+// versions that count calls and requested bytes in per-thread tallies, charged to the scope of the
+// calling thread. Without ALLOC_STATS nothing is replaced and ALLOC_SCOPE compiles away.
+#ifdef ALLOC_STATS
+struct alloc_shard {
+    unsigned long long allocs[A_TAG_NUM];
+    unsigned long long bytes[A_TAG_NUM];
+    unsigned long long frees;
+    alloc_shard *next;
+    // Set while a thread owns the shard, cleared when it exits so the next new thread takes it over
+    int owned;
+};
+
+class alloc_stats {
+public:
+    static void allocated(size_t size) {
+        alloc_shard *s = shard();
+        __atomic_store_n(&s->allocs[t_tag], s->allocs[t_tag] + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->bytes[t_tag], s->bytes[t_tag] + size, __ATOMIC_RELAXED);
+    }
+    static void freed() {
+        alloc_shard *s = shard();
+        __atomic_store_n(&s->frees, s->frees + 1, __ATOMIC_RELAXED);
+    }
+    static alloc_tag tag() { return t_tag; }
+    static void set_tag(alloc_tag tag) { t_tag = tag; }
+
+    // Totals per subsystem and per processed request. The last line, steady_state_allocs, counts every
+    // allocation outside A_DEBUG and is what scripts/alloc_check.sh compares before and after a run.
+    static void render(string &out, unsigned long long requests);
+
+private:
+    static alloc_shard *shard() {
+        if (!t_shard) {
+            t_shard = add_shard();
+        }
+        return t_shard;
+    }
+    // Shards come from malloc and are linked lock-free, registering one must not recurse into operator new.
+    // A shard released by an exited thread is claimed before a new one is made, and keeps its tallies.
+    static alloc_shard *add_shard();
+    // Thread exit hook
+    static void release_shard(void *shard);
+    static void create_key();
+
+    static __thread alloc_shard *t_shard;
+    static __thread alloc_tag t_tag;
+    static alloc_shard *m_shards;
+    static pthread_key_t m_exit_key;
+    static pthread_once_t m_key_once;
+};
+
+// Charge allocations of the enclosing block to tag, the previous scope is restored on exit
+class alloc_scope {
+public:
+    alloc_scope(alloc_tag tag) : m_prev(alloc_stats::tag()) { alloc_stats::set_tag(tag); }
+    ~alloc_scope() { alloc_stats::set_tag(m_prev); }
+
+private:
+    alloc_tag m_prev;
+};
+
+#define ALLOC_SCOPE(tag) alloc_scope alloc_scope_guard(tag)
+#else
+#define ALLOC_SCOPE(tag) do {} while (0)
+#endif
+
+#endif
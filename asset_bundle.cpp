@@ -0,0 +1,100 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "asset_bundle.h"
+
+#ifdef EMBED_BUNDLE
+// The bundle file named by EMBED_BUNDLE, assembled into read-only data of the binary
+__asm__(".section .rodata\n"
+        ".balign 64\n"
+        "embedded_bundle:\n"
+        ".incbin \"" EMBED_BUNDLE "\"\n"
+        "embedded_bundle_end:\n"
+        ".previous\n");
+extern "C" const char embedded_bundle[], embedded_bundle_end[];
+#endif
+
+// True when s and its NUL lie inside the size bytes at data
+static bool inside(const char *data, uint64_t size, const bundle_string &s) {
+    return (uint64_t)s.offset + s.len < size && data[s.offset + s.len] == '\0';
+}
+
+bool asset_bundle::load(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(bundle_header)) {
+        close(fd);
+        return false;
+    }
+    void *data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    if (!attach((const char *)data, st.st_size)) {
+        munmap(data, st.st_size);
+        return false;
+    }
+    return true;
+}
+
+bool asset_bundle::load_embedded() {
+#ifdef EMBED_BUNDLE
+    return attach(embedded_bundle, embedded_bundle_end - embedded_bundle);
+#else
+    return false;
+#endif
+}
+
+bool asset_bundle::attach(const char *data, size_t size) {
+    const bundle_header *h = (const bundle_header *)data;
+    if (size < sizeof(*h) || memcmp(h->magic, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC)) != 0 ||
+        h->version != BUNDLE_VERSION || h->size > size || h->bucket_count == 0 ||
+        h->displacements % sizeof(uint32_t) != 0 || h->displacements > h->size ||
+        (h->size - h->displacements) / sizeof(uint32_t) < h->bucket_count ||
+        h->assets % sizeof(uint64_t) != 0 || h->assets > h->size ||
+        (h->size - h->assets) / sizeof(bundle_asset) < h->asset_count) {
+        return false;
+    }
+    // Checked once here, so serving can trust every offset
+    const bundle_asset *assets = (const bundle_asset *)(data + h->assets);
+    for (uint32_t i = 0; i < h->asset_count; ++i) {
+        const bundle_asset &a = assets[i];
+        if (!inside(data, h->size, a.path) || !inside(data, h->size, a.content_type) ||
+            !inside(data, h->size, a.last_modified) || !(a.encodings & 1)) {
+            return false;
+        }
+        for (int e = 0; e < BUNDLE_ENCODINGS; ++e) {
+            const bundle_body &b = a.bodies[e];
+            if ((a.encodings & (1 << e)) &&
+                (b.offset > h->size || h->size - b.offset < b.size || !inside(data, h->size, b.etag) ||
+                 !inside(data, h->size, b.validators) || !inside(data, h->size, b.headers))) {
+                return false;
+            }
+        }
+    }
+    m_data = data;
+    m_header = h;
+    m_displacements = (const uint32_t *)(data + h->displacements);
+    m_assets = assets;
+    return true;
+}
+
+const bundle_asset *asset_bundle::find(const char *url) const {
+    if (!m_header || m_header->asset_count == 0) {
+        return NULL;
+    }
+    size_t len = strlen(url);
+    uint32_t seed = m_displacements[bundle_hash(url, len, 0) % m_header->bucket_count];
+    const bundle_asset &a = m_assets[bundle_hash(url, len, seed) % m_header->asset_count];
+    if (a.path.len != len || memcmp(text(a.path), url, len) != 0) {
+        return NULL;
+    }
+    return &a;
+}
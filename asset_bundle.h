@@ -0,0 +1,95 @@
+#ifndef ASSET_BUNDLE_H
+#define ASSET_BUNDLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Files of a directory packed by tools/pack_assets into one read-only blob, served without touching the
+// file system. The blob is mapped from a sidecar file (-B) or, in builds with -DEMBED_BUNDLE="file", linked
+// into the binary. It is read in place: a header, the displacements of a perfect hash over the URL paths,
+// one bundle_asset per slot of that hash, then strings and the bodies. Every asset carries its identity body
+// and, for compressible types, the gzip and zstd bodies that were worth keeping. Each body comes with its
+// ETag and with its ETag, Last-Modified, Content-Type and Content-Encoding header lines formatted at pack
+// time. Offsets count from the start of the blob, integers are in the byte order of the packing machine.
+
+#define BUNDLE_MAGIC "WSBUNDL"
+static const uint32_t BUNDLE_VERSION = 1;
+// Bodies by content coding, in the order of httpHandler::ENCODING: identity, gzip, zstd
+static const int BUNDLE_ENCODINGS = 3;
+
+struct bundle_header {
+    char magic[8];              // BUNDLE_MAGIC and its NUL
+    uint32_t version;
+    uint32_t asset_count;       // slots of the perfect hash, one per asset
+    uint32_t bucket_count;      // displacements, a path hashed with seed 0 picks one
+    uint32_t reserved;
+    uint64_t size;              // bytes in the blob
+    uint64_t displacements;     // uint32_t[bucket_count]
+    uint64_t assets;            // bundle_asset[asset_count], in slot order
+};
+
+// NUL terminated text at offset, len bytes before the NUL
+struct bundle_string {
+    uint32_t offset;
+    uint32_t len;
+};
+
+struct bundle_body {
+    uint64_t offset;
+    uint64_t size;
+    bundle_string etag;         // quoted strong ETag made from a hash of the body
+    bundle_string validators;   // "ETag:...\r\nLast-Modified:...\r\n"
+    bundle_string headers;      // "Content-Type:...\r\n", then "Content-Encoding:...\r\n" when encoded
+};
+
+struct bundle_asset {
+    bundle_string path;         // URL path, "/home.html"
+    bundle_string content_type; // empty when the extension is unknown
+    bundle_string last_modified;
+    int64_t mtime;
+    uint32_t compressible;
+    uint32_t encodings;         // bit e set when bodies[e] is present, identity always is
+    bundle_body bodies[BUNDLE_ENCODINGS];
+};
+
+// FNV-1a of the first len bytes of s, started from a state that depends on seed
+inline uint64_t bundle_hash(const char *s, size_t len, uint32_t seed) {
+    uint64_t hash = 14695981039346656037ULL ^ (seed * 0x9E3779B97F4A7C15ULL);
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ (unsigned char)s[i]) * 1099511628211ULL;
+    }
+    return hash ^ (hash >> 29);
+}
+
+class asset_bundle {
+public:
+    static asset_bundle *get_instance() {
+        static asset_bundle instance;
+        return &instance;
+    }
+
+    // Map the bundle in the file at path, false when it cannot be read or is not a valid bundle
+    bool load(const char *path);
+    // Serve the bundle linked in by an EMBED_BUNDLE build, false in other builds
+    bool load_embedded();
+    bool loaded() const { return m_data != NULL; }
+    // The asset at url, NULL when the bundle has none. Hashes url twice and compares it once.
+    const bundle_asset *find(const char *url) const;
+    const char *text(const bundle_string &s) const { return m_data + s.offset; }
+    char *body(const bundle_body &b) const { return (char *)m_data + b.offset; }
+    uint32_t size() const { return m_header ? m_header->asset_count : 0; }
+    uint64_t bytes() const { return m_header ? m_header->size : 0; }
+
+private:
+    asset_bundle() : m_data(NULL), m_header(NULL), m_displacements(NULL), m_assets(NULL) {}
+    // Check that data holds a bundle whose offsets all fall inside it, then serve it
+    bool attach(const char *data, size_t size);
+
+private:
+    const char *m_data;
+    const bundle_header *m_header;
+    const uint32_t *m_displacements;
+    const bundle_asset *m_assets;
+};
+
+#endif
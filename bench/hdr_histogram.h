@@ -0,0 +1,140 @@
+#ifndef HDR_HISTOGRAM_H
+#define HDR_HISTOGRAM_H
+
+#include <stdio.h>
+#include <string.h>
+
+// Log-linear latency histogram in nanoseconds, HDR style like latency_histogram in metrics.h but with
+// 2^SUB_BITS = 128 sub-buckets per power of two, so every value is kept within 0.8%. One writer per
+// instance, merge() combines the per-thread ones.
+class hdr_histogram {
+public:
+    static const int SUB_BITS = 7;
+    static const int SUB_COUNT = 1 << SUB_BITS;
+    static const int MAX_EXP = 40;
+    static const int BUCKETS = (MAX_EXP - SUB_BITS + 2) << SUB_BITS;
+
+    hdr_histogram() { reset(); }
+
+    void reset() {
+        memset(m_counts, 0, sizeof(m_counts));
+        m_total = 0;
+        m_max = 0;
+    }
+
+    static int bucket(unsigned long long v) {
+        if (v < (unsigned long long)SUB_COUNT) {
+            return (int)v;
+        }
+        int exp = 63 - __builtin_clzll(v);
+        if (exp > MAX_EXP) {
+            return BUCKETS - 1;
+        }
+        int shift = exp - SUB_BITS;
+        return ((exp - SUB_BITS + 1) << SUB_BITS) + (int)((v >> shift) & (SUB_COUNT - 1));
+    }
+    // Midpoint of the values counted in bucket idx
+    static unsigned long long value(int idx) {
+        if (idx < SUB_COUNT) {
+            return idx;
+        }
+        int exp = (idx >> SUB_BITS) + SUB_BITS - 1;
+        int shift = exp - SUB_BITS;
+        unsigned long long lower = (unsigned long long)(SUB_COUNT + (idx & (SUB_COUNT - 1))) << shift;
+        return lower + ((1ULL << shift) >> 1);
+    }
+
+    void record(unsigned long long v, unsigned long long count = 1) {
+        m_counts[bucket(v)] += count;
+        m_total += count;
+        if (v > m_max) {
+            m_max = v;
+        }
+    }
+    // Closed-loop correction for coordinated omission, as HdrHistogram's copyCorrectedForCoordinatedOmission:
+    // a response that took v stalled the requests that would have been sent every interval meanwhile, so
+    // v - interval, v - 2 * interval, ... are counted too.
+    void corrected(unsigned long long interval, hdr_histogram &out) const {
+        out.reset();
+        for (int i = 0; i < BUCKETS; ++i) {
+            if (m_counts[i]) {
+                unsigned long long v = value(i);
+                out.record(v, m_counts[i]);
+                for (unsigned long long missed = v > interval ? v - interval : 0; interval && missed >= interval;
+                     missed -= interval) {
+                    out.record(missed, m_counts[i]);
+                }
+            }
+        }
+        out.m_max = m_max;
+    }
+
+    void merge(const hdr_histogram &other) {
+        for (int i = 0; i < BUCKETS; ++i) {
+            m_counts[i] += other.m_counts[i];
+        }
+        m_total += other.m_total;
+        if (other.m_max > m_max) {
+            m_max = other.m_max;
+        }
+    }
+
+    unsigned long long total() const { return m_total; }
+    unsigned long long max() const { return m_max; }
+    unsigned long long mean() const {
+        double sum = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            sum += (double)value(i) * m_counts[i];
+        }
+        return m_total ? (unsigned long long)(sum / m_total) : 0;
+    }
+    unsigned long long percentile(double p) const {
+        if (m_total == 0) {
+            return 0;
+        }
+        unsigned long long rank = (unsigned long long)(p / 100.0 * m_total + 0.5);
+        if (rank < 1) {
+            rank = 1;
+        }
+        unsigned long long seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += m_counts[i];
+            if (seen >= rank) {
+                unsigned long long v = value(i);
+                return v < m_max ? v : m_max;
+            }
+        }
+        return m_max;
+    }
+
+    // Percentile distribution in the layout of HdrHistogram's outputPercentileDistribution, in ms
+    void print_distribution(FILE *out) const {
+        fprintf(out, "%12s %14s %10s %14s\n", "Value(ms)", "Percentile", "TotalCount", "1/(1-Percentile)");
+        unsigned long long seen = 0;
+        double next = 0.0;
+        for (int i = 0; i < BUCKETS && m_total; ++i) {
+            if (!m_counts[i]) {
+                continue;
+            }
+            seen += m_counts[i];
+            double pct = (double)seen / m_total;
+            if (pct >= next || seen == m_total) {
+                if (seen == m_total) {
+                    fprintf(out, "%12.3f %14.12f %10llu %14s\n", value(i) / 1e6, 1.0, seen, "inf");
+                    break;
+                }
+                fprintf(out, "%12.3f %14.12f %10llu %14.2f\n", value(i) / 1e6, pct, seen, 1.0 / (1.0 - pct));
+                // Step a tenth of the remaining distance to 100%, so the tail gets ever finer lines
+                double step = (1.0 - pct) / 10.0;
+                next = pct + (step > 1e-7 ? step : 1e-7);
+            }
+        }
+    }
+
+private:
+    unsigned long long m_counts[BUCKETS];
+    unsigned long long m_total;
+    unsigned long long m_max;
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef HTTP_RESPONSE_H
+#define HTTP_RESPONSE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+// Incremental parser of the server's HTTP/1.1 responses, which always carry Content-Length. Bodies are
+// skipped without being buffered, a header is parsed once it is complete in the buffer.
+struct response_parser {
+    int status;                 // of the response being parsed or just completed
+    bool in_body;
+    long long body_left;
+    bool server_closes;         // a response announced Connection: close
+
+    response_parser() { reset(); }
+
+    void reset() {
+        status = 0;
+        in_body = false;
+        body_left = 0;
+        server_closes = false;
+    }
+
+    // Consume every complete response in buf[0, len) and call done() after each, returns the bytes consumed.
+    // The caller keeps the rest, an incomplete header, for the next call.
+    template <typename F>
+    int parse(char *buf, int len, F done) {
+        int off = 0;
+        while (off < len) {
+            if (in_body) {
+                long long take = len - off < body_left ? len - off : body_left;
+                off += take;
+                body_left -= take;
+                if (body_left == 0) {
+                    in_body = false;
+                    done();
+                }
+                continue;
+            }
+            char *start = buf + off;
+            char *end = (char *)memmem(start, len - off, "\r\n\r\n", 4);
+            if (!end) {
+                break;
+            }
+            *end = '\0';
+            status = 0;
+            sscanf(start, "HTTP/%*s %d", &status);
+            body_left = 0;
+            for (char *line = strstr(start, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+                if (strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+                    body_left = atoll(line + 17);
+                } else if (strncasecmp(line + 2, "Connection:", 11) == 0 && strcasestr(line + 13, "close")) {
+                    server_closes = true;
+                }
+            }
+            off = end + 4 - buf;
+            in_body = body_left > 0;
+            if (!in_body) {
+                done();
+            }
+        }
+        return off;
+    }
+};
+
+#endif
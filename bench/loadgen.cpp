@@ -0,0 +1,506 @@
+// HTTP load generator for the server, built by `make bench`.
+//
+// Every thread runs its own epoll loop over a share of the connections. In closed-loop mode (no -r) each
+// connection keeps -P requests in flight and sends the next one as soon as a response arrives. In open-loop
+// mode (-r rate) each connection sends on a fixed schedule, and latency is measured from the time a request
+// was due rather than the time it was sent, so a stalled server is charged for every request it delayed
+// (coordinated omission). Closed-loop results are also reported corrected after the fact, HdrHistogram
+// style, with the mean latency as the expected interval.
+//
+// The request mix comes from a scenario file, one request per line, with request headers written without spaces:
+//     # weight method path [Header:value ...] [urlencoded body]
+//     70 GET /picture.jpg
+//     20 GET /home.html Range:bytes=0-65535
+//     10 POST /2 user=bench&password=bench
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "hdr_histogram.h"
+#include "http_response.h"
+
+using namespace std;
+
+static const int MAX_DEPTH = 64;
+static const int READ_SIZE = 64 * 1024;
+
+static unsigned long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct options {
+    const char *host;
+    int port;
+    int threads;
+    int connections;
+    int duration;
+    int warmup;
+    double rate;            // requests per second over all connections, 0 for closed loop
+    int depth;              // requests in flight per connection
+    bool keepalive;
+    const char *scenario;
+    int abandon;            // percent of sends after which the connection is reset without waiting for a response
+};
+
+// Request mix, every request pre-rendered
+struct request_kind {
+    int weight;
+    string text;
+};
+
+struct scenario {
+    vector<request_kind> kinds;
+    int total_weight;
+};
+
+static bool load_scenario(const options &opt, scenario &sc) {
+    char host[64];
+    snprintf(host, sizeof(host), "%s:%d", opt.host, opt.port);
+    const char *conn = opt.keepalive ? "keep-alive" : "close";
+    vector<string> lines;
+    if (!opt.scenario) {
+        lines.push_back("1 GET /");
+    } else {
+        FILE *fp = fopen(opt.scenario, "r");
+        if (!fp) {
+            fprintf(stderr, "cannot open scenario %s\n", opt.scenario);
+            return false;
+        }
+        char line[4096];
+        while (fgets(line, sizeof(line), fp)) {
+            lines.push_back(line);
+        }
+        fclose(fp);
+    }
+
+    sc.total_weight = 0;
+    for (size_t i = 0; i < lines.size(); ++i) {
+        int weight = 0;
+        char method[16], path[1024];
+        int used = 0;
+        int n = sscanf(lines[i].c_str(), "%d %15s %1023s%n", &weight, method, path, &used);
+        if (n < 3 || lines[i][0] == '#') {
+            continue;
+        }
+        // The remaining words are headers, Name:value, and at most one body
+        string headers, body;
+        char word[2048];
+        int len;
+        for (const char *p = lines[i].c_str() + used; sscanf(p, "%2047s%n", word, &len) == 1; p += len) {
+            const char *colon = strchr(word, ':');
+            if (colon && colon > word && strcspn(word, "=&") > (size_t)(colon - word)) {
+                headers += string(word, colon - word) + ": " + (colon + 1) + "\r\n";
+            } else {
+                body = word;
+            }
+        }
+        char head[8192];
+        if (!body.empty()) {
+            snprintf(head, sizeof(head),
+                     "%s %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n%s"
+                     "Content-Type: application/x-www-form-urlencoded\r\nContent-Length: %d\r\n\r\n%s",
+                     method, path, host, conn, headers.c_str(), (int)body.size(), body.c_str());
+        } else {
+            snprintf(head, sizeof(head), "%s %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n%s\r\n", method, path,
+                     host, conn, headers.c_str());
+        }
+        request_kind kind = {weight, head};
+        sc.kinds.push_back(kind);
+        sc.total_weight += weight;
+    }
+    if (sc.kinds.empty() || sc.total_weight <= 0) {
+        fprintf(stderr, "scenario has no requests\n");
+        return false;
+    }
+    return true;
+}
+
+// One client connection and the due times of its requests in flight, oldest first
+struct connection {
+    int fd;
+    unsigned long long due[MAX_DEPTH];
+    int head;
+    int inflight;
+    unsigned long long next_due;    // open loop: when the next request should go out
+    string out;
+    size_t out_off;
+    char in[READ_SIZE];
+    int in_len;
+    response_parser parser;
+};
+
+struct worker {
+    pthread_t thread;
+    const options *opt;
+    const scenario *sc;
+    int first_conn;
+    int conns;
+    unsigned long long start;
+    unsigned long long measure_from;
+    unsigned long long end;
+    unsigned long long rng;
+    hdr_histogram hist;
+    unsigned long long requests;
+    unsigned long long bytes;
+    unsigned long long status[6];   // by status class, 0 for unparsable
+    unsigned long long errors;
+    unsigned long long reconnects;
+    unsigned long long abandoned;
+};
+
+static unsigned int next_random(worker *w) {
+    // xorshift64*
+    w->rng ^= w->rng >> 12;
+    w->rng ^= w->rng << 25;
+    w->rng ^= w->rng >> 27;
+    return (unsigned int)((w->rng * 2685821657736338717ULL) >> 32);
+}
+
+static int open_connection(const options *opt) {
+    int fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opt->port);
+    inet_pton(AF_INET, opt->host, &addr.sin_addr);
+    // Loopback connects complete immediately, so connect blocking and switch to non-blocking after
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+static void watch(int epfd, connection *c, int op) {
+    struct epoll_event ev;
+    ev.data.ptr = c;
+    ev.events = EPOLLIN | (c->out_off < c->out.size() ? (uint32_t)EPOLLOUT : 0);
+    epoll_ctl(epfd, op, c->fd, &ev);
+}
+
+static void reset_connection(connection *c) {
+    c->head = 0;
+    c->inflight = 0;
+    c->out.clear();
+    c->out_off = 0;
+    c->in_len = 0;
+    c->parser.reset();
+}
+
+// Requests in flight are lost with the connection and count as errors. expected is set when the server
+// closed after its response as announced, which is not counted as a reconnect.
+static bool reconnect(worker *w, int epfd, connection *c, bool expected = false) {
+    if (c->fd >= 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+    }
+    if (now_ns() >= w->measure_from) {
+        w->errors += c->inflight;
+    }
+    reset_connection(c);
+    c->fd = open_connection(w->opt);
+    if (c->fd < 0) {
+        return false;
+    }
+    if (!expected) {
+        ++w->reconnects;
+    }
+    watch(epfd, c, EPOLL_CTL_ADD);
+    return true;
+}
+
+// Reset the connection with its requests in flight, so the server closes it while they are queued or processed
+// and hands the fd to the next connection. The requests count as abandoned rather than as errors.
+static bool abandon(worker *w, int epfd, connection *c) {
+    struct linger lg = {1, 0};
+    setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    w->abandoned += c->inflight;
+    c->inflight = 0;
+    return reconnect(w, epfd, c, true);
+}
+
+static void flush_out(worker *w, int epfd, connection *c) {
+    while (c->out_off < c->out.size()) {
+        ssize_t n = send(c->fd, c->out.data() + c->out_off, c->out.size() - c->out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN) {
+                reconnect(w, epfd, c);
+            }
+            break;
+        }
+        c->out_off += n;
+    }
+    if (c->out_off == c->out.size()) {
+        c->out.clear();
+        c->out_off = 0;
+    }
+    watch(epfd, c, EPOLL_CTL_MOD);
+}
+
+// Queue one request due at due, picked from the mix
+static void send_request(worker *w, connection *c, unsigned long long due) {
+    int pick = next_random(w) % w->sc->total_weight;
+    size_t k = 0;
+    while (pick >= w->sc->kinds[k].weight) {
+        pick -= w->sc->kinds[k].weight;
+        ++k;
+    }
+    c->out += w->sc->kinds[k].text;
+    c->due[(c->head + c->inflight) % MAX_DEPTH] = due;
+    ++c->inflight;
+}
+
+static void response_done(worker *w, connection *c, unsigned long long now) {
+    unsigned long long due = c->due[c->head];
+    c->head = (c->head + 1) % MAX_DEPTH;
+    --c->inflight;
+    if (now >= w->measure_from && now < w->end) {
+        w->hist.record(now - due);
+        ++w->requests;
+        int cls = c->parser.status / 100;
+        ++w->status[cls >= 1 && cls <= 5 ? cls : 0];
+    }
+}
+
+// Parse every complete response in the input buffer
+static void parse_responses(worker *w, connection *c, unsigned long long now) {
+    int off = c->parser.parse(c->in, c->in_len, [&]() { response_done(w, c, now); });
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+}
+
+static void *run_worker(void *arg) {
+    worker *w = (worker *)arg;
+    const options *opt = w->opt;
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    vector<connection *> conns;
+    bool open_loop = opt->rate > 0;
+    // Each connection carries an equal share of the rate, their schedules are staggered over one interval
+    unsigned long long interval = open_loop ? (unsigned long long)(1e9 * opt->connections / opt->rate) : 0;
+    for (int i = 0; i < w->conns; ++i) {
+        connection *c = new connection();
+        reset_connection(c);
+        c->fd = open_connection(opt);
+        if (c->fd < 0) {
+            fprintf(stderr, "cannot connect to %s:%d\n", opt->host, opt->port);
+            exit(1);
+        }
+        c->next_due = w->start + interval * (w->first_conn + i) / opt->connections;
+        watch(epfd, c, EPOLL_CTL_ADD);
+        conns.push_back(c);
+    }
+
+    struct epoll_event events[256];
+    while (true) {
+        unsigned long long now = now_ns();
+        if (now >= w->end) {
+            break;
+        }
+        // Send what is due, or in closed loop whatever the pipeline depth allows
+        unsigned long long wake = w->end;
+        for (size_t i = 0; i < conns.size(); ++i) {
+            connection *c = conns[i];
+            if (c->fd < 0 && !reconnect(w, epfd, c)) {
+                continue;
+            }
+            bool queued = false;
+            if (open_loop) {
+                while (c->next_due <= now && c->inflight < opt->depth) {
+                    send_request(w, c, c->next_due);
+                    c->next_due += interval;
+                    queued = true;
+                }
+                if (c->inflight < opt->depth && c->next_due < wake) {
+                    wake = c->next_due;
+                }
+            } else {
+                while (c->inflight < opt->depth) {
+                    send_request(w, c, now);
+                    queued = true;
+                }
+            }
+            if (queued) {
+                flush_out(w, epfd, c);
+                if (opt->abandon && c->fd >= 0 && (int)(next_random(w) % 100) < opt->abandon) {
+                    abandon(w, epfd, c);
+                }
+            }
+        }
+        int timeout = wake > now ? (int)((wake - now) / 1000000) : 0;
+        int n = epoll_wait(epfd, events, 256, timeout);
+        now = now_ns();
+        for (int i = 0; i < n; ++i) {
+            connection *c = (connection *)events[i].data.ptr;
+            if (events[i].events & EPOLLOUT) {
+                flush_out(w, epfd, c);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                ssize_t got = recv(c->fd, c->in + c->in_len, READ_SIZE - c->in_len, 0);
+                if (got <= 0) {
+                    if (got < 0 && errno == EAGAIN) {
+                        continue;
+                    }
+                    reconnect(w, epfd, c);
+                    continue;
+                }
+                if (now >= w->measure_from && now < w->end) {
+                    w->bytes += got;
+                }
+                c->in_len += got;
+                parse_responses(w, c, now);
+                if (c->parser.server_closes && c->inflight == 0) {
+                    reconnect(w, epfd, c, true);
+                } else if (c->in_len == READ_SIZE) {
+                    // Response header larger than the buffer
+                    reconnect(w, epfd, c);
+                }
+            }
+        }
+    }
+    for (size_t i = 0; i < conns.size(); ++i) {
+        if (conns[i]->fd >= 0) {
+            close(conns[i]->fd);
+        }
+        delete conns[i];
+    }
+    close(epfd);
+    return NULL;
+}
+
+static void print_latency(const char *title, const hdr_histogram &h) {
+    printf("%s\n", title);
+    printf("  p50 %.3f ms  p90 %.3f ms  p99 %.3f ms  p99.9 %.3f ms  p99.99 %.3f ms  max %.3f ms\n",
+           h.percentile(50) / 1e6, h.percentile(90) / 1e6, h.percentile(99) / 1e6, h.percentile(99.9) / 1e6,
+           h.percentile(99.99) / 1e6, h.max() / 1e6);
+}
+
+static void usage(const char *prog) {
+    printf("usage: %s [-H host] [-t threads] [-c connections] [-d seconds] [-w warmup_seconds] [-r rate]\n"
+           "       [-P pipeline_depth] [-C] [-A abandon_percent] [-f scenario_file] port\n"
+           "  -r    open loop at rate requests/s over all connections, closed loop without it\n"
+           "  -C    send Connection: close and open a new connection per request\n"
+           "  -A    reset the connection right after sending in percent of cases, to churn server fds\n",
+           prog);
+}
+
+int main(int argc, char *argv[]) {
+    options opt = {"127.0.0.1", 0, 2, 16, 10, 2, 0, 1, true, NULL, 0};
+    int c;
+    while ((c = getopt(argc, argv, "H:t:c:d:w:r:P:CA:f:")) != -1) {
+        switch (c) {
+        case 'H': opt.host = optarg; break;
+        case 't': opt.threads = atoi(optarg); break;
+        case 'c': opt.connections = atoi(optarg); break;
+        case 'd': opt.duration = atoi(optarg); break;
+        case 'w': opt.warmup = atoi(optarg); break;
+        case 'r': opt.rate = atof(optarg); break;
+        case 'P': opt.depth = atoi(optarg); break;
+        case 'C': opt.keepalive = false; break;
+        case 'A': opt.abandon = atoi(optarg); break;
+        case 'f': opt.scenario = optarg; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (argc <= optind) {
+        usage(argv[0]);
+        return 1;
+    }
+    opt.port = atoi(argv[optind]);
+    if (opt.threads < 1 || opt.connections < opt.threads || opt.duration < 1 || opt.depth < 1 ||
+        opt.depth > MAX_DEPTH) {
+        fprintf(stderr, "need 1 <= threads <= connections, duration >= 1 and 1 <= depth <= %d\n", MAX_DEPTH);
+        return 1;
+    }
+    if (!opt.keepalive) {
+        opt.depth = 1;
+    }
+    scenario sc;
+    if (!load_scenario(opt, sc)) {
+        return 1;
+    }
+
+    if (opt.rate > 0) {
+        printf("Running %ds open loop at %.0f req/s @ %s:%d, %d threads, %d connections, depth %d%s\n",
+               opt.duration, opt.rate, opt.host, opt.port, opt.threads, opt.connections, opt.depth,
+               opt.keepalive ? "" : ", no keep-alive");
+    } else {
+        printf("Running %ds closed loop @ %s:%d, %d threads, %d connections, depth %d%s\n", opt.duration, opt.host,
+               opt.port, opt.threads, opt.connections, opt.depth, opt.keepalive ? "" : ", no keep-alive");
+    }
+
+    unsigned long long start = now_ns() + 50000000ULL;
+    vector<worker *> workers;
+    for (int i = 0; i < opt.threads; ++i) {
+        worker *w = new worker();
+        w->opt = &opt;
+        w->sc = &sc;
+        w->first_conn = opt.connections * i / opt.threads;
+        w->conns = opt.connections * (i + 1) / opt.threads - w->first_conn;
+        w->start = start;
+        w->measure_from = start + opt.warmup * 1000000000ULL;
+        w->end = w->measure_from + opt.duration * 1000000000ULL;
+        w->rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        pthread_create(&w->thread, NULL, run_worker, w);
+        workers.push_back(w);
+    }
+
+    hdr_histogram *hist = new hdr_histogram();
+    unsigned long long requests = 0, bytes = 0, errors = 0, reconnects = 0, abandoned = 0;
+    unsigned long long status[6] = {0};
+    for (size_t i = 0; i < workers.size(); ++i) {
+        worker *w = workers[i];
+        pthread_join(w->thread, NULL);
+        hist->merge(w->hist);
+        requests += w->requests;
+        bytes += w->bytes;
+        errors += w->errors;
+        reconnects += w->reconnects;
+        abandoned += w->abandoned;
+        for (int s = 0; s < 6; ++s) {
+            status[s] += w->status[s];
+        }
+        delete w;
+    }
+
+    printf("  %llu requests in %ds, %.1f req/s, %.2f MB/s\n", requests, opt.duration,
+           (double)requests / opt.duration, bytes / 1e6 / opt.duration);
+    printf("  status 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, other %llu, errors %llu, reconnects %llu\n",
+           status[2], status[3], status[4], status[5], status[0] + status[1], errors, reconnects);
+    if (opt.abandon) {
+        printf("  %llu requests abandoned\n", abandoned);
+    }
+    if (opt.rate > 0) {
+        print_latency("Latency from the scheduled send time (corrected for coordinated omission):", *hist);
+        hist->print_distribution(stdout);
+    } else {
+        hdr_histogram *corrected = new hdr_histogram();
+        hist->corrected(hist->mean(), *corrected);
+        print_latency("Latency as measured:", *hist);
+        print_latency("Latency corrected for coordinated omission (expected interval = mean):", *corrected);
+        corrected->print_distribution(stdout);
+        delete corrected;
+    }
+    delete hist;
+    return 0;
+}
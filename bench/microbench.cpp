@@ -0,0 +1,526 @@
+// Microbenchmarks of the server's internal components, built by `make microbench`.
+//
+// Every benchmark times a batch of operations and reports nanoseconds per operation. The batch size is
+// calibrated so one run takes about -t milliseconds, a few warm-up runs are discarded, and the mean,
+// standard deviation, minimum and median over -n runs are printed. The measuring thread is pinned to one
+// CPU (-c), threads a benchmark starts itself may run on any CPU the process was allowed. With -o the
+// results are also written as JSON, tagged with -l, so two commits can be compared run against run.
+//
+//     bench/microbench [-n runs] [-t ms_per_run] [-w warmup_runs] [-c cpu] [-r doc_root] [-o out.json]
+//                      [-l label] [name_prefix ...]
+#include "../http_handler.h"
+#include "../thread_pool.h"
+#include "../timer.h"
+#include "../user_store.h"
+#include "../log.h"
+
+#include <dirent.h>
+#include <sched.h>
+#include <time.h>
+#include <math.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+extern const char *doc_root;
+
+// Gives the benchmarks the parser and response assembly without a socket
+struct http_bench {
+    static void load(httpHandler &h, const char *request, int len) {
+        h.init();
+        memcpy(h.m_read_buf, request, len);
+        h.m_read_idx = len;
+    }
+    static httpHandler::HTTP_CODE parse(httpHandler &h) { return h.processRead(); }
+    static bool write(httpHandler &h, httpHandler::HTTP_CODE code) {
+        h.m_writeBuff_idx = 0;
+        return h.processWrite(code);
+    }
+    static void release(httpHandler &h) { h.unmap(); }
+};
+
+static unsigned long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int rng_state = 2463534242u;
+static unsigned int rnd() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+// Keeps a result alive so the compiler cannot drop the work producing it
+static volatile unsigned long long sink;
+
+static cpu_set_t all_cpus;
+
+// Timer wheel holding LIVE connections' timers, expire stamps grow like the reactor's phase deadlines
+static const int LIVE = 1024;
+static timer_wheel live_timers;
+static util_timer *live[LIVE];
+static client_data timer_users[LIVE];
+static unsigned long long expire_clock;
+
+static void noop_cb(client_data *) {}
+
+static void setup_timers() {
+    expire_clock = timer_wheel::now_ms() + 10000;
+    for (int i = 0; i < LIVE; ++i) {
+        timer_users[i].sockfd = i;
+        live[i] = live_timers.new_timer();
+        live[i]->expire = ++expire_clock;
+        live[i]->cb_func = noop_cb;
+        live[i]->user_data = &timer_users[i];
+        live_timers.add_timer(live[i]);
+    }
+}
+
+// A connection closes and a new one is accepted: its timer joins 1024 live ones
+static unsigned long long bench_timer_add(long n) {
+    unsigned long long start = now_ns();
+    for (long i = 0; i < n; ++i) {
+        int idx = rnd() % LIVE;
+        live_timers.del_timer(live[idx]);
+        util_timer *timer = live_timers.new_timer();
+        timer->expire = ++expire_clock;
+        timer->cb_func = noop_cb;
+        timer->user_data = &timer_users[idx];
+        live_timers.add_timer(timer);
+        live[idx] = timer;
+    }
+    return now_ns() - start;
+}
+
+// A request renews one of 1024 live timers
+static unsigned long long bench_timer_adjust(long n) {
+    unsigned long long start = now_ns();
+    for (long i = 0; i < n; ++i) {
+        util_timer *timer = live[rnd() % LIVE];
+        timer->expire = ++expire_clock;
+        live_timers.adjust_timer(timer);
+    }
+    return now_ns() - start;
+}
+
+// One tick expiring 64 idle connections, each tick one slot later
+static unsigned long long bench_timer_tick(long n) {
+    static timer_wheel expired;
+    static unsigned long long clock = timer_wheel::now_ms();
+    unsigned long long elapsed = 0;
+    for (long i = 0; i < n; ++i) {
+        for (int j = 0; j < 64; ++j) {
+            util_timer *timer = expired.new_timer();
+            timer->expire = 1;
+            timer->cb_func = noop_cb;
+            timer->user_data = &timer_users[j];
+            expired.add_timer(timer);
+        }
+        unsigned long long start = now_ns();
+        expired.tick(clock += timer_wheel::SLOT_MS);
+        elapsed += now_ns() - start;
+    }
+    return elapsed;
+}
+
+struct ping {
+    ping() : done(0, "microbench.ping") {}
+    void process() { done.post(); }
+    bool closing() const { return false; }
+    void release() {}
+    sem done;
+};
+static threadpool<ping> *pool;
+static threadpool<ping> *spin_pool;
+
+// Append to the worker queue and wait until a worker ran the request
+static unsigned long long roundtrip(threadpool<ping> *tp, long n) {
+    static ping request;
+    unsigned long long start = now_ns();
+    for (long i = 0; i < n; ++i) {
+        tp->append(&request);
+        request.done.wait();
+    }
+    return now_ns() - start;
+}
+static unsigned long long bench_threadpool_roundtrip(long n) { return roundtrip(pool, n); }
+// Same with workers spinning up to 50us before parking, only meaningful with a spare CPU for them
+static unsigned long long bench_threadpool_roundtrip_spin(long n) { return roundtrip(spin_pool, n); }
+
+static void *log_writer(void *arg) {
+    long lines = (long)arg;
+    pthread_setaffinity_np(pthread_self(), sizeof(all_cpus), &all_cpus);
+    for (long i = 0; i < lines; ++i) {
+        LOG_INFO("GET /picture.jpg HTTP/1.1 %ld", i);
+    }
+    return NULL;
+}
+
+// n log lines written by threads writers together, per line of wall time
+static unsigned long long log_contention(long n, int threads) {
+    pthread_t tids[16];
+    unsigned long long start = now_ns();
+    for (int i = 0; i < threads; ++i) {
+        pthread_create(&tids[i], NULL, log_writer, (void *)(n / threads + (i < n % threads)));
+    }
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    return now_ns() - start;
+}
+static unsigned long long bench_log_1t(long n) { return log_contention(n, 1); }
+static unsigned long long bench_log_4t(long n) { return log_contention(n, 4); }
+
+struct metrics_job {
+    long ops;
+    bool record;
+};
+
+static void *metrics_writer(void *arg) {
+    metrics_job *job = (metrics_job *)arg;
+    pthread_setaffinity_np(pthread_self(), sizeof(all_cpus), &all_cpus);
+    if (job->record) {
+        for (long i = 0; i < job->ops; ++i) {
+            METRICS_RECORD(H_DB_ACQUIRE, i << 4);
+        }
+    } else {
+        for (long i = 0; i < job->ops; ++i) {
+            METRICS_ADD(M_REQUESTS, 1);
+        }
+    }
+    return NULL;
+}
+
+// n counter adds or histogram records made by threads writers together to the same metric, per operation of
+// wall time. Writers go to shards of their own, so more writers should not cost more per operation.
+static unsigned long long metrics_contention(long n, int threads, bool record) {
+    pthread_t tids[16];
+    metrics_job jobs[16];
+    unsigned long long start = now_ns();
+    for (int i = 0; i < threads; ++i) {
+        jobs[i].ops = n / threads + (i < n % threads);
+        jobs[i].record = record;
+        pthread_create(&tids[i], NULL, metrics_writer, &jobs[i]);
+    }
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    return now_ns() - start;
+}
+static unsigned long long bench_metrics_add_1t(long n) { return metrics_contention(n, 1, false); }
+static unsigned long long bench_metrics_add_4t(long n) { return metrics_contention(n, 4, false); }
+static unsigned long long bench_metrics_record_1t(long n) { return metrics_contention(n, 1, true); }
+static unsigned long long bench_metrics_record_4t(long n) { return metrics_contention(n, 4, true); }
+
+static void empty_endpoint(string &) {}
+
+static const char get_short[] =
+    "GET /microbench HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n";
+static const char get_browser[] =
+    "GET /microbench HTTP/1.1\r\n"
+    "Host: localhost:9006\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "\r\n";
+static const char get_file[] =
+    "GET /picture.jpg HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n";
+static const char post_login[] =
+    "POST /2 HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n"
+    "Content-Type: application/x-www-form-urlencoded\r\nContent-Length: 30\r\n\r\n"
+    "user=user00042&password=pw0042";
+
+static httpHandler *handler;
+
+static unsigned long long parse_corpus(long n, const char *request, int len) {
+    unsigned long long start = now_ns();
+    for (long i = 0; i < n; ++i) {
+        http_bench::load(*handler, request, len);
+        sink += http_bench::parse(*handler);
+        http_bench::release(*handler);
+    }
+    return now_ns() - start;
+}
+// Reset, parse and route a request, the last two stat and map the file they serve
+static unsigned long long bench_parse_short(long n) { return parse_corpus(n, get_short, sizeof(get_short) - 1); }
+static unsigned long long bench_parse_browser(long n) { return parse_corpus(n, get_browser, sizeof(get_browser) - 1); }
+static unsigned long long bench_parse_file(long n) { return parse_corpus(n, get_file, sizeof(get_file) - 1); }
+static unsigned long long bench_parse_login(long n) { return parse_corpus(n, post_login, sizeof(post_login) - 1); }
+
+// Status line and headers of a mapped file, and of a 404 page with its body
+static unsigned long long bench_write_file(long n) {
+    http_bench::load(*handler, get_file, sizeof(get_file) - 1);
+    httpHandler::HTTP_CODE code = http_bench::parse(*handler);
+    unsigned long long start = now_ns();
+    for (long i = 0; i < n; ++i) {
+        sink += http_bench::write(*handler, code);
+    }
+    unsigned long long elapsed = now_ns() - start;
+    http_bench::release(*handler);
+    return elapsed;
+}
+static unsigned long long bench_write_404(long n) {
+    unsigned long long start = now_ns();
+    for (long i = 0; i < n; ++i) {
+        sink += http_bench::write(*handler, httpHandler::NO_RESOURCE);
+    }
+    return now_ns() - start;
+}
+
+// Login lookups over 10000 users, in the MySQL store's ordered cache and the local store's hash index
+static const int USERS = 10000;
+static mysql_user_store *map_store;
+static local_user_store *hash_store;
+static char user_names[USERS][16];
+static char user_passwds[USERS][16];
+
+static unsigned long long verify_users(user_store *store, long n) {
+    unsigned long long start = now_ns();
+    for (long i = 0; i < n; ++i) {
+        int idx = rnd() % USERS;
+        sink += store->verify(user_names[idx], user_passwds[idx]);
+    }
+    return now_ns() - start;
+}
+static unsigned long long bench_verify_map(long n) { return verify_users(map_store, n); }
+static unsigned long long bench_verify_hash(long n) { return verify_users(hash_store, n); }
+
+struct benchmark {
+    const char *name;
+    const char *op;
+    unsigned long long (*run)(long n);
+};
+
+static const benchmark benchmarks[] = {
+    {"timer_add", "del + add of 1 of 1024 timers", bench_timer_add},
+    {"timer_adjust", "renew 1 of 1024 timers", bench_timer_adjust},
+    {"timer_tick", "tick expiring 64 timers", bench_timer_tick},
+    {"threadpool_roundtrip", "append + worker runs it", bench_threadpool_roundtrip},
+    {"threadpool_roundtrip_spin", "append + spinning worker runs it", bench_threadpool_roundtrip_spin},
+    {"log_write_1t", "log line, 1 writer", bench_log_1t},
+    {"log_write_4t", "log line, 4 writers", bench_log_4t},
+    {"metrics_add_1t", "METRICS_ADD, 1 writer", bench_metrics_add_1t},
+    {"metrics_add_4t", "METRICS_ADD, 4 writers", bench_metrics_add_4t},
+    {"metrics_record_1t", "METRICS_RECORD, 1 writer", bench_metrics_record_1t},
+    {"metrics_record_4t", "METRICS_RECORD, 4 writers", bench_metrics_record_4t},
+    {"http_parse_short", "reset + parse + route", bench_parse_short},
+    {"http_parse_browser", "reset + parse + route", bench_parse_browser},
+    {"http_parse_file", "reset + parse + map file", bench_parse_file},
+    {"http_parse_login", "reset + parse + verify + map file", bench_parse_login},
+    {"http_write_file", "file response headers", bench_write_file},
+    {"http_write_404", "404 response", bench_write_404},
+    {"user_verify_map", "login lookup, 10000 users", bench_verify_map},
+    {"user_verify_hash", "login lookup, 10000 users", bench_verify_hash},
+};
+
+struct result {
+    const benchmark *bench;
+    long iterations;
+    vector<double> samples;
+    double mean, stddev, min, median;
+};
+
+// Grow the batch until it takes a tenth of the target, then scale it to the target
+static long calibrate(const benchmark &b, unsigned long long target_ns) {
+    long n = 1;
+    for (;;) {
+        unsigned long long t = b.run(n);
+        if (t >= target_ns / 10 || n >= (1L << 30)) {
+            double scaled = (double)n * target_ns / (t ? t : 1);
+            return scaled < 1 ? 1 : (long)scaled;
+        }
+        n *= 10;
+    }
+}
+
+static void summarize(result &r) {
+    vector<double> sorted(r.samples);
+    sort(sorted.begin(), sorted.end());
+    double sum = 0;
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        sum += sorted[i];
+    }
+    r.mean = sum / sorted.size();
+    double var = 0;
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        var += (sorted[i] - r.mean) * (sorted[i] - r.mean);
+    }
+    r.stddev = sorted.size() > 1 ? sqrt(var / (sorted.size() - 1)) : 0;
+    r.min = sorted[0];
+    size_t mid = sorted.size() / 2;
+    r.median = sorted.size() % 2 ? sorted[mid] : (sorted[mid - 1] + sorted[mid]) / 2;
+}
+
+static bool write_json(const char *path, const char *label, int cpu, int runs, int target_ms,
+                       const vector<result> &results) {
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        return false;
+    }
+    fprintf(out, "{\n  \"label\": \"%s\",\n  \"cpu\": %d,\n  \"runs\": %d,\n  \"target_ms\": %d,\n  \"unit\": \"ns/op\",\n",
+            label, cpu, runs, target_ms);
+    fprintf(out, "  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const result &r = results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"op\": \"%s\", \"iterations\": %ld, \"mean\": %.2f, \"stddev\": %.2f, "
+                     "\"min\": %.2f, \"median\": %.2f, \"samples\": [",
+                r.bench->name, r.bench->op, r.iterations, r.mean, r.stddev, r.min, r.median);
+        for (size_t j = 0; j < r.samples.size(); ++j) {
+            fprintf(out, "%s%.2f", j ? ", " : "", r.samples[j]);
+        }
+        fprintf(out, "]}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+    return fclose(out) == 0;
+}
+
+static bool selected(const char *name, char **prefixes, int count) {
+    for (int i = 0; i < count; ++i) {
+        if (strncmp(name, prefixes[i], strlen(prefixes[i])) == 0) {
+            return true;
+        }
+    }
+    return count == 0;
+}
+
+static void remove_dir(const char *dir) {
+    DIR *d = opendir(dir);
+    if (d) {
+        struct dirent *e;
+        while ((e = readdir(d)) != NULL) {
+            if (strcmp(e->d_name, ".") && strcmp(e->d_name, "..")) {
+                string path = string(dir) + "/" + e->d_name;
+                unlink(path.c_str());
+            }
+        }
+        closedir(d);
+    }
+    rmdir(dir);
+}
+
+static void usage(const char *prog) {
+    printf("usage: %s [-n runs] [-t ms_per_run] [-w warmup_runs] [-c cpu] [-r doc_root] [-o out.json] [-l label]"
+           " [name_prefix ...]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int runs = 10, target_ms = 200, warmup = 2, cpu = -1;
+    const char *out_path = NULL;
+    const char *label = "";
+    doc_root = "./resource";
+
+    int c;
+    while ((c = getopt(argc, argv, "n:t:w:c:r:o:l:")) != -1) {
+        switch (c) {
+        case 'n': runs = atoi(optarg); break;
+        case 't': target_ms = atoi(optarg); break;
+        case 'w': warmup = atoi(optarg); break;
+        case 'c': cpu = atoi(optarg); break;
+        case 'r': doc_root = optarg; break;
+        case 'o': out_path = optarg; break;
+        case 'l': label = optarg; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (runs < 1 || target_ms < 1 || warmup < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char dir[] = "/tmp/microbench.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    string log_path = string(dir) + "/microbench.log";
+    string users_path = string(dir) + "/users.log";
+    if (!Log::get_instance()->init(log_path.c_str())) {
+        fprintf(stderr, "cannot open log in %s\n", dir);
+        return 1;
+    }
+
+    setup_timers();
+    // As the server runs by default, so file requests are served from file_cache
+    if (!file_cache::get_instance()->init(doc_root, 1000, true)) {
+        fprintf(stderr, "cannot open %s\n", doc_root);
+        return 1;
+    }
+    handler = new httpHandler;
+    httpHandler::addEndpoint("/microbench", empty_endpoint);
+
+    map_store = new mysql_user_store(NULL);
+    hash_store = new local_user_store(users_path.c_str());
+    if (!hash_store->load()) {
+        fprintf(stderr, "cannot open %s\n", users_path.c_str());
+        return 1;
+    }
+    for (int i = 0; i < USERS; ++i) {
+        snprintf(user_names[i], sizeof(user_names[i]), "user%05d", i);
+        snprintf(user_passwds[i], sizeof(user_passwds[i]), "pw%04d", i);
+        map_store->reserve(user_names[i]);
+        map_store->settle(user_names[i], user_passwds[i], true);
+        hash_store->add(user_names[i], user_passwds[i]);
+    }
+    httpHandler::m_store = map_store;
+
+    // Workers and log writers run wherever they are allowed, only the measuring thread is pinned
+    sched_getaffinity(0, sizeof(all_cpus), &all_cpus);
+    pool = new threadpool<ping>(4);
+    spin_pool = new threadpool<ping>(4);
+    spin_pool->set_spin(50000);
+    if (cpu < 0) {
+        for (int i = CPU_SETSIZE - 1; i >= 0 && cpu < 0; --i) {
+            if (CPU_ISSET(i, &all_cpus)) {
+                cpu = i;
+            }
+        }
+    }
+    cpu_set_t pinned;
+    CPU_ZERO(&pinned);
+    CPU_SET(cpu, &pinned);
+    if (sched_setaffinity(0, sizeof(pinned), &pinned) != 0) {
+        fprintf(stderr, "cannot pin to cpu %d, running unpinned\n", cpu);
+        cpu = -1;
+    }
+
+    unsigned long long target_ns = target_ms * 1000000ULL;
+    vector<result> results;
+    printf("%-26s %-34s %12s %10s %6s %10s %10s\n", "benchmark", "op", "mean ns/op", "stddev", "cv%", "min",
+           "median");
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); ++i) {
+        const benchmark &b = benchmarks[i];
+        if (!selected(b.name, argv + optind, argc - optind)) {
+            continue;
+        }
+        result r;
+        r.bench = &b;
+        r.iterations = calibrate(b, target_ns);
+        for (int j = 0; j < warmup; ++j) {
+            b.run(r.iterations);
+        }
+        for (int j = 0; j < runs; ++j) {
+            r.samples.push_back((double)b.run(r.iterations) / r.iterations);
+        }
+        summarize(r);
+        printf("%-26s %-34s %12.1f %10.1f %6.1f %10.1f %10.1f\n", b.name, b.op, r.mean, r.stddev,
+               r.mean > 0 ? 100 * r.stddev / r.mean : 0, r.min, r.median);
+        fflush(stdout);
+        results.push_back(r);
+    }
+
+    remove_dir(dir);
+    if (out_path && !write_json(out_path, label, cpu, runs, target_ms, results)) {
+        fprintf(stderr, "cannot write %s\n", out_path);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,507 @@
+// Replays traffic captured by the server's -c option, built by `make bench`.
+//
+// Every captured connection becomes a session: opened at its captured time, sending its requests in
+// order, each once it is due and the previous response has arrived, and closed at its captured time, so
+// idle keep-alive connections are held open as they were. -s scales the timeline, -s 2 replays twice as
+// fast and -s 0 as fast as possible, each session still sending one request after the other. Latency is
+// measured from sending a request to its last response byte, and reported per route (method and path
+// without the query), along with how far sends slipped behind the schedule.
+//
+//     bench/replay [-H host] [-t threads] [-s speed] capture_file port
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <map>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "../capture.h"
+#include "hdr_histogram.h"
+#include "http_response.h"
+
+using namespace std;
+
+static const int READ_SIZE = 64 * 1024;
+static const int MAX_ROUTES = 64;
+
+static unsigned long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct options {
+    const char *host;
+    int port;
+    int threads;
+    double speed;               // 0 for as fast as possible
+    const char *file;
+};
+
+// One request cut out of a session's bytes, at the time its first byte was read
+struct request {
+    size_t off;
+    size_t len;
+    unsigned long long ns;
+    int route;
+};
+
+struct session {
+    unsigned long long open_ns;
+    unsigned long long close_ns;
+    string bytes;
+    vector<request> requests;
+
+    // Replay state
+    int fd;
+    size_t next;                // request to send or in flight
+    bool inflight;
+    size_t out_off;             // bytes of the request in flight sent so far
+    unsigned long long sent;
+    bool opened;
+    bool closed;
+    char in[READ_SIZE];
+    int in_len;
+    response_parser parser;
+};
+
+static vector<string> routes;
+
+// Route of a request: method and path up to the query string, the rest share one line past MAX_ROUTES
+static int route_of(const char *start, size_t len) {
+    static map<string, int> index;
+    const char *sp = (const char *)memchr(start, ' ', len);
+    size_t end = sp ? sp - start + 1 : len;
+    while (end < len && start[end] != ' ' && start[end] != '?' && start[end] != '\r') {
+        ++end;
+    }
+    string key(start, end);
+    map<string, int>::iterator it = index.find(key);
+    if (it != index.end()) {
+        return it->second;
+    }
+    if ((int)routes.size() == MAX_ROUTES - 1) {
+        routes.push_back("(other)");
+    }
+    if ((int)routes.size() >= MAX_ROUTES) {
+        return MAX_ROUTES - 1;
+    }
+    routes.push_back(key);
+    index[key] = routes.size() - 1;
+    return routes.size() - 1;
+}
+
+// Split a session's bytes into requests by header end and Content-Length, an incomplete tail is dropped.
+// chunks holds the offset and time of every captured read.
+static void split_requests(session *s, const vector<pair<size_t, unsigned long long> > &chunks) {
+    size_t off = 0;
+    size_t chunk = 0;
+    while (off < s->bytes.size()) {
+        const char *start = s->bytes.data() + off;
+        const char *end = (const char *)memmem(start, s->bytes.size() - off, "\r\n\r\n", 4);
+        if (!end) {
+            break;
+        }
+        size_t len = end + 4 - start;
+        string head(start, len);
+        const char *cl = strcasestr(head.c_str(), "\r\nContent-Length:");
+        if (cl) {
+            len += atoll(cl + 17);
+        }
+        if (off + len > s->bytes.size()) {
+            break;
+        }
+        while (chunk + 1 < chunks.size() && chunks[chunk + 1].first <= off) {
+            ++chunk;
+        }
+        request r = {off, len, chunks[chunk].second, route_of(start, len)};
+        s->requests.push_back(r);
+        off += len;
+    }
+}
+
+static bool load_capture(const char *path, vector<session *> &sessions, unsigned long long &first_ns) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return false;
+    }
+    capture_header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic))) {
+        fprintf(stderr, "%s is not a capture file\n", path);
+        fclose(fp);
+        return false;
+    }
+    map<unsigned int, session *> by_conn;
+    map<unsigned int, vector<pair<size_t, unsigned long long> > > chunks;
+    unsigned long long last_ns = 0;
+    capture_record rec;
+    char data[65536];
+    while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+        if (rec.len && fread(data, rec.len, 1, fp) != 1) {
+            break;
+        }
+        last_ns = rec.ns;
+        if (rec.type == traffic_capture::OPEN) {
+            session *s = new session();
+            s->open_ns = rec.ns;
+            s->close_ns = 0;
+            by_conn[rec.conn] = s;
+            sessions.push_back(s);
+            continue;
+        }
+        map<unsigned int, session *>::iterator it = by_conn.find(rec.conn);
+        if (it == by_conn.end()) {
+            continue;
+        }
+        if (rec.type == traffic_capture::DATA) {
+            chunks[rec.conn].push_back(make_pair(it->second->bytes.size(), rec.ns));
+            it->second->bytes.append(data, rec.len);
+        } else if (rec.type == traffic_capture::CLOSE) {
+            it->second->close_ns = rec.ns;
+        }
+    }
+    fclose(fp);
+
+    first_ns = sessions.empty() ? 0 : sessions[0]->open_ns;
+    for (map<unsigned int, session *>::iterator it = by_conn.begin(); it != by_conn.end(); ++it) {
+        session *s = it->second;
+        split_requests(s, chunks[it->first]);
+        // Still open when the capture ended
+        if (!s->close_ns) {
+            s->close_ns = last_ns;
+        }
+    }
+    return true;
+}
+
+struct route_stats {
+    hdr_histogram latency;
+    unsigned long long errors;
+};
+
+struct worker {
+    pthread_t thread;
+    const options *opt;
+    vector<session *> sessions;
+    unsigned long long start;
+    unsigned long long first_ns;
+    route_stats *routes;
+    hdr_histogram slip;
+    unsigned long long requests;
+    unsigned long long errors;
+    unsigned long long reconnects;
+    unsigned long long end;
+};
+
+// Time on the replay clock of a captured time
+static unsigned long long due(const worker *w, unsigned long long captured) {
+    if (w->opt->speed <= 0) {
+        return w->start;
+    }
+    return w->start + (unsigned long long)((captured - w->first_ns) / w->opt->speed);
+}
+
+static int open_connection(const options *opt) {
+    int fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opt->port);
+    inet_pton(AF_INET, opt->host, &addr.sin_addr);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+typedef pair<unsigned long long, session *> action;
+typedef priority_queue<action, vector<action>, greater<action> > schedule;
+
+static void drop_connection(int epfd, session *s) {
+    if (s->fd >= 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+        close(s->fd);
+        s->fd = -1;
+    }
+    s->in_len = 0;
+    s->parser.reset();
+}
+
+// Queue the next step of a session: its next request, or closing once all were answered
+static void plan(worker *w, schedule &sched, session *s) {
+    if (s->next < s->requests.size()) {
+        sched.push(make_pair(due(w, s->requests[s->next].ns), s));
+    } else {
+        sched.push(make_pair(due(w, s->close_ns), s));
+    }
+}
+
+static void flush_out(int epfd, session *s) {
+    const request &r = s->requests[s->next];
+    while (s->out_off < r.len) {
+        ssize_t n = send(s->fd, s->bytes.data() + r.off + s->out_off, r.len - s->out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            break;
+        }
+        s->out_off += n;
+    }
+    struct epoll_event ev;
+    ev.data.ptr = s;
+    ev.events = EPOLLIN | (s->out_off < r.len ? (uint32_t)EPOLLOUT : 0);
+    epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev);
+}
+
+static bool connect_session(worker *w, int epfd, session *s) {
+    s->fd = open_connection(w->opt);
+    if (s->fd < 0) {
+        return false;
+    }
+    struct epoll_event ev;
+    ev.data.ptr = s;
+    ev.events = EPOLLIN;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd, &ev);
+    return true;
+}
+
+// The request in flight failed, move on to the next one
+static void request_failed(worker *w, schedule &sched, session *s) {
+    ++w->errors;
+    ++w->routes[s->requests[s->next].route].errors;
+    s->inflight = false;
+    ++s->next;
+    plan(w, sched, s);
+}
+
+// A scheduled step is due: connect, send the next request, or close
+static void step(worker *w, int epfd, schedule &sched, session *s, unsigned long long now) {
+    if (s->closed || s->inflight) {
+        return;
+    }
+    if (s->next >= s->requests.size()) {
+        drop_connection(epfd, s);
+        s->closed = true;
+        return;
+    }
+    if (s->fd < 0) {
+        if (s->next > 0) {
+            ++w->reconnects;
+        }
+        if (!connect_session(w, epfd, s)) {
+            s->inflight = true;
+            request_failed(w, sched, s);
+            return;
+        }
+    }
+    w->slip.record(now - due(w, s->requests[s->next].ns));
+    s->inflight = true;
+    s->out_off = 0;
+    s->sent = now;
+    flush_out(epfd, s);
+}
+
+static void *run_worker(void *arg) {
+    worker *w = (worker *)arg;
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    schedule sched;
+    for (size_t i = 0; i < w->sessions.size(); ++i) {
+        session *s = w->sessions[i];
+        s->fd = -1;
+        s->next = 0;
+        s->inflight = false;
+        s->opened = false;
+        s->closed = false;
+        s->in_len = 0;
+        sched.push(make_pair(due(w, s->open_ns), s));
+    }
+    size_t open = w->sessions.size();
+
+    struct epoll_event events[256];
+    while (open > 0) {
+        unsigned long long now = now_ns();
+        while (!sched.empty() && sched.top().first <= now) {
+            session *s = sched.top().second;
+            sched.pop();
+            if (!s->opened) {
+                // Connect at the captured time, which may be well ahead of the first request
+                s->opened = true;
+                connect_session(w, epfd, s);
+                plan(w, sched, s);
+                continue;
+            }
+            step(w, epfd, sched, s, now);
+            if (s->closed) {
+                --open;
+            }
+        }
+        if (open == 0) {
+            break;
+        }
+        int timeout = -1;
+        if (!sched.empty()) {
+            unsigned long long wake = sched.top().first;
+            timeout = wake > now ? (int)((wake - now + 999999) / 1000000) : 0;
+        }
+        int n = epoll_wait(epfd, events, 256, timeout);
+        now = now_ns();
+        for (int i = 0; i < n; ++i) {
+            session *s = (session *)events[i].data.ptr;
+            if (s->fd < 0) {
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && s->inflight) {
+                flush_out(epfd, s);
+            }
+            if (!(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                continue;
+            }
+            ssize_t got = recv(s->fd, s->in + s->in_len, READ_SIZE - s->in_len, 0);
+            if (got < 0 && errno == EAGAIN) {
+                continue;
+            }
+            if (got <= 0 || s->in_len + got == READ_SIZE) {
+                // The server closed, a request in flight failed and the next one reconnects
+                drop_connection(epfd, s);
+                if (s->inflight) {
+                    request_failed(w, sched, s);
+                }
+                continue;
+            }
+            s->in_len += got;
+            bool answered = false;
+            int off = s->parser.parse(s->in, s->in_len, [&]() { answered = true; });
+            memmove(s->in, s->in + off, s->in_len - off);
+            s->in_len -= off;
+            if (answered && s->inflight) {
+                w->routes[s->requests[s->next].route].latency.record(now - s->sent);
+                ++w->requests;
+                s->inflight = false;
+                ++s->next;
+                if (s->parser.server_closes) {
+                    drop_connection(epfd, s);
+                }
+                plan(w, sched, s);
+            }
+        }
+    }
+    w->end = now_ns();
+    close(epfd);
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    printf("usage: %s [-H host] [-t threads] [-s speed] capture_file port\n"
+           "  -s    timeline speed-up, 1 replays in real time and 0 as fast as possible\n",
+           prog);
+}
+
+int main(int argc, char *argv[]) {
+    options opt = {"127.0.0.1", 0, 1, 1.0, NULL};
+    int c;
+    while ((c = getopt(argc, argv, "H:t:s:")) != -1) {
+        switch (c) {
+        case 'H': opt.host = optarg; break;
+        case 't': opt.threads = atoi(optarg); break;
+        case 's': opt.speed = atof(optarg); break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (argc - optind < 2 || opt.threads < 1 || opt.speed < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    opt.file = argv[optind];
+    opt.port = atoi(argv[optind + 1]);
+
+    vector<session *> sessions;
+    unsigned long long first_ns = 0;
+    if (!load_capture(opt.file, sessions, first_ns)) {
+        return 1;
+    }
+    size_t total = 0;
+    for (size_t i = 0; i < sessions.size(); ++i) {
+        total += sessions[i]->requests.size();
+    }
+    if (opt.speed > 0) {
+        printf("replaying %zu connections, %zu requests from %s at %gx\n", sessions.size(), total, opt.file, opt.speed);
+    } else {
+        printf("replaying %zu connections, %zu requests from %s as fast as possible\n", sessions.size(), total, opt.file);
+    }
+
+    // Sessions are dealt round-robin, each is replayed by one thread
+    vector<worker *> workers;
+    unsigned long long start = now_ns() + 10000000;
+    for (int i = 0; i < opt.threads; ++i) {
+        worker *w = new worker();
+        w->opt = &opt;
+        w->start = start;
+        w->first_ns = first_ns;
+        w->routes = new route_stats[MAX_ROUTES]();
+        workers.push_back(w);
+    }
+    for (size_t i = 0; i < sessions.size(); ++i) {
+        workers[i % opt.threads]->sessions.push_back(sessions[i]);
+    }
+    for (int i = 0; i < opt.threads; ++i) {
+        pthread_create(&workers[i]->thread, NULL, run_worker, workers[i]);
+    }
+
+    unsigned long long requests = 0, errors = 0, reconnects = 0, end = start;
+    hdr_histogram slip, all;
+    for (int i = 0; i < opt.threads; ++i) {
+        worker *w = workers[i];
+        pthread_join(w->thread, NULL);
+        requests += w->requests;
+        errors += w->errors;
+        reconnects += w->reconnects;
+        slip.merge(w->slip);
+        if (w->end > end) {
+            end = w->end;
+        }
+        if (i > 0) {
+            for (int r = 0; r < MAX_ROUTES; ++r) {
+                workers[0]->routes[r].latency.merge(w->routes[r].latency);
+                workers[0]->routes[r].errors += w->routes[r].errors;
+            }
+        }
+    }
+
+    double secs = (end - start) / 1e9;
+    printf("%llu responses, %llu errors, %llu reconnects in %.2f s, %.1f req/s\n", requests, errors, reconnects,
+           secs, secs > 0 ? requests / secs : 0.0);
+    if (opt.speed > 0) {
+        printf("schedule slip  p50 %.3f ms  p99 %.3f ms  max %.3f ms\n", slip.percentile(50) / 1e6,
+               slip.percentile(99) / 1e6, slip.max() / 1e6);
+    }
+    printf("%-40s %9s %7s %10s %10s %10s %10s\n", "route", "count", "errors", "p50 ms", "p99 ms", "p99.9 ms",
+           "max ms");
+    for (size_t r = 0; r < routes.size(); ++r) {
+        const route_stats &rs = workers[0]->routes[r];
+        all.merge(rs.latency);
+        printf("%-40s %9llu %7llu %10.3f %10.3f %10.3f %10.3f\n", routes[r].c_str(), rs.latency.total(), rs.errors,
+               rs.latency.percentile(50) / 1e6, rs.latency.percentile(99) / 1e6, rs.latency.percentile(99.9) / 1e6,
+               rs.latency.max() / 1e6);
+    }
+    printf("%-40s %9llu %7llu %10.3f %10.3f %10.3f %10.3f\n", "all", all.total(), errors, all.percentile(50) / 1e6,
+           all.percentile(99) / 1e6, all.percentile(99.9) / 1e6, all.max() / 1e6);
+    return errors ? 2 : 0;
+}
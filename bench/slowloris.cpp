@@ -0,0 +1,235 @@
+// Slow clients for testing connection deadlines, built by `make bench`.
+//
+// Opens -c connections that each hold a connection slot in one phase of a request for as long as the server
+// lets them, and reports how many the server closed and after how long:
+//     first   connect and send nothing
+//     header  send the request line, then one header byte every -i ms
+//     body    send the headers of a POST with a large body, then one body byte every -i ms
+//     read    request a large file and never read the response
+//     idle    complete one keep-alive request, then send nothing
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static unsigned long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+struct options {
+    const char *host;
+    int port;
+    int connections;
+    int duration;
+    int interval;
+    const char *mode;
+    const char *path;
+};
+
+struct slow_conn {
+    int fd;
+    bool connected;
+    string out;            // sent all at once when the connection is up
+    size_t trickled;       // bytes of the endless trickle sent so far
+    unsigned long long opened;
+    unsigned long long closed;
+};
+
+static int start_connect(const options &opt) {
+    int fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (strcmp(opt.mode, "read") == 0) {
+        // A small receive window keeps the server's response stuck in its send buffer
+        int size = 4096;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opt.port);
+    inet_pton(AF_INET, opt.host, &addr.sin_addr);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static string opening(const options &opt) {
+    char buf[512];
+    const char *mode = opt.mode;
+    if (strcmp(mode, "header") == 0) {
+        snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\n", opt.path);
+    } else if (strcmp(mode, "body") == 0) {
+        snprintf(buf, sizeof(buf),
+                 "POST /2 HTTP/1.1\r\nHost: %s\r\nContent-Type: application/x-www-form-urlencoded\r\n"
+                 "Content-Length: 1000000\r\n\r\n",
+                 opt.host);
+    } else if (strcmp(mode, "read") == 0 || strcmp(mode, "idle") == 0) {
+        snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n", opt.path,
+                 opt.host);
+    } else {
+        buf[0] = '\0';
+    }
+    return buf;
+}
+
+static void usage(const char *prog) {
+    printf("usage: %s [-H host] [-c connections] [-d seconds] [-i interval_ms] [-p path] [-m mode] port\n"
+           "  -m    first, header, body, read or idle, see the top of bench/slowloris.cpp\n",
+           prog);
+}
+
+int main(int argc, char *argv[]) {
+    options opt = {"127.0.0.1", 0, 1000, 60, 1000, "header", NULL};
+    int c;
+    while ((c = getopt(argc, argv, "H:c:d:i:p:m:")) != -1) {
+        switch (c) {
+        case 'H': opt.host = optarg; break;
+        case 'c': opt.connections = atoi(optarg); break;
+        case 'd': opt.duration = atoi(optarg); break;
+        case 'i': opt.interval = atoi(optarg); break;
+        case 'p': opt.path = optarg; break;
+        case 'm': opt.mode = optarg; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    const char *modes[] = {"first", "header", "body", "read", "idle"};
+    bool known = false;
+    for (int i = 0; i < 5; ++i) {
+        known = known || strcmp(opt.mode, modes[i]) == 0;
+    }
+    if (argc <= optind || !known || opt.connections < 1 || opt.interval < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    opt.port = atoi(argv[optind]);
+    if (!opt.path) {
+        opt.path = strcmp(opt.mode, "read") == 0 ? "/ProjectReport.pdf" : "/";
+    }
+    bool trickle = strcmp(opt.mode, "header") == 0 || strcmp(opt.mode, "body") == 0;
+    string first = opening(opt);
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    vector<slow_conn> conns(opt.connections);
+    unsigned long long start = now_ms();
+    int failed = 0;
+    for (int i = 0; i < opt.connections; ++i) {
+        slow_conn &sc = conns[i];
+        sc.fd = start_connect(opt);
+        sc.connected = false;
+        sc.out = first;
+        sc.trickled = 0;
+        sc.opened = now_ms();
+        sc.closed = 0;
+        if (sc.fd < 0) {
+            ++failed;
+            continue;
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLOUT | EPOLLIN | EPOLLRDHUP;
+        ev.data.u32 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, sc.fd, &ev);
+    }
+    printf("%d connections in %s mode, %d failed to start\n", opt.connections, opt.mode, failed);
+
+    unsigned long long end = start + opt.duration * 1000ULL;
+    unsigned long long next_trickle = start + opt.interval;
+    int open = opt.connections - failed;
+    struct epoll_event events[256];
+    char buf[4096];
+    while (open > 0) {
+        unsigned long long now = now_ms();
+        if (now >= end) {
+            break;
+        }
+        if (trickle && now >= next_trickle) {
+            // One more byte of a header or body that never ends
+            for (size_t i = 0; i < conns.size(); ++i) {
+                slow_conn &sc = conns[i];
+                if (sc.fd >= 0 && sc.connected && !sc.closed) {
+                    const char *byte = strcmp(opt.mode, "header") == 0 ? (sc.trickled % 2 ? "a" : "X") : "a";
+                    if (send(sc.fd, byte, 1, MSG_NOSIGNAL) == 1) {
+                        ++sc.trickled;
+                    }
+                }
+            }
+            next_trickle += opt.interval;
+        }
+        unsigned long long wake = trickle && next_trickle < end ? next_trickle : end;
+        int n = epoll_wait(epfd, events, 256, wake > now ? (int)(wake - now) : 0);
+        now = now_ms();
+        for (int e = 0; e < n; ++e) {
+            slow_conn &sc = conns[events[e].data.u32];
+            if (sc.closed) {
+                continue;
+            }
+            if (!sc.connected && (events[e].events & EPOLLOUT)) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(sc.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err == 0) {
+                    sc.connected = true;
+                    sc.opened = now;
+                    if (!sc.out.empty()) {
+                        send(sc.fd, sc.out.data(), sc.out.size(), MSG_NOSIGNAL);
+                    }
+                    struct epoll_event ev;
+                    ev.events = EPOLLIN | EPOLLRDHUP;
+                    ev.data.u32 = events[e].data.u32;
+                    epoll_ctl(epfd, EPOLL_CTL_MOD, sc.fd, &ev);
+                    continue;
+                }
+            }
+            if (strcmp(opt.mode, "read") == 0 && !(events[e].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                // Leave the response unread, only a close matters
+                continue;
+            }
+            ssize_t got = recv(sc.fd, buf, sizeof(buf), 0);
+            if (got > 0 || (got < 0 && errno == EAGAIN)) {
+                // The idle mode's response, the connection then sits idle
+                continue;
+            }
+            sc.closed = now;
+            epoll_ctl(epfd, EPOLL_CTL_DEL, sc.fd, NULL);
+            --open;
+        }
+    }
+
+    vector<unsigned long long> held;
+    int connected = 0;
+    for (size_t i = 0; i < conns.size(); ++i) {
+        connected += conns[i].connected;
+        if (conns[i].connected && conns[i].closed) {
+            held.push_back(conns[i].closed - conns[i].opened);
+        }
+        if (conns[i].fd >= 0) {
+            close(conns[i].fd);
+        }
+    }
+    close(epfd);
+    sort(held.begin(), held.end());
+    printf("  %d connected, %zu closed by the server, %zu still open after %ds\n", connected, held.size(),
+           connected - held.size(), opt.duration);
+    if (!held.empty()) {
+        printf("  held for min %.1f s, median %.1f s, max %.1f s\n", held.front() / 1e3, held[held.size() / 2] / 1e3,
+               held.back() / 1e3);
+    }
+    return 0;
+}
@@ -0,0 +1,181 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "log.h"
+#include "metrics.h"
+
+bool traffic_capture::init(const char *path, int one_in_n, int max_mb, int max_fd) {
+    m_fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (m_fd < 0) {
+        LOG_ERROR("cannot open capture file %s, errno is:%d", path, errno);
+        return false;
+    }
+    capture_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.start_unix_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    header.one_in_n = one_in_n > 0 ? one_in_n : 1;
+    if (write(m_fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) {
+        ::close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+
+    m_max_fd = max_fd;
+    m_conn = new unsigned int[max_fd]();
+    m_next_conn = 0;
+    m_one_in_n = header.one_in_n;
+    m_accepts = 0;
+    m_start = metrics::now();
+    m_max_bytes = max_mb * (1ULL << 20);
+    m_bytes = sizeof(header);
+    m_dropped = 0;
+    m_full = false;
+    m_buf[0] = new char[BUFFER_SIZE];
+    m_buf[1] = new char[BUFFER_SIZE];
+    m_active = 0;
+    m_fill = 0;
+    m_pending = 0;
+    m_stop = false;
+    if (pthread_create(&m_writer, NULL, writer, this) != 0) {
+        return false;
+    }
+    m_enabled = true;
+    return true;
+}
+
+void traffic_capture::stop() {
+    if (m_fd < 0) {
+        return;
+    }
+    m_lock.lock();
+    m_enabled = false;
+    m_stop = true;
+    m_cond.signal();
+    m_lock.unlock();
+    pthread_join(m_writer, NULL);
+    ::close(m_fd);
+    m_fd = -1;
+    LOG_INFO("capture closed: %u connections, %llu bytes, %llu records dropped", m_next_conn, m_bytes, m_dropped);
+}
+
+void traffic_capture::flush() {
+    if (!m_enabled) {
+        return;
+    }
+    m_lock.lock();
+    handoff();
+    m_lock.unlock();
+}
+
+void traffic_capture::open(int fd) {
+    if (!m_enabled || fd >= m_max_fd) {
+        return;
+    }
+    m_lock.lock();
+    m_conn[fd] = m_accepts++ % m_one_in_n == 0 ? ++m_next_conn : 0;
+    m_lock.unlock();
+    if (m_conn[fd]) {
+        append(fd, OPEN, NULL, 0);
+    }
+}
+
+void traffic_capture::close(int fd) {
+    if (m_enabled && fd < m_max_fd && m_conn[fd]) {
+        append(fd, CLOSE, NULL, 0);
+        m_conn[fd] = 0;
+    }
+}
+
+// A dropped record ends the capture of its connection, so no session is replayed with a hole in it
+void traffic_capture::append(int fd, RECORD type, const char *buf, int len) {
+    int need = sizeof(capture_record) + len;
+    m_lock.lock();
+    unsigned int conn = m_conn[fd];
+    if (!m_enabled || !conn) {
+        m_lock.unlock();
+        return;
+    }
+    if (m_bytes + need > m_max_bytes) {
+        m_enabled = false;
+        m_full = true;
+        m_lock.unlock();
+        LOG_INFO("capture reached its size cap after %u connections", m_next_conn);
+        return;
+    }
+    if (m_fill + need > BUFFER_SIZE) {
+        handoff();
+        if (m_fill + need > BUFFER_SIZE) {
+            ++m_dropped;
+            m_conn[fd] = 0;
+            m_lock.unlock();
+            return;
+        }
+    }
+    capture_record rec;
+    rec.ns = metrics::now() - m_start;
+    rec.conn = conn;
+    rec.type = type;
+    rec.len = len;
+    memcpy(m_buf[m_active] + m_fill, &rec, sizeof(rec));
+    if (len) {
+        memcpy(m_buf[m_active] + m_fill + sizeof(rec), buf, len);
+    }
+    m_fill += need;
+    m_bytes += need;
+    m_lock.unlock();
+}
+
+void traffic_capture::handoff() {
+    if (m_pending || !m_fill) {
+        return;
+    }
+    m_pending = m_fill;
+    m_active = 1 - m_active;
+    m_fill = 0;
+    m_cond.signal();
+}
+
+void *traffic_capture::writer(void *arg) {
+    ((traffic_capture *)arg)->run();
+    return NULL;
+}
+
+void traffic_capture::run() {
+    m_lock.lock();
+    while (true) {
+        while (!m_pending && !m_stop) {
+            m_cond.wait(m_lock);
+        }
+        if (!m_pending) {
+            // Stopping, the active buffer goes out last
+            if (!m_fill) {
+                break;
+            }
+            handoff();
+        }
+        const char *buf = m_buf[1 - m_active];
+        int len = m_pending;
+        m_lock.unlock();
+        for (int off = 0; off < len;) {
+            ssize_t n = write(m_fd, buf + off, len - off);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                LOG_ERROR("capture write error, errno is:%d", errno);
+                break;
+            }
+            off += n;
+        }
+        m_lock.lock();
+        m_pending = 0;
+    }
+    m_lock.unlock();
+}
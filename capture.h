@@ -0,0 +1,96 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <pthread.h>
+
+#include "locker.h"
+
+// Capture file layout, read back by bench/replay. The file starts with a capture_header, followed by
+// capture_records; a DATA record is followed by len request bytes exactly as the server read them.
+struct capture_header {
+    char magic[8];                      // CAPTURE_MAGIC
+    unsigned long long start_unix_ns;   // wall clock when capturing started
+    unsigned int one_in_n;              // connection sampling rate
+    unsigned int reserved;
+};
+
+struct capture_record {
+    unsigned long long ns;      // since capturing started
+    unsigned int conn;          // capture id of the connection, from 1
+    unsigned short type;        // traffic_capture::RECORD
+    unsigned short len;
+};
+
+#define CAPTURE_MAGIC "WSCAP01"
+
+// Records the traffic of sampled connections for deterministic replay: accept, every chunk of request bytes
+// read and close, with their time. Connections are sampled 1-in-N at accept so keep-alive sessions stay
+// whole. Records go to one of two buffers, a writer thread writes the full one out, so the reactor never
+// waits for the disk. Records are dropped if both buffers are full, and capturing stops for good once the
+// file reaches its size cap.
+class traffic_capture {
+public:
+    enum RECORD {
+        OPEN = 1,
+        DATA,
+        CLOSE
+    };
+
+    static traffic_capture *get_instance() {
+        static traffic_capture instance;
+        return &instance;
+    }
+
+    // max_fd bounds the socket fds, max_mb caps the file size
+    bool init(const char *path, int one_in_n, int max_mb, int max_fd);
+    // Write out what is buffered and close the file
+    void stop();
+    // Hand the buffered records to the writer, called from the timer tick so the file stays current
+    void flush();
+
+    // Connection events by socket fd, a no-op unless the connection was sampled at open
+    void open(int fd);
+    void data(int fd, const char *buf, int len) {
+        if (m_enabled && fd < m_max_fd && m_conn[fd]) {
+            append(fd, DATA, buf, len);
+        }
+    }
+    void close(int fd);
+
+private:
+    traffic_capture() : m_enabled(false), m_fd(-1), m_max_fd(0), m_conn(0), m_lock("capture"), m_cond("capture") {}
+    void append(int fd, RECORD type, const char *buf, int len);
+    // Swap buffers if the writer is idle, called with m_lock held
+    void handoff();
+    static void *writer(void *arg);
+    void run();
+
+private:
+    static const int BUFFER_SIZE = 4 << 20;
+
+    bool m_enabled;
+    int m_fd;
+    int m_max_fd;
+    // Capture id of the connection on each fd, 0 when not sampled
+    unsigned int *m_conn;
+    unsigned int m_next_conn;
+    unsigned int m_one_in_n;
+    unsigned int m_accepts;
+    unsigned long long m_start;
+    unsigned long long m_max_bytes;
+    unsigned long long m_bytes;
+    unsigned long long m_dropped;
+    bool m_full;
+
+    char *m_buf[2];
+    int m_active;
+    int m_fill;
+    // Bytes of the other buffer waiting for the writer, 0 when it is idle
+    int m_pending;
+    bool m_stop;
+    pthread_t m_writer;
+    locker m_lock;
+    cond m_cond;
+};
+
+#endif
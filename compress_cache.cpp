@@ -0,0 +1,165 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "compress_cache.h"
+#include "file_cache.h"
+#include "log.h"
+#include "metrics.h"
+
+bool compress_cache::init(size_t max_bytes) {
+    m_max_bytes = max_bytes;
+    if (max_bytes == 0) {
+        return true;
+    }
+    m_stop = false;
+    if (pthread_create(&m_thread, NULL, worker, this) != 0) {
+        m_max_bytes = 0;
+        return false;
+    }
+    m_running = true;
+    return true;
+}
+
+void compress_cache::stop() {
+    if (!m_running) {
+        return;
+    }
+    m_lock.lock();
+    m_stop = true;
+    m_cond.signal();
+    m_lock.unlock();
+    pthread_join(m_thread, NULL);
+    m_running = false;
+}
+
+shared_ptr<const compress_cache::variant> compress_cache::lookup(const char *url, const struct stat &st) {
+    if (m_max_bytes == 0 || st.st_size > (off_t)(m_max_bytes / MAX_FILE_SHARE)) {
+        return NULL;
+    }
+    string key = makeKey(st);
+    shared_ptr<const variant> copy;
+    m_lock.lock();
+    unordered_map<string, list<item>::iterator>::iterator it = m_index.find(key);
+    if (it != m_index.end()) {
+        m_lru.splice(m_lru.begin(), m_lru, it->second);
+        copy = it->second->copy;
+    } else if (m_pending.size() < (size_t)MAX_PENDING && m_pending.insert(make_pair(key, true)).second) {
+        job j = {key, url};
+        m_jobs.push_back(j);
+        m_cond.signal();
+    }
+    m_lock.unlock();
+    if (copy && copy->data.empty()) {
+        return NULL;
+    }
+    return copy;
+}
+
+string compress_cache::makeKey(const struct stat &st) {
+    char key[96];
+    snprintf(key, sizeof(key), "%llx:%llx:%llx:%llx", (unsigned long long)st.st_dev, (unsigned long long)st.st_ino,
+             (unsigned long long)st.st_size,
+             (unsigned long long)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec);
+    return key;
+}
+
+size_t compress_cache::bytes() {
+    m_lock.lock();
+    size_t bytes = m_bytes;
+    m_lock.unlock();
+    return bytes;
+}
+
+void *compress_cache::worker(void *arg) {
+    ((compress_cache *)arg)->run();
+    return NULL;
+}
+
+void compress_cache::run() {
+    m_lock.lock();
+    while (true) {
+        while (m_jobs.empty() && !m_stop) {
+            m_cond.wait(m_lock);
+        }
+        if (m_stop) {
+            break;
+        }
+        job j = m_jobs.front();
+        m_jobs.pop_front();
+        m_lock.unlock();
+        unsigned long long start = metrics::now();
+        shared_ptr<const variant> copy = compress(j.url, j.key);
+        if (copy) {
+            METRICS_ADD(M_COMPRESS_JOBS, 1);
+            LOG_INFO("compressed %s to %zu bytes in %llu us", j.url.c_str(), copy->data.size(),
+                     (metrics::now() - start) / 1000);
+        }
+        m_lock.lock();
+        if (copy) {
+            insert(j.key, copy);
+        }
+        m_pending.erase(j.key);
+    }
+    m_lock.unlock();
+}
+
+shared_ptr<const compress_cache::variant> compress_cache::compress(const string &url, const string &key) {
+    int fd = file_cache::get_instance()->open(url.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    // The file may have been replaced or edited since the lookup, a copy of that file would go out under the
+    // key and ETag of the old one
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0 || makeKey(st) != key) {
+        close(fd);
+        return NULL;
+    }
+    void *src = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (src == MAP_FAILED) {
+        return NULL;
+    }
+    shared_ptr<variant> copy = make_shared<variant>();
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // windowBits 15 + 16 writes a gzip header and trailer around the deflate stream
+    if (deflateInit2(&zs, 9, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        munmap(src, st.st_size);
+        return NULL;
+    }
+    copy->data.resize(deflateBound(&zs, st.st_size));
+    zs.next_in = (Bytef *)src;
+    zs.avail_in = st.st_size;
+    zs.next_out = (Bytef *)&copy->data[0];
+    zs.avail_out = copy->data.size();
+    int ret = deflate(&zs, Z_FINISH);
+    copy->data.resize(zs.total_out);
+    deflateEnd(&zs);
+    munmap(src, st.st_size);
+    if (ret != Z_STREAM_END) {
+        return NULL;
+    }
+    if (copy->data.size() * 100 > (size_t)st.st_size * (100 - MIN_SAVING_PERCENT)) {
+        // Remembered as not worth it, so the file is not compressed again
+        copy->data.clear();
+    }
+    copy->data.shrink_to_fit();
+    return copy;
+}
+
+void compress_cache::insert(const string &key, const shared_ptr<const variant> &copy) {
+    item entry = {key, copy};
+    m_lru.push_front(entry);
+    m_index[key] = m_lru.begin();
+    m_bytes += cost(*copy);
+    while (m_bytes > m_max_bytes && !m_lru.empty()) {
+        item &old = m_lru.back();
+        m_bytes -= cost(*old.copy);
+        m_index.erase(old.key);
+        m_lru.pop_back();
+    }
+}
@@ -0,0 +1,89 @@
+#ifndef COMPRESS_CACHE_H
+#define COMPRESS_CACHE_H
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <deque>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "locker.h"
+
+using namespace std;
+
+// Gzip copies of compressible files that have no precompressed sibling. One background thread compresses,
+// so compression never runs on a worker: lookup() returns a cached copy at once, and on a miss queues the
+// file and the request goes out uncompressed. Copies are keyed by inode, size and mtime, so an edited file
+// gets a new copy while the old one ages out. The cache holds at most max_bytes and evicts the least
+// recently used copies, a copy still being sent stays alive through its shared_ptr. Each entry is charged
+// ENTRY_COST on top of its copy, so files remembered as not worth compressing are evicted too.
+class compress_cache {
+public:
+    struct variant {
+        string data;    // gzip stream, empty when compressing did not pay off
+    };
+
+    static compress_cache *get_instance() {
+        static compress_cache instance;
+        return &instance;
+    }
+
+    // Start the compressor thread keeping up to max_bytes of copies, 0 disables it and every lookup misses
+    bool init(size_t max_bytes);
+    void stop();
+    // The gzip copy of the file at url under doc_root with stat st, NULL while there is none
+    shared_ptr<const variant> lookup(const char *url, const struct stat &st);
+    // Bytes of copies held, with ENTRY_COST for each entry
+    size_t bytes();
+
+private:
+    // Files larger than max_bytes / MAX_FILE_SHARE are sent as they are
+    static const int MAX_FILE_SHARE = 8;
+    static const int MAX_PENDING = 256;
+    // A copy must save a tenth of the file to be worth the Content-Encoding
+    static const int MIN_SAVING_PERCENT = 10;
+    // Bytes charged for an entry besides its copy, about what its key and nodes take
+    static const int ENTRY_COST = 256;
+
+    struct job {
+        string key;
+        string url;
+    };
+    struct item {
+        string key;
+        shared_ptr<const variant> copy;
+    };
+
+    compress_cache() : m_max_bytes(0), m_bytes(0), m_stop(false), m_running(false), m_lock("compress"),
+                       m_cond("compress") {}
+    static void *worker(void *arg);
+    void run();
+    // Key of the file with stat st
+    static string makeKey(const struct stat &st);
+    // Gzip the file at url, opened through file_cache so that no link leads out of doc_root, NULL when it
+    // cannot be read or is no longer the file key was made for
+    static shared_ptr<const variant> compress(const string &url, const string &key);
+    // Bytes an entry counts against m_max_bytes
+    static size_t cost(const variant &copy) { return copy.data.size() + ENTRY_COST; }
+    // Insert a copy as most recently used and evict down to m_max_bytes, called with m_lock held
+    void insert(const string &key, const shared_ptr<const variant> &copy);
+
+private:
+    size_t m_max_bytes;
+    size_t m_bytes;
+    // Most recently used first
+    list<item> m_lru;
+    unordered_map<string, list<item>::iterator> m_index;
+    deque<job> m_jobs;
+    // Keys queued or being compressed, so a file is queued once however many requests miss it
+    unordered_map<string, bool> m_pending;
+    bool m_stop;
+    bool m_running;
+    pthread_t m_thread;
+    locker m_lock;
+    cond m_cond;
+};
+
+#endif
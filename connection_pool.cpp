@@ -1,62 +1,229 @@
 #include <mysql/mysql.h>
+#include <mysql/errmsg.h>
 #include <iostream>
 #include <string>
 #include <list>
-#include <mutex>
-#include <semaphore.h> // C++20, use alternative for older standards
+#include <vector>
+#include <string.h>
+#include <unistd.h>
 
 #include "connection_pool.h"
+#include "log.h"
+#include "metrics.h"
+#include "probes.h"
 
 using namespace std;
 
+// Seconds between two rounds of the maintainer thread
+static const int MAINTAIN_INTERVAL = 1;
+// Idle connections not used for this many seconds are pinged by the maintainer
+static const int PING_INTERVAL = 5;
+// Connect and read timeout of a single handle, bounds how long a health check can block
+static const unsigned int NET_TIMEOUT = 3;
+
+// Microseconds elapsed since start on the monotonic clock
+static unsigned long long elapsedUs(const struct timespec& start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1000000ULL + now.tv_nsec / 1000 - start.tv_nsec / 1000;
+}
+
 // Singleton pattern implementation for connection pool
 connection_pool* connection_pool::GetInstance() {
     static connection_pool instance;
     return &instance;
 }
 
-connection_pool::connection_pool() : CurConn(0), FreeConn(0) {}
+connection_pool::connection_pool() : MinConn(0), MaxConn(0), CurConn(0), FreeConn(0), Opening(0), AcquireTimeout(-1),
+                                     IdleTimeout(60), m_stop(false), lock("connection_pool"),
+                                     m_freed("connection_pool.freed"), m_maintaining(false) {
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+// Argument of a warm-up thread, con is set to the opened handle or NULL on failure
+struct warmup_arg {
+    connection_pool* pool;
+    MYSQL* con;
+};
 
-void connection_pool::init(const string& url, const string& User, const string& PassWord, const string& DBName, int Port, unsigned int MaxConn) {
+void* connection_pool::warmup(void* arg) {
+    warmup_arg* w = (warmup_arg*)arg;
+    w->con = w->pool->connect();
+    mysql_thread_end();
+    return NULL;
+}
+
+void connection_pool::init(const string& url, const string& user, const string& password, const string& databaseName, int port,
+                           unsigned int minConn, unsigned int maxConn, int acquireTimeoutMs, int idleTimeout) {
     this->url = url;
-    this->Port = Port;
-    this->User = User;
-    this->PassWord = PassWord;
-    this->DatabaseName = DBName;
-
-    lock_guard<mutex> guard(lock); // Use RAII for locking
-    for (unsigned int i = 0; i < MaxConn; i++) {
-        MYSQL *con = mysql_init(nullptr);
-        if (!con) {
-            cerr << "Error: " << mysql_error(con) << endl;
-            throw runtime_error("Failed to init MYSQL connection");
+    this->port = port;
+    this->user = user;
+    this->password = password;
+    this->databaseName = databaseName;
+    MinConn = minConn;
+    MaxConn = maxConn < minConn ? minConn : maxConn;
+    AcquireTimeout = acquireTimeoutMs;
+    IdleTimeout = idleTimeout;
+
+    // mysql_init is only thread safe once the library has been initialized
+    mysql_library_init(0, NULL, NULL);
+
+    // Open the initial connections in parallel, start-up then costs one round trip instead of MinConn
+    vector<pthread_t> threads(MinConn);
+    vector<warmup_arg> args(MinConn);
+    vector<bool> started(MinConn, false);
+    for (unsigned int i = 0; i < MinConn; i++) {
+        args[i].pool = this;
+        args[i].con = NULL;
+        if (pthread_create(&threads[i], NULL, warmup, &args[i]) == 0) {
+            started[i] = true;
+        } else {
+            args[i].con = connect();
         }
-        con = mysql_real_connect(con, url.c_str(), User.c_str(), PassWord.c_str(), DBName.c_str(), Port, nullptr, 0);
-        if (!con) {
-            cerr << "Error: " << mysql_error(con) << endl;
-            throw runtime_error("Failed to connect to MYSQL server");
+    }
+    for (unsigned int i = 0; i < MinConn; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
         }
-        connList.push_back(con);
-        FreeConn++;
     }
-    reserve = semaphore(FreeConn);
-    this->MaxConn = FreeConn;
+
+    time_t now = time(NULL);
+    lock.lock();
+    for (unsigned int i = 0; i < MinConn; i++) {
+        if (args[i].con) {
+            idle_conn idle = {args[i].con, now};
+            connList.push_back(idle);
+            ++FreeConn;
+            ++m_stats.opened;
+        }
+    }
+    lock.unlock();
+
+    if (FreeConn < MinConn) {
+        // The maintainer keeps retrying, so a database that comes up later still fills the pool
+        LOG_ERROR("MySQL pool opened %u of %u connections", FreeConn, MinConn);
+    }
+
+    if (pthread_create(&m_maintainer, NULL, maintainer, this) == 0) {
+        m_maintaining = true;
+    } else {
+        LOG_ERROR("%s", "MySQL pool maintainer thread creation failed");
+    }
+}
+
+MYSQL* connection_pool::connect() {
+    MYSQL* con = mysql_init(NULL);
+    if (!con) {
+        LOG_ERROR("%s", "MySQL init error");
+        return NULL;
+    }
+    mysql_options(con, MYSQL_OPT_CONNECT_TIMEOUT, &NET_TIMEOUT);
+    mysql_options(con, MYSQL_OPT_READ_TIMEOUT, &NET_TIMEOUT);
+    if (!mysql_real_connect(con, url.c_str(), user.c_str(), password.c_str(), databaseName.c_str(), port, NULL, 0)) {
+        LOG_ERROR("MySQL connect error:%s", mysql_error(con));
+        mysql_close(con);
+        return NULL;
+    }
+    return con;
+}
+
+// Called with the lock held
+void connection_pool::recordWait(unsigned long long us) {
+    ++m_stats.waits;
+    m_stats.wait_us_total += us;
+    if (us > m_stats.wait_us_max) {
+        m_stats.wait_us_max = us;
+    }
 }
 
 MYSQL* connection_pool::GetConnection() {
-    if (connList.empty()) {
-        return nullptr;
+    return GetConnection(AcquireTimeout);
+}
+
+MYSQL* connection_pool::GetConnection(int timeout_ms) {
+    struct timespec start, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (timeout_ms > 0) {
+        // m_freed waits on the monotonic clock, like the elapsed time checked after a wakeup
+        deadline = start;
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
     }
 
-    reserve.acquire(); // Block until a connection is available
-    lock_guard<mutex> guard(lock);
-    MYSQL* con = connList.front();
-    connList.pop_front();
+    bool waited = false;
+    lock.lock();
+    while (!m_stop) {
+        if (!connList.empty()) {
+            MYSQL* con = connList.front().con;
+            connList.pop_front();
+            --FreeConn;
+            ++CurConn;
+            ++m_stats.acquires;
+            if (waited) {
+                recordWait(elapsedUs(start));
+            }
+            lock.unlock();
+            unsigned long long us = elapsedUs(start);
+            METRICS_RECORD(H_DB_ACQUIRE, us * 1000);
+            PROBE2(db_acquire, us, 1);
+            return con;
+        }
 
-    --FreeConn;
-    ++CurConn;
+        // Grow instead of queueing while the pool is below its maximum size
+        if (FreeConn + CurConn + Opening < MaxConn) {
+            ++Opening;
+            lock.unlock();
+            MYSQL* con = connect();
+            lock.lock();
+            --Opening;
+            if (con) {
+                ++CurConn;
+                ++m_stats.acquires;
+                ++m_stats.opened;
+                if (waited) {
+                    recordWait(elapsedUs(start));
+                }
+                lock.unlock();
+                unsigned long long us = elapsedUs(start);
+                METRICS_RECORD(H_DB_ACQUIRE, us * 1000);
+                PROBE2(db_acquire, us, 1);
+                return con;
+            }
+            // Server unreachable, fall back to waiting for a returned connection
+        }
 
-    return con;
+        if (timeout_ms == 0) {
+            break;
+        }
+        if (!waited) {
+            PROBE1(db_wait, timeout_ms);
+        }
+        waited = true;
+        if (timeout_ms < 0) {
+            m_freed.wait(lock);
+        } else if (!m_freed.timewait(lock, deadline) && elapsedUs(start) >= timeout_ms * 1000ULL) {
+            break;
+        }
+    }
+
+    ++m_stats.timeouts;
+    recordWait(elapsedUs(start));
+    lock.unlock();
+    METRICS_ADD(M_DB_TIMEOUTS, 1);
+    unsigned long long us = elapsedUs(start);
+    METRICS_RECORD(H_DB_ACQUIRE, us * 1000);
+    PROBE2(db_acquire, us, 0);
+    LOG_WARN("MySQL connection acquire timed out after %d ms", timeout_ms);
+    return NULL;
+}
+
+bool connection_pool::Broken(MYSQL* con) {
+    unsigned int err = mysql_errno(con);
+    return err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST;
 }
 
 bool connection_pool::ReleaseConnection(MYSQL* con) {
@@ -64,29 +231,164 @@ bool connection_pool::ReleaseConnection(MYSQL* con) {
         return false;
     }
 
-    lock_guard<mutex> guard(lock);
-    connList.push_back(con);
+    // A handle that lost the server, e.g. to a restart, would fail every query until the idle ping finds it,
+    // which never happens under steady load. It is closed here, the maintainer refills the pool to MinConn and
+    // GetConnection grows it on demand.
+    if (Broken(con)) {
+        LOG_WARN("MySQL connection lost:%s", mysql_error(con));
+        mysql_close(con);
+        lock.lock();
+        --CurConn;
+        ++m_stats.broken;
+        lock.unlock();
+        m_freed.signal();
+        return true;
+    }
+
+    lock.lock();
+    idle_conn idle = {con, time(NULL)};
+    connList.push_back(idle);
     ++FreeConn;
     --CurConn;
+    lock.unlock();
 
-    reserve.release(); // Signal that a connection is available
+    // Signal that a connection is available
+    m_freed.signal();
+    PROBE1(db_release, con);
     return true;
 }
 
+void* connection_pool::maintainer(void* arg) {
+    connection_pool* pool = (connection_pool*)arg;
+    pool->maintain();
+    mysql_thread_end();
+    return NULL;
+}
+
+// Close connections idle for too long above MinConn, ping the other idle ones and replace the broken,
+// then refill the pool up to MinConn. Network round trips happen outside the lock, handles being checked
+// are counted in Opening so GetConnection never grows the pool past MaxConn meanwhile.
+void connection_pool::maintain() {
+    int rounds = 0;
+    while (true) {
+        sleep(MAINTAIN_INTERVAL);
+
+        list<idle_conn> expired;
+        list<idle_conn> check;
+        time_t now = time(NULL);
+
+        lock.lock();
+        if (m_stop) {
+            lock.unlock();
+            break;
+        }
+        unsigned int total = FreeConn + CurConn + Opening;
+        for (list<idle_conn>::iterator it = connList.begin(); it != connList.end();) {
+            list<idle_conn>::iterator cur = it++;
+            if (total > MinConn && now - cur->last_used >= IdleTimeout) {
+                expired.splice(expired.end(), connList, cur);
+                --FreeConn;
+                --total;
+            } else if (now - cur->last_used >= PING_INTERVAL) {
+                check.splice(check.end(), connList, cur);
+                --FreeConn;
+                ++Opening;
+            }
+        }
+        // Open what is missing below MinConn, e.g. after the server was restarted
+        unsigned int missing = total < MinConn ? MinConn - total : 0;
+        Opening += missing;
+        lock.unlock();
+
+        for (list<idle_conn>::iterator it = expired.begin(); it != expired.end(); ++it) {
+            mysql_close(it->con);
+        }
+
+        unsigned int checked = check.size();
+        unsigned long long broken = 0;
+        unsigned long long opened = 0;
+        for (list<idle_conn>::iterator it = check.begin(); it != check.end();) {
+            if (mysql_ping(it->con) == 0) {
+                it->last_used = now;
+                ++it;
+                continue;
+            }
+            LOG_WARN("MySQL connection lost:%s", mysql_error(it->con));
+            mysql_close(it->con);
+            ++broken;
+            it->con = connect();
+            if (it->con) {
+                ++opened;
+                it->last_used = now;
+                ++it;
+            } else {
+                it = check.erase(it);
+            }
+        }
+        for (unsigned int i = 0; i < missing; i++) {
+            MYSQL* con = connect();
+            if (!con) {
+                break;
+            }
+            ++opened;
+            idle_conn idle = {con, now};
+            check.push_back(idle);
+        }
+
+        lock.lock();
+        Opening -= checked + missing;
+        FreeConn += check.size();
+        connList.splice(connList.end(), check);
+        m_stats.closed += expired.size();
+        m_stats.broken += broken;
+        m_stats.opened += opened;
+        if (++rounds % 60 == 0) {
+            LOG_INFO("MySQL pool free:%u busy:%u acquires:%llu waits:%llu timeouts:%llu avg wait:%lluus max wait:%lluus",
+                     FreeConn, CurConn, m_stats.acquires, m_stats.waits, m_stats.timeouts,
+                     m_stats.waits ? m_stats.wait_us_total / m_stats.waits : 0ULL, m_stats.wait_us_max);
+        }
+        lock.unlock();
+        // Wake waiters for the returned handles, and those that may now open a connection themselves
+        m_freed.broadcast();
+    }
+}
+
 void connection_pool::DestroyPool() {
-    lock_guard<mutex> guard(lock);
-    for (auto con : connList) {
-        mysql_close(con);
+    lock.lock();
+    m_stop = true;
+    lock.unlock();
+    m_freed.broadcast();
+    if (m_maintaining) {
+        pthread_join(m_maintainer, NULL);
+        m_maintaining = false;
+    }
+
+    lock.lock();
+    for (list<idle_conn>::iterator it = connList.begin(); it != connList.end(); ++it) {
+        mysql_close(it->con);
     }
     connList.clear();
     CurConn = 0;
     FreeConn = 0;
+    lock.unlock();
 }
 
 int connection_pool::GetFreeConn() {
     return FreeConn;
 }
 
+int connection_pool::GetCurConn() {
+    return CurConn;
+}
+
+void connection_pool::GetStats(pool_stats* stats) {
+    lock.lock();
+    *stats = m_stats;
+    stats->free_conn = FreeConn;
+    stats->cur_conn = CurConn;
+    lock.unlock();
+}
+
 connection_pool::~connection_pool() {
     DestroyPool();
 }
@@ -97,6 +399,12 @@ connectionRAII::connectionRAII(MYSQL** SQL, connection_pool* connPool) {
     poolRAII = connPool;
 }
 
+connectionRAII::connectionRAII(MYSQL** SQL, connection_pool* connPool, int timeout_ms) {
+    *SQL = connPool->GetConnection(timeout_ms);
+    conRAII = *SQL;
+    poolRAII = connPool;
+}
+
 connectionRAII::~connectionRAII() {
     poolRAII->ReleaseConnection(conRAII);
 }
@@ -4,12 +4,28 @@
 #include <iostream>
 #include <list>
 #include <string>
+#include <time.h>
+#include <pthread.h>
 #include <mysql/mysql.h>
 
 #include "locker.h"
 
 using namespace std;
 
+// Wait-time and health counters of the pool, read through connection_pool::GetStats()
+struct pool_stats {
+    unsigned long long acquires;        // Successful GetConnection calls
+    unsigned long long waits;           // Acquires that had to block for a free connection
+    unsigned long long timeouts;        // Acquires that gave up at their deadline
+    unsigned long long wait_us_total;   // Total time spent blocked in GetConnection
+    unsigned long long wait_us_max;     // Longest single wait
+    unsigned long long opened;          // Connections opened (warm-up, growth and reconnects)
+    unsigned long long closed;          // Connections closed by the idle shrinker
+    unsigned long long broken;          // Connections dropped after a failed health check or a lost query
+    unsigned int free_conn;
+    unsigned int cur_conn;
+};
+
 class connection_pool {
 public:
     connection_pool();
@@ -18,21 +34,49 @@ public:
     // Singleton access
     static connection_pool* GetInstance();
 
-    MYSQL* GetConnection();                        // Retrieve a connection from the pool
-    bool ReleaseConnection(MYSQL* conn);           // Return a connection to the pool
+    MYSQL* GetConnection();                        // Retrieve a connection, waiting at most the configured acquire timeout
+    MYSQL* GetConnection(int timeout_ms);          // Retrieve a connection, < 0 waits forever, 0 only tries once
+    bool ReleaseConnection(MYSQL* conn);           // Return a connection to the pool, closing it when broken
+    static bool Broken(MYSQL* conn);               // True when the last call on conn lost the server
     int GetFreeConn();                             // Get the number of available connections
+    int GetCurConn();                              // Get the number of connections handed out
+    void GetStats(pool_stats* stats);              // Snapshot the wait-time and health counters
     void DestroyPool();                            // Destroy all connections and clean up the pool
 
-    void init(const string& url, const string& user, const string& password, const string& databaseName, int port, unsigned int maxConn);
+    // minConn connections are opened in parallel at start-up and kept alive, the pool grows up to
+    // maxConn while callers are waiting, and connections idle for idleTimeout seconds above minConn are closed
+    void init(const string& url, const string& user, const string& password, const string& databaseName, int port,
+              unsigned int minConn, unsigned int maxConn, int acquireTimeoutMs = 1000, int idleTimeout = 60);
+
+private:
+    // Idle connection and the time it was last returned to the pool
+    struct idle_conn {
+        MYSQL* con;
+        time_t last_used;
+    };
+
+    MYSQL* connect();                              // Open one connection, called without holding the lock
+    static void* warmup(void* arg);                // Thread body used to open the initial connections in parallel
+    static void* maintainer(void* arg);            // Background health check and idle shrink thread
+    void maintain();
+    void recordWait(unsigned long long us);
 
 private:
+    unsigned int MinConn;      // Minimum number of connections kept open
     unsigned int MaxConn;      // Maximum number of connections in the pool
     unsigned int CurConn;      // Number of connections currently in use
     unsigned int FreeConn;     // Number of connections currently available
+    unsigned int Opening;      // Number of connections being opened or health checked outside the lock
+    int AcquireTimeout;        // Default deadline of GetConnection() in ms
+    int IdleTimeout;           // Seconds an idle connection above MinConn is kept
+    bool m_stop;
 
     locker lock;               // Mutex for thread safety
-    list<MYSQL*> connList;     // List of available connections
-    sem reserve;               // Semaphore tracking available connections
+    cond m_freed;              // Signalled when a connection is returned or a slot to open one frees up
+    list<idle_conn> connList;  // List of available connections
+    pthread_t m_maintainer;
+    bool m_maintaining;
+    pool_stats m_stats;
 
     string url;                // Database URL
     int port;                  // Database port
@@ -45,6 +89,7 @@ private:
 class connectionRAII {
 public:
     connectionRAII(MYSQL** con, connection_pool* connPool);
+    connectionRAII(MYSQL** con, connection_pool* connPool, int timeout_ms);
     ~connectionRAII();
 
 private:
@@ -0,0 +1,290 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <linux/openat2.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "file_cache.h"
+#include "log.h"
+#include "metrics.h"
+
+// Changes that can make an entry stale, in the directory itself or in a file or directory inside it
+static const uint32_t WATCH_MASK = IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                   IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+// Set once openat2 turned out to be missing, kernels before 5.6, so paths are opened with openat
+static bool no_openat2 = false;
+
+// Write the path of url relative to the root into path: slashes and "." segments go, "" becomes ".". False
+// when a ".." segment would climb out of the root or the path does not fit.
+static bool normalize(const char *url, char *path, size_t size) {
+    size_t n = 0;
+    for (const char *seg = url; *seg;) {
+        seg += strspn(seg, "/");
+        size_t len = strcspn(seg, "/");
+        if (len == 0 || (len == 1 && seg[0] == '.')) {
+            seg += len;
+            continue;
+        }
+        if (len == 2 && seg[0] == '.' && seg[1] == '.') {
+            return false;
+        }
+        if (n + (n > 0) + len >= size) {
+            return false;
+        }
+        if (n > 0) {
+            path[n++] = '/';
+        }
+        memcpy(path + n, seg, len);
+        n += len;
+        seg += len;
+    }
+    if (n == 0) {
+        path[n++] = '.';
+    }
+    path[n] = '\0';
+    return true;
+}
+
+// Open path under dirfd, refusing to resolve out of it through a symbolic link or a /proc link. Falls back to
+// openat where openat2 is missing, the path was normalized and holds no ".." of its own.
+static int openBeneath(int dirfd, const char *path, int flags) {
+    if (!__atomic_load_n(&no_openat2, __ATOMIC_RELAXED)) {
+        struct open_how how;
+        memset(&how, 0, sizeof(how));
+        how.flags = flags;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        int fd = syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+        if (fd >= 0 || errno != ENOSYS) {
+            return fd;
+        }
+        __atomic_store_n(&no_openat2, true, __ATOMIC_RELAXED);
+    }
+    return openat(dirfd, path, flags);
+}
+
+file_cache::entry::~entry() {
+    if (address) {
+        METRICS_ADD(M_FILE_SYSCALLS, 1);
+        munmap(address, st.st_size);
+    }
+}
+
+bool file_cache::init(const char *root, int ttl_ms, bool use_inotify) {
+    m_dirfd = ::open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (m_dirfd < 0) {
+        return false;
+    }
+    m_enabled = ttl_ms >= 0;
+    m_ttl_ns = m_enabled ? ttl_ms * 1000000ULL : 0;
+    if (!m_enabled || !use_inotify) {
+        return true;
+    }
+    m_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_inotify_fd < 0) {
+        LOG_WARN("inotify_init1 failed, errno %d, files are checked every %d ms", errno, ttl_ms);
+        return true;
+    }
+    if (pthread_create(&m_thread, NULL, worker, this) != 0) {
+        close(m_inotify_fd);
+        m_inotify_fd = -1;
+        return true;
+    }
+    m_running = true;
+    return true;
+}
+
+void file_cache::stop() {
+    if (!m_running) {
+        return;
+    }
+    __atomic_store_n(&m_stop, true, __ATOMIC_RELEASE);
+    pthread_join(m_thread, NULL);
+    m_running = false;
+}
+
+shared_ptr<const file_cache::entry> file_cache::lookup(const char *url, bool map) {
+    // Keyed on the normalized path, so "/a//b" and "/./a/b" share the entry of "/a/b"
+    char path[PATH_MAX];
+    if (!normalize(url, path, sizeof(path))) {
+        shared_ptr<entry> file = make_shared<entry>();
+        file->path = url;
+        file->error = ENOENT;
+        file->address = NULL;
+        return file;
+    }
+    if (!m_enabled) {
+        return open_entry(path, map);
+    }
+    unsigned long long hash = 14695981039346656037ULL;
+    for (const char *p = path; *p; ++p) {
+        hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    int index = (int)(hash >> 54) & (SLOTS - 1);
+    stripe &lock = m_stripes[index & (STRIPES - 1)];
+    slot &s = m_slots[index];
+    unsigned long long now = metrics::now();
+    // Read before the file system is, so that a change seen during the check leaves the entry due again
+    unsigned long long epoch = __atomic_load_n(&m_epoch, __ATOMIC_ACQUIRE);
+    lock.lock.lock();
+    if (s.file && s.file->path == path) {
+        if (fresh(s, now)) {
+            shared_ptr<const entry> file = s.file;
+            lock.lock.unlock();
+            METRICS_ADD(M_FILE_CACHE_HITS, 1);
+            return file;
+        }
+        struct stat st;
+        METRICS_ADD(M_FILE_SYSCALLS, 1);
+        int error = fstatat(m_dirfd, path, &st, 0) < 0 ? errno : 0;
+        if (!changed(*s.file, error, st)) {
+            s.checked_ns = now;
+            s.epoch = epoch;
+            shared_ptr<const entry> file = s.file;
+            lock.lock.unlock();
+            METRICS_ADD(M_FILE_CACHE_REVALIDATIONS, 1);
+            return file;
+        }
+    }
+    // Watched before it is opened, so no change after the open goes unseen
+    bool watched = m_running && watch(path);
+    shared_ptr<const entry> file = open_entry(path, true);
+    // A file that could not be mapped is tried again by the next request
+    if (file->error == 0 && mappable(file->st) && !file->address) {
+        lock.lock.unlock();
+        return file;
+    }
+    if (!s.file) {
+        __atomic_add_fetch(&m_size, 1, __ATOMIC_RELAXED);
+    }
+    s.file = file;
+    s.checked_ns = now;
+    s.epoch = epoch;
+    s.watched = watched;
+    lock.lock.unlock();
+    METRICS_ADD(M_FILE_CACHE_MISSES, 1);
+    return file;
+}
+
+int file_cache::open(const char *url, int flags) {
+    char path[PATH_MAX];
+    if (!normalize(url, path, sizeof(path))) {
+        errno = ENOENT;
+        return -1;
+    }
+    return openBeneath(m_dirfd, path, flags);
+}
+
+shared_ptr<const file_cache::entry> file_cache::map(const shared_ptr<const entry> &file) {
+    if (file->address || file->error || !mappable(file->st)) {
+        return file;
+    }
+    return open_entry(file->path.c_str(), true);
+}
+
+shared_ptr<const file_cache::entry> file_cache::open_entry(const char *path, bool map) {
+    shared_ptr<entry> file = make_shared<entry>();
+    file->path = path;
+    file->error = 0;
+    file->address = NULL;
+    // Open first and stat the descriptor, so the stat and the mapping are of the same file even if it is
+    // being replaced. O_NONBLOCK keeps a FIFO under the root from blocking the worker, O_PATH takes neither
+    // read permission nor a FIFO's peer. A link leading out of the root fails with EXDEV and is answered as
+    // missing.
+    METRICS_ADD(M_FILE_SYSCALLS, 1);
+    int fd = openBeneath(m_dirfd, path, (map ? O_RDONLY | O_NONBLOCK : O_PATH) | O_CLOEXEC);
+    if (fd < 0) {
+        file->error = errno;
+        // A file this process may not read still has a stat, answered 403 when others may not read it either
+        if (file->error == EACCES) {
+            METRICS_ADD(M_FILE_SYSCALLS, 1);
+            if (fstatat(m_dirfd, path, &file->st, 0) == 0 && !(file->st.st_mode & S_IROTH)) {
+                file->error = 0;
+            }
+        }
+        return file;
+    }
+    METRICS_ADD(M_FILE_SYSCALLS, 2);
+    if (fstat(fd, &file->st) < 0) {
+        file->error = errno;
+    } else if (map && mappable(file->st)) {
+        METRICS_ADD(M_FILE_SYSCALLS, 1);
+        void *address = mmap(0, file->st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address != MAP_FAILED) {
+            file->address = (char *)address;
+        }
+    }
+    close(fd);
+    return file;
+}
+
+bool file_cache::fresh(const slot &s, unsigned long long now_ns) const {
+    if (s.watched) {
+        return s.epoch == __atomic_load_n(&m_epoch, __ATOMIC_ACQUIRE);
+    }
+    return now_ns - s.checked_ns < m_ttl_ns;
+}
+
+bool file_cache::changed(const entry &e, int error, const struct stat &st) {
+    if (error != 0 || e.error != 0) {
+        return error != e.error;
+    }
+    return st.st_dev != e.st.st_dev || st.st_ino != e.st.st_ino || st.st_size != e.st.st_size ||
+           st.st_mode != e.st.st_mode || st.st_mtim.tv_sec != e.st.st_mtim.tv_sec ||
+           st.st_mtim.tv_nsec != e.st.st_mtim.tv_nsec || st.st_ctim.tv_sec != e.st.st_ctim.tv_sec ||
+           st.st_ctim.tv_nsec != e.st.st_ctim.tv_nsec;
+}
+
+bool file_cache::watch(const char *path) {
+    // The root by its descriptor, so a relative doc_root or a later chdir do not matter
+    char dir[PATH_MAX];
+    size_t prefix = snprintf(dir, sizeof(dir), "/proc/self/fd/%d/", m_dirfd);
+    METRICS_ADD(M_FILE_SYSCALLS, 1);
+    if (inotify_add_watch(m_inotify_fd, dir, WATCH_MASK | IN_ONLYDIR) < 0) {
+        return false;
+    }
+    for (const char *slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/')) {
+        size_t len = slash - path;
+        if (prefix + len >= sizeof(dir)) {
+            return false;
+        }
+        memcpy(dir + prefix, path, len);
+        dir[prefix + len] = '\0';
+        // A directory that does not exist yet leaves its parent watched, which sees it created
+        METRICS_ADD(M_FILE_SYSCALLS, 1);
+        if (inotify_add_watch(m_inotify_fd, dir, WATCH_MASK | IN_ONLYDIR) < 0) {
+            return errno == ENOENT || errno == ENOTDIR;
+        }
+    }
+    return true;
+}
+
+void *file_cache::worker(void *arg) {
+    ((file_cache *)arg)->run();
+    return NULL;
+}
+
+void file_cache::run() {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = {m_inotify_fd, POLLIN, 0};
+    while (!__atomic_load_n(&m_stop, __ATOMIC_ACQUIRE)) {
+        if (poll(&pfd, 1, 200) <= 0) {
+            continue;
+        }
+        bool any = false;
+        while (read(m_inotify_fd, events, sizeof(events)) > 0) {
+            any = true;
+        }
+        if (any) {
+            __atomic_add_fetch(&m_epoch, 1, __ATOMIC_RELEASE);
+        }
+    }
+    close(m_inotify_fd);
+    m_inotify_fd = -1;
+}
@@ -0,0 +1,101 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <memory>
+#include <string>
+
+#include "locker.h"
+
+using namespace std;
+
+// Open files under doc_root, shared by all workers. An entry holds the stat of a path and, for a readable
+// regular file, a mapping of all of it, so serving a cached file makes no file system call, and a path that
+// does not exist (the .gz sibling most files lack) is remembered as missing. Paths are normalized, refusing
+// "..", and opened with openat2 beneath a descriptor of doc_root taken once, so no link leads out of it. An
+// entry is checked again with one fstatat once ttl_ms passed, or with inotify once anything changed in a
+// directory on its path, and replaced when the file changed. Direct mapped behind striped locks like
+// validator_cache. Responses hold their entry through a shared_ptr, so an entry replaced while being sent is
+// unmapped after its last response.
+class file_cache {
+public:
+    struct entry {
+        ~entry();
+        string path;    // relative to doc_root
+        int error;      // errno of opening the path, 0 when st is valid
+        struct stat st;
+        char *address;  // the file mapped, NULL unless st is a readable regular file that is not empty
+    };
+
+    static file_cache *get_instance() {
+        static file_cache instance;
+        return &instance;
+    }
+
+    // Serve files under root, checking entries again after ttl_ms, and with use_inotify as soon as their
+    // directory changes, falling back to ttl_ms where a directory cannot be watched. A negative ttl_ms turns
+    // the cache off so that every lookup opens and maps the file anew.
+    bool init(const char *root, int ttl_ms, bool use_inotify);
+    void stop();
+    // The entry of url, a path under root such as "/home.html", never NULL. A url climbing out of the root
+    // with ".." gets an entry that is missing. With the cache off and map false, the file is only opened
+    // with O_PATH for its stat, e.g. to answer a conditional GET, and map() maps it when it is sent.
+    shared_ptr<const entry> lookup(const char *url, bool map = true);
+    // The entry of the same path with the file mapped, file itself when it is mapped or cannot be
+    shared_ptr<const entry> map(const shared_ptr<const entry> &file);
+    // Open url under the root with flags as lookup does, for readers that need a descriptor of their own, or
+    // -1 with errno set
+    int open(const char *url, int flags);
+    // Entries held
+    int size() const { return __atomic_load_n(&m_size, __ATOMIC_RELAXED); }
+
+private:
+    static const int SLOTS = 1024;
+    static const int STRIPES = 16;
+
+    struct slot {
+        shared_ptr<const entry> file;
+        unsigned long long checked_ns;
+        // m_epoch when the entry was checked, meaningful when its directories are watched
+        unsigned long long epoch;
+        bool watched;
+    };
+    struct stripe {
+        stripe() : lock("file_cache") {}
+        locker lock;
+    };
+
+    file_cache() : m_dirfd(-1), m_ttl_ns(0), m_enabled(false), m_inotify_fd(-1), m_epoch(0), m_stop(false),
+                   m_running(false), m_size(0) {}
+    // Open, stat and map path, normalized and relative to the root, or only stat it when map is false
+    shared_ptr<const entry> open_entry(const char *path, bool map);
+    // True when st is of a file entries map
+    static bool mappable(const struct stat &st) {
+        return S_ISREG(st.st_mode) && (st.st_mode & S_IROTH) && st.st_size > 0;
+    }
+    // True when the entry in s is known to match the file system at now_ns without a look at it
+    bool fresh(const slot &s, unsigned long long now_ns) const;
+    // True when error and st, just read from the file system, no longer describe what e holds
+    static bool changed(const entry &e, int error, const struct stat &st);
+    // Watch every directory from the root down to the one holding path, false when one could not be
+    bool watch(const char *path);
+    static void *worker(void *arg);
+    // Read inotify events and move m_epoch on for each batch of them
+    void run();
+
+private:
+    int m_dirfd;
+    unsigned long long m_ttl_ns;
+    bool m_enabled;
+    int m_inotify_fd;
+    unsigned long long m_epoch;
+    bool m_stop;
+    bool m_running;
+    pthread_t m_thread;
+    int m_size;
+    slot m_slots[SLOTS];
+    stripe m_stripes[STRIPES];
+};
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef FILE_TYPES_H
+#define FILE_TYPES_H
+
+#include <string.h>
+#include <strings.h>
+
+// Content types by file extension, and whether a type is worth compressing. Shared by the server and
+// tools/pack_assets, so bundled and served files agree.
+struct file_type {
+    const char *ext;
+    const char *content_type;
+    bool compressible;
+};
+static const file_type file_types[] = {
+    {".html", "text/html", true},
+    {".htm", "text/html", true},
+    {".css", "text/css", true},
+    {".js", "application/javascript", true},
+    {".json", "application/json", true},
+    {".txt", "text/plain", true},
+    {".xml", "application/xml", true},
+    {".svg", "image/svg+xml", true},
+    {".pdf", "application/pdf", true},
+    {".jpg", "image/jpeg", false},
+    {".jpeg", "image/jpeg", false},
+    {".png", "image/png", false},
+    {".gif", "image/gif", false},
+    {".ico", "image/x-icon", false},
+};
+
+// The type of path by its extension, NULL when unknown
+inline const file_type *file_type_of(const char *path) {
+    const char *ext = strrchr(path, '.');
+    for (size_t i = 0; ext && i < sizeof(file_types) / sizeof(file_types[0]); i++) {
+        if (strcasecmp(ext, file_types[i].ext) == 0) {
+            return &file_types[i];
+        }
+    }
+    return NULL;
+}
+
+#endif
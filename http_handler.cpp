@@ -1,18 +1,52 @@
-#include <map>
 #include <mysql/mysql.h>
-#include <fstream>
+#include <limits.h>
+#include <algorithm>
 
 #include "http_handler.h"
 #include "log.h"
+#include "metrics.h"
+#include "probes.h"
+#include "alloc_stats.h"
+#include "topk.h"
+#include "capture.h"
+#include "affinity.h"
+#include "file_types.h"
 
 // Directory for HTML resources
 const char* doc_root = "/home/zhn/Desktop/WebServer/resource";
 
-// Stores user credentials
-map<string, string> users;
+// Built-in text endpoints
+struct endpoint {
+    const char *url;
+    httpHandler::text_endpoint render;
+    const char *content_type;
+};
+static const int MAX_ENDPOINTS = 16;
+static endpoint endpoints[MAX_ENDPOINTS];
+static int endpoint_count = 0;
 
-// Synchronization lock
-locker m_lock;
+int httpHandler::m_user_count = 0;
+int httpHandler::m_epollfd = -1;
+user_store *httpHandler::m_store = NULL;
+mysql_user_store *httpHandler::m_sql_store = NULL;
+bool httpHandler::m_steer_cpu = false;
+bool httpHandler::m_tcp_nodelay = false;
+bool httpHandler::m_tcp_cork = false;
+const char *httpHandler::m_cache_control = "no-cache";
+// First byte and keep-alive idle get fixed deadlines, the old 15 s timeout. Headers may take longer at 500 B/s
+// or more, bodies, uploads among them, and responses as long as the client sends 500 B/s or reads 1 KB/s.
+httpHandler::phase_limit httpHandler::m_limits[PHASE_NUM] = {
+    {10000, 10000, 0},   // FIRST_BYTE
+    {10000, 30000, 500}, // READ_HEADER
+    {10000, 0, 500},     // READ_BODY
+    {10000, 0, 1000},    // WRITE_RESPONSE
+    {15000, 15000, 0},   // KEEP_ALIVE
+};
+static const char *phase_names[] = {"first", "header", "body", "write", "idle"};
+
+// Content-Encoding names and sibling suffixes by httpHandler::ENCODING
+static const char *encoding_names[] = {"identity", "gzip", "zstd"};
+static const char *encoding_suffixes[] = {"", ".gz", ".zst"};
 
 // HTTP status messages
 const char *ok_200_title = "OK";
@@ -24,6 +58,28 @@ const char *error_404_title = "Not Found";
 const char *error_404_form = "Resource not found.\n";
 const char *error_500_title = "Internal Error";
 const char *error_500_form = "Server error.\n";
+const char *partial_206_title = "Partial Content";
+const char *not_modified_304_title = "Not Modified";
+const char *error_416_title = "Range Not Satisfiable";
+const char *error_416_form = "Requested range not satisfiable.\n";
+
+// Responses to uploads, the body of a stored one lists its files. 500 comes last and answers any status missing.
+struct upload_status {
+    int status;
+    const char *title;
+    const char *form;
+};
+static const upload_status upload_statuses[] = {
+    {200, "OK", ""},
+    {201, "Created", ""},
+    {400, "Bad Request", "Invalid upload.\n"},
+    {403, "Forbidden", "Upload not allowed.\n"},
+    {411, "Length Required", "Uploads need a Content-Length.\n"},
+    {413, "Content Too Large", "Upload larger than the server takes.\n"},
+    {507, "Insufficient Storage", "No space left for the upload.\n"},
+    {500, "Internal Error", "Server error.\n"},
+};
+static const int UPLOAD_STATUS_NUM = sizeof(upload_statuses) / sizeof(upload_statuses[0]);
 
 // Sets file descriptor to non-blocking mode
 int setNonBlocking(int fd) {
@@ -33,10 +89,11 @@ int setNonBlocking(int fd) {
     return old_option;
 }
 
-// Registers fd in epoll instance
-void addFd(int epollfd, int fd, bool one_shot) {
+// Registers fd in epoll instance, generation goes in the upper half of the event data next to fd. The fd must
+// be non-blocking already, connections are accepted that way.
+void addFd(int epollfd, int fd, bool one_shot, unsigned int generation) {
     epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = (unsigned long long)generation << 32 | (unsigned int)fd;
     event.events = EPOLLIN | EPOLLRDHUP; // Detect half-closed connections
 
     if (one_shot) {
@@ -44,69 +101,1028 @@ void addFd(int epollfd, int fd, bool one_shot) {
     }
 
     epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
-    setNonBlocking(fd);
-}
-
-// Removes fd from epoll instance
-void removeFd(int epollfd, int fd) {
-    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, 0);
-    close(fd);
 }
 
 // Updates fd event to one-shot in epoll
-void setEventOneshot(int epollfd, int fd, int ev) {
+void setEventOneshot(int epollfd, int fd, int ev, unsigned int generation) {
     epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = (unsigned long long)generation << 32 | (unsigned int)fd;
     event.events = ev | EPOLLONESHOT | EPOLLRDHUP;
     epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
 }
 
+// Register before the server starts, the table is read without locking
+void httpHandler::addEndpoint(const char *url, text_endpoint render, const char *content_type) {
+    if (endpoint_count < MAX_ENDPOINTS) {
+        endpoints[endpoint_count].url = url;
+        endpoints[endpoint_count].render = render;
+        endpoints[endpoint_count].content_type = content_type;
+        endpoint_count++;
+    }
+}
+
+const char *httpHandler::phaseName(PHASE phase) {
+    return phase_names[phase];
+}
+
+bool httpHandler::setLimits(const char *spec) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", spec);
+    char *save = NULL;
+    for (char *item = strtok_r(buf, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(item, '=');
+        if (!value) {
+            return false;
+        }
+        *value++ = '\0';
+        int phase = 0;
+        while (phase < PHASE_NUM && strcmp(item, phase_names[phase]) != 0) {
+            phase++;
+        }
+        double timeout = 0, max = -1;
+        int rate = -1;
+        if (phase == PHASE_NUM || sscanf(value, "%lf:%lf:%d", &timeout, &max, &rate) < 1 || timeout <= 0) {
+            return false;
+        }
+        phase_limit &limit = m_limits[phase];
+        limit.timeout_ms = (int)(timeout * 1000);
+        if (max >= 0) {
+            limit.max_ms = (int)(max * 1000);
+        } else if (limit.max_ms && limit.max_ms < limit.timeout_ms) {
+            limit.max_ms = limit.timeout_ms;
+        }
+        if (rate >= 0) {
+            limit.min_rate = rate;
+        }
+        if (limit.max_ms && limit.max_ms < limit.timeout_ms) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void httpHandler::enterPhase(PHASE phase) {
+    m_phase = phase;
+    m_phase_start = METRICS_NOW() / 1000000;
+    m_phase_bytes = 0;
+}
+
+unsigned long long httpHandler::deadline() const {
+    const phase_limit &limit = m_limits[m_phase];
+    long long allowed = limit.timeout_ms;
+    if (limit.min_rate > 0) {
+        allowed += m_phase_bytes * 1000 / limit.min_rate;
+    }
+    if (limit.max_ms && allowed > limit.max_ms) {
+        allowed = limit.max_ms;
+    }
+    return m_phase_start + allowed;
+}
+
+// A worker holding the handler may still be writing the response or parsing into the buffers, so the fd and with
+// it the slot stay its own until it lets go
+void httpHandler::closeConnection() {
+    if (__atomic_fetch_or(&m_holds, HOLDS_CLOSING, __ATOMIC_ACQ_REL) == 0) {
+        __atomic_store_n(&m_holds, 0, __ATOMIC_RELAXED);
+        finishClose();
+    }
+}
+
+void httpHandler::release() {
+    if (__atomic_sub_fetch(&m_holds, 1, __ATOMIC_ACQ_REL) == HOLDS_CLOSING) {
+        finishClose();
+    }
+}
+
+// The generation changes before the holds are cleared, so work and events queued for the closed connection are
+// dropped rather than holding the handler again
+void httpHandler::finishClose() {
+    int fd = m_sockfd;
+    retire();
+    abortUpload();
+    m_sockfd = -1;
+    __atomic_store_n(&m_holds, 0, __ATOMIC_RELEASE);
+    close(fd);
+}
+
+void httpHandler::abortUpload() {
+    if (m_upload) {
+        METRICS_ADD(M_UPLOADS_FAILED, 1);
+        delete m_upload;
+        m_upload = NULL;
+    }
+}
+
+bool httpHandler::sqlCompleted() {
+    // Settled here rather than in finishSql, which a closed connection never reaches
+    if (!m_sql_login) {
+        m_sql_store->settle(m_user, m_passwd, m_sql.state == sql_request::DONE && m_sql.rows == 1);
+    }
+    if (!closing()) {
+        return true;
+    }
+    m_sql.state = sql_request::IDLE;
+    return false;
+}
+
 // Initialize new connections
 void httpHandler::init(int sockfd, const sockaddr_in &addr) {
     m_sockfd = sockfd;
     m_address = addr;
-    addFd(m_epollfd, sockfd, true);
+    addFd(m_epollfd, sockfd, true, generation());
     m_user_count++;
+    traffic_capture::get_instance()->open(sockfd);
+    m_cpu = m_steer_cpu ? incoming_cpu(sockfd) : -1;
+    if (m_tcp_nodelay) {
+        int one = 1;
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    enterPhase(FIRST_BYTE);
     init();
+    m_accept_ns = METRICS_NOW();
 }
 
 // Prepare socket for data handling
-void httpHandler::init() {
-    mysql = NULL;
+void httpHandler::init(int carried) {
     bytes_to_send = 0;
+    m_iv_count = 0;
+    m_iv_start = 0;
+    m_ready_ns = 0;
+    m_text.clear();
+    m_trace.start();
     bytes_have_send = 0;
-    m_check_state = CHECK_STATE_REQUESTLINE;  // Initial state for parsing requests
+    m_check_state = REQUEST_LINE;  // Initial state for parsing requests
     m_linger = false;  // Connection close flag
     m_method = GET;  // Default HTTP method
     m_url = 0;
     m_version = 0;
     m_content_length = 0;
+    m_has_length = false;
     m_host = 0;
+    m_range = 0;
+    m_if_range = 0;
+    m_if_none_match = 0;
+    m_if_modified_since = 0;
+    m_accept_encoding = 0;
+    m_body_type = 0;
+    m_expect_continue = false;
+    m_chunked = false;
+    m_status = 0;
+    m_content_type = 0;
+    m_vary = false;
+    m_encoding = IDENTITY;
+    m_asset = 0;
     m_start_line = 0;
     m_checked_idx = 0;
-    m_read_idx = 0;
+    m_read_idx = carried;
+    m_pipelined = carried > 0;
     m_writeBuff_idx = 0;
     cgi = 0;
-    memset(m_read_buf, '\0', READ_BUFFER_SIZE);
-    memset(m_writeBuff_buf, '\0', writeBuff_BUFFER_SIZE);
+    m_string = 0;
+    m_sql_login = false;
+    memset(m_read_buf + carried, '\0', READ_BUFFER_SIZE + 1 - carried);
+    memset(m_writeBuff_buf, '\0', WRITE_BUFFER_SIZE);
     memset(m_real_file, '\0', FILENAME_LEN);
+    memset(m_user, '\0', sizeof(m_user));
+    memset(m_passwd, '\0', sizeof(m_passwd));
 }
 
-// Initialize connection to MySQL database
-void httpHandler::initMysql(connection_pool* connPool) {
-    MYSQL* mysql = NULL;
-    connectionRAII mysqlcon(&mysql, connPool);
+// Extract one line ending in \r\n from the read buffer, terminating it in place
+httpHandler::LINE_STATUS httpHandler::parseLine() {
+    char temp;
+    for (; m_checked_idx < m_read_idx; ++m_checked_idx) {
+        temp = m_read_buf[m_checked_idx];
+        if (temp == '\r') {
+            if ((m_checked_idx + 1) == m_read_idx) {
+                return LINE_OPEN;
+            } else if (m_read_buf[m_checked_idx + 1] == '\n') {
+                m_read_buf[m_checked_idx++] = '\0';
+                m_read_buf[m_checked_idx++] = '\0';
+                return LINE_OK;
+            }
+            return LINE_BAD;
+        } else if (temp == '\n') {
+            if (m_checked_idx > 1 && m_read_buf[m_checked_idx - 1] == '\r') {
+                m_read_buf[m_checked_idx - 1] = '\0';
+                m_read_buf[m_checked_idx++] = '\0';
+                return LINE_OK;
+            }
+            return LINE_BAD;
+        }
+    }
+    return LINE_OPEN;
+}
 
-    if (mysql_query(mysql, "SELECT username, passwd FROM user")) {
-        LOG_ERROR("SELECT error:%s\n", mysql_error(mysql));
+// Read what the client sent, the socket is level triggered so one recv per event is enough
+bool httpHandler::readBuff() {
+    if (m_upload) {
+        // The body of an upload is spliced into its pipe for a worker to write out. It skips the traffic
+        // capture, which keeps the request line and headers only.
+        long moved = m_upload->receive(m_sockfd);
+        if (moved < 0) {
+            abortUpload();
+            return false;
+        }
+        m_phase_bytes += moved;
+        m_trace.mark();
+        return true;
+    }
+    if (m_read_idx >= READ_BUFFER_SIZE) {
+        return false;
+    }
+    unsigned long long start = m_trace.now();
+    int bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return true;
+    }
+    if (bytes_read <= 0) {
+        return false;
     }
+    traffic_capture::get_instance()->data(m_sockfd, m_read_buf + m_read_idx, bytes_read);
+    m_read_idx += bytes_read;
+    // A worker saw the headers end when it asked for more, the rest is body
+    if (m_phase == FIRST_BYTE || m_phase == KEEP_ALIVE) {
+        enterPhase(READ_HEADER);
+    } else if (m_phase == READ_HEADER && m_check_state == CONTENT) {
+        enterPhase(READ_BODY);
+    }
+    m_phase_bytes += bytes_read;
+    if (m_accept_ns) {
+        METRICS_RECORD(H_ACCEPT_TO_READ, METRICS_NOW() - m_accept_ns);
+        m_accept_ns = 0;
+    }
+    m_trace.span("readBuff", start);
+    // Queue wait starts here, the reactor appends the handler to the thread pool next
+    m_trace.mark();
+    return true;
+}
 
-    MYSQL_RES* result = mysql_store_result(mysql);
-    int num_fields = mysql_num_fields(result);
+// Whether the len bytes at seg are a dot segment, "." or "..", with dots that may be written as %2e. Returns the
+// number of dots, 0 for any other segment.
+static int dotSegment(const char *seg, size_t len) {
+    int dots = 0;
+    for (size_t i = 0; i < len; dots++) {
+        if (seg[i] == '.') {
+            i++;
+        } else if (len - i >= 3 && seg[i] == '%' && seg[i + 1] == '2' && (seg[i + 2] == 'e' || seg[i + 2] == 'E')) {
+            i += 3;
+        } else {
+            return 0;
+        }
+    }
+    return dots <= 2 ? dots : 0;
+}
 
-    while (MYSQL_ROW row = mysql_fetch_row(result)) {
-        users[string(row[0])] = string(row[1]);
+// Normalize the path of url in place, before any of it is joined to doc_root: repeated slashes and "." segments
+// go, and a ".." segment, which could climb out of doc_root, makes it false. The query is kept as it is.
+static bool normalizePath(char *url) {
+    char *out = url;
+    const char *in = url;
+    bool trailing = false;
+    while (*in == '/') {
+        in += strspn(in, "/");
+        size_t len = strcspn(in, "/?#");
+        int dots = dotSegment(in, len);
+        if (dots == 2) {
+            return false;
+        }
+        trailing = len == 0 || dots == 1;
+        if (!trailing) {
+            *out++ = '/';
+            memmove(out, in, len);
+            out += len;
+        }
+        in += len;
+    }
+    if (out == url || trailing) {
+        *out++ = '/';
     }
+    memmove(out, in, strlen(in) + 1);
+    return true;
+}
+
+// Parse the request line: method, URL and HTTP version
+httpHandler::HTTP_CODE httpHandler::parseRequest(char *text) {
+    m_url = strpbrk(text, " \t");
+    if (!m_url) {
+        return BAD_REQUEST;
+    }
+    *m_url++ = '\0';
+    char *method = text;
+    if (strcasecmp(method, "GET") == 0) {
+        m_method = GET;
+    } else if (strcasecmp(method, "POST") == 0) {
+        m_method = POST;
+        cgi = 1;
+    } else if (strcasecmp(method, "PUT") == 0 && upload::enabled()) {
+        m_method = PUT;
+    } else {
+        return BAD_REQUEST;
+    }
+    m_url += strspn(m_url, " \t");
+    m_version = strpbrk(m_url, " \t");
+    if (!m_version) {
+        return BAD_REQUEST;
+    }
+    *m_version++ = '\0';
+    m_version += strspn(m_version, " \t");
+    if (strcasecmp(m_version, "HTTP/1.1") != 0) {
+        return BAD_REQUEST;
+    }
+    if (strncasecmp(m_url, "http://", 7) == 0) {
+        m_url += 7;
+        m_url = strchr(m_url, '/');
+    }
+    if (m_url && strncasecmp(m_url, "https://", 8) == 0) {
+        m_url += 8;
+        m_url = strchr(m_url, '/');
+    }
+    if (!m_url || m_url[0] != '/' || !normalizePath(m_url)) {
+        return BAD_REQUEST;
+    }
+    m_check_state = HEADER;
+    return NO_REQUEST;
+}
+
+// Parse one header line, an empty line ends the headers
+httpHandler::HTTP_CODE httpHandler::parseHeader(char *text) {
+    if (text[0] == '\0') {
+        // The body of an upload is not buffered, processRequest streams it
+        if (uploadRequest()) {
+            return GET_REQUEST;
+        }
+        if (m_content_length != 0) {
+            m_check_state = CONTENT;
+            return NO_REQUEST;
+        }
+        return GET_REQUEST;
+    } else if (strncasecmp(text, "Connection:", 11) == 0) {
+        text += 11;
+        text += strspn(text, " \t");
+        if (strcasecmp(text, "keep-alive") == 0) {
+            m_linger = true;
+        }
+    } else if (strncasecmp(text, "Content-length:", 15) == 0) {
+        text += 15;
+        text += strspn(text, " \t");
+        m_content_length = atoll(text);
+        if (m_content_length < 0) {
+            return BAD_REQUEST;
+        }
+        m_has_length = true;
+    } else if (strncasecmp(text, "Content-Type:", 13) == 0) {
+        text += 13;
+        text += strspn(text, " \t");
+        m_body_type = text;
+    } else if (strncasecmp(text, "Expect:", 7) == 0) {
+        text += 7;
+        text += strspn(text, " \t");
+        m_expect_continue = strcasecmp(text, "100-continue") == 0;
+    } else if (strncasecmp(text, "Transfer-Encoding:", 18) == 0) {
+        m_chunked = true;
+    } else if (strncasecmp(text, "Host:", 5) == 0) {
+        text += 5;
+        text += strspn(text, " \t");
+        m_host = text;
+    } else if (strncasecmp(text, "Range:", 6) == 0) {
+        text += 6;
+        text += strspn(text, " \t");
+        m_range = text;
+    } else if (strncasecmp(text, "If-Range:", 9) == 0) {
+        text += 9;
+        text += strspn(text, " \t");
+        m_if_range = text;
+    } else if (strncasecmp(text, "If-None-Match:", 14) == 0) {
+        text += 14;
+        text += strspn(text, " \t");
+        m_if_none_match = text;
+    } else if (strncasecmp(text, "If-Modified-Since:", 18) == 0) {
+        text += 18;
+        text += strspn(text, " \t");
+        m_if_modified_since = text;
+    } else if (strncasecmp(text, "Accept-Encoding:", 16) == 0) {
+        text += 16;
+        text += strspn(text, " \t");
+        m_accept_encoding = text;
+    } else {
+        LOG_INFO("unknown header: %s", text);
+    }
+    return NO_REQUEST;
+}
+
+// The body is complete once m_content_length bytes follow the headers
+httpHandler::HTTP_CODE httpHandler::parseData(char *text) {
+    if (m_read_idx >= (m_content_length + m_checked_idx)) {
+        m_next_byte = text[m_content_length];
+        text[m_content_length] = '\0';
+        // POST body carries the user name and password
+        m_string = text;
+        return GET_REQUEST;
+    }
+    return NO_REQUEST;
+}
+
+// Copy the value of key from an urlencoded "key=value&..." body
+static bool formValue(const char *body, const char *key, char *value, size_t size) {
+    size_t key_len = strlen(key);
+    const char *p = body;
+    while (p && *p) {
+        if (strncmp(p, key, key_len) == 0 && p[key_len] == '=') {
+            p += key_len + 1;
+            size_t len = strcspn(p, "&");
+            if (len == 0 || len >= size) {
+                return false;
+            }
+            memcpy(value, p, len);
+            value[len] = '\0';
+            return true;
+        }
+        p = strchr(p, '&');
+        if (p) {
+            ++p;
+        }
+    }
+    return false;
+}
+
+// Form values are urlencoded, reject anything that could escape the quotes of an SQL literal
+static bool sqlSafe(const char *value) {
+    for (; *value; ++value) {
+        if (*value == '\'' || *value == '"' || *value == '\\' || (unsigned char)*value < 0x20) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Handle a complete request: run login and registration posts, then map the requested file
+httpHandler::HTTP_CODE httpHandler::processRequest() {
+    if (uploadRequest()) {
+        return startUpload();
+    }
+    const char *p = strrchr(m_url, '/');
+
+    // Login posts go to /2 and registration posts to /3
+    if (cgi == 1 && (*(p + 1) == '2' || *(p + 1) == '3')) {
+        m_sql_login = *(p + 1) == '2';
+        const char *fail_page = m_sql_login ? "/loginError.html" : "/registerError.html";
+        if (!m_string || !formValue(m_string, "user", m_user, sizeof(m_user)) ||
+            !formValue(m_string, "password", m_passwd, sizeof(m_passwd)) || !sqlSafe(m_user) || !sqlSafe(m_passwd)) {
+            return mapFile(fail_page);
+        }
+
+        if (m_sql_store) {
+            // Names registered, or claimed by a registration in flight, fail without a round trip. The claim
+            // serializes registrations of a name, the table has no unique key on username.
+            if (!m_sql_login && !m_sql_store->reserve(m_user)) {
+                return mapFile(fail_page);
+            }
+            char query[256];
+            if (m_sql_login) {
+                snprintf(query, sizeof(query), "SELECT passwd FROM user WHERE username = '%s'", m_user);
+            } else {
+                snprintf(query, sizeof(query), "INSERT INTO user(username, passwd) VALUES('%s', '%s')", m_user, m_passwd);
+            }
+            m_sql.query = query;
+            m_sql.want_result = m_sql_login;
+            m_sql.owner = this;
+            // Held until the completion, so a close meanwhile leaves the fd, and with it m_sql, to this query.
+            // The handler may be resumed by another worker before submit returns, nothing is touched afterwards.
+            hold();
+            sql_async::get_instance()->submit(&m_sql);
+            return ASYNC_REQUEST;
+        }
+
+        if (m_sql_login) {
+            return mapFile(m_store->verify(m_user, m_passwd) ? "/picture.html" : fail_page);
+        }
+        return mapFile(m_store->add(m_user, m_passwd) == user_store::ADDED ? "/login.html" : fail_page);
+    }
+
+    if (m_method == GET) {
+        for (int i = 0; i < endpoint_count; i++) {
+            if (strcmp(m_url, endpoints[i].url) == 0) {
+                ALLOC_SCOPE(A_DEBUG);
+                endpoints[i].render(m_text);
+                m_text_type = endpoints[i].content_type;
+                return TEXT_REQUEST;
+            }
+        }
+    }
+    if (strcmp(m_url, "/") == 0) {
+        return mapFile("/home.html");
+    }
+    if (cgi == 1 && *(p + 1) == '0') {
+        return mapFile("/register.html");
+    }
+    if (cgi == 1 && *(p + 1) == '1') {
+        return mapFile("/login.html");
+    }
+    return mapFile(m_url);
+}
+
+httpHandler::HTTP_CODE httpHandler::finishSql() {
+    m_trace.span("db_query_async", m_sql.submitted);
+    bool ok = m_sql.state == sql_request::DONE;
+    m_sql.state = sql_request::IDLE;
+    if (m_sql_login) {
+        return mapFile(ok && m_sql.rows > 0 && m_sql.value == m_passwd ? "/picture.html" : "/loginError.html");
+    }
+    return mapFile(ok && m_sql.rows == 1 ? "/login.html" : "/registerError.html");
+}
+
+bool httpHandler::uploadRequest() const {
+    return upload::enabled() && (m_method == PUT || (m_method == POST && m_body_type &&
+                                                     strncasecmp(m_body_type, "multipart/form-data", 19) == 0));
+}
+
+httpHandler::HTTP_CODE httpHandler::startUpload() {
+    if (m_chunked || !m_has_length) {
+        return finishUpload(411);
+    }
+    m_upload = new upload;
+    int status = m_method == PUT ? m_upload->startPut(m_url, m_content_length)
+                                 : m_upload->startForm(m_body_type, m_content_length);
+    if (status) {
+        return finishUpload(status);
+    }
+    // The client holds the body back until told to go on, a refusal above went out instead
+    if (m_expect_continue) {
+        static const char go_on[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        send(m_sockfd, go_on, sizeof(go_on) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+    long long taken = std::min((long long)(m_read_idx - m_checked_idx), m_content_length);
+    status = m_upload->consume(m_read_buf + m_checked_idx, taken);
+    // Bytes after the body belong to a pipelined request, writeBuff carries them over
+    m_checked_idx += taken;
+    if (status == 0 && m_upload->remaining() == 0) {
+        status = m_upload->drain();
+    }
+    if (status) {
+        return finishUpload(status);
+    }
+    enterPhase(READ_BODY);
+    m_phase_bytes = taken;
+    return NO_REQUEST;
+}
+
+httpHandler::HTTP_CODE httpHandler::continueUpload() {
+    int status = m_upload->drain();
+    return status ? finishUpload(status) : NO_REQUEST;
+}
+
+httpHandler::HTTP_CODE httpHandler::finishUpload(int status) {
+    m_status = status;
+    m_text.clear();
+    if (status >= 400) {
+        // The rest of the body may still be on its way, the connection cannot be reused
+        m_linger = false;
+        METRICS_ADD(M_UPLOADS_FAILED, 1);
+        LOG_INFO("upload to %s refused with %d", m_url, status);
+    } else {
+        m_text = m_upload->report();
+    }
+    delete m_upload;
+    m_upload = NULL;
+    return UPLOAD_RESPONSE;
+}
+
+httpHandler::HTTP_CODE httpHandler::mapFile(const char *url) {
+    // Bundled assets are served without a look at the file system, anything else comes from doc_root
+    const bundle_asset *asset = asset_bundle::get_instance()->find(url);
+    if (asset) {
+        return mapAsset(asset);
+    }
+    snprintf(m_real_file, FILENAME_LEN, "%s%s", doc_root, url);
+    // A conditional GET is answered from the stat, so with the cache off the file is mapped only once it is
+    // not answered 304
+    bool map = m_method != GET || (!m_if_none_match && !m_if_modified_since);
+    m_file = file_cache::get_instance()->lookup(url, map);
+    if (m_file->error) {
+        return NO_RESOURCE;
+    }
+    m_file_stat = m_file->st;
+    if (!(m_file_stat.st_mode & S_IROTH)) {
+        return FORBIDDEN_REQUEST;
+    }
+    if (S_ISDIR(m_file_stat.st_mode)) {
+        return BAD_REQUEST;
+    }
+    const file_type *type = file_type_of(url);
+    if (type) {
+        m_content_type = type->content_type;
+        m_vary = type->compressible;
+    }
+    if (m_vary && m_accept_encoding && m_file_stat.st_size > 0) {
+        selectEncoding(url, map);
+    }
+    validator_cache::get_instance()->lookup(m_file_stat, m_etag, m_last_modified);
+    if (m_encoded) {
+        // The in-memory copy is another representation of the same file and needs an ETag of its own
+        size_t len = strlen(m_etag);
+        snprintf(m_etag + len - 1, sizeof(m_etag) - len + 1, "-gz\"");
+    }
+    // A current copy is confirmed from the stat alone
+    if (notModified()) {
+        return NOT_MODIFIED;
+    }
+    if (m_file_stat.st_size == 0) {
+        return FILE_REQUEST;
+    }
+    if (m_encoded) {
+        m_file_address = (char *)m_encoded->data.data();
+        m_file_stat.st_size = m_encoded->data.size();
+        return FILE_REQUEST;
+    }
+    if (!m_file->address) {
+        m_file = file_cache::get_instance()->map(m_file);
+        if (m_file->error) {
+            return NO_RESOURCE;
+        }
+        if (!m_file->address) {
+            return INTERNAL_ERROR;
+        }
+        // The file may have been replaced since its stat, the response describes the one mapped
+        if (m_file->st.st_ino != m_file_stat.st_ino || m_file->st.st_size != m_file_stat.st_size ||
+            m_file->st.st_mtim.tv_sec != m_file_stat.st_mtim.tv_sec ||
+            m_file->st.st_mtim.tv_nsec != m_file_stat.st_mtim.tv_nsec) {
+            m_file_stat = m_file->st;
+            validator_cache::get_instance()->lookup(m_file_stat, m_etag, m_last_modified);
+        }
+    }
+    m_file_address = m_file->address;
+    return FILE_REQUEST;
+}
+
+void httpHandler::unmap() {
+    m_asset = 0;
+    m_encoded.reset();
+    m_file.reset();
+    m_file_address = 0;
+}
+
+// Parse the digits at *p into *value, saturating at LLONG_MAX, false when there are none
+static bool rangeNumber(const char **p, long long *value) {
+    if (**p < '0' || **p > '9') {
+        return false;
+    }
+    *value = 0;
+    for (; **p >= '0' && **p <= '9'; ++*p) {
+        int digit = **p - '0';
+        *value = *value > (LLONG_MAX - digit) / 10 ? LLONG_MAX : *value * 10 + digit;
+    }
+    return true;
+}
+
+// Parse a Range header value such as "bytes=0-499,1000-,-200" against a file of size bytes. Returns the number
+// of satisfiable ranges in ranges, sorted with overlapping and adjacent ones merged, which RFC 7233 allows
+// whatever order they were asked in. Returns 0 when the header is malformed or asks for more than max ranges,
+// so that it is ignored, and -1 when no range is satisfiable.
+static int parseRanges(const char *spec, long long size, httpHandler::byte_range *ranges, int max) {
+    if (strncasecmp(spec, "bytes=", 6) != 0) {
+        return 0;
+    }
+    const char *p = spec + 6;
+    int asked = 0, count = 0;
+    while (true) {
+        // Empty list elements are allowed, as in "bytes=0-9,,20-29"
+        p += strspn(p, " \t,");
+        if (*p == '\0' && asked > 0) {
+            break;
+        }
+        long long first, last;
+        if (*p == '-') {
+            // Suffix range, the last n bytes
+            ++p;
+            long long n;
+            if (!rangeNumber(&p, &n)) {
+                return 0;
+            }
+            first = n >= size ? 0 : size - n;
+            last = n == 0 ? -1 : size - 1;
+        } else {
+            if (!rangeNumber(&p, &first) || *p++ != '-') {
+                return 0;
+            }
+            last = size - 1;
+            long long end;
+            if (rangeNumber(&p, &end)) {
+                if (end < first) {
+                    return 0;
+                }
+                last = end < last ? end : last;
+            }
+        }
+        if (++asked > max) {
+            return 0;
+        }
+        if (first <= last) {
+            ranges[count].first = first;
+            ranges[count].last = last;
+            ++count;
+        }
+        p += strspn(p, " \t");
+        if (*p == '\0') {
+            break;
+        }
+        if (*p++ != ',') {
+            return 0;
+        }
+    }
+    if (count == 0) {
+        return -1;
+    }
+    std::sort(ranges, ranges + count,
+              [](const httpHandler::byte_range &a, const httpHandler::byte_range &b) { return a.first < b.first; });
+    int merged = 0;
+    for (int i = 1; i < count; ++i) {
+        if (ranges[i].first <= ranges[merged].last + 1) {
+            ranges[merged].last = ranges[i].last > ranges[merged].last ? ranges[i].last : ranges[merged].last;
+        } else {
+            ranges[++merged] = ranges[i];
+        }
+    }
+    return merged + 1;
+}
+
+// 0 sends the whole file: no Range header, an ignored one, or an If-Range naming another version of the file.
+// If-Range compares strongly, so only the exact ETag or Last-Modified date keeps the range.
+int httpHandler::selectRanges(byte_range *ranges) {
+    if (!m_range || m_method != GET || m_file_stat.st_size == 0) {
+        return 0;
+    }
+    if (m_if_range && strcmp(m_if_range, m_etag) != 0 && strcmp(m_if_range, m_last_modified) != 0) {
+        return 0;
+    }
+    return parseRanges(m_range, m_file_stat.st_size, ranges, MAX_RANGES);
+}
+
+// Bit 1 << ENCODING of every coding Accept-Encoding allows with a q-value above 0. "*" stands for the codings
+// not named, and identity is always allowed.
+static int acceptedEncodings(const char *header) {
+    int named = 0, accepted = 1 << httpHandler::IDENTITY;
+    bool star = false;
+    const char *p = header;
+    while (true) {
+        p += strspn(p, " \t,");
+        size_t len = strcspn(p, " \t;,");
+        if (len == 0) {
+            break;
+        }
+        const char *name = p;
+        p += len;
+        double q = 1;
+        // Parameters, only q matters
+        while (*(p += strspn(p, " \t")) == ';') {
+            ++p;
+            p += strspn(p, " \t");
+            if ((*p == 'q' || *p == 'Q') && p[1] == '=') {
+                q = atof(p + 2);
+            }
+            p += strcspn(p, ";,");
+        }
+        if (len == 1 && *name == '*') {
+            star = q > 0;
+            continue;
+        }
+        for (int e = httpHandler::GZIP; e < httpHandler::ENCODING_NUM; e++) {
+            if (strlen(encoding_names[e]) == len && strncasecmp(name, encoding_names[e], len) == 0) {
+                named |= 1 << e;
+                accepted |= q > 0 ? 1 << e : 0;
+            }
+        }
+    }
+    if (star) {
+        accepted |= ~named & ((1 << httpHandler::ENCODING_NUM) - 1);
+    }
+    return accepted;
+}
+
+void httpHandler::selectEncoding(const char *url, bool map) {
+    int accepted = acceptedEncodings(m_accept_encoding);
+    char sibling[FILENAME_LEN];
+    for (int e = ENCODING_NUM - 1; e > IDENTITY; e--) {
+        if (!(accepted & (1 << e)) ||
+            snprintf(sibling, FILENAME_LEN, "%s%s", url, encoding_suffixes[e]) >= FILENAME_LEN) {
+            continue;
+        }
+        // Siblings that do not exist are cached as missing too, so looking for them costs nothing
+        shared_ptr<const file_cache::entry> file = file_cache::get_instance()->lookup(sibling, map);
+        // A sibling older than the file is stale and left alone
+        if (!file->error && S_ISREG(file->st.st_mode) && (file->st.st_mode & S_IROTH) && file->st.st_size > 0 &&
+            file->st.st_mtime >= m_file_stat.st_mtime) {
+            snprintf(m_real_file, FILENAME_LEN, "%s%s", doc_root, sibling);
+            m_file = file;
+            m_file_stat = file->st;
+            m_encoding = (ENCODING)e;
+            METRICS_ADD(M_ENCODED_STATIC, 1);
+            return;
+        }
+    }
+    if (accepted & (1 << GZIP)) {
+        m_encoded = compress_cache::get_instance()->lookup(url, m_file_stat);
+        if (m_encoded) {
+            m_encoding = GZIP;
+            METRICS_ADD(M_ENCODED_CACHED, 1);
+        }
+    }
+}
+
+httpHandler::HTTP_CODE httpHandler::mapAsset(const bundle_asset *asset) {
+    asset_bundle *bundle = asset_bundle::get_instance();
+    m_vary = asset->compressible;
+    m_content_type = asset->content_type.len ? bundle->text(asset->content_type) : NULL;
+    int accepted = m_vary && m_accept_encoding ? acceptedEncodings(m_accept_encoding) : 1 << IDENTITY;
+    for (int e = ENCODING_NUM - 1; e > IDENTITY; e--) {
+        if ((accepted & asset->encodings & (1 << e))) {
+            m_encoding = (ENCODING)e;
+            METRICS_ADD(M_ENCODED_STATIC, 1);
+            break;
+        }
+    }
+    m_asset = &asset->bodies[m_encoding];
+    METRICS_ADD(M_BUNDLE_HITS, 1);
+    snprintf(m_etag, sizeof(m_etag), "%s", bundle->text(m_asset->etag));
+    snprintf(m_last_modified, sizeof(m_last_modified), "%s", bundle->text(asset->last_modified));
+    m_file_stat.st_mtime = asset->mtime;
+    m_file_stat.st_size = m_asset->size;
+    if (notModified()) {
+        return NOT_MODIFIED;
+    }
+    m_file_address = bundle->body(*m_asset);
+    return FILE_REQUEST;
+}
+
+// If-None-Match wins over If-Modified-Since, which RFC 7232 has recipients ignore when both are sent
+bool httpHandler::notModified() {
+    if (m_method != GET) {
+        return false;
+    }
+    if (m_if_none_match) {
+        return etag_list_matches(m_if_none_match, m_etag);
+    }
+    if (m_if_modified_since) {
+        time_t since;
+        if (strcmp(m_if_modified_since, m_last_modified) == 0) {
+            return true;
+        }
+        // A date in the future is invalid and ignored
+        return parse_http_date(m_if_modified_since, &since) && since <= time(NULL) && m_file_stat.st_mtime <= since;
+    }
+    return false;
+}
+
+// Send the response with writev, waiting for EPOLLOUT when the socket buffer is full
+bool httpHandler::writeBuff() {
+    ssize_t temp = 0;
+    unsigned long long start = m_trace.now();
+    if (bytes_to_send == 0) {
+        setEventOneshot(m_epollfd, m_sockfd, EPOLLIN, generation());
+        init();
+        enterPhase(KEEP_ALIVE);
+        return true;
+    }
+    if (m_phase != WRITE_RESPONSE) {
+        enterPhase(WRITE_RESPONSE);
+        setCork(true);
+    }
+    while (1) {
+        temp = writev(m_sockfd, m_iv + m_iv_start, m_iv_count - m_iv_start);
+        if (temp < 0) {
+            if (errno == EAGAIN) {
+                m_trace.span("writeBuff", start);
+                setEventOneshot(m_epollfd, m_sockfd, EPOLLOUT, generation());
+                return true;
+            }
+            unmap();
+            return false;
+        }
+        bytes_have_send += temp;
+        bytes_to_send -= temp;
+        m_phase_bytes += temp;
+        METRICS_ADD(M_BYTES_SENT, temp);
+        // Skip the iovecs written in full and trim the one written in part
+        size_t written = temp;
+        while (m_iv_start < m_iv_count && written >= m_iv[m_iv_start].iov_len) {
+            written -= m_iv[m_iv_start++].iov_len;
+        }
+        if (m_iv_start < m_iv_count) {
+            m_iv[m_iv_start].iov_base = (char *)m_iv[m_iv_start].iov_base + written;
+            m_iv[m_iv_start].iov_len -= written;
+        }
+        if (bytes_to_send <= 0) {
+            setCork(false);
+            if (m_ready_ns) {
+                METRICS_RECORD(H_WRITE, METRICS_NOW() - m_ready_ns);
+            }
+            m_trace.span("writeBuff", start);
+            m_trace.finish();
+            heavy_hitters::get_instance()->record(m_address.sin_addr.s_addr, m_url, bytes_have_send);
+            unmap();
+            if (m_linger) {
+                // Bytes past the end of this request belong to requests the client pipelined behind it
+                int end = m_checked_idx;
+                if (m_check_state == CONTENT) {
+                    end += m_content_length;
+                    m_read_buf[end] = m_next_byte;
+                }
+                int carried = m_read_idx > end ? m_read_idx - end : 0;
+                memmove(m_read_buf, m_read_buf + end, carried);
+                init(carried);
+                enterPhase(carried > 0 ? READ_HEADER : KEEP_ALIVE);
+                m_phase_bytes = carried;
+                if (carried > 0) {
+                    m_trace.mark();
+                } else {
+                    setEventOneshot(m_epollfd, m_sockfd, EPOLLIN, generation());
+                }
+                return true;
+            }
+            setEventOneshot(m_epollfd, m_sockfd, EPOLLIN, generation());
+            return false;
+        }
+    }
+}
+
+void httpHandler::setCork(bool on) {
+    if (m_tcp_cork) {
+        int value = on;
+        setsockopt(m_sockfd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+    }
+}
+
+void httpHandler::add_iov(char *base, size_t len) {
+    m_iv[m_iv_count].iov_base = base;
+    m_iv[m_iv_count].iov_len = len;
+    ++m_iv_count;
+    bytes_to_send += len;
+}
+
+bool httpHandler::add_response(const char *format, ...) {
+    if (m_writeBuff_idx >= WRITE_BUFFER_SIZE) {
+        return false;
+    }
+    va_list arg_list;
+    va_start(arg_list, format);
+    int len = vsnprintf(m_writeBuff_buf + m_writeBuff_idx, WRITE_BUFFER_SIZE - 1 - m_writeBuff_idx, format, arg_list);
+    va_end(arg_list);
+    if (len >= (WRITE_BUFFER_SIZE - 1 - m_writeBuff_idx)) {
+        return false;
+    }
+    m_writeBuff_idx += len;
+    return true;
+}
+
+bool httpHandler::add_status_line(int status, const char *title) {
+    return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
+}
+
+bool httpHandler::add_headers(long long content_len) {
+    return add_content_length(content_len) && add_linger() && add_blank_line();
+}
+
+bool httpHandler::add_content_length(long long content_len) {
+    return add_response("Content-Length:%lld\r\n", content_len);
+}
+
+bool httpHandler::add_content_type() {
+    return add_response("Content-Type:%s\r\n", "text/html");
+}
+
+bool httpHandler::add_linger() {
+    return add_response("Connection:%s\r\n", (m_linger == true) ? "keep-alive" : "close");
+}
+
+bool httpHandler::add_blank_line() {
+    return add_response("%s", "\r\n");
+}
+
+bool httpHandler::add_validators() {
+    if (m_asset) {
+        if (!add_response("%s", asset_bundle::get_instance()->text(m_asset->validators))) {
+            return false;
+        }
+    } else if (!add_response("ETag:%s\r\nLast-Modified:%s\r\n", m_etag, m_last_modified)) {
+        return false;
+    }
+    if (m_cache_control && m_cache_control[0] && !add_response("Cache-Control:%s\r\n", m_cache_control)) {
+        return false;
+    }
+    return !m_vary || add_response("Vary:Accept-Encoding\r\n");
+}
+
+bool httpHandler::add_representation() {
+    if (m_asset) {
+        return add_response("%s", asset_bundle::get_instance()->text(m_asset->headers));
+    }
+    if (m_content_type && !add_response("Content-Type:%s\r\n", m_content_type)) {
+        return false;
+    }
+    return m_encoding == IDENTITY || add_response("Content-Encoding:%s\r\n", encoding_names[m_encoding]);
+}
+
+bool httpHandler::add_content(const char *content) {
+    return add_response("%s", content);
 }
 
 // Parse incoming data
@@ -115,21 +1131,21 @@ httpHandler::HTTP_CODE httpHandler::processRead() {
     HTTP_CODE ret = NO_REQUEST;
     char *text = 0;
 
-    while ((m_check_state == CHECK_STATE_CONTENT && line_status == LINE_OK) || ((line_status = parseLine()) == LINE_OK)) {
+    while ((m_check_state == CONTENT && line_status == LINE_OK) || ((line_status = parseLine()) == LINE_OK)) {
         text = get_line();
         m_start_line = m_checked_idx;
         LOG_INFO("%s", text);
         switch (m_check_state) {
-            case CHECK_STATE_REQUESTLINE:
+            case REQUEST_LINE:
                 ret = parseRequest(text);
                 if (ret == BAD_REQUEST) return BAD_REQUEST;
                 break;
-            case CHECK_STATE_HEADER:
+            case HEADER:
                 ret = parseHeader(text);
                 if (ret == BAD_REQUEST) return BAD_REQUEST;
                 else if (ret == GET_REQUEST) return processRequest();
                 break;
-            case CHECK_STATE_CONTENT:
+            case CONTENT:
                 ret = parseData(text);
                 if (ret == GET_REQUEST) return processRequest();
                 line_status = LINE_OPEN;
@@ -154,48 +1170,189 @@ bool httpHandler::processWrite(HTTP_CODE ret) {
             add_headers(strlen(error_404_form));
             if (!add_content(error_404_form)) return false;
             break;
+        case NO_RESOURCE:
+            add_status_line(404, error_404_title);
+            add_headers(strlen(error_404_form));
+            if (!add_content(error_404_form)) return false;
+            break;
         case FORBIDDEN_REQUEST:
             add_status_line(403, error_403_title);
             add_headers(strlen(error_403_form));
             if (!add_content(error_403_form)) return false;
             break;
-        case FILE_REQUEST:
-            add_status_line(200, ok_200_title);
-            if (m_file_stat.st_size != 0) {
-                add_headers(m_file_stat.st_size);
-                m_iv[0].iov_base = m_writeBuff_buf;
-                m_iv[0].iov_len = m_writeBuff_idx;
-                m_iv[1].iov_base = m_file_address;
-                m_iv[1].iov_len = m_file_stat.st_size;
-                m_iv_count = 2;
-                bytes_to_send = m_writeBuff_idx + m_file_stat.st_size;
-                return true;
-            } else {
+        case FILE_REQUEST: {
+            if (m_file_stat.st_size == 0) {
                 const char *ok_string = "<html><body></body></html>";
+                add_status_line(200, ok_200_title);
                 add_headers(strlen(ok_string));
                 if (!add_content(ok_string)) return false;
+                break;
+            }
+            byte_range ranges[MAX_RANGES];
+            int range_count = selectRanges(ranges);
+            long long size = m_file_stat.st_size;
+            if (range_count < 0) {
+                add_status_line(416, error_416_title);
+                add_response("Content-Range:bytes */%lld\r\n", size);
+                add_headers(strlen(error_416_form));
+                if (!add_content(error_416_form)) return false;
+                break;
             }
+            add_status_line(range_count > 0 ? 206 : 200, range_count > 0 ? partial_206_title : ok_200_title);
+            add_response("Accept-Ranges:bytes\r\n");
+            add_validators();
+            if (range_count <= 1) {
+                add_representation();
+            }
+            m_iv_count = 1;
+            m_iv_start = 0;
+            bytes_to_send = 0;
+            if (range_count == 0) {
+                add_iov(m_file_address, size);
+            } else if (range_count == 1) {
+                add_response("Content-Range:bytes %lld-%lld/%lld\r\n", ranges[0].first, ranges[0].last, size);
+                add_iov(m_file_address + ranges[0].first, ranges[0].last - ranges[0].first + 1);
+            } else {
+                // Part headers go to m_text, the parts themselves are slices of the mapped file
+                static unsigned int boundary_seq = 0;
+                char boundary[32];
+                snprintf(boundary, sizeof(boundary), "%08lx%08x", (unsigned long)time(NULL),
+                         __atomic_add_fetch(&boundary_seq, 1, __ATOMIC_RELAXED));
+                add_response("Content-Type:multipart/byteranges; boundary=%s\r\n", boundary);
+                if (m_encoding != IDENTITY) {
+                    add_response("Content-Encoding:%s\r\n", encoding_names[m_encoding]);
+                }
+                // The content type has no length bound, so only the range line, of three numbers of at most 19
+                // digits, is formatted into a buffer
+                size_t part_end[MAX_RANGES];
+                char range_line[96];
+                m_text.clear();
+                for (int i = 0; i < range_count; ++i) {
+                    m_text.append("\r\n--").append(boundary).append("\r\n");
+                    if (m_content_type) {
+                        m_text.append("Content-Type: ").append(m_content_type).append("\r\n");
+                    }
+                    snprintf(range_line, sizeof(range_line), "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                             ranges[i].first, ranges[i].last, size);
+                    m_text += range_line;
+                    part_end[i] = m_text.size();
+                }
+                m_text.append("\r\n--").append(boundary).append("--\r\n");
+                size_t part_start = 0;
+                for (int i = 0; i < range_count; ++i) {
+                    add_iov(&m_text[part_start], part_end[i] - part_start);
+                    add_iov(m_file_address + ranges[i].first, ranges[i].last - ranges[i].first + 1);
+                    part_start = part_end[i];
+                }
+                add_iov(&m_text[part_start], m_text.size() - part_start);
+            }
+            if (!add_headers(bytes_to_send)) return false;
+            m_iv[0].iov_base = m_writeBuff_buf;
+            m_iv[0].iov_len = m_writeBuff_idx;
+            bytes_to_send += m_writeBuff_idx;
+            return true;
+        }
+        case NOT_MODIFIED:
+            add_status_line(304, not_modified_304_title);
+            add_validators();
+            if (!add_linger() || !add_blank_line()) return false;
+            METRICS_ADD(M_NOT_MODIFIED, 1);
             break;
+        case UPLOAD_RESPONSE: {
+            int i = 0;
+            while (i + 1 < UPLOAD_STATUS_NUM && upload_statuses[i].status != m_status) {
+                i++;
+            }
+            const upload_status *reply = &upload_statuses[i];
+            if (m_status >= 400) {
+                m_text = reply->form;
+            }
+            add_status_line(reply->status, reply->title);
+            add_response("Content-Type:text/plain\r\n");
+            add_headers(m_text.size());
+            m_iv_count = 0;
+            m_iv_start = 0;
+            bytes_to_send = 0;
+            add_iov(m_writeBuff_buf, m_writeBuff_idx);
+            add_iov(&m_text[0], m_text.size());
+            return true;
+        }
+        case TEXT_REQUEST:
+            add_status_line(200, ok_200_title);
+            add_response("Content-Type:%s\r\n", m_text_type);
+            add_headers(m_text.size());
+            m_iv_count = 0;
+            m_iv_start = 0;
+            bytes_to_send = 0;
+            add_iov(m_writeBuff_buf, m_writeBuff_idx);
+            add_iov(&m_text[0], m_text.size());
+            return true;
         default:
             return false;
     }
-    m_iv[0].iov_base = m_writeBuff_buf;
-    m_iv[0].iov_len = m_writeBuff_idx;
-    m_iv_count = 1;
-    bytes_to_send = m_writeBuff_idx;
+    m_iv_count = 0;
+    m_iv_start = 0;
+    bytes_to_send = 0;
+    add_iov(m_writeBuff_buf, m_writeBuff_idx);
     return true;
 }
 
 // Main processing loop
 void httpHandler::process() {
-    HTTP_CODE read_ret = processRead();
+    serve();
+    // Nothing of the handler is touched after this, the slot may belong to the next connection
+    release();
+}
+
+void httpHandler::serve() {
+    HTTP_CODE read_ret;
+    m_pipelined = false;
+    unsigned long long start;
+    int sockfd = m_sockfd;
+    unsigned int generation = this->generation();
+    PROBE1(process_start, sockfd);
+    request_trace::set_current(&m_trace);
+    // Second pass of a login or registration whose query completed on the event loop
+    if (m_sql.state == sql_request::DONE || m_sql.state == sql_request::FAILED) {
+        start = m_trace.now();
+        read_ret = finishSql();
+    } else if (m_upload) {
+        // More of an upload's body is in its pipe
+        m_trace.span("queue", m_trace.marked());
+        start = m_trace.now();
+        read_ret = continueUpload();
+    } else {
+        m_trace.span("queue", m_trace.marked());
+        start = m_trace.now();
+        read_ret = processRead();
+    }
+    request_trace::set_current(NULL);
+    PROBE2(process_end, sockfd, (int)read_ret);
     if (read_ret == NO_REQUEST) {
-        setEventOneshot(m_epollfd, m_sockfd, EPOLLIN);
+        if (generation == this->generation()) {
+            setEventOneshot(m_epollfd, sockfd, EPOLLIN, generation);
+        }
         return;
     }
+    if (read_ret == ASYNC_REQUEST) {
+        // The query completion may already have handed the handler to another worker
+        return;
+    }
+    m_trace.span("processRead", start);
+    start = m_trace.now();
     bool writeBuff_ret = processWrite(read_ret);
+    m_trace.span("processWrite", start);
+    // The timer closed the connection meanwhile, its fd may already be a new client's
+    if (generation != this->generation()) {
+        METRICS_ADD(M_STALE_REQUESTS, 1);
+        return;
+    }
     if (!writeBuff_ret) {
-        closeConnection();
+        // The reactor closes the connection, and drops its timer, on the hang-up this raises
+        shutdown(sockfd, SHUT_RDWR);
+        setEventOneshot(m_epollfd, sockfd, EPOLLIN, generation);
+        return;
     }
-    setEventOneshot(m_epollfd, m_sockfd, EPOLLOUT);
+    m_ready_ns = METRICS_NOW();
+    setEventOneshot(m_epollfd, m_sockfd, EPOLLOUT, generation);
 }
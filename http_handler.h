@@ -7,6 +7,7 @@
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <string.h>
@@ -17,9 +18,19 @@
 #include <errno.h>
 #include <sys/mman.h>
 #include <sys/uio.h>
+#include <memory>
+#include <string>
 
 #include "locker.h"
 #include "connection_pool.h"
+#include "sql_async.h"
+#include "user_store.h"
+#include "trace.h"
+#include "validators.h"
+#include "compress_cache.h"
+#include "file_cache.h"
+#include "asset_bundle.h"
+#include "upload.h"
 
 // Handles HTTP requests and connections
 class httpHandler {
@@ -28,6 +39,18 @@ public:
     static const int FILENAME_LEN = 200;
     static const int READ_BUFFER_SIZE = 2048;
     static const int WRITE_BUFFER_SIZE = 2048;
+    // Ranges sent as multipart/byteranges, a Range header asking for more is ignored and the whole file sent
+    static const int MAX_RANGES = 16;
+    // Response headers, then a part header and a file slice per range, then the closing boundary
+    static const int MAX_IOV = 2 * MAX_RANGES + 2;
+    // Bit of m_holds set when the connection was closed while a worker held the handler
+    static const unsigned int HOLDS_CLOSING = 1u << 31;
+
+    // Inclusive byte offsets of one range of a file
+    struct byte_range {
+        long long first;
+        long long last;
+    };
 
     // Supported HTTP methods for this handler
     enum METHOD {
@@ -58,7 +81,37 @@ public:
         FORBIDDEN_REQUEST,  // Access to the requested resource is forbidden
         FILE_REQUEST,       // Request for a file that exists and can be served
         INTERNAL_ERROR,     // Internal server error
-        CLOSED_CONNECTION   // Client has closed the connection
+        CLOSED_CONNECTION,  // Client has closed the connection
+        ASYNC_REQUEST,      // Waiting for a non-blocking database query, resumed by the reactor
+        TEXT_REQUEST,       // A generated text body in m_text is ready, e.g. /metrics
+        NOT_MODIFIED,       // The client's copy of the file is current, answered without a body
+        UPLOAD_RESPONSE     // An upload was stored or refused, m_status and m_text hold the response
+    };
+
+    // Content codings of a file response, the precompressed sibling of file is file.gz or file.zst
+    enum ENCODING {
+        IDENTITY = 0,
+        GZIP,
+        ZSTD,
+        ENCODING_NUM
+    };
+
+    // Phases of a connection, each with its own deadline
+    enum PHASE {
+        FIRST_BYTE = 0,  // accepted, waiting for the first byte of the first request
+        READ_HEADER,     // request line and headers arriving
+        READ_BODY,       // POST body arriving, or an upload streaming to disk
+        WRITE_RESPONSE,  // response being sent
+        KEEP_ALIVE,      // waiting for the next request
+        PHASE_NUM
+    };
+
+    // A phase may last timeout_ms, plus a second for every min_rate bytes it moved, up to max_ms. min_rate 0
+    // gives a fixed deadline, max_ms 0 leaves the extension uncapped so only the rate counts.
+    struct phase_limit {
+        int timeout_ms;
+        int max_ms;
+        int min_rate;
     };
 
     // Status of parsing individual lines
@@ -68,14 +121,18 @@ public:
         LINE_OPEN      // Line parsing is incomplete
     };
 
-    httpHandler() : m_sockfd(-1), m_url(nullptr), m_version(nullptr), m_host(nullptr),
-                    m_content_length(0), m_linger(false), m_file_address(nullptr),
-                    m_method(GET), m_check_state(REQUEST_LINE), cgi(0), bytes_to_send(0),
-                    bytes_have_send(0), m_writeBuff_idx(0), m_read_idx(0), m_checked_idx(0),
-                    m_start_line(0) {}
+    httpHandler() : m_sockfd(-1), m_read_idx(0), m_checked_idx(0), m_start_line(0), m_writeBuff_idx(0),
+                    m_check_state(REQUEST_LINE), m_method(GET), m_url(nullptr), m_version(nullptr), m_host(nullptr),
+                    m_content_length(0), m_range(nullptr), m_if_range(nullptr), m_if_none_match(nullptr),
+                    m_if_modified_since(nullptr), m_accept_encoding(nullptr), m_linger(false), m_cpu(-1),
+                    m_generation(0), m_holds(0), m_phase(FIRST_BYTE), m_phase_start(0), m_phase_bytes(0),
+                    m_file_address(nullptr), m_content_type(nullptr), m_vary(false), m_encoding(IDENTITY),
+                    m_asset(nullptr), m_upload(nullptr), m_iv_count(0), m_iv_start(0), cgi(0), bytes_to_send(0),
+                    bytes_have_send(0), m_accept_ns(0), m_ready_ns(0) {}
 
     ~httpHandler() {
         unmap(); // Unmap any mapped files
+        delete m_upload;
         if (m_sockfd != -1) {
             close(m_sockfd); // Close the socket if it's open
         }
@@ -83,22 +140,67 @@ public:
 
     // Initialize handler for a new connection
     void init(int sockfd, const sockaddr_in &addr);
-    // Close the connection and clean up
-    void closeConnection(bool real_close = true);
-    // Main processing loop
+    // Reactor side, with the fd out of epoll: close the connection and clean up. When a worker holds the handler
+    // the fd stays open until the last holder lets go and closes it, so the slot cannot take a new connection
+    // while a worker still runs on it.
+    void closeConnection();
+    // Reactor side: a worker is about to get the handler, it holds it until its process() returns
+    void hold() { __atomic_add_fetch(&m_holds, 1, __ATOMIC_ACQUIRE); }
+    // Let go of the handler, and close the connection when it was closed while held
+    void release();
+    // True once the connection was closed while held, its fd stays open until the last holder lets go
+    bool closing() const { return __atomic_load_n(&m_holds, __ATOMIC_ACQUIRE) & HOLDS_CLOSING; }
+    // Main processing loop, run by the worker holding the handler
     void process();
-    // Read incoming data into the buffer
+    // Read incoming data into the buffer, or into the pipe of an upload
     bool readBuff();
     // Write data from the buffer to the client
     bool writeBuff();
+    // True after writeBuff finished a keep-alive response and the next request was already read, the caller
+    // queues the handler instead of waiting for EPOLLIN
+    bool pipelined() const { return m_pipelined; }
+    // CPU that received the connection's packets, for the thread pool to prefer a worker there, -1 when unknown
+    int cpu() const { return m_cpu; }
+    // Bumped whenever the connection in this slot is closed. Queued work and epoll events carry the value they
+    // were created with, and are dropped when it no longer matches, since the fd may belong to a new client.
+    unsigned int generation() const { return __atomic_load_n(&m_generation, __ATOMIC_ACQUIRE); }
+    // Invalidate queued work and events of the connection, done when its fd is closed
+    void retire() { __atomic_add_fetch(&m_generation, 1, __ATOMIC_RELEASE); }
+    // Called on the event loop when the non-blocking query completed: settles the name a registration claimed,
+    // then is true when the connection that submitted the query is still open, a query of a closed one is
+    // discarded. The query holds the handler until the completion releases it.
+    bool sqlCompleted();
+    // Drop the upload of a connection being closed, by the reactor or by the last worker holding the handler
+    void abortUpload();
     // Get the address of the connected socket
     sockaddr_in *get_address() { return &m_address; }
-    // Initialize MySQL database connections
-    void initMysql(connection_pool *connPool);
+    // Phase the connection is in, and when it must be over on the monotonic clock of timer_wheel::now_ms.
+    // Read by the reactor between events, when no worker holds the handler.
+    PHASE phase() const { return m_phase; }
+    unsigned long long deadline() const;
+    // Parse per-phase limits such as "header=10:30:500,idle=5", phase=timeout_s[:max_s[:min_rate_bytes_per_s]]
+    // with phases first, header, body, write and idle
+    static bool setLimits(const char *spec);
+    static const char *phaseName(PHASE phase);
+
+    // Renders the body of a built-in text endpoint
+    typedef void (*text_endpoint)(std::string &out);
+    // Serve GET url with a body generated by render, for metrics and debug pages
+    static void addEndpoint(const char *url, text_endpoint render, const char *content_type = "text/plain; version=0.0.4");
 
 private:
-    // Common initialization routine
-    void init();
+    // bench/microbench.cpp drives the parser and response assembly without a socket
+    friend struct http_bench;
+    // Common initialization routine, carried bytes at the start of the read buffer are kept
+    void init(int carried = 0);
+    // Body of process()
+    void serve();
+    // Close the fd, after which the slot may take the next connection at once
+    void finishClose();
+    // Start a phase, its deadline runs from now
+    void enterPhase(PHASE phase);
+    // Hold back partial segments of the response while it is written, when m_tcp_cork is set
+    void setCork(bool on);
     // Process read data
     HTTP_CODE processRead();
     // Write response data to client
@@ -111,12 +213,35 @@ private:
     HTTP_CODE parseData(char *text);
     // Handle a complete HTTP request
     HTTP_CODE processRequest();
+    // Pick the result page of a login or registration once its non-blocking query completed
+    HTTP_CODE finishSql();
+    // True for a PUT, or a multipart/form-data POST, whose body goes to the upload directory
+    bool uploadRequest() const;
+    // Stream the body of an upload request into files, see upload.h. The body bytes read with the headers are
+    // written at once, the rest is read off the socket by readBuff and written by continueUpload.
+    HTTP_CODE startUpload();
+    HTTP_CODE continueUpload();
+    // Answer an upload with status, releasing it
+    HTTP_CODE finishUpload(int status);
+    // Find a file in the asset bundle, or else under doc_root in file_cache, and take its mapping
+    HTTP_CODE mapFile(const char *url);
+    // Serve the body of a bundled asset that Accept-Encoding allows, with its prebuilt header lines
+    HTTP_CODE mapAsset(const bundle_asset *asset);
     // Get a pointer to the current line in the read buffer
     char *get_line() { return m_read_buf + m_start_line; }
     // Parse a line from the buffer
     LINE_STATUS parseLine();
-    // Unmap the mapped file
+    // Release the mapped file
     void unmap();
+    // Ranges of the mapped file that the Range header selects, see parseRanges in http_handler.cpp
+    int selectRanges(byte_range *ranges);
+    // True when If-None-Match or If-Modified-Since show the client holds the current version of the file
+    bool notModified();
+    // Switch to the best encoding of the file at url that Accept-Encoding allows: a precompressed sibling,
+    // zstd first, or the gzip copy of compress_cache. Siblings are looked up with map, as mapFile looked up url.
+    void selectEncoding(const char *url, bool map);
+    // Send len bytes at base after what is queued already
+    void add_iov(char *base, size_t len);
     // Add formatted response to the buffer
     bool add_response(const char *format, ...);
     // Add content to the HTTP response
@@ -124,27 +249,45 @@ private:
     // Add the status line to the HTTP response
     bool add_status_line(int status, const char *title);
     // Add headers to the HTTP response
-    bool add_headers(int content_length);
+    bool add_headers(long long content_length);
     // Add content type header
     bool add_content_type();
     // Add content length header
-    bool add_content_length(int content_length);
+    bool add_content_length(long long content_length);
     // Add connection header (keep-alive or close)
     bool add_linger();
     // Add a blank line to signal the end of the headers
     bool add_blank_line();
+    // Add ETag, Last-Modified, Cache-Control and Vary of the file
+    bool add_validators();
+    // Add Content-Type and Content-Encoding of the file
+    bool add_representation();
 
 public:
     // Static variables for epoll and user count
     static int m_epollfd;
     static int m_user_count;
-    MYSQL *mysql;
+    // Storage backend of login and registration
+    static user_store *m_store;
+    // Set when login and registration queries run on the non-blocking MySQL API, m_store is then this store
+    static mysql_user_store *m_sql_store;
+    // Set when workers are pinned, accepted connections then look up their incoming CPU
+    static bool m_steer_cpu;
+    // Send small writes at once (TCP_NODELAY), and cork each response so its headers and body leave in full
+    // segments (TCP_CORK) however many writes it takes
+    static bool m_tcp_nodelay;
+    static bool m_tcp_cork;
+    // Deadlines by phase
+    static phase_limit m_limits[PHASE_NUM];
+    // Cache-Control of files, "no-cache" by default so browsers revalidate with ETag, NULL or empty to omit it
+    static const char *m_cache_control;
 
 private:
     // Connection details
     int m_sockfd;
     sockaddr_in m_address;
-    char m_read_buf[READ_BUFFER_SIZE];
+    // One byte past READ_BUFFER_SIZE terminates a request or body that fills the buffer to its end
+    char m_read_buf[READ_BUFFER_SIZE + 1];
     char m_writeBuff_buf[WRITE_BUFFER_SIZE];
     int m_read_idx;
     int m_checked_idx;
@@ -156,16 +299,71 @@ private:
     char *m_url;
     char *m_version;
     char *m_host;
-    int m_content_length;
+    long long m_content_length;
+    // Set by a Content-Length header, an upload without one is refused rather than taken as empty
+    bool m_has_length;
+    // Range and conditional header values, NULL when absent
+    char *m_range;
+    char *m_if_range;
+    char *m_if_none_match;
+    char *m_if_modified_since;
+    char *m_accept_encoding;
+    // Content-Type of the request body, NULL when absent
+    char *m_body_type;
+    // Set by "Expect: 100-continue" and by a Transfer-Encoding, which uploads do not take
+    bool m_expect_continue;
+    bool m_chunked;
+    // Byte after the POST body, overwritten by the body's terminating NUL
+    char m_next_byte;
     bool m_linger;
+    bool m_pipelined;
+    int m_cpu;
+    unsigned int m_generation;
+    // Workers holding the handler, queued or running, and a query in flight, with HOLDS_CLOSING once the
+    // reactor closed the connection
+    unsigned int m_holds;
+    // Current phase, its start in ms and the bytes read or written in it
+    PHASE m_phase;
+    unsigned long long m_phase_start;
+    long long m_phase_bytes;
     char *m_file_address;
+    // Body of a text endpoint, or the part headers of a multipart/byteranges response
+    std::string m_text;
+    const char *m_text_type;
     struct stat m_file_stat;
-    struct iovec m_iv[2];
+    // Validators of m_file_stat, set by mapFile
+    char m_etag[validator_cache::ETAG_LEN];
+    char m_last_modified[validator_cache::DATE_LEN];
+    // Type of the file by extension, NULL when unknown, and whether its responses vary by Accept-Encoding
+    const char *m_content_type;
+    bool m_vary;
+    ENCODING m_encoding;
+    // Gzip copy sent from memory instead of a mapped file, held until the response is written
+    shared_ptr<const compress_cache::variant> m_encoded;
+    // Open file the response comes from, its mapping stays valid while this is held
+    shared_ptr<const file_cache::entry> m_file;
+    // Bundled body the response comes from instead, NULL for files
+    const bundle_body *m_asset;
+    // Upload in progress, and the status of its response
+    upload *m_upload;
+    int m_status;
+    // Response left to write is m_iv[m_iv_start, m_iv_count)
+    struct iovec m_iv[MAX_IOV];
     int m_iv_count;
+    int m_iv_start;
     int cgi;
     char *m_string;
-    int bytes_to_send;
-    int bytes_have_send;
+    long long bytes_to_send;
+    long long bytes_have_send;
+    // Credentials of a login or registration post, and its query in async SQL mode
+    char m_user[100];
+    char m_passwd[100];
+    bool m_sql_login;
+    sql_request m_sql;
+    // Monotonic timestamps of accept and of the response becoming ready, 0 once recorded
+    unsigned long long m_accept_ns;
+    unsigned long long m_ready_ns;
+    request_trace m_trace;
 };
 
 #endif
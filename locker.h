@@ -5,13 +5,124 @@
 #include <pthread.h>
 #include <semaphore.h>
 
+// Contention profiling, built with -DLOCK_PROFILE. Locks, semaphores and condition variables are named at
+// construction and everything sharing a name adds to one lock_stats entry. Without LOCK_PROFILE the names
+// are ignored and the wrappers compile to the bare pthread calls.
+#ifdef LOCK_PROFILE
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+struct lock_stats {
+    const char *name;
+    const char *kind;                       // "mutex", "sem" or "cond"
+    unsigned long long acquisitions;        // lock() calls, or sem/cond waits
+    unsigned long long contended;           // acquisitions that had to block
+    unsigned long long wait_ns;
+    unsigned long long wait_max_ns;
+    unsigned long long hold_ns;             // mutex only, time between lock() and unlock()
+    unsigned long long hold_max_ns;
+    lock_stats *next;
+};
+
+class lock_profile {
+public:
+    static unsigned long long now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    // Entry shared by every primitive of this name and kind, entries are never freed
+    static lock_stats *get(const char *name, const char *kind) {
+        pthread_mutex_lock(&registry_mutex());
+        lock_stats *s = head();
+        while (s && (strcmp(s->name, name) != 0 || strcmp(s->kind, kind) != 0)) {
+            s = s->next;
+        }
+        if (!s) {
+            s = new lock_stats();
+            s->name = name;
+            s->kind = kind;
+            s->next = head();
+            head() = s;
+        }
+        pthread_mutex_unlock(&registry_mutex());
+        return s;
+    }
+
+    static void add(unsigned long long *counter, unsigned long long n) {
+        __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+    }
+    static void max(unsigned long long *counter, unsigned long long n) {
+        unsigned long long cur = __atomic_load_n(counter, __ATOMIC_RELAXED);
+        while (n > cur && !__atomic_compare_exchange_n(counter, &cur, n, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+    }
+    static void waited(lock_stats *s, bool contended, unsigned long long wait) {
+        add(&s->acquisitions, 1);
+        if (contended) {
+            add(&s->contended, 1);
+            add(&s->wait_ns, wait);
+            max(&s->wait_max_ns, wait);
+        }
+    }
+
+    // One line per named primitive, most waited-for first
+    static void render(std::string &out) {
+        pthread_mutex_lock(&registry_mutex());
+        lock_stats *sorted = NULL;
+        for (lock_stats *s = head(); s; s = s->next) {
+            lock_stats *copy = new lock_stats(*s);
+            lock_stats **pos = &sorted;
+            while (*pos && (*pos)->wait_ns >= copy->wait_ns) {
+                pos = &(*pos)->next;
+            }
+            copy->next = *pos;
+            *pos = copy;
+        }
+        pthread_mutex_unlock(&registry_mutex());
+
+        char line[320];
+        snprintf(line, sizeof(line), "%-28s %-5s %12s %12s %12s %12s %12s %12s\n", "name", "kind", "acquired",
+                 "contended", "wait_ms", "wait_max_us", "hold_ms", "hold_max_us");
+        out += line;
+        while (sorted) {
+            lock_stats *s = sorted;
+            snprintf(line, sizeof(line), "%-28s %-5s %12llu %12llu %12.3f %12.1f %12.3f %12.1f\n", s->name, s->kind,
+                     s->acquisitions, s->contended, s->wait_ns / 1e6, s->wait_max_ns / 1e3, s->hold_ns / 1e6,
+                     s->hold_max_ns / 1e3);
+            out += line;
+            sorted = s->next;
+            delete s;
+        }
+    }
+
+private:
+    static lock_stats *&head() {
+        static lock_stats *list = NULL;
+        return list;
+    }
+    static pthread_mutex_t &registry_mutex() {
+        static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+        return mutex;
+    }
+};
+#endif
+
 // Semaphore wrapper class for managing semaphores
 class sem {
 public:
-    sem(int num = 0) {
+    sem(int num = 0, const char *name = "sem") {
         if (sem_init(&m_sem, 0, num) != 0) {
-            throw std::exception(); 
+            throw std::exception();
         }
+#ifdef LOCK_PROFILE
+        m_stats = lock_profile::get(name, "sem");
+#else
+        (void)name;
+#endif
     }
 
     ~sem() {
@@ -20,7 +131,18 @@ public:
 
     // Wait decreases the semaphore
     bool wait() {
+#ifdef LOCK_PROFILE
+        if (sem_trywait(&m_sem) == 0) {
+            lock_profile::waited(m_stats, false, 0);
+            return true;
+        }
+        unsigned long long start = lock_profile::now();
+        bool ret = sem_wait(&m_sem) == 0;
+        lock_profile::waited(m_stats, true, lock_profile::now() - start);
+        return ret;
+#else
         return sem_wait(&m_sem) == 0;
+#endif
     }
 
     // Post increases the semaphore
@@ -29,15 +151,24 @@ public:
     }
 
 private:
-    sem_t m_sem;  
+    sem_t m_sem;
+#ifdef LOCK_PROFILE
+    lock_stats *m_stats;
+#endif
 };
 
 class locker {
 public:
-    locker() {
+    locker(const char *name = "mutex") {
         if (pthread_mutex_init(&m_mutex, NULL) != 0) {
             throw std::exception();
         }
+#ifdef LOCK_PROFILE
+        m_stats = lock_profile::get(name, "mutex");
+        m_locked_at = 0;
+#else
+        (void)name;
+#endif
     }
 
     ~locker() {
@@ -45,10 +176,26 @@ public:
     }
 
     bool lock() {
+#ifdef LOCK_PROFILE
+        if (pthread_mutex_trylock(&m_mutex) == 0) {
+            lock_profile::waited(m_stats, false, 0);
+            m_locked_at = lock_profile::now();
+            return true;
+        }
+        unsigned long long start = lock_profile::now();
+        bool ret = pthread_mutex_lock(&m_mutex) == 0;
+        m_locked_at = lock_profile::now();
+        lock_profile::waited(m_stats, true, m_locked_at - start);
+        return ret;
+#else
         return pthread_mutex_lock(&m_mutex) == 0;
+#endif
     }
 
     bool unlock() {
+#ifdef LOCK_PROFILE
+        released();
+#endif
         return pthread_mutex_unlock(&m_mutex) == 0;
     }
 
@@ -56,17 +203,45 @@ public:
         return &m_mutex;
     }
 
+#ifdef LOCK_PROFILE
+    // Hold time bookkeeping around a condition wait, which releases and retakes the mutex
+    void released() {
+        unsigned long long hold = lock_profile::now() - m_locked_at;
+        lock_profile::add(&m_stats->hold_ns, hold);
+        lock_profile::max(&m_stats->hold_max_ns, hold);
+    }
+    void reacquired() {
+        m_locked_at = lock_profile::now();
+    }
+#endif
+
 private:
-    pthread_mutex_t m_mutex; 
+    pthread_mutex_t m_mutex;
+#ifdef LOCK_PROFILE
+    lock_stats *m_stats;
+    // Written by the owner only
+    unsigned long long m_locked_at;
+#endif
 };
 
 // Condition variable class for managing condition variables
 class cond {
 public:
-    cond() {
-        if (pthread_cond_init(&m_cond, NULL) != 0) {
+    // timewait deadlines are on CLOCK_MONOTONIC, so a step of the wall clock does not move them
+    cond(const char *name = "cond") {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        int ret = pthread_cond_init(&m_cond, &attr);
+        pthread_condattr_destroy(&attr);
+        if (ret != 0) {
             throw std::exception();
         }
+#ifdef LOCK_PROFILE
+        m_stats = lock_profile::get(name, "cond");
+#else
+        (void)name;
+#endif
     }
 
     ~cond() {
@@ -81,6 +256,33 @@ public:
         return pthread_cond_timedwait(&m_cond, m_mutex, &t) == 0;
     }
 
+    // Waits on a locker keep its hold time free of the time spent parked here
+    bool wait(locker &lock) {
+#ifdef LOCK_PROFILE
+        lock.released();
+        unsigned long long start = lock_profile::now();
+        bool ret = pthread_cond_wait(&m_cond, lock.get()) == 0;
+        lock.reacquired();
+        lock_profile::waited(m_stats, true, lock_profile::now() - start);
+        return ret;
+#else
+        return pthread_cond_wait(&m_cond, lock.get()) == 0;
+#endif
+    }
+
+    bool timewait(locker &lock, struct timespec t) {
+#ifdef LOCK_PROFILE
+        lock.released();
+        unsigned long long start = lock_profile::now();
+        bool ret = pthread_cond_timedwait(&m_cond, lock.get(), &t) == 0;
+        lock.reacquired();
+        lock_profile::waited(m_stats, true, lock_profile::now() - start);
+        return ret;
+#else
+        return pthread_cond_timedwait(&m_cond, lock.get(), &t) == 0;
+#endif
+    }
+
     // Signal wakes one waiting thread
     bool signal() {
         return pthread_cond_signal(&m_cond) == 0;
@@ -92,7 +294,10 @@ public:
     }
 
 private:
-    pthread_cond_t m_cond; 
+    pthread_cond_t m_cond;
+#ifdef LOCK_PROFILE
+    lock_stats *m_stats;
+#endif
 };
 
 #endif
@@ -5,10 +5,12 @@
 #include <pthread.h>
 
 #include "log.h"
+#include "probes.h"
+#include "alloc_stats.h"
 
 using namespace std;
 
-Log::Log()
+Log::Log() : m_mutex("log")
 {
     m_count = 0;
 }
@@ -63,6 +65,7 @@ bool Log::init(const char *file_name, int log_buf_size, int split_lines)
 // Write log with standard format
 void Log::write_log(int level, const char *format, ...)
 {
+    ALLOC_SCOPE(A_LOG);
 
     struct timeval now = {0, 0};
     gettimeofday(&now, NULL);
@@ -123,7 +126,7 @@ void Log::write_log(int level, const char *format, ...)
     va_list valst;
     va_start(valst, format);
 
-    string log_str;
+    // Format into m_buf and write it out under one lock, the line is never copied to the heap
     m_mutex.lock();
 
     // Write time to buffer, snprintf returns the number of bytes that are written when success
@@ -131,16 +134,16 @@ void Log::write_log(int level, const char *format, ...)
                      my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday,
                      my_tm.tm_hour, my_tm.tm_min, my_tm.tm_sec, now.tv_usec, s);
     // Write log content with specific format to buffer
-    int m = vsnprintf(m_buf + n, m_log_buf_size - 1, format, valst);
+    int m = vsnprintf(m_buf + n, m_log_buf_size - n - 1, format, valst);
+    if (m > m_log_buf_size - n - 2)
+    {
+        m = m_log_buf_size - n - 2;
+    }
     m_buf[n + m] = '\n';
     m_buf[n + m + 1] = '\0';
-    log_str = m_buf;
-
-    m_mutex.unlock();
-
-    m_mutex.lock();
+    PROBE2(log_write, level, m_buf);
     // Write to file
-    fputs(log_str.c_str(), m_fp);   
+    fputs(m_buf, m_fp);
     m_mutex.unlock();
     va_end(valst);
 }
@@ -15,6 +15,16 @@
 #include "http_handler.h"
 #include "log.h"
 #include "connection_pool.h"
+#include "sql_async.h"
+#include "user_store.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probes.h"
+#include "alloc_stats.h"
+#include "watchdog.h"
+#include "topk.h"
+#include "capture.h"
+#include "affinity.h"
 
 // Max number of file descriptors (called as "fd" below for short)
 #define MAX_FD 65536
@@ -22,19 +32,26 @@
 #define MAX_EVENT_NUMBER 10000
 // Timeslot for timer
 #define TIMESLOT 5
+// Max connections accepted per listen socket event, so a connection storm cannot starve established connections
+#define ACCEPT_BATCH 64
 
 // Functions below are defined in http_handler
 // Add and remove fd to and from kernel envents table
-extern int addFd(int epollfd, int fd, bool one_shot);
+extern int addFd(int epollfd, int fd, bool one_shot, unsigned int generation = 0);
 extern int remove(int epollfd, int fd);
 // Set fd non-blocking, to support write action when the connection peer closes (half-close)
 extern int setNonBlocking(int fd);
+// Directory of the HTML resources
+extern const char *doc_root;
 
 // Timer for the process
 static int pipefd[2];
-static sort_timer_lst timer_lst;
+static timer_wheel timers;
 
 static int epollfd = 0;
+static threadpool<httpHandler> *pool = NULL;
+// Connection handlers, indexed by fd
+static httpHandler *users = NULL;
 
 // Signal handler, keep its last error number and write signal from the writing end of the pipe
 void sigHandler(int sig)
@@ -60,10 +77,12 @@ void setSig(int sig, void(handler)(int), bool restart = true)
     assert(sigaction(sig, &sa, NULL) != -1);
 }
 
-// Trigger SIGALRM for each TIMESLOT
+// Periodic work on SIGALRM, every TIMESLOT. Connection deadlines are checked by the timer wheel instead.
 void timer_handler()
 {
-    timer_lst.tick();
+    // Heavy-hitter windows are one timer period long
+    heavy_hitters::get_instance()->rotate();
+    traffic_capture::get_instance()->flush();
     alarm(TIMESLOT);
 }
 
@@ -72,58 +91,562 @@ void cb_func(client_data *user_data)
 {
     epoll_ctl(epollfd, EPOLL_CTL_DEL, user_data->sockfd, 0);
     assert(user_data);
-    close(user_data->sockfd);
+    PROBE1(conn_close, user_data->sockfd);
+    traffic_capture::get_instance()->close(user_data->sockfd);
+    // The caller returns the timer to the timer list
+    user_data->timer = NULL;
+    // A worker still holding the handler closes the fd once it is done, the fd cannot be accepted again before
+    users[user_data->sockfd].closeConnection();
     httpHandler::m_user_count--;
     LOG_INFO("close fd %d", user_data->sockfd);
     Log::get_instance()->flush();
 }
+// Count a connection closed for missing the deadline of its phase
+void deadlineMissed(int sockfd)
+{
+    httpHandler::PHASE phase = users[sockfd].phase();
+    METRICS_ADD((metric_counter)(M_DEADLINE_FIRST_BYTE + phase), 1);
+    LOG_INFO("fd %d missed its %s deadline", sockfd, httpHandler::phaseName(phase));
+}
+// Timer callback of a connection
+void expireConnection(client_data *user_data)
+{
+    deadlineMissed(user_data->sockfd);
+    cb_func(user_data);
+}
+// Move the timer to the deadline of the connection's phase. A request handed to a worker gets at least the write
+// timeout for its processing, the next event of the connection sets the deadline of its phase again.
+void renewTimer(util_timer *timer, int sockfd, bool queued)
+{
+    unsigned long long expire = users[sockfd].deadline();
+    if (queued)
+    {
+        unsigned long long grace = timer_wheel::now_ms() + httpHandler::m_limits[httpHandler::WRITE_RESPONSE].timeout_ms;
+        expire = expire > grace ? expire : grace;
+    }
+    timer->expire = expire;
+    timers.adjust_timer(timer);
+}
+// Hand a connection's handler to the thread pool, a worker holds it until its process() returns
+void queueRequest(httpHandler *handler, int cpu)
+{
+    handler->hold();
+    if (!pool->append(handler, cpu))
+    {
+        handler->release();
+    }
+}
+// Completion callback of a non-blocking query, the handler goes back to the thread pool to build its response
+void sqlComplete(void *owner)
+{
+    httpHandler *handler = (httpHandler *)owner;
+    if (handler->sqlCompleted())
+    {
+        queueRequest(handler, -1);
+    }
+    else
+    {
+        // The connection that sent the query was closed meanwhile
+        METRICS_ADD(M_STALE_REQUESTS, 1);
+    }
+    // Let go of the hold taken at submit, the last one of a closed connection closes its fd
+    handler->release();
+}
+// Body of the /metrics endpoint
+void renderMetrics(std::string &out)
+{
+    metrics::get_instance()->render(out);
+}
+// Body of the /debug/trace endpoint
+void renderTrace(std::string &out)
+{
+    tracer::render(out);
+}
+// Body of the /debug/topk endpoint
+void renderTopk(std::string &out)
+{
+    heavy_hitters::get_instance()->render(out);
+}
+long queueDepth(void *)
+{
+    return pool->queued();
+}
+long workerThreads(void *)
+{
+    return pool->size();
+}
+long compressCacheBytes(void *)
+{
+    return compress_cache::get_instance()->bytes();
+}
+long fileCacheEntries(void *)
+{
+    return file_cache::get_instance()->size();
+}
+// Time workers spent blocked on the database, waiting for a connection and, unless queries are
+// non-blocking, on the query itself
+unsigned long long dbWait(void *)
+{
+    unsigned long long ns = metrics::get_instance()->sum(H_DB_ACQUIRE);
+    if (!httpHandler::m_sql_store)
+    {
+        ns += metrics::get_instance()->sum(H_DB_QUERY);
+    }
+    return ns;
+}
+long activeConnections(void *)
+{
+    return httpHandler::m_user_count;
+}
+long freeDbConnections(void *arg)
+{
+    return ((connection_pool *)arg)->GetFreeConn();
+}
+#ifdef ALLOC_STATS
+// Body of the /debug/allocs endpoint
+void renderAllocs(std::string &out)
+{
+    alloc_stats::render(out, metrics::get_instance()->total(M_REQUESTS));
+}
+#endif
+#ifdef LOCK_PROFILE
+// Body of the /debug/locks endpoint
+void renderLocks(std::string &out)
+{
+    lock_profile::render(out);
+}
+// Write the contention report to the log, on SIGUSR1
+void dumpLocks()
+{
+    std::string report;
+    lock_profile::render(report);
+    size_t start = 0;
+    while (start < report.size())
+    {
+        size_t end = report.find('\n', start);
+        LOG_INFO("lock %s", report.substr(start, end - start).c_str());
+        start = end + 1;
+    }
+    Log::get_instance()->flush();
+}
+#endif
 // Write a message to connection, used as error message sender
 void writeMsg(int connfd, const char *info)
 {
-    printf("%s", info);
-    send(connfd, info, strlen(info), 0);
+    send(connfd, info, strlen(info), MSG_NOSIGNAL | MSG_DONTWAIT);
     close(connfd);
 }
 
+// Descriptor kept in reserve, freed to accept a connection only to close it when the process is out of them
+static int spare_fd = -1;
+
+// Take one connection off the backlog of listenfd and close it with the reserved descriptor, false when there
+// is no reserve or nothing to accept
+bool shedConnection(int listenfd)
+{
+    if (spare_fd < 0)
+    {
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (spare_fd < 0)
+        {
+            return false;
+        }
+    }
+    close(spare_fd);
+    int connfd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+    if (connfd >= 0)
+    {
+        close(connfd);
+    }
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return connfd >= 0;
+}
+
+// Parse -O, a comma separated list of nodelay, cork, defer=<seconds> and fastopen=<queue length>
+bool parseTcpOptions(const char *spec, int *defer_accept_s, int *fastopen_queue)
+{
+    string text(spec);
+    size_t start = 0;
+    while (start <= text.size())
+    {
+        size_t end = text.find(',', start);
+        if (end == string::npos)
+        {
+            end = text.size();
+        }
+        string item = text.substr(start, end - start);
+        if (item == "nodelay")
+        {
+            httpHandler::m_tcp_nodelay = true;
+        }
+        else if (item == "cork")
+        {
+            httpHandler::m_tcp_cork = true;
+        }
+        else if (item.compare(0, 6, "defer=") == 0)
+        {
+            *defer_accept_s = atoi(item.c_str() + 6);
+        }
+        else if (item.compare(0, 9, "fastopen=") == 0)
+        {
+            *fastopen_queue = atoi(item.c_str() + 9);
+        }
+        else
+        {
+            return false;
+        }
+        if (*defer_accept_s < 0 || *fastopen_queue < 0)
+        {
+            return false;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
 int main(int argc, char *argv[])
 {
     // Initialize server log
     Log::get_instance()->init("ServerLog", 2000, 800000);
 
-    if (argc <= 1)
+    // -a runs login and registration queries on the non-blocking MySQL API, driven by the epoll loop
+    // -l <file> keeps users in an embedded append-only store instead of MySQL
+    // -t <n> traces one request in n, -s <ms> keeps the trace of any request slower than ms
+    // -r <dir> serves resources from dir instead of the compiled-in doc_root
+    // -w <ms> logs a backtrace of the event loop when one iteration is busy longer than ms, 0 disables it
+    // -c <file> captures the traffic of one connection in -n <n> for bench/replay, up to -m <mb> megabytes
+    // -R <cpus> pins the reactor and -W <cpus> the workers, one per CPU, to CPU lists such as 0-3,8
+    // -p <us> lets idle workers spin up to us for the next request before parking, while requests arrive that fast
+    // -b <n> is the listen backlog, -O sets TCP options: nodelay,cork on connections, defer=<s>,fastopen=<n> on the listener
+    // -H <value> is the Cache-Control header of files, "no-cache" by default, empty to leave it out
+    // -z <mb> bounds the gzip copies of compressible files made in the background, 0 compresses nothing
+    // -F <ms> checks open files kept by file_cache every ms, "inotify" (the default) when their directory changes,
+    // "off" opens and maps files for every request
+    // -B <file> serves the assets packed into file by tools/pack_assets ahead of doc_root, in place of the
+    // bundle linked into an EMBED_BUNDLE build
+    bool async_sql = false;
+    const char *local_store = NULL;
+    int trace_every = 0;
+    int trace_slow_ms = 0;
+    int stall_ms = 100;
+    const char *capture_file = NULL;
+    int capture_one_in_n = 1;
+    int capture_max_mb = 64;
+    const char *reactor_cpus = NULL;
+    const char *worker_cpus = NULL;
+    int spin_us = 0;
+    const char *pool_range = NULL;
+    int max_queue = 10000;
+    const char *limits = NULL;
+    int backlog = 4096;
+    const char *tcp_options = NULL;
+    int compress_mb = 64;
+    const char *file_cache_mode = "inotify";
+    const char *bundle_file = NULL;
+    const char *upload_dir = NULL;
+    int upload_max_mb = 1024;
+    int opt;
+    while ((opt = getopt(argc, argv, "al:t:s:r:w:c:n:m:R:W:p:P:q:T:b:O:H:z:F:B:U:M:")) != -1)
     {
-        printf("usage: %s ip_address port_number\n", basename(argv[0]));
+        switch (opt)
+        {
+        case 'a':
+            async_sql = true;
+            break;
+        case 'l':
+            local_store = optarg;
+            break;
+        case 't':
+            trace_every = atoi(optarg);
+            break;
+        case 's':
+            trace_slow_ms = atoi(optarg);
+            break;
+        case 'r':
+            doc_root = optarg;
+            break;
+        case 'w':
+            stall_ms = atoi(optarg);
+            break;
+        case 'c':
+            capture_file = optarg;
+            break;
+        case 'n':
+            capture_one_in_n = atoi(optarg);
+            break;
+        case 'm':
+            capture_max_mb = atoi(optarg);
+            break;
+        case 'R':
+            reactor_cpus = optarg;
+            break;
+        case 'W':
+            worker_cpus = optarg;
+            break;
+        case 'p':
+            spin_us = atoi(optarg);
+            break;
+        case 'P':
+            pool_range = optarg;
+            break;
+        case 'q':
+            max_queue = atoi(optarg);
+            break;
+        case 'T':
+            limits = optarg;
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            break;
+        case 'O':
+            tcp_options = optarg;
+            break;
+        case 'H':
+            httpHandler::m_cache_control = optarg;
+            break;
+        case 'z':
+            compress_mb = atoi(optarg);
+            break;
+        case 'F':
+            file_cache_mode = optarg;
+            break;
+        case 'B':
+            bundle_file = optarg;
+            break;
+        case 'U':
+            upload_dir = optarg;
+            break;
+        case 'M':
+            upload_max_mb = atoi(optarg);
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (argc <= optind)
+    {
+        printf("usage: %s [-a] [-l user_store_file] [-t trace_one_in_n] [-s trace_slow_ms] [-r doc_root] [-w stall_ms] [-c capture_file [-n capture_one_in_n] [-m capture_max_mb]] [-R reactor_cpus] [-W worker_cpus] [-p spin_us] [-P min_threads-max_threads] [-q max_queue] [-T phase=timeout_s[:max_s[:min_rate]],...] [-b backlog] [-O nodelay,cork,defer=s,fastopen=n] [-H cache_control] [-z compress_cache_mb] [-F file_check_ms|inotify|off] [-B bundle_file] [-U upload_dir [-M upload_max_mb]] port_number\n", basename(argv[0]));
         return 1;
     }
 
-    int port = atoi(argv[1]);
+    int port = atoi(argv[optind]);
+
+    // CPU lists must name CPUs this process may run on
+    cpu_set_t allowed, reactor_set, worker_set;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    const char *cpu_lists[2] = {reactor_cpus, worker_cpus};
+    cpu_set_t *cpu_sets[2] = {&reactor_set, &worker_set};
+    for (int i = 0; i < 2; i++)
+    {
+        cpu_set_t outside;
+        if (cpu_lists[i] && (!parse_cpu_list(cpu_lists[i], cpu_sets[i]) ||
+                             (CPU_AND(&outside, cpu_sets[i], &allowed), CPU_COUNT(&outside) != CPU_COUNT(cpu_sets[i]))))
+        {
+            printf("bad or unavailable cpu list %s\n", cpu_lists[i]);
+            return 1;
+        }
+    }
+
+    // Worker count bounds, by default from 2 up to four per CPU so workers blocked on the database can be covered
+    long ncpu = worker_cpus ? CPU_COUNT(&worker_set) : CPU_COUNT(&allowed);
+    int min_threads = 2;
+    int max_threads = ncpu * 4 > 8 ? ncpu * 4 : 8;
+    if (pool_range && (sscanf(pool_range, "%d-%d", &min_threads, &max_threads) != 2 || min_threads <= 0 ||
+                       max_threads < min_threads))
+    {
+        printf("bad thread pool range %s\n", pool_range);
+        return 1;
+    }
+    if (max_queue <= 0)
+    {
+        printf("bad queue length %d\n", max_queue);
+        return 1;
+    }
+    if (limits && !httpHandler::setLimits(limits))
+    {
+        printf("bad deadlines %s\n", limits);
+        return 1;
+    }
+    if (compress_mb < 0)
+    {
+        printf("bad compress cache size %d\n", compress_mb);
+        return 1;
+    }
+    // With inotify, files in directories that cannot be watched are checked every second
+    int file_check_ms = 1000;
+    bool file_inotify = strcmp(file_cache_mode, "inotify") == 0;
+    if (strcmp(file_cache_mode, "off") == 0)
+    {
+        file_check_ms = -1;
+    }
+    else if (!file_inotify)
+    {
+        char *end;
+        file_check_ms = strtol(file_cache_mode, &end, 10);
+        if (end == file_cache_mode || *end != '\0' || file_check_ms < 0)
+        {
+            printf("bad file cache mode %s\n", file_cache_mode);
+            return 1;
+        }
+    }
+    if (backlog <= 0)
+    {
+        printf("bad listen backlog %d\n", backlog);
+        return 1;
+    }
+    int defer_accept_s = 0, fastopen_queue = 0;
+    if (tcp_options && !parseTcpOptions(tcp_options, &defer_accept_s, &fastopen_queue))
+    {
+        printf("bad tcp options %s\n", tcp_options);
+        return 1;
+    }
+    int initial_threads = 8 < min_threads ? min_threads : 8 > max_threads ? max_threads : 8;
 
     setSig(SIGPIPE, SIG_IGN);
 
-    // Create a mysql connection pool
-    connection_pool *connPool = connection_pool::GetInstance();
-    connPool->init("localhost", "root", "Aa199781.", "mydb", 6000, 8);
+    // Load the users from the embedded store, or from MySQL through the connection pool
+    connection_pool *connPool = NULL;
+    user_store *store = NULL;
+    mysql_user_store *sql_store = NULL;
+    if (local_store)
+    {
+        store = new local_user_store(local_store);
+        async_sql = false;
+    }
+    else
+    {
+        // Create a mysql connection pool, 4 connections are opened at start-up and it grows up to 8 under load
+        connPool = connection_pool::GetInstance();
+        connPool->init("localhost", "root", "Aa199781.", "mydb", 6000, 4, 8);
+        store = sql_store = new mysql_user_store(connPool);
+    }
+    if (!store->load())
+    {
+        LOG_ERROR("%s", "cannot load the user store");
+        Log::get_instance()->flush();
+        return 1;
+    }
+    httpHandler::m_store = store;
+
+    if (async_sql && !sql_async::available())
+    {
+        // Without the non-blocking client API registrations block a worker as before
+        LOG_WARN("%s", "MySQL client has no non-blocking API, async SQL disabled");
+        async_sql = false;
+    }
 
     // Creating a thread pool
-    threadpool<httpHandler> *pool = NULL;
     try
     {
-        pool = new threadpool<httpHandler>(connPool);
+        pool = new threadpool<httpHandler>(initial_threads, max_queue, worker_cpus ? &worker_set : NULL, max_threads);
     }
     catch (...)
     {
         return 1;
     }
+    // A spinning worker holds a CPU the reactor or a busy worker could use, so a single CPU never spins
+    if (spin_us > 0 && sysconf(_SC_NPROCESSORS_ONLN) > 1)
+    {
+        pool->set_spin(spin_us * 1000ULL);
+    }
+    else if (spin_us > 0)
+    {
+        LOG_WARN("%s", "worker spinning needs more than one cpu, workers park at once");
+    }
+    if (min_threads < max_threads && !pool->autosize(min_threads, dbWait, NULL))
+    {
+        LOG_WARN("%s", "cannot start the thread pool tuner, the pool stays at its initial size");
+    }
+
+    // Serve Prometheus metrics at /metrics
+    httpHandler::addEndpoint("/metrics", renderMetrics);
+    metrics::get_instance()->add_gauge("webserver_queue_depth", "Requests waiting for a worker.", queueDepth, NULL);
+    metrics::get_instance()->add_gauge("webserver_connections", "Open client connections.", activeConnections, NULL);
+    metrics::get_instance()->add_gauge("webserver_worker_threads", "Worker threads in the thread pool.", workerThreads, NULL);
+    if (connPool)
+    {
+        metrics::get_instance()->add_gauge("webserver_db_free_connections", "Idle pooled database connections.",
+                                           freeDbConnections, connPool);
+    }
+
+#ifdef LOCK_PROFILE
+    httpHandler::addEndpoint("/debug/locks", renderLocks);
+#endif
+#ifdef ALLOC_STATS
+    httpHandler::addEndpoint("/debug/allocs", renderAllocs);
+#endif
+
+    // Sampled request traces at /debug/trace, load them in chrome://tracing or Perfetto
+    tracer::configure(trace_every, trace_slow_ms);
+    httpHandler::addEndpoint("/debug/trace", renderTrace, "application/json");
+    // Heaviest clients and URLs of the last timer periods at /debug/topk
+    httpHandler::addEndpoint("/debug/topk", renderTopk);
+    // Assets served ahead of doc_root
+    if (bundle_file && !asset_bundle::get_instance()->load(bundle_file))
+    {
+        printf("cannot load asset bundle %s\n", bundle_file);
+        return 1;
+    }
+    if (!bundle_file)
+    {
+        asset_bundle::get_instance()->load_embedded();
+    }
+    if (asset_bundle::get_instance()->loaded())
+    {
+        LOG_INFO("serving %u bundled assets, %llu bytes", asset_bundle::get_instance()->size(),
+                 (unsigned long long)asset_bundle::get_instance()->bytes());
+    }
+    // PUT and multipart/form-data POST bodies stored as files
+    if (upload_dir && !upload::configure(upload_dir, (long long)upload_max_mb << 20))
+    {
+        printf("cannot store uploads in %s\n", upload_dir);
+        return 1;
+    }
+    // Open files of doc_root shared by the workers
+    if (!file_cache::get_instance()->init(doc_root, file_check_ms, file_inotify))
+    {
+        LOG_WARN("cannot open %s, every file will be missing", doc_root);
+    }
+    metrics::get_instance()->add_gauge("webserver_file_cache_entries", "Files and missing paths held open by the file cache.",
+                                       fileCacheEntries, NULL);
+    // Gzip copies of compressible files without a precompressed sibling
+    if (!compress_cache::get_instance()->init((size_t)compress_mb << 20))
+    {
+        LOG_WARN("%s", "cannot start the compressor, files without a .gz sibling go out uncompressed");
+    }
+    metrics::get_instance()->add_gauge("webserver_compress_cache_bytes", "Bytes of gzip copies held in memory.",
+                                       compressCacheBytes, NULL);
+    // Traffic capture for bench/replay
+    if (capture_file && !traffic_capture::get_instance()->init(capture_file, capture_one_in_n, capture_max_mb, MAX_FD))
+    {
+        printf("cannot open capture file %s\n", capture_file);
+        return 1;
+    }
+
+    if (worker_cpus)
+    {
+        for (int i = 0; i < max_threads; i++)
+        {
+            LOG_INFO("worker %d on cpu %d, numa node %d", i, pool->worker_cpu(i), cpu_node(pool->worker_cpu(i)));
+        }
+        // Requests prefer a worker on the CPU that took the connection's interrupts
+        httpHandler::m_steer_cpu = true;
+    }
+    // The reactor is pinned before it allocates the connection table, so the table is first touched on its
+    // NUMA node. Helper threads started from here on, like the watchdog, share its CPUs.
+    if (reactor_cpus && !pin_thread(pthread_self(), &reactor_set))
+    {
+        LOG_WARN("cannot pin the reactor to %s", reactor_cpus);
+    }
 
     // Create http connection instances
-    httpHandler *users = new httpHandler[MAX_FD];
+    users = new httpHandler[MAX_FD];
     assert(users);
 
-    // Initialize Mysql read table
-    users->initMysql(connPool);
-
-    // Creaet listen socket
-    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
+    // Creaet listen socket, non-blocking so the accept loop stops when the backlog is drained
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    int listenfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     assert(listenfd >= 0);
 
     // Bind listen socket to server port
@@ -138,7 +661,19 @@ int main(int argc, char *argv[])
     setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
     ret = bind(listenfd, (struct sockaddr *)&address, sizeof(address));
     assert(ret >= 0);
-    ret = listen(listenfd, 5);
+    // Wake the reactor only once the first request bytes are in, and let clients send them with the SYN
+    if (defer_accept_s > 0 &&
+        setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept_s, sizeof(defer_accept_s)) < 0)
+    {
+        LOG_WARN("cannot set TCP_DEFER_ACCEPT, errno is:%d", errno);
+    }
+    if (fastopen_queue > 0 &&
+        setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN, &fastopen_queue, sizeof(fastopen_queue)) < 0)
+    {
+        LOG_WARN("cannot set TCP_FASTOPEN, errno is:%d", errno);
+    }
+    // The kernel caps backlog at net.core.somaxconn
+    ret = listen(listenfd, backlog);
     assert(ret >= 0);
 
     // Create kernel events table
@@ -152,94 +687,154 @@ int main(int argc, char *argv[])
     // "m_" indicates a shared variable
     httpHandler::m_epollfd = epollfd;
 
+    if (async_sql)
+    {
+        sql_async::get_instance()->init(epollfd, MAX_FD, connPool, sqlComplete);
+        httpHandler::m_sql_store = sql_store;
+    }
+
     // Create socket pipe
     ret = socketpair(PF_UNIX, SOCK_STREAM, 0, pipefd);
     assert(ret != -1);
     // Set the write end of the pipe to non-blocking, to support a half-close socket
     setNonBlocking(pipefd[1]);
+    setNonBlocking(pipefd[0]);
     addFd(epollfd, pipefd[0], false);
     // Set handler for SIGALRM and SIGTERM
     // SIGALRM -> trigger after a certain period of time
     // SIGTERM -> trigger at termination
     setSig(SIGALRM, sigHandler, false);
     setSig(SIGTERM, sigHandler, false);
+#ifdef LOCK_PROFILE
+    // SIGUSR1 -> dump the lock contention report to the log
+    setSig(SIGUSR1, sigHandler, false);
+#endif
     bool stop_server = false;
 
     client_data *users_timer = new client_data[MAX_FD];
 
     bool timeout = false;
     // Trigger SIGALRM once for each TIMESLOT
-    // In this lab, SIGALRM is sent for each 5s to notice the root process to check the timer list, and close timeout connection
-    // Timeout for each connection is 15s since its initialization or last interaction with server, and its timer will be checked for each 5s
+    // Connection deadlines depend on the phase of the connection, see httpHandler::m_limits and -T
     alarm(TIMESLOT);
 
+    // Stamp every iteration and dispatch of the event loop, for the loop histograms and the stall watchdog
+    reactor_watchdog *watchdog = reactor_watchdog::get_instance();
+    if (!watchdog->init(stall_ms))
+    {
+        LOG_WARN("%s", "cannot start the reactor watchdog");
+    }
+
+    ALLOC_SCOPE(A_REACTOR);
     while (!stop_server)
     {
-        // Wait for new event on listen fd
-        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+        // Wait for new event on listen fd, or until the next timer wheel slot is due
+        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, timers.next_timeout(timer_wheel::now_ms()));
         if (number < 0 && errno != EINTR)
         {
             LOG_ERROR("%s", "epoll failure");
             break;
         }
+        watchdog->begin_iteration();
         // Process all new events
         for (int i = 0; i < number; i++)
         {
-            int sockfd = events[i].data.fd;
+            int sockfd = (int)(events[i].data.u64 & 0xffffffff);
+            unsigned int generation = events[i].data.u64 >> 32;
 
             // Process new request on listen fd
             if (sockfd == listenfd)
             {
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof(client_address);
-
-                int connfd = accept(listenfd, (struct sockaddr *)&client_address, &client_addrlength);
-                if (connfd < 0)
+                watchdog->dispatch("accept");
+                METRICS_ADD(M_ACCEPT_WAKEUPS, 1);
+                int shed = 0;
+                // Drain the backlog, the listen socket is level triggered so a capped batch resumes next iteration
+                for (int accepted = 0; accepted < ACCEPT_BATCH; accepted++)
                 {
-                    LOG_ERROR("%s:errno is:%d", "accept error", errno);
-                    continue;
+                    struct sockaddr_in client_address;
+                    socklen_t client_addrlength = sizeof(client_address);
+
+                    int connfd = accept4(listenfd, (struct sockaddr *)&client_address, &client_addrlength,
+                                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (connfd < 0)
+                    {
+                        // Out of descriptors, the connections waiting are refused, or the level triggered listen
+                        // socket would wake the loop again at once for as long as they wait
+                        if ((errno == EMFILE || errno == ENFILE) && shedConnection(listenfd))
+                        {
+                            METRICS_ADD(M_ACCEPTS_SHED, 1);
+                            shed++;
+                            continue;
+                        }
+                        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR)
+                        {
+                            LOG_ERROR("%s:errno is:%d", "accept error", errno);
+                        }
+                        if (errno == ECONNABORTED || errno == EINTR)
+                        {
+                            continue;
+                        }
+                        break;
+                    }
+                    METRICS_ADD(M_ACCEPTS, 1);
+                    PROBE1(conn_accept, connfd);
+                    // If number of new events exceeds the maximum number allowed
+                    if (httpHandler::m_user_count >= MAX_FD)
+                    {
+                        writeMsg(connfd, "Internal server busy");
+                        LOG_ERROR("%s", "Internal server busy");
+                        continue;
+                    }
+                    users[connfd].init(connfd, client_address);
+
+                    // Initialize user data
+                    // Create timer, set timeout callback function, and add timer to the timer wheel
+                    users_timer[connfd].address = client_address;
+                    users_timer[connfd].sockfd = connfd;
+                    util_timer *timer = timers.new_timer();
+                    timer->user_data = &users_timer[connfd];
+                    timer->cb_func = expireConnection;
+                    // The first byte is due within its phase deadline
+                    timer->expire = users[connfd].deadline();
+                    // Add timer to connection fd
+                    users_timer[connfd].timer = timer;
+                    // Add timer to timer wheel
+                    timers.add_timer(timer);
                 }
-                // If number of new events exceeds the maximum number allowed
-                if (httpHandler::m_user_count >= MAX_FD)
+                if (shed)
                 {
-                    writeMsg(connfd, "Internal server busy");
-                    LOG_ERROR("%s", "Internal server busy");
-                    continue;
+                    LOG_WARN("out of file descriptors, refused %d connections", shed);
                 }
-                users[connfd].init(connfd, client_address);
-
-                // Initialize user data
-                // Create timer, set timeout callback function, and add timer to the ascending linked list
-                users_timer[connfd].address = client_address;
-                users_timer[connfd].sockfd = connfd;
-                util_timer *timer = new util_timer;
-                timer->user_data = &users_timer[connfd];
-                timer->cb_func = cb_func;
-                time_t cur = time(NULL);
-                // Set expire time to current time + 5s * 3
-                timer->expire = cur + 3 * TIMESLOT;
-                // Add timer to connection fd
-                users_timer[connfd].timer = timer;
-                // Add timer to timer list
-                timer_lst.add_timer(timer);
+            }
+            // MySQL socket of a non-blocking query became readable
+            else if (httpHandler::m_sql_store && sql_async::get_instance()->owns(sockfd))
+            {
+                watchdog->dispatch("sql");
+                sql_async::get_instance()->handle(sockfd);
+            }
+            // Event of a connection closed earlier in this batch, its fd may already belong to a new client
+            else if (sockfd != pipefd[0] && generation != users[sockfd].generation())
+            {
+                METRICS_ADD(M_STALE_EVENTS, 1);
             }
             // Handle error events
             else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
             {
+                watchdog->dispatch("error");
                 // Remove timer when IO event error occurs
                 util_timer *timer = users_timer[sockfd].timer;
-                timer->cb_func(&users_timer[sockfd]);
+                cb_func(&users_timer[sockfd]);
 
                 if (timer)
                 {
-                    timer_lst.del_timer(timer);
+                    timers.del_timer(timer);
                 }
             }
 
             // If any signal is triggered
             else if ((sockfd == pipefd[0]) && (events[i].events & EPOLLIN))
             {
-                int sig;
+                watchdog->dispatch("signal");
                 char signals[1024];
                 // Read signal from pipe. return -1 when fails, return number of bytes when successes (normally return 1 for signal)
                 ret = recv(pipefd[0], signals, sizeof(signals), 0);
@@ -266,7 +861,15 @@ int main(int argc, char *argv[])
                         case SIGTERM:
                         {
                             stop_server = true;
+                            break;
                         }
+#ifdef LOCK_PROFILE
+                        case SIGUSR1:
+                        {
+                            dumpLocks();
+                            break;
+                        }
+#endif
                         }
                     }
                 }
@@ -275,80 +878,102 @@ int main(int argc, char *argv[])
             // If there is a read event (message sent from client)
             else if (events[i].events & EPOLLIN)
             {
+                watchdog->dispatch("read");
                 // Get the timer of the connection
                 util_timer *timer = users_timer[sockfd].timer;
-                // Read buffer
-                if (users[sockfd].readBuff())
+                // Read buffer, a client trickling bytes past the deadline of its phase is closed rather than served
+                bool received = users[sockfd].readBuff();
+                if (received && users[sockfd].deadline() > timer_wheel::now_ms())
                 {
                     LOG_INFO("deal with the client(%s)", inet_ntoa(users[sockfd].get_address()->sin_addr));
                     Log::get_instance()->flush();
                     // Add new event to request queue of thread pool
-                    pool->append(users + sockfd);
+                    queueRequest(users + sockfd, users[sockfd].cpu());
 
                     if (timer)
                     {
                         // Renew the timer
-                        time_t cur = time(NULL);
-                        timer->expire = cur + 3 * TIMESLOT;
+                        renewTimer(timer, sockfd, true);
                         LOG_INFO("%s", "adjust timer once");
                         Log::get_instance()->flush();
-                        // Adjust timer's position in the list
-                        timer_lst.adjust_timer(timer);
                     }
                 }
                 // If readBuff failed (error occurs or connection ends by server), close connection and delete timer
                 else
                 {
-                    timer->cb_func(&users_timer[sockfd]);
+                    if (received)
+                    {
+                        deadlineMissed(sockfd);
+                    }
+                    cb_func(&users_timer[sockfd]);
                     if (timer)
                     {
-                        timer_lst.del_timer(timer);
+                        timers.del_timer(timer);
                     }
                 }
             }
             else if (events[i].events & EPOLLOUT)
             {
+                watchdog->dispatch("write");
                 util_timer *timer = users_timer[sockfd].timer;
-                if (users[sockfd].writeBuff())
+                // A client reading the response slower than the write phase allows is closed
+                bool written = users[sockfd].writeBuff();
+                if (written && users[sockfd].deadline() > timer_wheel::now_ms())
                 {
+                    // The client already sent its next request
+                    if (users[sockfd].pipelined())
+                    {
+                        queueRequest(users + sockfd, users[sockfd].cpu());
+                    }
                     LOG_INFO("send data to the client(%s)", inet_ntoa(users[sockfd].get_address()->sin_addr));
                     Log::get_instance()->flush();
 
                     if (timer)
                     {
                         // Renew the timer
-                        time_t cur = time(NULL);
-                        timer->expire = cur + 3 * TIMESLOT;
+                        renewTimer(timer, sockfd, users[sockfd].pipelined());
                         LOG_INFO("%s", "adjust timer once");
                         Log::get_instance()->flush();
-                        // Adjust timer's position in the list
-                        timer_lst.adjust_timer(timer);
                     }
                 }
                 else
                 {
-                    timer->cb_func(&users_timer[sockfd]);
+                    if (written)
+                    {
+                        deadlineMissed(sockfd);
+                    }
+                    cb_func(&users_timer[sockfd]);
                     if (timer)
                     {
-                        timer_lst.del_timer(timer);
+                        timers.del_timer(timer);
                     }
                 }
             }
         }
-        // If SIGALARM is triggered (for each 5s), timeout flags is set, then call timer handler to check the timer list
+        // Close the connections whose phase deadline passed
+        timers.tick(timer_wheel::now_ms());
+        // If SIGALARM is triggered (for each 5s), timeout flags is set, then call the periodic timer handler
         if (timeout)
         {
+            watchdog->dispatch("timer");
             timer_handler();
             timeout = false;
         }
+        watchdog->end_iteration();
     }
+    watchdog->stop();
+    traffic_capture::get_instance()->stop();
+    compress_cache::get_instance()->stop();
+    file_cache::get_instance()->stop();
     // Release resource
     close(epollfd);
     close(listenfd);
     close(pipefd[1]);
     close(pipefd[0]);
+    // Workers finish their requests before the handlers go
+    delete pool;
     delete[] users;
     delete[] users_timer;
-    delete pool;
+    delete store;
     return 0;
 }
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "metrics.h"
+
+__thread metrics_shard *metrics::t_shard = NULL;
+
+static const char *counter_names[M_COUNTER_NUM][2] = {
+    {"webserver_accepts_total", "Connections accepted."},
+    {"webserver_queue_rejects_total", "Requests refused because the worker queue was full."},
+    {"webserver_requests_total", "Requests processed by worker threads."},
+    {"webserver_bytes_sent_total", "Response bytes written to client sockets."},
+    {"webserver_timer_expirations_total", "Connections closed by the inactivity timer."},
+    {"webserver_db_acquire_timeouts_total", "Database connection acquisitions that hit their deadline."},
+    {"webserver_reactor_stalls_total", "Event loop iterations that exceeded the watchdog threshold."},
+    {"webserver_queue_cpu_handoffs_total", "Requests handed to an idle worker pinned to the CPU that received them."},
+    {"webserver_queue_wakes_skipped_total", "Requests left to a spinning worker without a wakeup."},
+    {"webserver_worker_spin_hits_total", "Worker spins that found a queued request before parking."},
+    {"webserver_worker_parks_total", "Times a worker parked on its semaphore."},
+    {"webserver_worker_pool_resizes_total", "Times the thread pool grew or shrank."},
+    {"webserver_stale_requests_total", "Requests dropped because their connection closed while they were queued or processed."},
+    {"webserver_stale_events_total", "Epoll events dropped because their connection was already closed."},
+    {"webserver_deadline_first_byte_total", "Connections closed before sending a first byte in time."},
+    {"webserver_deadline_header_total", "Connections closed for sending request headers too slowly."},
+    {"webserver_deadline_body_total", "Connections closed for sending a request body too slowly."},
+    {"webserver_deadline_write_total", "Connections closed for reading a response too slowly."},
+    {"webserver_deadline_idle_total", "Keep-alive connections closed when idle."},
+    {"webserver_accept_wakeups_total", "Listen socket events handled, accepts_total over this is the accept batch size."},
+    {"webserver_not_modified_total", "Conditional GETs answered 304 Not Modified."},
+    {"webserver_encoded_static_total", "Responses sent from a precompressed .gz or .zst file."},
+    {"webserver_encoded_cached_total", "Responses sent from a gzip copy made in the background."},
+    {"webserver_compress_jobs_total", "Files compressed by the background compressor."},
+    {"webserver_file_cache_hits_total", "Files served from an open file cache entry without a system call."},
+    {"webserver_file_cache_revalidations_total", "Open file cache entries confirmed unchanged by a stat."},
+    {"webserver_file_cache_misses_total", "Files opened and mapped into the open file cache."},
+    {"webserver_file_syscalls_total", "System calls made to find, open, map and unmap files."},
+    {"webserver_bundle_hits_total", "Responses served from the asset bundle."},
+    {"webserver_upload_bytes_total", "Request body bytes of PUT and form uploads taken off sockets."},
+    {"webserver_upload_files_total", "Files stored in the upload directory."},
+    {"webserver_uploads_failed_total", "Uploads refused or cut short, by the server or the client."},
+    {"webserver_accepts_shed_total", "Connections closed as soon as accepted because the process was out of file descriptors."},
+};
+
+static const char *histogram_names[H_HISTOGRAM_NUM][2] = {
+    {"webserver_accept_to_read_seconds", "Time from accept to the first bytes read from the client."},
+    {"webserver_queue_wait_seconds", "Time a request waited in the worker queue."},
+    {"webserver_process_seconds", "Time spent in httpHandler::process."},
+    {"webserver_db_acquire_seconds", "Time spent acquiring a database connection."},
+    {"webserver_db_query_seconds", "Database query round trip time."},
+    {"webserver_write_seconds", "Time from response ready to its last byte written."},
+    {"webserver_reactor_iteration_seconds", "Busy time of one event loop iteration."},
+    {"webserver_reactor_lag_seconds", "Time an event waited behind others of the same event loop iteration."},
+};
+
+// Exposed bucket bounds in nanoseconds, the fine buckets are folded into these at scrape time
+static const unsigned long long export_bounds[] = {
+    1000ULL, 2500ULL, 5000ULL, 10000ULL, 25000ULL, 50000ULL, 100000ULL, 250000ULL, 500000ULL,
+    1000000ULL, 2500000ULL, 5000000ULL, 10000000ULL, 25000000ULL, 50000000ULL, 100000000ULL,
+    250000000ULL, 500000000ULL, 1000000000ULL, 2500000000ULL, 5000000000ULL, 10000000000ULL,
+};
+
+unsigned long long latency_histogram::upper(int idx) {
+    if (idx < SUB_COUNT) {
+        return idx;
+    }
+    int exp = (idx >> SUB_BITS) + SUB_BITS - 1;
+    int shift = exp - SUB_BITS;
+    unsigned long long lower = (unsigned long long)(SUB_COUNT + (idx & (SUB_COUNT - 1))) << shift;
+    return lower + (1ULL << shift) - 1;
+}
+
+metrics_shard *metrics::add_shard() {
+    metrics_shard *s;
+    m_mutex.lock();
+    if (!m_free.empty()) {
+        s = m_free.back();
+        m_free.pop_back();
+    } else {
+        s = new metrics_shard();
+        m_shards.push_back(s);
+        // Room for every shard to be released, so an exiting thread does not allocate. Grown along with
+        // m_shards, so no allocation is added to those of a new shard.
+        if (m_free.capacity() < m_shards.capacity()) {
+            m_free.reserve(m_shards.capacity());
+        }
+    }
+    m_mutex.unlock();
+    pthread_setspecific(m_exit_key, s);
+    return s;
+}
+
+void metrics::release_shard(void *shard) {
+    metrics *m = get_instance();
+    t_shard = NULL;
+    m->m_mutex.lock();
+    m->m_free.push_back((metrics_shard *)shard);
+    m->m_mutex.unlock();
+}
+
+void metrics::add_gauge(const char *name, const char *help, long (*read)(void *arg), void *arg) {
+    gauge g = {name, help, read, arg};
+    m_mutex.lock();
+    m_gauges.push_back(g);
+    m_mutex.unlock();
+}
+
+unsigned long long metrics::total(metric_counter c) {
+    unsigned long long sum = 0;
+    m_mutex.lock();
+    for (size_t i = 0; i < m_shards.size(); ++i) {
+        sum += __atomic_load_n(&m_shards[i]->counters[c], __ATOMIC_RELAXED);
+    }
+    m_mutex.unlock();
+    return sum;
+}
+
+unsigned long long metrics::sum(metric_histogram h) {
+    unsigned long long sum = 0;
+    m_mutex.lock();
+    for (size_t i = 0; i < m_shards.size(); ++i) {
+        sum += __atomic_load_n(&m_shards[i]->histograms[h].sum, __ATOMIC_RELAXED);
+    }
+    m_mutex.unlock();
+    return sum;
+}
+
+void metrics::render(string &out) {
+    char line[256];
+    unsigned long long counters[M_COUNTER_NUM] = {0};
+    vector<unsigned long long> buckets(H_HISTOGRAM_NUM * latency_histogram::BUCKETS, 0);
+    unsigned long long sums[H_HISTOGRAM_NUM] = {0};
+
+    // Merge the shards, their owners keep writing meanwhile so every word is read atomically
+    m_mutex.lock();
+    for (size_t i = 0; i < m_shards.size(); ++i) {
+        metrics_shard *s = m_shards[i];
+        for (int c = 0; c < M_COUNTER_NUM; ++c) {
+            counters[c] += __atomic_load_n(&s->counters[c], __ATOMIC_RELAXED);
+        }
+        for (int h = 0; h < H_HISTOGRAM_NUM; ++h) {
+            latency_histogram &hist = s->histograms[h];
+            for (int b = 0; b < latency_histogram::BUCKETS; ++b) {
+                buckets[h * latency_histogram::BUCKETS + b] += __atomic_load_n(&hist.counts[b], __ATOMIC_RELAXED);
+            }
+            sums[h] += __atomic_load_n(&hist.sum, __ATOMIC_RELAXED);
+        }
+    }
+    vector<gauge> gauges = m_gauges;
+    m_mutex.unlock();
+
+    for (int c = 0; c < M_COUNTER_NUM; ++c) {
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counter_names[c][0],
+                 counter_names[c][1], counter_names[c][0], counter_names[c][0], counters[c]);
+        out += line;
+    }
+    for (size_t g = 0; g < gauges.size(); ++g) {
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s gauge\n%s %ld\n", gauges[g].name, gauges[g].help,
+                 gauges[g].name, gauges[g].name, gauges[g].read(gauges[g].arg));
+        out += line;
+    }
+    for (int h = 0; h < H_HISTOGRAM_NUM; ++h) {
+        const char *name = histogram_names[h][0];
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s histogram\n", name, histogram_names[h][1], name);
+        out += line;
+        unsigned long long *fine = &buckets[h * latency_histogram::BUCKETS];
+        unsigned long long cumulative = 0;
+        int b = 0;
+        for (size_t e = 0; e < sizeof(export_bounds) / sizeof(export_bounds[0]); ++e) {
+            while (b < latency_histogram::BUCKETS && latency_histogram::upper(b) < export_bounds[e]) {
+                cumulative += fine[b++];
+            }
+            snprintf(line, sizeof(line), "%s_bucket{le=\"%g\"} %llu\n", name, export_bounds[e] / 1e9, cumulative);
+            out += line;
+        }
+        while (b < latency_histogram::BUCKETS) {
+            cumulative += fine[b++];
+        }
+        snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n", name, cumulative,
+                 name, sums[h] / 1e9, name, cumulative);
+        out += line;
+    }
+}
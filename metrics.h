@@ -0,0 +1,167 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <vector>
+#include <time.h>
+
+#include "locker.h"
+
+using namespace std;
+
+// Event counters, each thread increments its own copy
+enum metric_counter {
+    M_ACCEPTS = 0,          // connections accepted
+    M_QUEUE_REJECTS,        // threadpool::append refused, request queue full
+    M_REQUESTS,             // requests processed by workers
+    M_BYTES_SENT,           // response bytes written to sockets
+    M_TIMER_EXPIRATIONS,    // connections closed by the timer
+    M_DB_TIMEOUTS,          // connection_pool::GetConnection gave up at its deadline
+    M_REACTOR_STALLS,       // event loop iterations caught by the watchdog
+    M_QUEUE_CPU_HANDOFFS,   // requests handed to an idle worker on the CPU that received them
+    M_QUEUE_WAKES_SKIPPED,  // appends that left the request to a spinning worker instead of waking one
+    M_WORKER_SPIN_HITS,     // worker spins that ended with a request queued
+    M_WORKER_PARKS,         // workers parked on their semaphore
+    M_POOL_RESIZES,         // thread pool grew or shrank
+    M_STALE_REQUESTS,       // queued or in-progress requests dropped because their connection was closed
+    M_STALE_EVENTS,         // epoll events dropped because their connection was closed
+    M_DEADLINE_FIRST_BYTE,  // connections closed for missing a phase deadline, in httpHandler::PHASE order
+    M_DEADLINE_HEADER,
+    M_DEADLINE_BODY,
+    M_DEADLINE_WRITE,
+    M_DEADLINE_IDLE,
+    M_ACCEPT_WAKEUPS,       // listen socket events, each accepts every pending connection up to ACCEPT_BATCH
+    M_NOT_MODIFIED,         // conditional GETs answered 304 without mapping the file
+    M_ENCODED_STATIC,       // responses sent from a precompressed .gz or .zst sibling
+    M_ENCODED_CACHED,       // responses sent from the gzip copy of compress_cache
+    M_COMPRESS_JOBS,        // files compressed by the compress_cache thread
+    M_FILE_CACHE_HITS,      // file_cache lookups answered without a look at the file system
+    M_FILE_CACHE_REVALIDATIONS, // file_cache entries confirmed by an fstatat
+    M_FILE_CACHE_MISSES,    // file_cache entries opened, first or after a change
+    M_FILE_SYSCALLS,        // openat, fstat, fstatat, mmap, munmap, close and inotify_add_watch calls made to serve files
+    M_BUNDLE_HITS,          // responses served from the asset bundle
+    M_UPLOAD_BYTES,         // request body bytes of PUT and form uploads taken off sockets
+    M_UPLOAD_FILES,         // files stored in the upload directory
+    M_UPLOADS_FAILED,       // uploads refused or cut short, by the server or the client
+    M_ACCEPTS_SHED,         // connections closed as accepted because the process was out of file descriptors
+    M_COUNTER_NUM
+};
+
+// Per-stage latencies of a request
+enum metric_histogram {
+    H_ACCEPT_TO_READ = 0,   // accept to first bytes read
+    H_QUEUE_WAIT,           // threadpool::append to worker pickup
+    H_PROCESS,              // httpHandler::process
+    H_DB_ACQUIRE,           // connection_pool::GetConnection
+    H_DB_QUERY,             // query round trip, blocking or non-blocking
+    H_WRITE,                // response ready to last byte written
+    H_REACTOR_ITERATION,    // event loop busy time from epoll_wait return to the next epoll_wait
+    H_REACTOR_LAG,          // epoll_wait return to the dispatch of each event
+    H_HISTOGRAM_NUM
+};
+
+// Log-linear latency histogram in nanoseconds, HDR style: every power of two is split in 2^SUB_BITS
+// buckets, so a value is known within 12.5% from 1ns to 2^MAX_EXP ns (~18 minutes). Written by one thread only.
+class latency_histogram {
+public:
+    static const int SUB_BITS = 3;
+    static const int SUB_COUNT = 1 << SUB_BITS;
+    static const int MAX_EXP = 40;
+    static const int BUCKETS = (MAX_EXP - SUB_BITS + 2) << SUB_BITS;
+
+    static int bucket(unsigned long long ns) {
+        if (ns < (unsigned long long)SUB_COUNT) {
+            return (int)ns;
+        }
+        int exp = 63 - __builtin_clzll(ns);
+        if (exp > MAX_EXP) {
+            return BUCKETS - 1;
+        }
+        int shift = exp - SUB_BITS;
+        return ((exp - SUB_BITS + 1) << SUB_BITS) + (int)((ns >> shift) & (SUB_COUNT - 1));
+    }
+    // Largest value counted in bucket idx
+    static unsigned long long upper(int idx);
+
+    void record(unsigned long long ns) {
+        int idx = bucket(ns);
+        // Single writer, relaxed stores keep the increments plain adds while scrapes read whole words
+        __atomic_store_n(&counts[idx], counts[idx] + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&sum, sum + ns, __ATOMIC_RELAXED);
+    }
+
+    unsigned long long counts[BUCKETS];
+    unsigned long long sum;
+};
+
+// Counters and histograms of one thread, aligned so two threads never write the same cache line
+struct alignas(64) metrics_shard {
+    unsigned long long counters[M_COUNTER_NUM];
+    latency_histogram histograms[H_HISTOGRAM_NUM];
+};
+
+// Collects per-thread shards and merges them into Prometheus text exposition format when scraped
+class metrics {
+public:
+    static metrics *get_instance() {
+        static metrics instance;
+        return &instance;
+    }
+
+    // Shard of the calling thread, created on first use
+    static metrics_shard *shard() {
+        if (!t_shard) {
+            t_shard = get_instance()->add_shard();
+        }
+        return t_shard;
+    }
+    static unsigned long long now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+    static void add(metric_counter c, unsigned long long n) {
+        metrics_shard *s = shard();
+        __atomic_store_n(&s->counters[c], s->counters[c] + n, __ATOMIC_RELAXED);
+    }
+    static void record(metric_histogram h, unsigned long long ns) {
+        shard()->histograms[h].record(ns);
+    }
+
+    // Value sampled at scrape time, e.g. queue depth or free database connections
+    void add_gauge(const char *name, const char *help, long (*read)(void *arg), void *arg);
+    // Sum of a counter over all threads
+    unsigned long long total(metric_counter c);
+    // Sum of the values recorded in a histogram over all threads
+    unsigned long long sum(metric_histogram h);
+    // Append all metrics in Prometheus text format
+    void render(string &out);
+
+private:
+    metrics() : m_mutex("metrics") { pthread_key_create(&m_exit_key, release_shard); }
+    // Shard of a thread that exited, or a new one. A reused shard keeps its counts, they are totals anyway.
+    metrics_shard *add_shard();
+    // Thread exit hook, hands the shard of the exiting thread to the next thread that needs one
+    static void release_shard(void *shard);
+
+    struct gauge {
+        const char *name;
+        const char *help;
+        long (*read)(void *arg);
+        void *arg;
+    };
+
+    static __thread metrics_shard *t_shard;
+    vector<metrics_shard *> m_shards;
+    // Shards of exited threads, still summed
+    vector<metrics_shard *> m_free;
+    pthread_key_t m_exit_key;
+    vector<gauge> m_gauges;
+    locker m_mutex;
+};
+
+#define METRICS_ADD(counter, n) metrics::add(counter, n)
+#define METRICS_RECORD(histogram, ns) metrics::record(histogram, ns)
+#define METRICS_NOW() metrics::now()
+
+#endif
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "multipart.h"
+
+// Copy the value of parameter key from a header value such as `form-data; name="a"; filename="b.txt"`, quoted
+// or not, into value. Parameters are the ones after the first ';', key is matched without case, so "name"
+// does not match "filename" and "filename*" is skipped.
+static bool headerParam(const char *header, const char *key, char *value, size_t size) {
+    size_t key_len = strlen(key);
+    const char *p = strchr(header, ';');
+    while (p && *p == ';') {
+        p++;
+        p += strspn(p, " \t");
+        size_t len = strcspn(p, "=; \t");
+        bool match = len == key_len && strncasecmp(p, key, key_len) == 0;
+        p += len;
+        p += strspn(p, " \t");
+        if (*p != '=') {
+            p = strchr(p, ';');
+            continue;
+        }
+        p++;
+        p += strspn(p, " \t");
+        size_t n = 0;
+        if (*p == '"') {
+            // Browsers send backslashes as they are and percent-encode quotes, RFC 7578 4.2
+            for (p++; *p && *p != '"'; p++) {
+                if (match && n + 1 < size) {
+                    value[n++] = *p;
+                }
+            }
+            if (*p == '"') {
+                p++;
+            }
+        } else {
+            for (; *p && *p != ';' && *p != ' ' && *p != '\t'; p++) {
+                if (match && n + 1 < size) {
+                    value[n++] = *p;
+                }
+            }
+        }
+        if (match) {
+            value[n] = '\0';
+            return n > 0;
+        }
+        p = strchr(p, ';');
+    }
+    return false;
+}
+
+bool multipart_scanner::init(const char *content_type) {
+    if (!content_type || strncasecmp(content_type, "multipart/form-data", 19) != 0) {
+        return false;
+    }
+    char boundary[MAX_BOUNDARY + 2];
+    if (!headerParam(content_type, "boundary", boundary, sizeof(boundary)) || strlen(boundary) > MAX_BOUNDARY) {
+        return false;
+    }
+    m_delimiter_len = snprintf(m_delimiter, sizeof(m_delimiter), "\r\n--%s", boundary);
+    m_state = PREAMBLE;
+    m_first = true;
+    return true;
+}
+
+void multipart_scanner::parseHeaders(const char *headers, size_t len) {
+    m_name[0] = '\0';
+    m_filename[0] = '\0';
+    const char *end = headers + len;
+    for (const char *line = headers; line < end;) {
+        const char *eol = (const char *)memmem(line, end - line, "\r\n", 2);
+        if (!eol) {
+            eol = end;
+        }
+        if (eol - line > 20 && strncasecmp(line, "Content-Disposition:", 20) == 0) {
+            char value[MAX_HEADERS + 1];
+            memcpy(value, line, eol - line);
+            value[eol - line] = '\0';
+            headerParam(value, "name", m_name, sizeof(m_name));
+            headerParam(value, "filename", m_filename, sizeof(m_filename));
+        }
+        line = eol + 2;
+    }
+}
+
+// Loops over the states that consume input without anything to report, each event returns
+multipart_scanner::event multipart_scanner::next(const char *in, size_t len, size_t *used, const char **data,
+                                                 size_t *data_len) {
+    const char *p = in;
+    const char *end = in + len;
+    while (true) {
+        size_t left = end - p;
+        *used = p - in;
+        switch (m_state) {
+            case PREAMBLE: {
+                // The body may open with the delimiter minus its CRLF
+                if (m_first) {
+                    size_t n = m_delimiter_len - 2;
+                    if (memcmp(p, m_delimiter + 2, left < n ? left : n) == 0) {
+                        if (left < n) {
+                            return NEED_MORE;
+                        }
+                        p += n;
+                        m_first = false;
+                        m_state = DELIMITER;
+                        continue;
+                    }
+                    m_first = false;
+                }
+                const char *found = (const char *)memmem(p, left, m_delimiter, m_delimiter_len);
+                if (!found) {
+                    // Preamble is skipped, all but what could start a delimiter
+                    if (left >= m_delimiter_len) {
+                        *used += left - (m_delimiter_len - 1);
+                    }
+                    return NEED_MORE;
+                }
+                p = found + m_delimiter_len;
+                m_state = DELIMITER;
+                continue;
+            }
+            case DELIMITER: {
+                if (left < 2) {
+                    return NEED_MORE;
+                }
+                if (p[0] == '-' && p[1] == '-') {
+                    *used += 2;
+                    m_state = EPILOGUE;
+                    return END;
+                }
+                // Transport padding, then the CRLF ending the delimiter line
+                size_t pad = 0;
+                while (pad < left && (p[pad] == ' ' || p[pad] == '\t')) {
+                    pad++;
+                }
+                if (pad > 64) {
+                    return MALFORMED;
+                }
+                if (left < pad + 2) {
+                    return NEED_MORE;
+                }
+                if (p[pad] != '\r' || p[pad + 1] != '\n') {
+                    return MALFORMED;
+                }
+                p += pad + 2;
+                m_state = HEADERS;
+                continue;
+            }
+            case HEADERS: {
+                if (left >= 2 && p[0] == '\r' && p[1] == '\n') {
+                    parseHeaders(p, 0);
+                    *used += 2;
+                    m_state = BODY;
+                    return PART;
+                }
+                const char *found = (const char *)memmem(p, left, "\r\n\r\n", 4);
+                if (!found) {
+                    return left >= MAX_HEADERS ? MALFORMED : NEED_MORE;
+                }
+                if ((size_t)(found - p) >= MAX_HEADERS) {
+                    return MALFORMED;
+                }
+                parseHeaders(p, found + 2 - p);
+                *used += found + 4 - p;
+                m_state = BODY;
+                return PART;
+            }
+            case BODY: {
+                const char *found = (const char *)memmem(p, left, m_delimiter, m_delimiter_len);
+                size_t safe;
+                if (found == p) {
+                    *used += m_delimiter_len;
+                    m_state = DELIMITER;
+                    return PART_END;
+                } else if (found) {
+                    safe = found - p;
+                } else {
+                    // Hold back a tail that could be the start of a delimiter cut off by the end of the piece
+                    safe = left >= m_delimiter_len ? left - (m_delimiter_len - 1) : 0;
+                    while (safe < left && (p[safe] != '\r' || memcmp(p + safe, m_delimiter, left - safe) != 0)) {
+                        safe++;
+                    }
+                }
+                if (safe == 0) {
+                    return NEED_MORE;
+                }
+                *data = p;
+                *data_len = safe;
+                *used += safe;
+                return DATA;
+            }
+            case EPILOGUE:
+                *used = len;
+                return NEED_MORE;
+        }
+        return MALFORMED;
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef MULTIPART_H
+#define MULTIPART_H
+
+#include <stddef.h>
+
+// Incremental scanner of a multipart/form-data body (RFC 7578) that sees the body in pieces of any size, as
+// they come off the pipe of an upload, and keeps no copy of it. next() returns one event at a time and
+// consumes what it covers. What it leaves unconsumed, a delimiter or part headers cut off by the end of the
+// piece, must be presented again in front of the next piece, and is never longer than MAX_CARRY. Part data is
+// returned in place.
+class multipart_scanner {
+public:
+    // Longest boundary RFC 2046 allows
+    static const size_t MAX_BOUNDARY = 70;
+    // Part headers longer than this make the body malformed
+    static const size_t MAX_HEADERS = 1024;
+    static const size_t MAX_CARRY = MAX_HEADERS;
+
+    enum event {
+        NEED_MORE,  // nothing more until the next piece of the body
+        PART,       // headers of a part read, name() and filename() describe it
+        DATA,       // data of the current part at *data, *data_len bytes
+        PART_END,   // the current part is over
+        END,        // the closing delimiter, the epilogue after it is skipped
+        MALFORMED
+    };
+
+    multipart_scanner() : m_delimiter_len(0), m_state(PREAMBLE), m_first(true) {
+        m_name[0] = '\0';
+        m_filename[0] = '\0';
+    }
+
+    // Take the boundary from the request's Content-Type, false unless it is multipart/form-data with one
+    bool init(const char *content_type);
+    // Scan the len bytes at in, *used of them are consumed
+    event next(const char *in, size_t len, size_t *used, const char **data, size_t *data_len);
+    // Form field name and file name of the current part, empty when absent
+    const char *name() const { return m_name; }
+    const char *filename() const { return m_filename; }
+    // True once the closing delimiter was seen
+    bool finished() const { return m_state == EPILOGUE; }
+
+private:
+    enum state {
+        PREAMBLE,   // before the first delimiter
+        DELIMITER,  // after a delimiter, "--" closes the body and CRLF starts a part
+        HEADERS,
+        BODY,
+        EPILOGUE
+    };
+
+    // Pick name and filename out of the Content-Disposition among len bytes of part headers
+    void parseHeaders(const char *headers, size_t len);
+
+private:
+    // "\r\n--" and the boundary, the first delimiter may lack the CRLF
+    char m_delimiter[4 + MAX_BOUNDARY + 1];
+    size_t m_delimiter_len;
+    state m_state;
+    bool m_first;
+    char m_name[128];
+    char m_filename[256];
+};
+
+#endif
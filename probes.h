@@ -0,0 +1,25 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+// USDT probe points of the "webserver" provider, for perf and bpftrace (bpftrace -l 'usdt:./server:*').
+// With <sys/sdt.h> (systemtap-sdt-dev) every probe is a single nop plus an ELF note describing where its
+// arguments live, so nothing is evaluated beyond values already in registers until a tracer attaches.
+// Without the header, or built with -DNO_PROBES, the probes compile away.
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+#define PROBE1(name, a) DTRACE_PROBE1(webserver, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(webserver, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(webserver, name, a, b, c)
+#else
+#define PROBE1(name, a) ((void)(a))
+#define PROBE2(name, a, b) ((void)(a), (void)(b))
+#define PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#endif
+
+#endif
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Fail when serving a static file still allocates once the server is warm. Run through `make alloc_check`,
+# which builds server_alloc with -DALLOC_STATS. Uses the embedded user store, so no database is needed.
+SERVER=$(realpath "${1:-./server_alloc}")
+RESOURCE=$(realpath "${2:-./resource}")
+PORT=${PORT:-9907}
+WARMUP=${WARMUP:-2000}
+REQUESTS=${REQUESTS:-2000}
+URL=http://127.0.0.1:$PORT
+
+dir=$(mktemp -d)
+cd "$dir" || exit 1
+"$SERVER" -l users.log -r "$RESOURCE" $PORT > /dev/null &
+pid=$!
+trap 'kill $pid 2> /dev/null; rm -rf "$dir"' EXIT
+sleep 1
+
+steady() {
+    curl -s $URL/debug/allocs | awk '/^steady_state_allocs/ { print $2 }'
+}
+fetch() {
+    # The fragment is not sent, it only makes curl repeat the request
+    curl -s -o /dev/null "$URL/home.html#[1-$1]" || exit 1
+}
+
+fetch $WARMUP
+before=$(steady)
+fetch $REQUESTS
+after=$(steady)
+if [ -z "$before" ] || [ -z "$after" ]; then
+    echo "alloc_check: no /debug/allocs, build the server with -DALLOC_STATS"
+    exit 1
+fi
+curl -s $URL/debug/allocs
+echo "alloc_check: $((after - before)) allocations over $REQUESTS static requests"
+[ "$after" -eq "$before" ]
@@ -0,0 +1,107 @@
+#!/bin/sh
+# Asset bundle checks and costs. The resource directory is packed with tools/pack_assets and served with -B
+# from a server whose doc_root does not exist, next to a server reading the directory. Every file must come
+# back from the bundle as it does from the directory, as it is and gzipped, and a path the bundle lacks must
+# fall back to doc_root. Then the pages of the demo site are loaded with bench/loadgen from the directory,
+# with and without the open file cache, and from the bundle, reporting requests per second, server CPU and
+# file system calls per request.
+# Uses the embedded user store, so no database is needed.
+SERVER=$(realpath "${1:-./server}")
+RESOURCE=$(realpath "${2:-./resource}")
+PACK=$(realpath "${3:-./tools/pack_assets}")
+LOADGEN=$(realpath "${LOADGEN:-./bench/loadgen}")
+PORT=${PORT:-9915}
+SECONDS_=${DURATION:-5}
+
+dir=$(mktemp -d)
+cd "$dir" || exit 1
+mkdir root
+cp "$RESOURCE"/* root/
+"$PACK" root resource.bundle || exit 1
+# Only on disk, served through the fallback
+echo "<p>not bundled</p>" > root/extra.html
+pids=
+trap 'kill $pids 2> /dev/null; rm -rf "$dir"' EXIT
+
+fail() {
+    echo "bundle_check: $1"
+    exit 1
+}
+
+"$SERVER" -l users.log -B resource.bundle -r "$dir/missing" $PORT > /dev/null &
+pids="$pids $!"
+"$SERVER" -l users2.log -r "$dir/root" $((PORT + 1)) > /dev/null &
+pids="$pids $!"
+sleep 1
+
+# fetch <port> <path> <Accept-Encoding> writes the decoded body to body.<port> and the headers to head.<port>
+fetch() {
+    curl -s -m 10 -D head.$1 -o raw.$1 -H "Accept-Encoding: $3" http://127.0.0.1:$1$2 || fail "request for $2 failed"
+    if tr -d '\r' < head.$1 | grep -qi "^Content-Encoding:gzip"; then
+        gzip -dc raw.$1 > body.$1
+    else
+        cp raw.$1 body.$1
+    fi
+}
+
+# The directory server gzips a file in the background after its first request
+for file in $(cd root && ls); do
+    fetch $((PORT + 1)) /$file gzip
+done
+sleep 1
+for file in $(cd root && ls); do
+    [ $file = extra.html ] && continue
+    for encoding in "" gzip; do
+        fetch $PORT /$file "$encoding"
+        fetch $((PORT + 1)) /$file "$encoding"
+        cmp -s body.$PORT root/$file || fail "bundled $file with '$encoding' differs from the file"
+        for name in Content-Type Content-Encoding Vary; do
+            [ "$(tr -d '\r' < head.$PORT | grep -i "^$name:")" = "$(tr -d '\r' < head.$((PORT + 1)) | grep -i "^$name:")" ] ||
+                fail "bundled $file with '$encoding' has another $name"
+        done
+    done
+done
+fetch $PORT /missing.html ""
+head -n 1 head.$PORT | grep -q " 404 " || fail "a path in neither gave $(head -n 1 head.$PORT)"
+kill $pids
+wait 2> /dev/null
+"$SERVER" -l users.log -B resource.bundle -r "$dir/root" $PORT > /dev/null &
+pids=$!
+sleep 1
+fetch $PORT /extra.html ""
+[ "$(cat body.$PORT)" = "<p>not bundled</p>" ] || fail "no fallback to doc_root"
+fetch $PORT /home.html ""
+ETAG=$(tr -d '\r' < head.$PORT | grep "^ETag:" | cut -d : -f 2)
+curl -s -m 10 -D head.$PORT -o /dev/null -H "If-None-Match: $ETAG" http://127.0.0.1:$PORT/home.html
+head -n 1 head.$PORT | grep -q " 304 " || fail "bundled ETag not revalidated"
+kill $pids
+wait 2> /dev/null
+
+# load <label> <server options>... prints the cost per request of the demo pages under load
+for page in home.html login.html register.html picture.html picture.jpg; do
+    echo "1 GET /$page Accept-Encoding:gzip" >> pages.scenario
+done
+load() {
+    label=$1
+    shift
+    "$SERVER" -l users.log "$@" $PORT > /dev/null &
+    pids=$!
+    sleep 1
+    before=$(awk '{ print $14 + $15 }' /proc/$pids/stat)
+    files_before=$(curl -s -m 10 http://127.0.0.1:$PORT/metrics | awk '$1 == "webserver_file_syscalls_total" { print $2 }')
+    "$LOADGEN" -c 4 -w 0 -d $SECONDS_ -f pages.scenario $PORT > load.out 2>&1
+    files_after=$(curl -s -m 10 http://127.0.0.1:$PORT/metrics | awk '$1 == "webserver_file_syscalls_total" { print $2 }')
+    after=$(awk '{ print $14 + $15 }' /proc/$pids/stat)
+    kill $pids
+    wait 2> /dev/null
+    grep -q "2xx [1-9][0-9]*, 3xx 0, 4xx 0, 5xx 0, other 0, errors 0" load.out || fail "$label load failed"
+    awk -v label="$label" -v ticks=$((after - before)) -v hz=$(getconf CLK_TCK) -v files=$((files_after - files_before)) '
+        / requests in / { n = $1; rate = $5 }
+        END { printf "  %-22s %8.1f req/s %8.1f us cpu/req %6.2f file syscalls/req\n", label, rate, ticks * 1e6 / hz / n, files / n }
+    ' load.out
+}
+echo "demo pages with gzip, loadgen -c 4 -d $SECONDS_:"
+load "doc_root, -F off" -r "$dir/root" -F off
+load "doc_root, file cache" -r "$dir/root"
+load "bundle" -B resource.bundle -r "$dir/missing"
+echo "bundle_check: all cases passed"
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Churn connections while a keep-alive client checks its responses: one loadgen resets half of its connections
+# right after sending, so the server closes them with requests in flight and reuses their fds at once, another
+# opens a connection per request. Fails when the keep-alive client sees an error or a response it did not
+# expect, or when the server stops answering. Uses the embedded user store, so no database is needed.
+SERVER=$(realpath "${1:-./server}")
+RESOURCE=$(realpath "${2:-./resource}")
+LOADGEN=$(realpath "${LOADGEN:-./bench/loadgen}")
+PORT=${PORT:-9909}
+SECONDS_=${DURATION:-10}
+URL=http://127.0.0.1:$PORT
+
+dir=$(mktemp -d)
+cd "$dir" || exit 1
+"$SERVER" -l users.log -r "$RESOURCE" $PORT > /dev/null &
+pid=$!
+trap 'kill $pid 2> /dev/null; rm -rf "$dir"' EXIT
+sleep 1
+
+"$LOADGEN" -t 4 -c 4 -w 0 -d $SECONDS_ -A 50 $PORT > abandon.out 2>&1 &
+abandon=$!
+"$LOADGEN" -t 2 -c 2 -w 0 -d $SECONDS_ -C $PORT > close.out 2>&1 &
+close=$!
+"$LOADGEN" -c 8 -w 0 -d $SECONDS_ $PORT > keepalive.out 2>&1
+wait $abandon $close
+
+grep -h "requests" abandon.out close.out keepalive.out
+curl -s -m 5 $URL/metrics | grep -E "^webserver_(stale|accepts|connections)"
+if ! kill -0 $pid 2> /dev/null || ! curl -s -m 5 -o /dev/null $URL/; then
+    echo "churn_check: server stopped answering"
+    exit 1
+fi
+# Every keep-alive request must come back 2xx, on its own connection
+grep -q "3xx 0, 4xx 0, 5xx 0, other 0, errors 0, reconnects 0" keepalive.out
@@ -0,0 +1,114 @@
+#!/bin/sh
+# Conditional GET cases with curl against a copy of the resource directory: ETag and Last-Modified on 200s,
+# If-None-Match lists, weak and "*" matches, If-Modified-Since dates, If-None-Match taking precedence, If-Range
+# with an ETag, and new validators once a file changes, and with the file cache off (-F off) a 304 that does not
+# map the file while a mismatch still gets the body. Then compares a browser reloading the demo site with and
+# without its cached validators. Fails at the first case that does not match.
+# Uses the embedded user store, so no database is needed.
+SERVER=$(realpath "${1:-./server}")
+RESOURCE=$(realpath "${2:-./resource}")
+LOADGEN=$(realpath "${LOADGEN:-./bench/loadgen}")
+PORT=${PORT:-9912}
+URL=http://127.0.0.1:$PORT/home.html
+
+dir=$(mktemp -d)
+cd "$dir" || exit 1
+mkdir root
+cp "$RESOURCE"/home.html "$RESOURCE"/picture.html "$RESOURCE"/picture.jpg root/
+"$SERVER" -l users.log -r "$dir/root" $PORT > /dev/null &
+pid=$!
+trap 'kill $pid 2> /dev/null; rm -rf "$dir"' EXIT
+sleep 1
+
+fail() {
+    echo "conditional_check: $1"
+    tr -d '\r' < head.out
+    exit 1
+}
+
+# get <expected status> <curl options>... fetches home.html into head.out and body.out
+get() {
+    want=$1
+    shift
+    rm -f body.out
+    curl -s -m 10 -D head.out -o body.out "$@" $URL || fail "request failed: $*"
+    status=$(head -n 1 head.out | cut -d ' ' -f 2)
+    [ "$status" = "$want" ] || fail "status $status, expected $want: $*"
+    if [ "$want" = 304 ] && [ -s body.out ]; then
+        fail "304 with a body: $*"
+    fi
+}
+
+# header <name> prints the value of a response header
+header() {
+    tr -d '\r' < head.out | grep -i "^$1:" | cut -d : -f 2- | sed 's/^ *//'
+}
+
+get 200
+ETAG=$(header ETag)
+LAST_MODIFIED=$(header Last-Modified)
+[ -n "$ETAG" ] && [ -n "$LAST_MODIFIED" ] || fail "no validators"
+[ "$(header Cache-Control)" = "no-cache" ] || fail "no Cache-Control"
+
+get 304 -H "If-None-Match: $ETAG"
+[ "$(header ETag)" = "$ETAG" ] || fail "304 without the ETag"
+get 304 -H "If-None-Match: W/$ETAG"
+get 304 -H "If-None-Match: \"other\", $ETAG"
+get 304 -H "If-None-Match: *"
+get 200 -H "If-None-Match: \"other\""
+get 304 -H "If-Modified-Since: $LAST_MODIFIED"
+get 200 -H "If-Modified-Since: Mon, 01 Jan 2001 00:00:00 GMT"
+get 200 -H "If-Modified-Since: Fri, 01 Jan 2100 00:00:00 GMT"
+get 200 -H "If-Modified-Since: yesterday"
+# If-None-Match decides alone when both are sent
+get 200 -H "If-None-Match: \"other\"" -H "If-Modified-Since: $LAST_MODIFIED"
+# If-Range needs the exact strong ETag
+get 206 -H "Range: bytes=0-9" -H "If-Range: $ETAG"
+get 200 -H "Range: bytes=0-9" -H "If-Range: W/$ETAG"
+# A POST is never answered 304
+curl -s -m 10 -D head.out -o body.out -X POST -d "x=1" -H "If-None-Match: *" http://127.0.0.1:$PORT/0
+head -n 1 head.out | grep -q " 304 " && fail "304 for a POST"
+
+# A changed file gets new validators and the old ETag no longer matches
+sleep 1
+echo "<!-- changed -->" >> root/home.html
+get 200 -H "If-None-Match: $ETAG"
+[ "$(header ETag)" != "$ETAG" ] || fail "ETag unchanged after an edit"
+get 304 -H "If-None-Match: $(header ETag)"
+cp "$RESOURCE"/home.html root/home.html
+
+# With -F off a revalidation opens the file with O_PATH for its stat and neither maps nor unmaps it: open,
+# fstat and close, where a full response also makes the mmap and munmap
+kill $pid
+wait $pid 2> /dev/null
+"$SERVER" -l users.log -r "$dir/root" -F off $PORT > /dev/null &
+pid=$!
+sleep 1
+get 200
+ETAG=$(header ETag)
+syscalls() {
+    curl -s -m 10 http://127.0.0.1:$PORT/metrics | awk '$1 == "webserver_file_syscalls_total" { print $2 }'
+}
+before=$(syscalls)
+get 304 -H "If-None-Match: $ETAG"
+[ $(($(syscalls) - before)) = 3 ] || fail "-F off: a 304 made $(($(syscalls) - before)) file system calls, not 3"
+get 200 -H "If-None-Match: \"other\""
+cmp -s body.out root/home.html || fail "-F off: a mismatched revalidation did not send the file"
+kill $pid
+wait $pid 2> /dev/null
+"$SERVER" -l users.log -r "$dir/root" $PORT > /dev/null &
+pid=$!
+sleep 1
+
+# A browser reloading the demo site, first without validators, then revalidating its cached copies
+for page in home.html picture.html picture.jpg; do
+    curl -s -m 10 -D head.out -o /dev/null http://127.0.0.1:$PORT/$page
+    echo "1 GET /$page If-None-Match:$(header ETag)" >> revalidate.scenario
+    echo "1 GET /$page" >> fetch.scenario
+done
+"$LOADGEN" -c 8 -w 1 -d 5 -f fetch.scenario $PORT > fetch.out 2>&1
+"$LOADGEN" -c 8 -w 1 -d 5 -f revalidate.scenario $PORT > revalidate.out 2>&1
+echo "full responses:"; grep -A 1 "requests in" fetch.out
+echo "revalidations:";  grep -A 1 "requests in" revalidate.out
+grep -q "2xx 0, 3xx [1-9][0-9]*, 4xx 0, 5xx 0, other 0, errors 0" revalidate.out || fail "revalidations were not all 304"
+echo "conditional_check: all cases passed"
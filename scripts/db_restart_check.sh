@@ -0,0 +1,79 @@
+#!/bin/sh
+# Restart MySQL under a login load: loadgen logs in for SECONDS_ seconds and RESTART runs halfway through,
+# while the free connections of the pool and its acquire timeouts are printed once a second. The server runs
+# with SERVER_OPTIONS, -a by default, which sends a SELECT per login, since logins are otherwise answered from
+# the users cached in memory and never touch the database. Fails when the server stops answering, drops a
+# connection instead of answering while the database is away, or RECOVER seconds after the restart still
+# cannot log in or register a new user, which is an INSERT on either path. Needs the MySQL setup of main.cpp
+# and a user allowed to run RESTART, so it is not part of the checks that run without a database.
+SERVER=$(realpath "${1:-./server}")
+RESOURCE=$(realpath "${2:-./resource}")
+LOADGEN=$(realpath "${LOADGEN:-./bench/loadgen}")
+PORT=${PORT:-9917}
+SECONDS_=${DURATION:-20}
+RECOVER=${RECOVER:-10}
+RESTART=${RESTART:-"systemctl restart mysql"}
+SERVER_OPTIONS=${SERVER_OPTIONS:--a}
+URL=http://127.0.0.1:$PORT
+
+dir=$(mktemp -d)
+cd "$dir" || exit 1
+pid=
+trap 'kill $pid 2> /dev/null; rm -rf "$dir"' EXIT
+
+fail() {
+    echo "db_restart_check: $1"
+    exit 1
+}
+
+gauge() {
+    curl -s -m 5 $URL/metrics | awk -v name=$1 '$1 == name { print $2 }'
+}
+
+# title <path> <form> prints the title of the page a post answers with
+title() {
+    curl -s -m 10 -d "$2" $URL$1 | sed -n 's/.*<title>\(.*\)<\/title>.*/\1/p'
+}
+
+# login prints Picture when the login went through
+login() {
+    title /2 "user=restart&password=restart"
+}
+
+# register prints Login when a user with a name not taken yet was stored
+register() {
+    title /3 "user=restart$$_$1&password=restart"
+}
+
+"$SERVER" $SERVER_OPTIONS -r "$RESOURCE" $PORT > /dev/null &
+pid=$!
+sleep 1
+# Registering an existing name fails, which is fine on a second run
+curl -s -m 10 -o /dev/null -d "user=restart&password=restart" $URL/3
+[ "$(login)" = Picture ] || fail "cannot log in before the restart, is MySQL set up as main.cpp expects?"
+[ "$(register before)" = Login ] || fail "cannot register before the restart"
+
+printf '1 POST /2 user=restart&password=restart\n' > login.scenario
+"$LOADGEN" -c 16 -w 0 -d $SECONDS_ -f login.scenario $PORT > load.out 2>&1 &
+load=$!
+echo "second free_connections acquire_timeouts"
+t=0
+while [ $t -lt $SECONDS_ ]; do
+    [ $t = $((SECONDS_ / 2)) ] && { echo "restarting: $RESTART"; $RESTART || fail "$RESTART failed"; }
+    sleep 1
+    t=$((t + 1))
+    echo "$t $(gauge webserver_db_free_connections) $(gauge webserver_db_acquire_timeouts_total)"
+done
+wait $load
+grep -h "requests\|errors" load.out
+
+kill -0 $pid 2> /dev/null || fail "the server died"
+# Logins may fail while the database is away, but each must be answered
+grep -q "errors 0," load.out || fail "connections were dropped instead of answered"
+t=0
+until [ "$(login)" = Picture ] && [ "$(register after$t)" = Login ]; do
+    t=$((t + 1))
+    [ $t -le $RECOVER ] || fail "queries still fail $RECOVER seconds after the restart"
+    sleep 1
+done
+echo "db_restart_check: logins and registrations went through again"
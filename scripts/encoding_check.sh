@@ -0,0 +1,98 @@
+#!/bin/sh
+# Content-Encoding checks and costs. A copy of the resource directory gets .gz and, when the zstd tool is
+# installed, .zst siblings for page.html and report.pdf, while home.html and ProjectReport.pdf have none and are
+# compressed in the background. Every variant must decode to the original and carry Vary, then each is loaded
+# with bench/loadgen and reported as bytes on the wire and server CPU per request.
+# Uses the embedded user store, so no database is needed.
+SERVER=$(realpath "${1:-./server}")
+RESOURCE=$(realpath "${2:-./resource}")
+LOADGEN=$(realpath "${LOADGEN:-./bench/loadgen}")
+PORT=${PORT:-9913}
+SECONDS_=${DURATION:-5}
+
+dir=$(mktemp -d)
+cd "$dir" || exit 1
+mkdir root
+cp "$RESOURCE"/home.html "$RESOURCE"/ProjectReport.pdf root/
+cp root/home.html root/page.html
+cp root/ProjectReport.pdf root/report.pdf
+gzip -9 -k root/page.html root/report.pdf
+zstd=false
+if command -v zstd > /dev/null; then
+    zstd -q -19 -k root/page.html root/report.pdf && zstd=true
+fi
+"$SERVER" -l users.log -r "$dir/root" $PORT > /dev/null &
+pid=$!
+trap 'kill $pid 2> /dev/null; rm -rf "$dir"' EXIT
+sleep 1
+
+fail() {
+    echo "encoding_check: $1"
+    tr -d '\r' < head.out
+    exit 1
+}
+
+# fetch <path> <Accept-Encoding> <expected Content-Encoding or identity>
+fetch() {
+    curl -s -m 10 -D head.out -o body.out -H "Accept-Encoding: $2" http://127.0.0.1:$PORT$1 || fail "request failed"
+    encoding=$(tr -d '\r' < head.out | grep -i "^Content-Encoding:" | cut -d : -f 2 | tr -d ' ')
+    [ "${encoding:-identity}" = "$3" ] || fail "$1 with $2 came as ${encoding:-identity}, expected $3"
+    tr -d '\r' < head.out | grep -qi "^Vary:Accept-Encoding" || fail "$1 without Vary"
+    case $3 in
+    gzip) gzip -dc body.out > plain.out ;;
+    zstd) zstd -q -dc body.out > plain.out ;;
+    *) cp body.out plain.out ;;
+    esac
+    cmp -s plain.out root/$(basename $1 | sed 's/^page/home/; s/^report/ProjectReport/') || fail "$1 as $3 does not decode"
+}
+
+# The first request for a file without a sibling queues it for compression and goes out as it is
+fetch /home.html gzip identity
+fetch /ProjectReport.pdf gzip identity
+sleep 1
+for file in /home.html /ProjectReport.pdf /page.html /report.pdf; do
+    fetch $file "" identity
+    fetch $file identity identity
+    fetch $file "gzip" gzip
+    fetch $file "gzip;q=0" identity
+    fetch $file "*" $([ $zstd = true ] && [ $file = /page.html -o $file = /report.pdf ] && echo zstd || echo gzip)
+    fetch $file "*, gzip;q=0" $([ $zstd = true ] && [ $file = /page.html -o $file = /report.pdf ] && echo zstd || echo identity)
+done
+if [ $zstd = true ]; then
+    fetch /page.html "gzip, zstd" zstd
+    fetch /report.pdf "zstd;q=0.5, gzip" zstd
+fi
+# Types not worth compressing never vary
+curl -s -m 10 -D head.out -o /dev/null -H "Accept-Encoding: gzip" http://127.0.0.1:$PORT/metrics
+tr -d '\r' < head.out | grep -qi "^Content-Encoding" && fail "metrics endpoint encoded"
+
+# cost <label> <path> <Accept-Encoding> prints bytes and server CPU per request under load
+cpu_ticks() {
+    awk '{ print $14 + $15 }' /proc/$pid/stat
+}
+cost() {
+    if [ -n "$3" ]; then
+        echo "1 GET $2 Accept-Encoding:$3" > cost.scenario
+    else
+        echo "1 GET $2" > cost.scenario
+    fi
+    before=$(cpu_ticks)
+    "$LOADGEN" -c 4 -w 0 -d $SECONDS_ -f cost.scenario $PORT > cost.out 2>&1
+    after=$(cpu_ticks)
+    awk -v label="$1" -v ticks=$((after - before)) -v hz=$(getconf CLK_TCK) '
+        / requests in / { n = $1; mb = $(NF - 1) * $4 }
+        END { printf "  %-28s %10.0f bytes/req %8.1f us cpu/req\n", label, mb * 1e6 / n, ticks * 1e6 / hz / n }
+    ' cost.out
+}
+echo "per request, loadgen -c 4 -d $SECONDS_:"
+for file in home ProjectReport; do
+    sibling=$([ $file = home ] && echo page.html || echo report.pdf)
+    ext=$([ $file = home ] && echo html || echo pdf)
+    cost "$file.$ext identity" /$file.$ext ""
+    cost "$file.$ext gzip cached" /$file.$ext gzip
+    cost "$file.$ext gzip sibling" /$sibling gzip
+    if [ $zstd = true ]; then
+        cost "$file.$ext zstd sibling" /$sibling zstd
+    fi
+done
+echo "encoding_check: all cases passed"
@@ -0,0 +1,83 @@
+#!/bin/sh
+# Open file cache checks and costs. In each -F mode, a file replaced or rewritten under a running server must
+# be served new, a path that was missing must be served once it is created, and neither ".." nor a symbolic
+# link may lead out of the root while a link inside it is followed. Then ProjectReport.pdf is
+# downloaded over and over with bench/loadgen and the file system calls per request are reported from
+# webserver_file_syscalls_total, with the write calls per request from /proc/<pid>/io.
+# Uses the embedded user store, so no database is needed.
+SERVER=$(realpath "${1:-./server}")
+RESOURCE=$(realpath "${2:-./resource}")
+LOADGEN=$(realpath "${LOADGEN:-./bench/loadgen}")
+PORT=${PORT:-9914}
+SECONDS_=${DURATION:-5}
+
+dir=$(mktemp -d)
+cd "$dir" || exit 1
+mkdir root
+cp "$RESOURCE"/home.html "$RESOURCE"/ProjectReport.pdf root/
+echo secret > secret.txt
+ln -s "$dir/secret.txt" root/out.txt
+ln -s home.html root/in.html
+pid=
+trap 'kill $pid 2> /dev/null; rm -rf "$dir"' EXIT
+
+fail() {
+    echo "file_cache_check: $1"
+    exit 1
+}
+
+# counter <name> prints a metric of the running server
+counter() {
+    curl -s -m 10 http://127.0.0.1:$PORT/metrics | awk -v name=$1 '$1 == name { print $2 }'
+}
+
+# body <path> prints the body the running server sends for path
+body() {
+    curl -s -m 10 http://127.0.0.1:$PORT$1
+}
+
+echo "1 GET /ProjectReport.pdf" > pdf.scenario
+echo "ProjectReport.pdf per request, loadgen -c 4 -d $SECONDS_:"
+for mode in inotify 1000 off; do
+    "$SERVER" -l users.log -r "$dir/root" -F $mode $PORT > /dev/null &
+    pid=$!
+    sleep 1
+    # TTL mode notices changes once its period passed
+    settle() {
+        [ $mode = 1000 ] && sleep 1.1
+        [ $mode = inotify ] && sleep 0.1
+    }
+    body /home.html > /dev/null
+    echo "<p>replaced</p>" > root/new.html
+    mv root/new.html root/home.html
+    settle
+    [ "$(body /home.html)" = "<p>replaced</p>" ] || fail "-F $mode served home.html from before a rename"
+    echo "<p>rewritten</p>" > root/home.html
+    settle
+    [ "$(body /home.html)" = "<p>rewritten</p>" ] || fail "-F $mode served home.html from before a rewrite"
+    body /later.html > /dev/null
+    echo "<p>later</p>" > root/later.html
+    settle
+    [ "$(body /later.html)" = "<p>later</p>" ] || fail "-F $mode still misses a created file"
+    rm root/later.html
+    [ "$(curl -s -m 10 -o /dev/null -w '%{http_code}' --path-as-is http://127.0.0.1:$PORT/../secret.txt)" = 404 ] ||
+        fail "-F $mode served a path above the root"
+    [ "$(curl -s -m 10 -o /dev/null -w '%{http_code}' http://127.0.0.1:$PORT/out.txt)" = 404 ] ||
+        fail "-F $mode followed a link out of the root"
+    [ "$(body /in.html)" = "$(body /home.html)" ] || fail "-F $mode did not follow a link inside the root"
+    cp "$RESOURCE"/home.html root/home.html
+
+    before=$(counter webserver_file_syscalls_total)
+    io_before=$(awk '/^syscw/ { print $2 }' /proc/$pid/io)
+    "$LOADGEN" -c 4 -w 0 -d $SECONDS_ -f pdf.scenario $PORT > load.out 2>&1
+    io_after=$(awk '/^syscw/ { print $2 }' /proc/$pid/io)
+    after=$(counter webserver_file_syscalls_total)
+    awk -v mode=$mode -v files=$((after - before)) -v io=$((io_after - io_before)) '
+        / requests in / { n = $1; rate = $5 }
+        END { printf "  -F %-8s %8.1f req/s %6.2f file syscalls/req %6.1f write calls/req\n", mode, rate, files / n, io / n }
+    ' load.out
+    grep -q "2xx [1-9][0-9]*, 3xx 0, 4xx 0, 5xx 0, other 0, errors 0" load.out || fail "-F $mode downloads failed"
+    kill $pid
+    wait $pid 2> /dev/null
+done
+echo "file_cache_check: all cases passed"
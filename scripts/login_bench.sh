@@ -0,0 +1,56 @@
+#!/bin/sh
+# Compare logins across the user store backends of BACKENDS: the embedded store (-l), and MySQL through the
+# blocking and the async (-a) SQL paths. For each, starts the server, registers the user of
+# bench/login.scenario and drives it with bench/loadgen for SECONDS_ seconds, at RATE requests/s when set,
+# printing req/s and the latency percentiles. The paths do not do the same work: store and blocking check the
+# password against users cached in memory and send no query, async sends a SELECT per login on the
+# non-blocking API. So blocking against async is the cost of a database round trip per login that keeps no
+# worker waiting, not of blocking against non-blocking queries. The MySQL backends need the setup of main.cpp,
+# so the script does not run with the database-free checks; BACKENDS=store runs without one. WORKERS small next
+# to CONNECTIONS shows the async path keeping workers free while queries are in flight.
+SERVER=$(realpath "${1:-./server}")
+RESOURCE=$(realpath "${2:-./resource}")
+LOADGEN=$(realpath "${LOADGEN:-./bench/loadgen}")
+SCENARIO=$(realpath "${SCENARIO:-./bench/login.scenario}")
+PORT=${PORT:-9918}
+SECONDS_=${DURATION:-10}
+CONNECTIONS=${CONNECTIONS:-64}
+WORKERS=${WORKERS:-2-8}
+RATE=${RATE:-}
+BACKENDS=${BACKENDS:-"store blocking async"}
+URL=http://127.0.0.1:$PORT
+
+dir=$(mktemp -d)
+cd "$dir" || exit 1
+pid=
+trap 'kill $pid 2> /dev/null; rm -rf "$dir"' EXIT
+
+# run <label> <server options>... prints the load results of one backend
+run() {
+    label=$1
+    shift
+    "$SERVER" "$@" -P $WORKERS -r "$RESOURCE" $PORT > /dev/null &
+    pid=$!
+    sleep 1
+    # Registering an existing name fails, which is fine
+    curl -s -m 10 -o /dev/null -d "user=bench&password=bench" $URL/3
+    if ! curl -s -m 10 -d "user=bench&password=bench" $URL/2 | grep -q "<title>Picture</title>"; then
+        echo "$label: cannot log in, is the database set up as main.cpp expects?"
+    else
+        echo "$label:"
+        "$LOADGEN" -c $CONNECTIONS -d $SECONDS_ ${RATE:+-r $RATE} -f "$SCENARIO" $PORT 2>&1 |
+            grep -A 1 "requests in\|status\|^Latency" | grep -v "^--"
+    fi
+    kill $pid
+    wait $pid 2> /dev/null
+    pid=
+}
+
+for backend in $BACKENDS; do
+    case $backend in
+    store) run "store, logins from memory" -l users.log ;;
+    blocking) run "blocking, logins from the cache of the user table" ;;
+    async) run "async, a SELECT per login" -a ;;
+    *) echo "unknown backend $backend" ;;
+    esac
+done
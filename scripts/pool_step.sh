@@ -0,0 +1,44 @@
+#!/bin/sh
+# Show the thread pool converging under step changes in load: drives the server with bench/loadgen at each
+# rate of RATES for STEP seconds and prints the worker count and queue depth once a second. Uses the embedded
+# user store, so workers never block on a database; point SERVER_ARGS at a MySQL setup to see it cover
+# blocked workers too.
+SERVER=$(realpath "${1:-./server}")
+RESOURCE=$(realpath "${2:-./resource}")
+LOADGEN=$(realpath "${LOADGEN:-./bench/loadgen}")
+PORT=${PORT:-9908}
+RATES=${RATES:-"0 2000 20000 2000 0"}
+STEP=${STEP:-10}
+POOL=${POOL:-2-32}
+SERVER_ARGS=${SERVER_ARGS:-"-l users.log"}
+URL=http://127.0.0.1:$PORT
+
+dir=$(mktemp -d)
+cd "$dir" || exit 1
+"$SERVER" $SERVER_ARGS -P $POOL -r "$RESOURCE" $PORT > /dev/null &
+pid=$!
+trap 'kill $pid 2> /dev/null; rm -rf "$dir"' EXIT
+sleep 1
+
+gauge() {
+    curl -s $URL/metrics | awk -v name=$1 '$1 == name { print $2 }'
+}
+
+echo "second rate workers queued"
+t=0
+for rate in $RATES; do
+    load=
+    if [ "$rate" -gt 0 ]; then
+        "$LOADGEN" -c 64 -d $STEP -r $rate $PORT > /dev/null 2>&1 &
+        load=$!
+    fi
+    i=0
+    while [ $i -lt $STEP ]; do
+        sleep 1
+        i=$((i + 1))
+        t=$((t + 1))
+        echo "$t $rate $(gauge webserver_worker_threads) $(gauge webserver_queue_depth)"
+    done
+    [ -n "$load" ] && wait $load
+done
+echo "resizes: $(gauge webserver_worker_pool_resizes_total)"
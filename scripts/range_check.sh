@@ -0,0 +1,118 @@
+#!/bin/sh
+# Byte-range edge cases against the PDF in the resource directory: single, suffix, open-ended and clamped ranges,
+# unsatisfiable and malformed ones, merged multipart ranges, If-Range, too many ranges, keep-alive reuse and a
+# large range written in many pieces to a slow reader. Fails at the first case that does not match.
+# Uses the embedded user store, so no database is needed.
+SERVER=$(realpath "${1:-./server}")
+RESOURCE=$(realpath "${2:-./resource}")
+PORT=${PORT:-9911}
+FILE=$RESOURCE/ProjectReport.pdf
+URL=http://127.0.0.1:$PORT/ProjectReport.pdf
+SIZE=$(wc -c < "$FILE")
+
+dir=$(mktemp -d)
+cd "$dir" || exit 1
+"$SERVER" -l users.log -r "$RESOURCE" $PORT > /dev/null &
+pid=$!
+trap 'kill $pid 2> /dev/null; rm -rf "$dir"' EXIT
+sleep 1
+
+fail() {
+    echo "range_check: $1"
+    tr -d '\r' < head.out
+    exit 1
+}
+
+# get <expected status> <curl options>... fetches the PDF into head.out and body.out
+get() {
+    want=$1
+    shift
+    curl -s -m 10 -D head.out -o body.out "$@" $URL || fail "request failed: $*"
+    status=$(head -n 1 head.out | cut -d ' ' -f 2)
+    [ "$status" = "$want" ] || fail "status $status, expected $want: $*"
+}
+
+# header <name> prints the value of a response header
+header() {
+    tr -d '\r' < head.out | grep -i "^$1:" | cut -d : -f 2- | sed 's/^ *//'
+}
+
+# slice <first> <count> prints count bytes of the file from first
+slice() {
+    tail -c +$(($1 + 1)) "$FILE" | head -c $2
+}
+
+same() {
+    slice $1 $2 > want.out
+    cmp -s want.out body.out || fail "body is not bytes $1+$2"
+}
+
+get 200
+[ "$(header Accept-Ranges)" = "bytes" ] || fail "no Accept-Ranges"
+LAST_MODIFIED=$(header Last-Modified)
+
+get 206 -H "Range: bytes=0-99"
+[ "$(header Content-Range)" = "bytes 0-99/$SIZE" ] || fail "single range"
+same 0 100
+
+get 206 -H "Range: bytes=-100"
+[ "$(header Content-Range)" = "bytes $((SIZE - 100))-$((SIZE - 1))/$SIZE" ] || fail "suffix range"
+same $((SIZE - 100)) 100
+
+get 206 -H "Range: bytes=$((SIZE - 10))-"
+same $((SIZE - 10)) 10
+
+get 206 -H "Range: bytes=$((SIZE - 10))-$((SIZE * 2))"
+[ "$(header Content-Range)" = "bytes $((SIZE - 10))-$((SIZE - 1))/$SIZE" ] || fail "range past the end"
+
+get 206 -H "Range: bytes=-$((SIZE * 2))"
+[ "$(wc -c < body.out)" -eq "$SIZE" ] || fail "suffix longer than the file"
+
+get 416 -H "Range: bytes=$SIZE-"
+[ "$(header Content-Range)" = "bytes */$SIZE" ] || fail "unsatisfiable range"
+get 416 -H "Range: bytes=-0"
+get 416 -H "Range: bytes=99999999999999999999999-"
+
+# Malformed headers are ignored
+for range in "bytes=5-1" "items=0-1" "bytes=" "bytes=a-b" "bytes=0-1;2-3"; do
+    get 200 -H "Range: $range"
+    [ "$(wc -c < body.out)" -eq "$SIZE" ] || fail "ignored range $range"
+done
+
+# Overlapping ranges are merged, the rest come as multipart/byteranges
+get 206 -H "Range: bytes=0-9,20-29,5-14"
+header Content-Type | grep -q "^multipart/byteranges; boundary=" || fail "multipart type"
+[ "$(grep -c "^Content-Range: bytes" body.out)" -eq 2 ] || fail "merged parts"
+grep -q "^Content-Range: bytes 0-14/$SIZE" body.out && grep -q "^Content-Range: bytes 20-29/$SIZE" body.out ||
+    fail "multipart ranges"
+[ "$(wc -c < body.out)" -eq "$(header Content-Length)" ] || fail "multipart length"
+
+# More than 16 ranges get the whole file
+many=0-0
+for i in $(seq 1 16); do
+    many=$many,$((i * 100))-$((i * 100))
+done
+get 200 -H "Range: bytes=$many"
+
+# If-Range honours the range only for the current Last-Modified
+get 206 -H "Range: bytes=0-9" -H "If-Range: $LAST_MODIFIED"
+get 200 -H "Range: bytes=0-9" -H "If-Range: Mon, 01 Jan 2001 00:00:00 GMT"
+get 200 -H "Range: bytes=0-9" -H "If-Range: \"some-etag\""
+
+# Endpoints ignore Range
+curl -s -m 10 -D head.out -o body.out -H "Range: bytes=0-9" http://127.0.0.1:$PORT/metrics
+head -n 1 head.out | grep -q " 200 " || fail "range on an endpoint"
+
+# Two ranges on one keep-alive connection
+curl -s -m 10 -H "Connection: keep-alive" -H "Range: bytes=100-199" $URL $URL > body.out || fail "keep-alive ranges"
+slice 100 100 > want.out
+cat want.out want.out > want2.out
+cmp -s want2.out body.out || fail "keep-alive ranges"
+
+# Large slices to a slow reader fill the socket buffer and are written in many pieces
+get 206 --limit-rate 4M -H "Range: bytes=1-$((SIZE - 2))"
+same 1 $((SIZE - 2))
+get 206 --limit-rate 4M -H "Range: bytes=0-999999,1500000-"
+[ "$(wc -c < body.out)" -eq "$(header Content-Length)" ] || fail "large multipart length"
+
+echo "range_check: all cases passed"
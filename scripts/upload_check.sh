@@ -0,0 +1,110 @@
+#!/bin/sh
+# Upload checks and costs. PUT and multipart/form-data POST bodies must come out byte for byte in the upload
+# directory, a replaced file must answer 200 instead of 201, bad names, bodies over -M, chunked bodies and bodies
+# without a Content-Length must be refused, and a client that goes away mid-body must leave neither a file nor a
+# descriptor behind. Then CLIENTS clients upload SIZE_MB each at once, as PUTs and as forms, reporting MB/s,
+# server CPU per MB and the peak resident size of the server against its size before, which must not grow with
+# the bytes in flight.
+# Uses the embedded user store, so no database is needed.
+SERVER=$(realpath "${1:-./server}")
+RESOURCE=$(realpath "${2:-./resource}")
+PORT=${PORT:-9916}
+CLIENTS=${CLIENTS:-4}
+SIZE_MB=${SIZE_MB:-256}
+
+dir=$(mktemp -d)
+cd "$dir" || exit 1
+mkdir up
+pid=
+trap 'kill $pid 2> /dev/null; rm -rf "$dir"' EXIT
+
+fail() {
+    echo "upload_check: $1"
+    exit 1
+}
+
+# status <curl options>... prints the status of the response
+status() {
+    curl -s -m 60 -o /dev/null -w '%{http_code}' "$@"
+}
+
+fds() {
+    ls /proc/$pid/fd | wc -l
+}
+
+head -c $((SIZE_MB << 20)) /dev/urandom > big.bin
+printf 'hello\n' > small.txt
+"$SERVER" -l users.log -r "$RESOURCE" -U "$dir/up" -M $((SIZE_MB + 1)) $PORT > /dev/null &
+pid=$!
+sleep 1
+idle_fds=$(fds)
+
+[ "$(status -T big.bin http://127.0.0.1:$PORT/put.bin)" = 201 ] || fail "PUT of a new file was not created"
+cmp -s big.bin up/put.bin || fail "PUT stored another body"
+[ "$(status -T small.txt http://127.0.0.1:$PORT/dir/put.bin)" = 200 ] || fail "PUT over a file did not answer 200"
+cmp -s small.txt up/put.bin || fail "PUT did not replace the file"
+[ "$(status -F field=value -F a=@small.txt -F "b=@big.bin;filename=C:\\form.bin" http://127.0.0.1:$PORT/)" = 201 ] ||
+    fail "form upload was not created"
+cmp -s small.txt up/small.txt && cmp -s big.bin up/form.bin || fail "form upload stored other bodies"
+[ "$(status -T small.txt http://127.0.0.1:$PORT/.hidden)" = 400 ] || fail "a dot file name was taken"
+[ "$(status -F "a=@small.txt;filename=../x" -F "b=@small.txt;filename=.x" http://127.0.0.1:$PORT/)" = 400 ] ||
+    fail "a dot file name was taken from a form"
+head -c $(((SIZE_MB + 1) * 1048576 + 1)) /dev/zero > over.bin
+[ "$(status -T over.bin http://127.0.0.1:$PORT/over.bin)" = 413 ] || fail "a body over -M was taken"
+[ "$(status -X PUT -H "Transfer-Encoding: chunked" --data-binary @small.txt http://127.0.0.1:$PORT/c.txt)" = 411 ] ||
+    fail "a chunked body was taken"
+[ "$(status -X PUT http://127.0.0.1:$PORT/nolength.txt)" = 411 ] || fail "a PUT without a Content-Length was taken"
+[ -e up/nolength.txt ] && fail "a PUT without a Content-Length stored a file"
+[ "$(status -X PUT -H "Content-Length: 0" http://127.0.0.1:$PORT/empty.txt)" = 201 ] && [ ! -s up/empty.txt ] ||
+    fail "an empty PUT was not stored"
+rm -f up/empty.txt
+curl -s -m 30 --limit-rate 1M -T big.bin http://127.0.0.1:$PORT/cut.bin > /dev/null &
+sleep 1.5
+kill $!
+sleep 0.5
+[ -e up/cut.bin ] && fail "an upload cut short was stored"
+[ "$(ls -A up | grep -c '^\.')" = 0 ] || fail "temporary files were left in the upload directory"
+[ "$(fds)" = "$idle_fds" ] || fail "an upload cut short left $(($(fds) - idle_fds)) descriptors open"
+# Keep-alive goes on after a body that was read to its end
+[ "$(status -T small.txt http://127.0.0.1:$PORT/k1.txt -o /dev/null -T small.txt http://127.0.0.1:$PORT/k2.txt)" = 201201 ] ||
+    fail "keep-alive uploads failed"
+rm -f up/*
+
+# load <label> <curl options for client i, with @I@ replaced by i>... prints the cost of CLIENTS uploads at once
+load() {
+    label=$1
+    shift
+    echo 5 > /proc/$pid/clear_refs
+    rss_before=$(awk '/^VmRSS/ { print $2 }' /proc/$pid/status)
+    cpu_before=$(awk '{ print $14 + $15 }' /proc/$pid/stat)
+    start=$(date +%s.%N)
+    pids=
+    i=0
+    while [ $i -lt $CLIENTS ]; do
+        curl -s -m 600 -o /dev/null -w '%{http_code}\n' $(echo "$@" | sed "s/@I@/$i/g") >> codes &
+        pids="$pids $!"
+        i=$((i + 1))
+    done
+    wait $pids
+    end=$(date +%s.%N)
+    cpu_after=$(awk '{ print $14 + $15 }' /proc/$pid/stat)
+    peak=$(awk '/^VmHWM/ { print $2 }' /proc/$pid/status)
+    [ "$(grep -c '^201$' codes)" = $CLIENTS ] || fail "$label: $(sort codes | uniq -c | tr '\n' ' ')"
+    rm -f codes
+    i=0
+    while [ $i -lt $CLIENTS ]; do
+        cmp -s big.bin up/file$i.bin || fail "$label: file$i.bin differs"
+        i=$((i + 1))
+    done
+    rm -f up/*
+    [ $((peak - rss_before)) -lt $((32 * 1024)) ] || fail "$label: the server grew by $(((peak - rss_before) / 1024)) MB"
+    awk -v label="$label" -v mb=$((CLIENTS * SIZE_MB)) -v start=$start -v end=$end -v ticks=$((cpu_after - cpu_before)) \
+        -v hz=$(getconf CLK_TCK) -v before=$rss_before -v peak=$peak 'BEGIN {
+        printf "  %-6s %8.1f MB/s %8.2f ms cpu/MB   rss %6.1f MB before, %6.1f MB peak\n", label, mb / (end - start),
+               ticks * 1000 / hz / mb, before / 1024, peak / 1024
+    }'
+}
+echo "$CLIENTS clients uploading $SIZE_MB MB each at once:"
+load PUT -T big.bin http://127.0.0.1:$PORT/file@I@.bin
+load form -F "file=@big.bin;filename=file@I@.bin" http://127.0.0.1:$PORT/upload
+echo "upload_check: all cases passed"
@@ -0,0 +1,170 @@
+#include <sys/epoll.h>
+#include <string.h>
+
+#include "sql_async.h"
+#include "log.h"
+#include "metrics.h"
+
+sql_async *sql_async::get_instance() {
+    static sql_async instance;
+    return &instance;
+}
+
+sql_async::sql_async() : m_epollfd(-1), m_max_fd(0), m_connPool(NULL), m_complete(NULL), m_inflight(NULL),
+                         m_lock("sql_async"), m_running(0), m_pending(0) {}
+
+sql_async::~sql_async() {
+    delete[] m_inflight;
+}
+
+void sql_async::init(int epollfd, int max_fd, connection_pool *connPool, void (*complete)(void *owner)) {
+    m_epollfd = epollfd;
+    m_max_fd = max_fd;
+    m_connPool = connPool;
+    m_complete = complete;
+    m_inflight = new sql_request *[max_fd];
+    memset(m_inflight, 0, sizeof(sql_request *) * max_fd);
+}
+
+void sql_async::submit(sql_request *req) {
+    req->state = sql_request::WAITING;
+    req->con = NULL;
+    req->res = NULL;
+    req->rows = 0;
+    req->value.clear();
+    req->submitted = METRICS_NOW();
+
+    MYSQL *con = m_connPool->GetConnection(0);
+    m_lock.lock();
+    ++m_pending;
+    if (con) {
+        ++m_running;
+    } else if (m_running > 0) {
+        // Every connection is busy with a query, the first one to finish starts this request
+        m_waiting.push_back(req);
+        m_lock.unlock();
+        return;
+    }
+    m_lock.unlock();
+    start(req, con);
+}
+
+void sql_async::start(sql_request *req, MYSQL *con) {
+    req->con = con;
+    if (!con) {
+        finish(req, false);
+        return;
+    }
+    req->state = sql_request::QUERY;
+    step(req);
+}
+
+void sql_async::handle(int fd) {
+    sql_request *req = m_inflight[fd];
+    if (req) {
+        step(req);
+    }
+}
+
+// Advance the request as far as it goes without blocking, and wait for the socket again when it would block.
+// Queries are small enough to go out in one write, so only readability is polled.
+void sql_async::step(sql_request *req) {
+#if MYSQL_VERSION_ID >= 80016
+    net_async_status status;
+    if (req->state == sql_request::QUERY) {
+        status = mysql_real_query_nonblocking(req->con, req->query.c_str(), req->query.size());
+        if (status == NET_ASYNC_ERROR) {
+            finish(req, false);
+            return;
+        }
+        if (status == NET_ASYNC_COMPLETE && !req->want_result) {
+            req->rows = mysql_affected_rows(req->con);
+            finish(req, true);
+            return;
+        }
+        if (status == NET_ASYNC_COMPLETE) {
+            req->state = sql_request::RESULT;
+        }
+    }
+    if (req->state == sql_request::RESULT) {
+        status = mysql_store_result_nonblocking(req->con, &req->res);
+        if (status == NET_ASYNC_ERROR) {
+            finish(req, false);
+            return;
+        }
+        if (status == NET_ASYNC_COMPLETE) {
+            if (req->res) {
+                req->rows = mysql_num_rows(req->res);
+                MYSQL_ROW row = mysql_fetch_row(req->res);
+                if (row && row[0]) {
+                    req->value = row[0];
+                }
+                mysql_free_result(req->res);
+                req->res = NULL;
+            }
+            finish(req, true);
+            return;
+        }
+    }
+
+    int fd = req->con->net.fd;
+    epoll_event event;
+    event.data.u64 = fd;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    if (m_inflight[fd]) {
+        epoll_ctl(m_epollfd, EPOLL_CTL_MOD, fd, &event);
+    } else {
+        m_inflight[fd] = req;
+        epoll_ctl(m_epollfd, EPOLL_CTL_ADD, fd, &event);
+    }
+#else
+    finish(req, false);
+#endif
+}
+
+void sql_async::finish(sql_request *req, bool ok) {
+    MYSQL *con = req->con;
+    if (con) {
+        int fd = con->net.fd;
+        if (fd >= 0 && fd < m_max_fd && m_inflight[fd] == req) {
+            epoll_ctl(m_epollfd, EPOLL_CTL_DEL, fd, 0);
+            m_inflight[fd] = NULL;
+        }
+        if (!ok) {
+            LOG_ERROR("async query error:%s", mysql_error(con));
+        }
+    }
+    req->con = NULL;
+    req->state = ok ? sql_request::DONE : sql_request::FAILED;
+    METRICS_RECORD(H_DB_QUERY, METRICS_NOW() - req->submitted);
+
+    // A connection that lost the server goes back to the pool, which closes it, instead of to the next waiter
+    bool lost = con && connection_pool::Broken(con);
+    sql_request *next = NULL;
+    list<sql_request *> orphans;
+    m_lock.lock();
+    --m_pending;
+    if (con && !lost && !m_waiting.empty()) {
+        next = m_waiting.front();
+        m_waiting.pop_front();
+    } else if (con) {
+        --m_running;
+        // Waiters are only started by a running request that finishes, with none left they would wait forever
+        if (m_running == 0) {
+            orphans.swap(m_waiting);
+        }
+    }
+    m_lock.unlock();
+
+    // The owner may be picked up by a worker as soon as it is handed back, req is not touched afterwards
+    m_complete(req->owner);
+
+    if (next) {
+        start(next, con);
+    } else if (con) {
+        m_connPool->ReleaseConnection(con);
+    }
+    for (list<sql_request *>::iterator it = orphans.begin(); it != orphans.end(); ++it) {
+        start(*it, NULL);
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef SQL_ASYNC_H
+#define SQL_ASYNC_H
+
+#include <list>
+#include <string>
+#include <mysql/mysql.h>
+
+#include "locker.h"
+#include "connection_pool.h"
+
+using namespace std;
+
+// A query run on the non-blocking MySQL client API, its socket is polled by the server's epoll loop
+struct sql_request {
+    enum STATE {
+        IDLE = 0,   // not submitted
+        WAITING,    // waiting for a free connection
+        QUERY,      // mysql_real_query_nonblocking in progress
+        RESULT,     // mysql_store_result_nonblocking in progress
+        DONE,       // completed, rows and value are set
+        FAILED      // error or no connection
+    };
+
+    sql_request() : state(IDLE), want_result(false), con(NULL), res(NULL), rows(0), owner(NULL), submitted(0) {}
+
+    STATE state;
+    string query;
+    bool want_result;   // Fetch a result set (SELECT) instead of counting affected rows
+    MYSQL *con;
+    MYSQL_RES *res;
+    long long rows;     // Rows returned by a SELECT, or affected by any other statement
+    string value;       // First column of the first returned row
+    void *owner;        // Passed to the completion callback
+    unsigned long long submitted;   // Monotonic ns at submit
+};
+
+// Drives sql_requests without blocking a thread for the database round trip. A worker submits the
+// request and moves on, the reactor resumes it whenever its MySQL socket becomes readable, and the
+// completion callback hands the owner back to the thread pool. At most one query is in flight per
+// pooled connection, requests beyond that wait in FIFO order for the next connection to come back.
+class sql_async {
+public:
+    static sql_async *get_instance();
+
+    // The non-blocking API appeared in MySQL 8.0.16
+    static bool available() { return MYSQL_VERSION_ID >= 80016; }
+    void init(int epollfd, int max_fd, connection_pool *connPool, void (*complete)(void *owner));
+    // Start a request, its completion is reported through the callback
+    void submit(sql_request *req);
+    // True when fd is the socket of an in-flight request
+    bool owns(int fd) const { return fd >= 0 && fd < m_max_fd && m_inflight[fd] != NULL; }
+    // Resume the request waiting on fd, called by the reactor on an epoll event
+    void handle(int fd);
+    // Number of requests in flight or waiting for a connection
+    int pending() const { return m_pending; }
+
+private:
+    sql_async();
+    ~sql_async();
+
+    void start(sql_request *req, MYSQL *con);
+    void step(sql_request *req);
+    void finish(sql_request *req, bool ok);
+
+private:
+    int m_epollfd;
+    int m_max_fd;
+    connection_pool *m_connPool;
+    void (*m_complete)(void *owner);
+    // In-flight request indexed by its MySQL socket fd
+    sql_request **m_inflight;
+    // Requests waiting for a free connection
+    list<sql_request *> m_waiting;
+    locker m_lock;
+    // Requests holding a connection, they hand it over to the next waiter when they finish
+    int m_running;
+    volatile int m_pending;
+};
+
+#endif
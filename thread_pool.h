@@ -1,13 +1,17 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
-#include <list>
 #include <cstdio>
 #include <exception>
 #include <pthread.h>
+#include <unistd.h>
 
 #include "locker.h"
-#include "connection_pool.h"
+#include "metrics.h"
+#include "probes.h"
+#include "alloc_stats.h"
+#include "affinity.h"
+#include "log.h"
 
 template <typename T>
 class threadpool
@@ -15,53 +19,141 @@ class threadpool
 public:
     // thread_number is the number staticly allocated threads in thread pool, it is determined according to the number of cpu cores
     // max_request is the maximum number of threads allowed in the queue
-    // connPool points to the connection pool
-    threadpool(connection_pool *connPool, int thread_number = 8, int max_request = 10000);
+    // cpus pins worker i to the i-th CPU of the set, round robin, NULL leaves them unpinned
+    // max_threads is the most workers autosize may grow to, 0 for thread_number
+    threadpool(int thread_number = 8, int max_request = 10000, const cpu_set_t *cpus = NULL, int max_threads = 0);
+    // Stops the workers and waits until each has finished its request and exited, requests still queued are dropped
     ~threadpool();
-    // Append new request to the request queue
-    bool append(T *request);
+    // Append new request to the request queue. cpu is the CPU that received the request, an idle worker
+    // pinned to it is preferred; -1 takes any worker. The caller holds the request for the worker, which
+    // lets go of it through process(), or through release() alone when its connection was closed meanwhile.
+    bool append(T *request, int cpu = -1);
+    // Number of requests waiting in the queue
+    int queued();
+    // Number of worker threads
+    int size();
+    // Grow and shrink between min_threads and max_threads, checked every interval_ms. Inputs are the average
+    // queue wait, the share of time workers were busy, and db_wait_ns(arg), the running total of time workers
+    // spent blocked on the database, which is busy time that uses no CPU.
+    bool autosize(int min_threads, unsigned long long (*db_wait_ns)(void *arg), void *arg, int interval_ms = 500);
+    // CPU worker i is pinned to, -1 when unpinned
+    int worker_cpu(int i) const { return m_workers[i].cpu; }
+    // Let a worker that runs out of requests spin up to max_spin_ns before parking, 0 parks at once
+    void set_spin(unsigned long long max_spin_ns) { m_max_spin_ns = max_spin_ns; }
 
 private:
+    // Queued request and the time it was appended
+    struct queue_item
+    {
+        T *request;
+        unsigned long long enqueued;
+    };
+    // Every worker parks on its own semaphore, so append wakes a chosen one: the most recently idle, whose
+    // cache is warmest, or the one on the request's CPU, which gets the request handed over directly
+    struct worker_slot
+    {
+        worker_slot() : wake(0, "threadpool.worker") {}
+        threadpool *pool;
+        int index;
+        int cpu;
+        sem wake;
+        bool has_handoff;
+        queue_item handoff;
+        // Set while a thread runs this slot, a retired worker clears it on exit
+        bool running;
+    };
+
     // Function run by worker thread, keeps handling requests from request queue
     static void *worker(void *arg);
-    void run();
+    void run(worker_slot *slot);
+    // Take an idle worker off the idle stack, the one on cpu if there is one, -1 when none qualifies
+    int take_idle(int cpu);
+    // How long a worker out of requests should spin, 0 to park at once
+    unsigned long long spin_budget();
+    // Spin until a request is queued or budget_ns passed
+    void spin(unsigned long long budget_ns);
+    // Start a thread for slot i, called with m_queuelocker held once threads run
+    bool start_worker(int i);
+    // Set the number of workers, surplus ones exit once they finish their request
+    void resize(int target);
+    static void *tuner(void *arg);
+    void tune();
 
 private:
-    // Number of threads in thread pool
+    // Queue wait a growing pool aims below, and the wait low enough to shrink
+    static const unsigned long long GROW_WAIT_NS = 1000000;
+    static const unsigned long long SHRINK_WAIT_NS = 200000;
+
+    // Number of threads in thread pool, worker slots at and above it retire
     int m_thread_number;
+    int m_min_threads;
+    int m_max_threads;
+    // CPUs the workers may use, their count is how many busy workers the pool can run without oversubscribing
+    cpu_set_t m_cpus;
+    bool m_pinned;
+    int m_ncpu;
     // Max number of requests in request queue
     int m_max_requests;
     // Thread pool array
     pthread_t *m_threads;
-    // Request queue
-    std::list<T *> m_requestQueue;
+    worker_slot *m_workers;
+    // Request queue, a ring of m_max_requests slots allocated up front so append never allocates
+    queue_item *m_requestQueue;
+    int m_queue_head;
+    int m_queue_size;
+    // Parked workers by index, the most recently parked last
+    int *m_idle;
+    int m_idle_count;
+    // Workers spinning for a request, append wakes a parked one only for requests beyond these
+    int m_spinning;
+    unsigned long long m_max_spin_ns;
+    // Moving average of the time between appends, the recent arrival rate
+    unsigned long long m_last_append;
+    unsigned long long m_gap_ewma;
+    // Running totals for autosize: queue wait and busy time of the requests processed
+    unsigned long long m_wait_ns;
+    unsigned long long m_busy_ns;
+    unsigned long long m_dequeued;
+    unsigned long long (*m_db_wait_ns)(void *arg);
+    void *m_db_arg;
+    int m_interval_ms;
+    bool m_tuning;
+    pthread_t m_tuner;
     locker m_queuelocker;
-    // Semaphore for request queue
-    sem m_queuestat;
+    // Signalled by each exiting worker, the destructor waits on it until no slot is running
+    cond m_exited;
     bool m_stop;
-    connection_pool *m_connPool;
 };
 
 // Create threadd pool instance
 template <typename T>
-threadpool<T>::threadpool( connection_pool *connPool, int thread_number, int max_requests) : m_thread_number(thread_number), m_max_requests(max_requests), m_stop(false), m_threads(NULL),m_connPool(connPool)
+threadpool<T>::threadpool(int thread_number, int max_requests, const cpu_set_t *cpus, int max_threads) : m_thread_number(thread_number), m_min_threads(thread_number), m_max_threads(max_threads > thread_number ? max_threads : thread_number), m_pinned(cpus != NULL), m_max_requests(max_requests), m_threads(NULL), m_workers(NULL), m_requestQueue(NULL), m_queue_head(0), m_queue_size(0), m_idle(NULL), m_idle_count(0), m_spinning(0), m_max_spin_ns(0), m_last_append(0), m_gap_ewma(0), m_wait_ns(0), m_busy_ns(0), m_dequeued(0), m_db_wait_ns(NULL), m_db_arg(NULL), m_interval_ms(0), m_tuning(false), m_queuelocker("threadpool.queue"), m_exited("threadpool.exited"), m_stop(false)
 {
     if (thread_number <= 0 || max_requests <= 0)
         throw std::exception();
+    if (cpus)
+        m_cpus = *cpus;
+    else
+        sched_getaffinity(0, sizeof(m_cpus), &m_cpus);
+    m_ncpu = CPU_COUNT(&m_cpus) > 0 ? CPU_COUNT(&m_cpus) : 1;
+    m_requestQueue = new queue_item[m_max_requests];
+    m_workers = new worker_slot[m_max_threads];
+    m_idle = new int[m_max_threads];
     // Initialize thread by id
-    m_threads = new pthread_t[m_thread_number];
+    m_threads = new pthread_t[m_max_threads];
     if (!m_threads)
         throw std::exception();
+    for (int i = 0; i < m_max_threads; ++i)
+    {
+        m_workers[i].pool = this;
+        m_workers[i].index = i;
+        m_workers[i].cpu = m_pinned ? nth_cpu(&m_cpus, i) : -1;
+        m_workers[i].has_handoff = false;
+        m_workers[i].running = false;
+    }
     for (int i = 0; i < thread_number; ++i)
     {
-        // Create new worker threads
-        if (pthread_create(m_threads + i, NULL, worker, this) != 0)
-        {
-            delete[] m_threads;
-            throw std::exception();
-        }
-        // Detach thread, in order to reclaim it after terminated
-        if (pthread_detach(m_threads[i]))
+        if (!start_worker(i))
         {
             delete[] m_threads;
             throw std::exception();
@@ -69,65 +161,390 @@ threadpool<T>::threadpool( connection_pool *connPool, int thread_number, int max
     }
 }
 
+template <typename T>
+bool threadpool<T>::start_worker(int i)
+{
+    // A pinned worker starts on its CPU, so its per-thread state is first touched on its own NUMA node
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (m_workers[i].cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(m_workers[i].cpu, &set);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+    // Create new worker threads
+    int ret = pthread_create(m_threads + i, &attr, worker, m_workers + i);
+    pthread_attr_destroy(&attr);
+    // Detach thread, in order to reclaim it after terminated
+    if (ret != 0 || pthread_detach(m_threads[i]))
+    {
+        return false;
+    }
+    m_workers[i].running = true;
+    return true;
+}
+
 // Delete thread pool instance
 template <typename T>
 threadpool<T>::~threadpool()
 {
-    delete[] m_threads;
+    m_queuelocker.lock();
     m_stop = true;
+    m_queuelocker.unlock();
+    // The tuner starts no workers once joined
+    if (m_tuning)
+    {
+        pthread_join(m_tuner, NULL);
+    }
+    m_queuelocker.lock();
+    for (int i = 0; i < m_max_threads; ++i)
+    {
+        if (m_workers[i].running)
+        {
+            m_workers[i].wake.post();
+        }
+    }
+    for (int i = 0; i < m_max_threads; ++i)
+    {
+        while (m_workers[i].running)
+        {
+            m_exited.wait(m_queuelocker);
+        }
+    }
+    m_queuelocker.unlock();
+    delete[] m_threads;
+    delete[] m_workers;
+    delete[] m_idle;
+    delete[] m_requestQueue;
+}
+template <typename T>
+int threadpool<T>::take_idle(int cpu)
+{
+    for (int i = m_idle_count - 1; i >= 0; --i)
+    {
+        int idx = m_idle[i];
+        if (cpu < 0 || m_workers[idx].cpu == cpu)
+        {
+            m_idle[i] = m_idle[--m_idle_count];
+            return idx;
+        }
+    }
+    return -1;
+}
+// Spin while requests arrive faster than a park and wake round trip would take: twice the average gap,
+// so the next request is likely to arrive in time, and nothing at all when the gap exceeds the limit
+template <typename T>
+unsigned long long threadpool<T>::spin_budget()
+{
+    unsigned long long gap = __atomic_load_n(&m_gap_ewma, __ATOMIC_RELAXED);
+    if (!m_max_spin_ns || gap > m_max_spin_ns)
+    {
+        return 0;
+    }
+    return 2 * gap < m_max_spin_ns ? 2 * gap : m_max_spin_ns;
+}
+template <typename T>
+void threadpool<T>::spin(unsigned long long budget_ns)
+{
+    unsigned long long deadline = METRICS_NOW() + budget_ns;
+    do
+    {
+        for (int i = 0; i < 64; ++i)
+        {
+            if (__atomic_load_n(&m_queue_size, __ATOMIC_RELAXED) > 0)
+            {
+                return;
+            }
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        }
+    } while (METRICS_NOW() < deadline);
 }
 // Append new request to queue
 template <typename T>
-bool threadpool<T>::append(T *request)
+bool threadpool<T>::append(T *request, int cpu)
 {
+    ALLOC_SCOPE(A_QUEUE);
     // Lock and unlock queue before and after accessing it
     m_queuelocker.lock();
-    if (m_requestQueue.size() > m_max_requests)
+    if (m_queue_size >= m_max_requests)
     {
         m_queuelocker.unlock();
+        METRICS_ADD(M_QUEUE_REJECTS, 1);
+        PROBE1(queue_reject, request);
         return false;
     }
-    m_requestQueue.push_back(request);
+    queue_item item = {request, METRICS_NOW()};
+    // Gaps are clamped so one idle period does not hide a burst for long
+    unsigned long long gap = item.enqueued - m_last_append;
+    m_last_append = item.enqueued;
+    gap = gap < 1000000 ? gap : 1000000;
+    m_gap_ewma = m_gap_ewma - m_gap_ewma / 8 + gap / 8;
+    int depth = m_queue_size;
+    int wake = cpu >= 0 ? take_idle(cpu) : -1;
+    if (wake >= 0)
+    {
+        m_workers[wake].handoff = item;
+        m_workers[wake].has_handoff = true;
+        METRICS_ADD(M_QUEUE_CPU_HANDOFFS, 1);
+    }
+    else
+    {
+        m_requestQueue[(m_queue_head + m_queue_size) % m_max_requests] = item;
+        depth = ++m_queue_size;
+        // A spinning worker picks the request up without a futex wake
+        wake = m_queue_size > m_spinning ? take_idle(-1) : -1;
+        if (m_spinning > 0 && wake < 0)
+        {
+            METRICS_ADD(M_QUEUE_WAKES_SKIPPED, 1);
+        }
+    }
     m_queuelocker.unlock();
-    // Post the queue semaphore
-    m_queuestat.post();
+    PROBE2(queue_append, request, depth);
+    if (wake >= 0)
+    {
+        m_workers[wake].wake.post();
+    }
     return true;
 }
+template <typename T>
+int threadpool<T>::queued()
+{
+    m_queuelocker.lock();
+    int size = m_queue_size;
+    m_queuelocker.unlock();
+    return size;
+}
+template <typename T>
+int threadpool<T>::size()
+{
+    m_queuelocker.lock();
+    int size = m_thread_number;
+    m_queuelocker.unlock();
+    return size;
+}
+template <typename T>
+bool threadpool<T>::autosize(int min_threads, unsigned long long (*db_wait_ns)(void *arg), void *arg, int interval_ms)
+{
+    if (min_threads <= 0 || min_threads > m_max_threads || interval_ms <= 0 || m_tuning)
+    {
+        return false;
+    }
+    m_min_threads = min_threads;
+    m_db_wait_ns = db_wait_ns;
+    m_db_arg = arg;
+    m_interval_ms = interval_ms;
+    if (pthread_create(&m_tuner, NULL, tuner, this) != 0)
+    {
+        return false;
+    }
+    m_tuning = true;
+    return true;
+}
+template <typename T>
+void threadpool<T>::resize(int target)
+{
+    m_queuelocker.lock();
+    int old = m_thread_number;
+    m_thread_number = target;
+    if (target < old)
+    {
+        // Parked workers above the new size are woken to exit, busy ones exit after their request
+        for (int i = m_idle_count - 1; i >= 0; --i)
+        {
+            int idx = m_idle[i];
+            if (idx >= target)
+            {
+                m_idle[i] = m_idle[--m_idle_count];
+                m_workers[idx].wake.post();
+            }
+        }
+    }
+    else
+    {
+        // A slot whose worker has not exited yet keeps it
+        for (int i = old; i < target; ++i)
+        {
+            if (!m_workers[i].running && !start_worker(i))
+            {
+                m_thread_number = i;
+                break;
+            }
+        }
+    }
+    m_queuelocker.unlock();
+}
+template <typename T>
+void *threadpool<T>::tuner(void *arg)
+{
+    ((threadpool *)arg)->tune();
+    return NULL;
+}
+// Grow by a quarter when requests wait or workers are saturated while CPU time is left, which is the case
+// when workers are blocked on the database. Shrink by an eighth when workers are mostly idle, or back
+// toward one per CPU when more workers than CPUs are all busy computing. Growing takes two intervals in a
+// row and shrinking four, and both start over after a resize, so a pool does not oscillate around a
+// threshold.
+template <typename T>
+void threadpool<T>::tune()
+{
+    unsigned long long last_wait = 0, last_busy = 0, last_dequeued = 0;
+    unsigned long long last_db = m_db_wait_ns ? m_db_wait_ns(m_db_arg) : 0;
+    unsigned long long last_ns = METRICS_NOW();
+    int hot = 0, cold = 0;
+    while (!m_stop)
+    {
+        usleep(m_interval_ms * 1000);
+        unsigned long long now = METRICS_NOW();
+        unsigned long long db_total = m_db_wait_ns ? m_db_wait_ns(m_db_arg) : 0;
+        m_queuelocker.lock();
+        unsigned long long wait = m_wait_ns - last_wait;
+        unsigned long long busy = m_busy_ns - last_busy;
+        unsigned long long dequeued = m_dequeued - last_dequeued;
+        last_wait = m_wait_ns;
+        last_busy = m_busy_ns;
+        last_dequeued = m_dequeued;
+        int n = m_thread_number;
+        m_queuelocker.unlock();
+        unsigned long long db = db_total - last_db;
+        last_db = db_total;
+        double interval = (double)(now - last_ns);
+        last_ns = now;
+
+        double avg_wait = dequeued ? (double)wait / dequeued : 0;
+        double busy_ratio = busy / (interval * n);
+        // CPUs' worth of time workers spent running rather than blocked on the database
+        double cpu_used = (busy > db ? busy - db : 0) / interval;
+        bool headroom = cpu_used < 0.9 * m_ncpu;
+        bool oversubscribed = n > m_ncpu && !headroom && db < busy / 10;
+        hot = (avg_wait > GROW_WAIT_NS || busy_ratio > 0.9) && headroom ? hot + 1 : 0;
+        cold = (busy_ratio < 0.5 && avg_wait < SHRINK_WAIT_NS) || oversubscribed ? cold + 1 : 0;
+
+        int target = n;
+        if (hot >= 2)
+        {
+            target = n + (n / 4 > 1 ? n / 4 : 1);
+            target = target < m_max_threads ? target : m_max_threads;
+        }
+        else if (cold >= 4)
+        {
+            target = n - (n / 8 > 1 ? n / 8 : 1);
+            if (oversubscribed && target < m_ncpu)
+            {
+                target = m_ncpu;
+            }
+            target = target > m_min_threads ? target : m_min_threads;
+        }
+        if (target != n)
+        {
+            resize(target);
+            hot = 0;
+            cold = 0;
+            METRICS_ADD(M_POOL_RESIZES, 1);
+            LOG_INFO("thread pool resized from %d to %d workers: queue wait %.0f us, busy %.0f%%, db %.0f%%, cpu %.2f",
+                     n, target, avg_wait / 1000, busy_ratio * 100, busy ? 100.0 * db / busy : 0.0, cpu_used);
+        }
+    }
+}
 // Call run() to process http request in a worker thread
 template <typename T>
 void *threadpool<T>::worker(void *arg)
 {
     // Wake a thread from thread pool
-    threadpool *pool = (threadpool *)arg;
-    // Get request from request queue, and run http handler
-    pool->run();
-    return pool;
+    worker_slot *slot = (worker_slot *)arg;
+    // Get request from request queue, and run http handler. The slot may be freed once run returns.
+    slot->pool->run(slot);
+    return NULL;
 }
 // Get request from request queue, and run http handler
 template <typename T>
-void threadpool<T>::run()
+void threadpool<T>::run(worker_slot *slot)
 {
+    ALLOC_SCOPE(A_QUEUE);
+    bool spun = false;
+    m_queuelocker.lock();
     while (!m_stop)
     {
-        // Block untill semaphore of request queue > 1
-        m_queuestat.wait();
-        // Lock before accessing request queue
-        m_queuelocker.lock();
-        if (m_requestQueue.empty())
+        queue_item item;
+        if (slot->index >= m_thread_number && !slot->has_handoff)
+        {
+            // Retired by a shrink
+            break;
+        }
+        if (slot->has_handoff)
+        {
+            item = slot->handoff;
+            slot->has_handoff = false;
+        }
+        else if (m_queue_size > 0)
+        {
+            item = m_requestQueue[m_queue_head];
+            m_queue_head = (m_queue_head + 1) % m_max_requests;
+            --m_queue_size;
+        }
+        else if (!spun && spin_budget() > 0)
         {
+            // Counted as spinning under the lock, so append either skips the wake and the request is seen
+            // here, or wakes a parked worker
+            ++m_spinning;
             m_queuelocker.unlock();
+            spin(spin_budget());
+            m_queuelocker.lock();
+            --m_spinning;
+            spun = true;
             continue;
         }
-        T *request = m_requestQueue.front();
-        m_requestQueue.pop_front();
-        m_queuelocker.unlock();
-        if (!request)
+        else
+        {
+            // Park until append takes this worker off the idle stack, another worker may have taken the
+            // queued request by then, in which case the worker parks again
+            m_idle[m_idle_count++] = slot->index;
+            m_queuelocker.unlock();
+            METRICS_ADD(M_WORKER_PARKS, 1);
+            slot->wake.wait();
+            m_queuelocker.lock();
+            spun = false;
             continue;
-
-        // Wake a mysql connection from connection pool
-        connectionRAII mysqlcon(&request->mysql, m_connPool);
-        // Process http request
-        request->process();
+        }
+        m_queuelocker.unlock();
+        if (spun)
+        {
+            METRICS_ADD(M_WORKER_SPIN_HITS, 1);
+            spun = false;
+        }
+        T *request = item.request;
+        unsigned long long start = METRICS_NOW();
+        unsigned long long end = start;
+        if (request && request->closing())
+        {
+            // Its connection was closed while it waited, the hold taken for this worker kept the slot from
+            // being reused and letting go of it finishes the close
+            METRICS_ADD(M_STALE_REQUESTS, 1);
+            request->release();
+        }
+        else if (request)
+        {
+            METRICS_RECORD(H_QUEUE_WAIT, start - item.enqueued);
+            PROBE2(queue_dequeue, request, start - item.enqueued);
+            // Process http request, the user store takes a database connection only when it needs one
+            {
+                ALLOC_SCOPE(A_REQUEST);
+                request->process();
+            }
+            end = METRICS_NOW();
+            METRICS_RECORD(H_PROCESS, end - start);
+            METRICS_ADD(M_REQUESTS, 1);
+        }
+        m_queuelocker.lock();
+        m_wait_ns += start - item.enqueued;
+        m_busy_ns += end - start;
+        ++m_dequeued;
     }
+    slot->running = false;
+    m_exited.broadcast();
+    m_queuelocker.unlock();
 }
 #endif
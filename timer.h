@@ -4,6 +4,8 @@
 #include <time.h>
 
 #include "log.h"
+#include "metrics.h"
+#include "probes.h"
 
 class util_timer;
 // Data for a connection
@@ -19,85 +21,95 @@ struct client_data
 class util_timer
 {
 public:
-    util_timer() : prev(NULL), next(NULL) {}
+    util_timer() : prev(NULL), next(NULL), slot(0) {}
 
 public:
-    // Expire time
-    time_t expire;
+    // Expire time, milliseconds on timer_wheel::now_ms
+    unsigned long long expire;
     // Callback function at timeout
     void (*cb_func)(client_data *);
     client_data *user_data;
-    // Pointers of the linked timer list
+    // Pointers of the linked list of the timer's wheel slot
     util_timer *prev;
     util_timer *next;
+    // Wheel slot the timer is linked into, kept since expire changes before adjust_timer
+    int slot;
 };
 
-// Container for timer list
-class sort_timer_lst
+// Hashed timing wheel. A timer hangs off the slot of its expire time, slots are SLOT_MS wide and the wheel turns
+// once every SLOTS * SLOT_MS, so a slot holds the timers of every turn and a timer further out than one turn is
+// passed over until its turn comes. Adding, renewing and deleting a timer are O(1) whatever the number of
+// connections, and tick visits only the slots that passed since the last tick.
+class timer_wheel
 {
 public:
-    sort_timer_lst() : head(NULL), tail(NULL) {}
-    ~sort_timer_lst()
+    static const int SLOT_MS = 100;
+    static const int SLOTS = 1024;
+
+    timer_wheel() : free_list(NULL), count(0), current(now_ms() / SLOT_MS)
     {
-        util_timer *tmp = head;
-        while (tmp)
+        for (int i = 0; i < SLOTS; ++i)
         {
-            head = tmp->next;
-            delete tmp;
-            tmp = head;
+            slots[i] = NULL;
         }
     }
-    // Add a new timer to list
-    void add_timer(util_timer *timer)
+    ~timer_wheel()
     {
-        if (!timer)
+        for (int i = 0; i < SLOTS; ++i)
         {
-            return;
+            while (slots[i])
+            {
+                util_timer *tmp = slots[i];
+                slots[i] = tmp->next;
+                delete tmp;
+            }
         }
-        if (!head)
+        while (free_list)
         {
-            head = tail = timer;
-            return;
+            util_timer *tmp = free_list;
+            free_list = tmp->next;
+            delete tmp;
         }
-        // If the new timer is shorter than current head, then insert it to head
-        if (timer->expire < head->expire)
+    }
+    // Monotonic clock of the expire times
+    static unsigned long long now_ms()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+    }
+    // Get a timer, reusing one released by del_timer or tick so steady-state accepts do not allocate
+    util_timer *new_timer()
+    {
+        if (!free_list)
         {
-            timer->next = head;
-            head->prev = timer;
-            head = timer;
-            return;
+            return new util_timer;
         }
-        // Otherwise insert timer to its right position after literation and comparisons with elements in the list
-        add_timer(timer, head);
+        util_timer *timer = free_list;
+        free_list = timer->next;
+        timer->prev = NULL;
+        timer->next = NULL;
+        return timer;
     }
-    // Adjust potision of timer when it is renewed
-    void adjust_timer(util_timer *timer)
+    // Add a new timer to the wheel, one already expired fires at the next tick
+    void add_timer(util_timer *timer)
     {
         if (!timer)
         {
             return;
         }
-        util_timer *tmp = timer->next;
-        // If timer was at the tail of list, there is no need to adjust (next new timer is always longer)
-        if (!tmp || (timer->expire < tmp->expire))
+        link(timer);
+        ++count;
+    }
+    // Move a timer whose expire time changed to its new slot
+    void adjust_timer(util_timer *timer)
+    {
+        if (!timer)
         {
             return;
         }
-        // If timer was the head, remove it from list and insert the timer again
-        if (timer == head)
-        {
-            head = head->next;
-            head->prev = NULL;
-            timer->next = NULL;
-            add_timer(timer, head);
-        }
-        // If timer was and internal element of the list, remove it and insert the timer again
-        else
-        {
-            timer->prev->next = timer->next;
-            timer->next->prev = timer->prev;
-            add_timer(timer, timer->next);
-        }
+        unlink(timer);
+        link(timer);
     }
     // Delete timer
     void del_timer(util_timer *timer)
@@ -106,103 +118,101 @@ public:
         {
             return;
         }
-        // If there is only one timer in the list
-        if ((timer == head) && (timer == tail))
+        unlink(timer);
+        --count;
+        free_timer(timer);
+    }
+    // Expire the timers of the slots that passed, a slot is done once its whole width is past
+    void tick(unsigned long long now)
+    {
+        unsigned long long end = now / SLOT_MS;
+        if (current >= end)
         {
-            delete timer;
-            head = NULL;
-            tail = NULL;
             return;
         }
-        // Delete the head 
-        if (timer == head)
+        // After a gap of a full turn or more every slot is due once
+        if (end - current > SLOTS)
         {
-            head = head->next;
-            head->prev = NULL;
-            delete timer;
-            return;
+            current = end - SLOTS;
         }
-        // Delete the tail
-        if (timer == tail)
+        for (; current < end; ++current)
         {
-            tail = tail->prev;
-            tail->next = NULL;
-            delete timer;
-            return;
+            util_timer *tmp = slots[current % SLOTS];
+            while (tmp)
+            {
+                util_timer *next = tmp->next;
+                // Timers of a later turn stay
+                if (tmp->expire <= now)
+                {
+                    unlink(tmp);
+                    --count;
+                    PROBE1(timer_expire, tmp->user_data->sockfd);
+                    tmp->cb_func(tmp->user_data);
+                    METRICS_ADD(M_TIMER_EXPIRATIONS, 1);
+                    free_timer(tmp);
+                }
+                tmp = next;
+            }
         }
-        timer->prev->next = timer->next;
-        timer->next->prev = timer->prev;
-        delete timer;
     }
-    // Timeout event handler
-    void tick()
+    // Milliseconds until the next slot is due, for epoll_wait, -1 without timers
+    int next_timeout(unsigned long long now) const
     {
-        if (!head)
-        {
-            return;
-        }
-        LOG_INFO("%s", "timer tick");
-        Log::get_instance()->flush();
-        // Get current time
-        time_t cur = time(NULL);
-        util_timer *tmp = head;
-        while (tmp)
+        if (count == 0)
         {
-            // Break until reaches an unexpired timer
-            // The timer stores an absolute time, therefore, if current time is samller than current iterator
-            // all timers behind current iterator do not expire at current time
-            if (cur < tmp->expire)
-            {
-                break;
-            }
-            // If current timer expire, call the callbakc function and timeout handler
-            tmp->cb_func(tmp->user_data);
-            // Remove the expired timer, and reset the head
-            // As it is an ascending list, head timer is always the first to expire
-            head = tmp->next;
-            if (head)
-            {
-                head->prev = NULL;
-            }
-            delete tmp;
-            tmp = head;
+            return -1;
         }
+        unsigned long long due = (current + 1) * SLOT_MS;
+        return due > now ? (int)(due - now) : 0;
     }
+    // Number of timers on the wheel
+    int size() const { return count; }
 
 private:
-    // Called by public add_timer and adjust_time
-    // Insert timer to list body after iteration
-    void add_timer(util_timer *timer, util_timer *lst_head)
+    // Keep a removed timer for the next new_timer
+    void free_timer(util_timer *timer)
     {
-        util_timer *prev = lst_head;
-        util_timer *tmp = prev->next;
-        // Iteration and comparison with each element of the list
-        while (tmp)
+        timer->next = free_list;
+        free_list = timer;
+    }
+    void link(util_timer *timer)
+    {
+        unsigned long long at = timer->expire / SLOT_MS;
+        timer->slot = (at > current ? at : current) % SLOTS;
+        util_timer *&head = slots[timer->slot];
+        timer->prev = NULL;
+        timer->next = head;
+        if (head)
         {
-            if (timer->expire < tmp->expire)
-            {
-                prev->next = timer;
-                timer->next = tmp;
-                tmp->prev = timer;
-                timer->prev = prev;
-                break;
-            }
-            prev = tmp;
-            tmp = tmp->next;
+            head->prev = timer;
+        }
+        head = timer;
+    }
+    void unlink(util_timer *timer)
+    {
+        if (timer->prev)
+        {
+            timer->prev->next = timer->next;
         }
-        // If tmp->next == null, insert the timer to tail
-        if (!tmp)
+        else
         {
-            prev->next = timer;
-            timer->prev = prev;
-            timer->next = NULL;
-            tail = timer;
+            slots[timer->slot] = timer->next;
+        }
+        if (timer->next)
+        {
+            timer->next->prev = timer->prev;
         }
+        timer->prev = NULL;
+        timer->next = NULL;
     }
 
 private:
-    util_timer *head;
-    util_timer *tail;
+    util_timer *slots[SLOTS];
+    // Released timers, linked through next
+    util_timer *free_list;
+    int count;
+    // First slot not yet expired, in SLOT_MS units since the clock's epoch
+    unsigned long long current;
 };
 
 #endif
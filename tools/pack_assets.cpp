@@ -0,0 +1,292 @@
+// Packs a directory into an asset bundle for the server's -B option or an EMBED_BUNDLE build, see
+// asset_bundle.h for the layout. Built and run by `make resource.bundle`.
+//
+// Every regular file below the directory becomes an asset at its path, names starting with a dot are
+// skipped. Compressible types also get a gzip body, compressed here unless a name.gz sibling at least as new
+// exists, and a zstd body when a name.zst sibling does. A compressed body is kept when it saves a tenth of the
+// file, the rule compress_cache follows. The paths are placed with hash and displace: each bucket of paths,
+// largest first, gets the first seed that sends all of them to free slots, so a lookup is two hashes and one
+// comparison.
+//
+//     tools/pack_assets directory out.bundle
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "../asset_bundle.h"
+#include "../file_types.h"
+#include "../validators.h"
+
+using namespace std;
+
+static const int MIN_SAVING_PERCENT = 10;
+static const uint32_t MAX_SEED = 1 << 24;
+static const char *encoding_names[BUNDLE_ENCODINGS] = {"identity", "gzip", "zstd"};
+static const char *encoding_suffixes[BUNDLE_ENCODINGS] = {"", ".gz", ".zst"};
+
+struct input {
+    string path;    // URL path
+    string file;    // where it was read from
+    struct stat st;
+    string bodies[BUNDLE_ENCODINGS];
+    uint32_t encodings;
+};
+
+static bool read_file(const string &file, string *out) {
+    FILE *f = fopen(file.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    char buf[65536];
+    size_t n;
+    out->clear();
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        out->append(buf, n);
+    }
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+static bool gzip(const string &in, string *out) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // windowBits 15 + 16 writes a gzip header and trailer around the deflate stream
+    if (deflateInit2(&zs, 9, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    out->resize(deflateBound(&zs, in.size()));
+    zs.next_in = (Bytef *)in.data();
+    zs.avail_in = in.size();
+    zs.next_out = (Bytef *)&(*out)[0];
+    zs.avail_out = out->size();
+    int ret = deflate(&zs, Z_FINISH);
+    out->resize(zs.total_out);
+    deflateEnd(&zs);
+    return ret == Z_STREAM_END;
+}
+
+static bool worth_it(const string &encoded, const string &identity) {
+    return encoded.size() * 100 <= identity.size() * (100 - MIN_SAVING_PERCENT);
+}
+
+static void walk(const string &dir, const string &prefix, vector<input> *inputs) {
+    DIR *d = opendir(dir.c_str());
+    if (!d) {
+        fprintf(stderr, "cannot open %s\n", dir.c_str());
+        exit(1);
+    }
+    vector<string> names;
+    while (struct dirent *e = readdir(d)) {
+        if (e->d_name[0] != '.') {
+            names.push_back(e->d_name);
+        }
+    }
+    closedir(d);
+    sort(names.begin(), names.end());
+    for (size_t i = 0; i < names.size(); ++i) {
+        input in;
+        in.file = dir + "/" + names[i];
+        in.path = prefix + "/" + names[i];
+        if (stat(in.file.c_str(), &in.st) < 0) {
+            continue;
+        }
+        if (S_ISDIR(in.st.st_mode)) {
+            walk(in.file, in.path, inputs);
+        } else if (S_ISREG(in.st.st_mode)) {
+            inputs->push_back(in);
+        }
+    }
+}
+
+// Read the bodies of in, the identity one and the compressed ones worth keeping
+static void encode(input *in) {
+    if (!read_file(in->file, &in->bodies[0])) {
+        fprintf(stderr, "cannot read %s\n", in->file.c_str());
+        exit(1);
+    }
+    in->encodings = 1;
+    const file_type *type = file_type_of(in->path.c_str());
+    if (!type || !type->compressible || in->bodies[0].empty()) {
+        return;
+    }
+    for (int e = 1; e < BUNDLE_ENCODINGS; ++e) {
+        string sibling = in->file + encoding_suffixes[e];
+        struct stat st;
+        // A sibling older than the file is stale and left alone, as the server does
+        bool fresh = stat(sibling.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_mtime >= in->st.st_mtime;
+        bool ok = fresh ? read_file(sibling, &in->bodies[e]) : e == 1 && gzip(in->bodies[0], &in->bodies[e]);
+        if (ok && !in->bodies[e].empty() && worth_it(in->bodies[e], in->bodies[0])) {
+            in->encodings |= 1 << e;
+        } else {
+            in->bodies[e].clear();
+        }
+    }
+}
+
+// Slot of every input by hash and displace, false when some bucket found no seed
+static bool place(const vector<input> &inputs, uint32_t bucket_count, vector<uint32_t> *seeds,
+                  vector<int> *slots) {
+    uint32_t n = inputs.size();
+    vector<vector<int> > buckets(bucket_count);
+    for (uint32_t i = 0; i < n; ++i) {
+        buckets[bundle_hash(inputs[i].path.data(), inputs[i].path.size(), 0) % bucket_count].push_back(i);
+    }
+    vector<uint32_t> order(bucket_count);
+    for (uint32_t b = 0; b < bucket_count; ++b) {
+        order[b] = b;
+    }
+    stable_sort(order.begin(), order.end(),
+                [&buckets](uint32_t a, uint32_t b) { return buckets[a].size() > buckets[b].size(); });
+    seeds->assign(bucket_count, 0);
+    slots->assign(n, -1);
+    vector<uint32_t> taken;
+    for (uint32_t k = 0; k < bucket_count && !buckets[order[k]].empty(); ++k) {
+        const vector<int> &bucket = buckets[order[k]];
+        uint32_t seed = 1;
+        for (; seed < MAX_SEED; ++seed) {
+            taken.clear();
+            for (size_t j = 0; j < bucket.size(); ++j) {
+                const string &path = inputs[bucket[j]].path;
+                uint32_t slot = bundle_hash(path.data(), path.size(), seed) % n;
+                if ((*slots)[slot] >= 0 || find(taken.begin(), taken.end(), slot) != taken.end()) {
+                    break;
+                }
+                taken.push_back(slot);
+            }
+            if (taken.size() == bucket.size()) {
+                break;
+            }
+        }
+        if (seed == MAX_SEED) {
+            return false;
+        }
+        (*seeds)[order[k]] = seed;
+        for (size_t j = 0; j < bucket.size(); ++j) {
+            (*slots)[taken[j]] = bucket[j];
+        }
+    }
+    return true;
+}
+
+static uint64_t align(uint64_t offset, uint64_t to) {
+    return (offset + to - 1) / to * to;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        printf("usage: %s directory out.bundle\n", argv[0]);
+        return 1;
+    }
+    vector<input> inputs;
+    walk(argv[1], "", &inputs);
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        encode(&inputs[i]);
+    }
+
+    uint32_t n = inputs.size();
+    uint32_t bucket_count = n / 2 + 1;
+    vector<uint32_t> seeds;
+    vector<int> slots;
+    if (!place(inputs, bucket_count, &seeds, &slots)) {
+        fprintf(stderr, "no perfect hash found for %u paths\n", n);
+        return 1;
+    }
+
+    bundle_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC));
+    header.version = BUNDLE_VERSION;
+    header.asset_count = n;
+    header.bucket_count = bucket_count;
+    header.displacements = sizeof(header);
+    header.assets = align(header.displacements + bucket_count * sizeof(uint32_t), sizeof(uint64_t));
+    uint64_t strings_base = header.assets + (uint64_t)n * sizeof(bundle_asset);
+
+    string strings, data;
+    vector<bundle_asset> assets(n);
+    int encoded = 0;
+    // Strings and bodies are appended in slot order, offsets are made absolute once the strings are done
+    auto add_string = [&strings, strings_base](const string &s) {
+        bundle_string out = {(uint32_t)(strings_base + strings.size()), (uint32_t)s.size()};
+        strings += s;
+        strings += '\0';
+        return out;
+    };
+    for (uint32_t slot = 0; slot < n; ++slot) {
+        const input &in = inputs[slots[slot]];
+        bundle_asset &a = assets[slot];
+        memset(&a, 0, sizeof(a));
+        const file_type *type = file_type_of(in.path.c_str());
+        char last_modified[validator_cache::DATE_LEN];
+        http_date(in.st.st_mtime, last_modified, sizeof(last_modified));
+        a.path = add_string(in.path);
+        a.content_type = add_string(type ? type->content_type : "");
+        a.last_modified = add_string(last_modified);
+        a.mtime = in.st.st_mtime;
+        a.compressible = type && type->compressible;
+        a.encodings = in.encodings;
+        for (int e = 0; e < BUNDLE_ENCODINGS; ++e) {
+            if (!(in.encodings & (1 << e))) {
+                continue;
+            }
+            const string &body = in.bodies[e];
+            bundle_body &b = a.bodies[e];
+            char etag[validator_cache::ETAG_LEN];
+            snprintf(etag, sizeof(etag), "\"%llx-%llx\"",
+                     (unsigned long long)bundle_hash(body.data(), body.size(), 0), (unsigned long long)body.size());
+            string headers;
+            if (type) {
+                headers = string("Content-Type:") + type->content_type + "\r\n";
+            }
+            if (e > 0) {
+                headers += string("Content-Encoding:") + encoding_names[e] + "\r\n";
+                encoded++;
+            }
+            b.etag = add_string(etag);
+            b.validators = add_string(string("ETag:") + etag + "\r\nLast-Modified:" + last_modified + "\r\n");
+            b.headers = add_string(headers);
+            data.resize(align(data.size(), 64));
+            b.offset = data.size();
+            b.size = body.size();
+            data += body;
+        }
+    }
+    uint64_t data_base = align(strings_base + strings.size(), 64);
+    for (uint32_t slot = 0; slot < n; ++slot) {
+        for (int e = 0; e < BUNDLE_ENCODINGS; ++e) {
+            if (assets[slot].encodings & (1 << e)) {
+                assets[slot].bodies[e].offset += data_base;
+            }
+        }
+    }
+    header.size = data_base + data.size();
+
+    string tmp = string(argv[2]) + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f) {
+        fprintf(stderr, "cannot write %s\n", tmp.c_str());
+        return 1;
+    }
+    string pad(64, '\0');
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(seeds.data(), sizeof(uint32_t), bucket_count, f);
+    fwrite(pad.data(), 1, header.assets - header.displacements - bucket_count * sizeof(uint32_t), f);
+    fwrite(assets.data(), sizeof(bundle_asset), n, f);
+    fwrite(strings.data(), 1, strings.size(), f);
+    fwrite(pad.data(), 1, data_base - strings_base - strings.size(), f);
+    fwrite(data.data(), 1, data.size(), f);
+    if (fclose(f) != 0 || rename(tmp.c_str(), argv[2]) != 0) {
+        fprintf(stderr, "cannot write %s\n", argv[2]);
+        return 1;
+    }
+    printf("packed %u assets and %d compressed bodies from %s into %s, %llu bytes\n", n, encoded, argv[1], argv[2],
+           (unsigned long long)header.size);
+    return 0;
+}
@@ -0,0 +1,247 @@
+#include <algorithm>
+#include <map>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "topk.h"
+
+__thread heavy_hitters::shard *heavy_hitters::t_shard = NULL;
+
+void space_saving::clear() {
+    m_size = 0;
+    memset(m_index, 0, sizeof(m_index));
+}
+
+int space_saving::find(const char *key, int len, unsigned long long hash) const {
+    for (int slot = hash & (SLOTS - 1); m_index[slot]; slot = (slot + 1) & (SLOTS - 1)) {
+        const entry &e = m_entries[m_index[slot] - 1];
+        if (e.hash == hash && e.len == len && memcmp(e.key, key, len) == 0) {
+            return m_index[slot] - 1;
+        }
+    }
+    return -1;
+}
+
+void space_saving::index_insert(int heap_idx) {
+    int slot = m_entries[heap_idx].hash & (SLOTS - 1);
+    while (m_index[slot]) {
+        slot = (slot + 1) & (SLOTS - 1);
+    }
+    m_index[slot] = heap_idx + 1;
+    m_slot[heap_idx] = slot;
+}
+
+// Linear probing deletion by backward shift, so lookups never need tombstones
+void space_saving::index_remove(int heap_idx) {
+    int hole = m_slot[heap_idx];
+    m_index[hole] = 0;
+    for (int slot = (hole + 1) & (SLOTS - 1); m_index[slot]; slot = (slot + 1) & (SLOTS - 1)) {
+        int home = m_entries[m_index[slot] - 1].hash & (SLOTS - 1);
+        // The entry can move into the hole unless its home lies cyclically in (hole, slot]
+        bool stays = hole <= slot ? (home > hole && home <= slot) : (home > hole || home <= slot);
+        if (!stays) {
+            m_index[hole] = m_index[slot];
+            m_slot[m_index[hole] - 1] = hole;
+            m_index[slot] = 0;
+            hole = slot;
+        }
+    }
+}
+
+void space_saving::swap_entries(int a, int b) {
+    entry tmp = m_entries[a];
+    m_entries[a] = m_entries[b];
+    m_entries[b] = tmp;
+    unsigned char slot = m_slot[a];
+    m_slot[a] = m_slot[b];
+    m_slot[b] = slot;
+    m_index[m_slot[a]] = a + 1;
+    m_index[m_slot[b]] = b + 1;
+}
+
+void space_saving::sift(int i) {
+    while (i > 0 && m_entries[(i - 1) / 2].count > m_entries[i].count) {
+        swap_entries(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while (true) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < m_size && m_entries[left].count < m_entries[smallest].count) {
+            smallest = left;
+        }
+        if (right < m_size && m_entries[right].count < m_entries[smallest].count) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            break;
+        }
+        swap_entries(i, smallest);
+        i = smallest;
+    }
+}
+
+void space_saving::add(const char *key, int len, unsigned long long hash, unsigned long long weight) {
+    if (len > KEY_LEN) {
+        len = KEY_LEN;
+    }
+    int i = find(key, len, hash);
+    if (i < 0) {
+        if (m_size < K) {
+            i = m_size++;
+            m_entries[i].count = 0;
+            m_entries[i].error = 0;
+        } else {
+            // Evict the lightest key, the newcomer may have been counted under it
+            i = 0;
+            index_remove(0);
+            m_entries[0].error = m_entries[0].count;
+        }
+        entry &e = m_entries[i];
+        e.hash = hash;
+        e.len = len;
+        memcpy(e.key, key, len);
+        index_insert(i);
+    }
+    m_entries[i].count += weight;
+    sift(i);
+}
+
+static unsigned long long fnv1a(const char *data, int len) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (int i = 0; i < len; ++i) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+heavy_hitters::shard *heavy_hitters::local() {
+    if (!t_shard) {
+        m_mutex.lock();
+        if (!m_free.empty()) {
+            t_shard = m_free.back();
+            m_free.pop_back();
+        } else {
+            t_shard = new shard();
+            m_shards.push_back(t_shard);
+            if (m_free.capacity() < m_shards.capacity()) {
+                m_free.reserve(m_shards.capacity());
+            }
+        }
+        m_mutex.unlock();
+        pthread_setspecific(m_exit_key, t_shard);
+    }
+    return t_shard;
+}
+
+void heavy_hitters::release_shard(void *s) {
+    heavy_hitters *h = get_instance();
+    t_shard = NULL;
+    h->m_mutex.lock();
+    h->m_free.push_back((shard *)s);
+    h->m_mutex.unlock();
+}
+
+// The URL is keyed without its query string or fragment and with repeated slashes collapsed
+void heavy_hitters::record(unsigned int addr, const char *url, unsigned long long bytes) {
+    char path[space_saving::KEY_LEN];
+    int len = 0;
+    if (!url) {
+        url = "-";
+    }
+    for (const char *p = url; *p && *p != '?' && *p != '#' && len < space_saving::KEY_LEN; ++p) {
+        if (*p == '/' && len > 0 && path[len - 1] == '/') {
+            continue;
+        }
+        path[len++] = *p;
+    }
+    unsigned long long addr_hash = fnv1a((const char *)&addr, sizeof(addr));
+    unsigned long long url_hash = fnv1a(path, len);
+
+    shard *s = local();
+    s->lock.lock();
+    s->current[ADDR_REQUESTS].add((const char *)&addr, sizeof(addr), addr_hash, 1);
+    s->current[ADDR_BYTES].add((const char *)&addr, sizeof(addr), addr_hash, bytes);
+    s->current[URL_REQUESTS].add(path, len, url_hash, 1);
+    s->current[URL_BYTES].add(path, len, url_hash, bytes);
+    s->lock.unlock();
+}
+
+void heavy_hitters::rotate() {
+    m_mutex.lock();
+    for (size_t i = 0; i < m_shards.size(); ++i) {
+        shard *s = m_shards[i];
+        s->lock.lock();
+        for (int d = 0; d < DIMENSION_NUM; ++d) {
+            s->previous[d] = s->current[d];
+            s->current[d].clear();
+        }
+        s->lock.unlock();
+    }
+    m_mutex.unlock();
+}
+
+struct merged_entry {
+    string key;
+    unsigned long long count;
+    unsigned long long error;
+};
+
+static bool heavier(const merged_entry &a, const merged_entry &b) {
+    return a.count > b.count;
+}
+
+// Counts of a key are summed over shards and windows. A key evicted from one summary but kept in another
+// is undercounted there, the report is an estimate of who dominates rather than exact accounting.
+void heavy_hitters::render(string &out, int top) {
+    static const char *titles[DIMENSION_NUM] = {"clients by requests", "clients by bytes sent", "urls by requests",
+                                                "urls by bytes sent"};
+    map<string, merged_entry> merged[DIMENSION_NUM];
+    m_mutex.lock();
+    for (size_t i = 0; i < m_shards.size(); ++i) {
+        shard *s = m_shards[i];
+        s->lock.lock();
+        for (int d = 0; d < DIMENSION_NUM; ++d) {
+            const space_saving *windows[2] = {&s->previous[d], &s->current[d]};
+            for (int w = 0; w < 2; ++w) {
+                for (int e = 0; e < windows[w]->size(); ++e) {
+                    const space_saving::entry &src = windows[w]->at(e);
+                    string key(src.key, src.len);
+                    merged_entry &dst = merged[d][key];
+                    dst.key = key;
+                    dst.count += src.count;
+                    dst.error += src.error;
+                }
+            }
+        }
+        s->lock.unlock();
+    }
+    m_mutex.unlock();
+
+    char line[160];
+    for (int d = 0; d < DIMENSION_NUM; ++d) {
+        vector<merged_entry> ranked;
+        for (map<string, merged_entry>::iterator it = merged[d].begin(); it != merged[d].end(); ++it) {
+            ranked.push_back(it->second);
+        }
+        sort(ranked.begin(), ranked.end(), heavier);
+        snprintf(line, sizeof(line), "# %s\n%-4s %-64s %14s %14s\n", titles[d], "rank", "key", "count", "error");
+        out += line;
+        for (int r = 0; r < top && r < (int)ranked.size(); ++r) {
+            char name[space_saving::KEY_LEN + 1];
+            if (d == ADDR_REQUESTS || d == ADDR_BYTES) {
+                struct in_addr addr;
+                memcpy(&addr, ranked[r].key.data(), sizeof(addr));
+                inet_ntop(AF_INET, &addr, name, sizeof(name));
+            } else {
+                snprintf(name, sizeof(name), "%s", ranked[r].key.c_str());
+            }
+            snprintf(line, sizeof(line), "%-4d %-64s %14llu %14llu\n", r + 1, name, ranked[r].count, ranked[r].error);
+            out += line;
+        }
+        out += "\n";
+    }
+}
@@ -0,0 +1,100 @@
+#ifndef TOPK_H
+#define TOPK_H
+
+#include <string>
+#include <vector>
+
+#include "locker.h"
+
+using namespace std;
+
+// Space-Saving summary of the K heaviest keys of a weighted stream, in fixed storage. Entries sit in a
+// min-heap by count with an open-addressing index from key to heap slot, so an update costs one probe and a
+// sift bounded by log2(K). A key not tracked replaces the lightest entry and inherits its count as error,
+// so count overestimates the key's true weight by at most error.
+class space_saving {
+public:
+    static const int K = 32;
+    static const int KEY_LEN = 64;
+
+    struct entry {
+        unsigned long long hash;
+        unsigned long long count;
+        unsigned long long error;
+        unsigned short len;
+        char key[KEY_LEN];
+    };
+
+    space_saving() { clear(); }
+    void clear();
+    void add(const char *key, int len, unsigned long long hash, unsigned long long weight);
+    int size() const { return m_size; }
+    const entry &at(int i) const { return m_entries[i]; }
+
+private:
+    static const int SLOTS = 2 * K;
+
+    int find(const char *key, int len, unsigned long long hash) const;
+    void sift(int i);
+    void swap_entries(int a, int b);
+    void index_insert(int heap_idx);
+    void index_remove(int heap_idx);
+
+private:
+    entry m_entries[K];
+    int m_size;
+    // Heap slot + 1 of the entry whose hash probes here, 0 for an empty slot
+    unsigned char m_index[SLOTS];
+    // Index slot of each entry, kept in step with heap swaps
+    unsigned char m_slot[K];
+};
+
+// Heaviest clients and URLs by requests and by bytes sent, fed by the reactor when a response completes.
+// Every updating thread owns a shard of four summaries. The timer tick closes the current window of each
+// shard into its previous one, and /debug/topk merges the previous and current windows of all shards,
+// so the report covers the last one to two timer periods. Memory is fixed per shard.
+class heavy_hitters {
+public:
+    enum DIMENSION {
+        ADDR_REQUESTS = 0,
+        ADDR_BYTES,
+        URL_REQUESTS,
+        URL_BYTES,
+        DIMENSION_NUM
+    };
+
+    static heavy_hitters *get_instance() {
+        static heavy_hitters instance;
+        return &instance;
+    }
+
+    // addr in network byte order, url as requested, bytes written for the response
+    void record(unsigned int addr, const char *url, unsigned long long bytes);
+    // Start a new window on every shard, called from the timer tick
+    void rotate();
+    // Top entries of every dimension as text
+    void render(string &out, int top = 10);
+
+private:
+    struct shard {
+        shard() : lock("topk") {}
+        locker lock;
+        space_saving current[DIMENSION_NUM];
+        space_saving previous[DIMENSION_NUM];
+    };
+
+    heavy_hitters() : m_mutex("topk.shards") { pthread_key_create(&m_exit_key, release_shard); }
+    // Shard of the calling thread, one left by a thread that exited if there is one
+    shard *local();
+    // Thread exit hook, the shard goes to the next thread that needs one and ages out of the windows
+    static void release_shard(void *s);
+
+    static __thread shard *t_shard;
+    vector<shard *> m_shards;
+    // Shards of exited threads, still merged
+    vector<shard *> m_free;
+    pthread_key_t m_exit_key;
+    locker m_mutex;
+};
+
+#endif
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+int tracer::m_sample_every = 0;
+unsigned long long tracer::m_slow_ns = 0;
+unsigned long long tracer::m_next_id = 0;
+__thread trace_ring *tracer::t_ring = NULL;
+__thread int tracer::t_tid = 0;
+vector<trace_ring *> tracer::m_rings;
+vector<trace_ring *> tracer::m_free;
+pthread_key_t tracer::m_exit_key;
+pthread_once_t tracer::m_key_once = PTHREAD_ONCE_INIT;
+locker tracer::m_mutex("tracer");
+__thread request_trace *request_trace::t_current = NULL;
+
+void tracer::configure(int sample_every, int slow_ms) {
+    m_sample_every = sample_every > 0 ? sample_every : 0;
+    m_slow_ns = slow_ms > 0 ? slow_ms * 1000000ULL : 0;
+}
+
+int tracer::tid() {
+    if (!t_tid) {
+        t_tid = syscall(SYS_gettid);
+    }
+    return t_tid;
+}
+
+unsigned long long tracer::next_id(bool &sampled) {
+    unsigned long long id = __atomic_add_fetch(&m_next_id, 1, __ATOMIC_RELAXED);
+    sampled = m_sample_every > 0 && id % m_sample_every == 0;
+    return id;
+}
+
+void tracer::create_key() {
+    pthread_key_create(&m_exit_key, release_ring);
+}
+
+trace_ring *tracer::ring() {
+    if (!t_ring) {
+        pthread_once(&m_key_once, create_key);
+        m_mutex.lock();
+        if (!m_free.empty()) {
+            t_ring = m_free.back();
+            m_free.pop_back();
+        } else {
+            t_ring = new trace_ring();
+            m_rings.push_back(t_ring);
+            if (m_free.capacity() < m_rings.capacity()) {
+                m_free.reserve(m_rings.capacity());
+            }
+        }
+        m_mutex.unlock();
+        // Events carry the tid of the thread that committed them, the ring's is its current owner
+        t_ring->tid = tid();
+        pthread_setspecific(m_exit_key, t_ring);
+    }
+    return t_ring;
+}
+
+void tracer::release_ring(void *ring) {
+    t_ring = NULL;
+    m_mutex.lock();
+    m_free.push_back((trace_ring *)ring);
+    m_mutex.unlock();
+}
+
+void tracer::commit(const trace_event *events, int n) {
+    trace_ring *r = ring();
+    unsigned long long head = r->head;
+    for (int i = 0; i < n; ++i) {
+        r->events[(head + i) & (trace_ring::SIZE - 1)] = events[i];
+    }
+    __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+}
+
+void tracer::render(string &out) {
+    char line[256];
+    bool first = true;
+    out += "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    m_mutex.lock();
+    vector<trace_ring *> rings = m_rings;
+    m_mutex.unlock();
+    for (size_t r = 0; r < rings.size(); ++r) {
+        trace_ring *ring = rings[r];
+        unsigned long long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned long long begin = head > (unsigned long long)trace_ring::SIZE ? head - trace_ring::SIZE : 0;
+        for (unsigned long long i = begin; i < head; ++i) {
+            trace_event ev = ring->events[i & (trace_ring::SIZE - 1)];
+            // The owner may have wrapped around while we were copying, drop what it overwrote
+            unsigned long long now_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            if (now_head > i + trace_ring::SIZE) {
+                continue;
+            }
+            snprintf(line, sizeof(line),
+                     "%s{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,"
+                     "\"args\":{\"trace_id\":%llu}}",
+                     first ? "" : ",\n", ev.name, ev.start_ns / 1000.0, ev.dur_ns / 1000.0, ev.tid, ev.trace_id);
+            out += line;
+            first = false;
+        }
+    }
+    out += "\n]}\n";
+}
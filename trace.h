@@ -0,0 +1,141 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <vector>
+#include <time.h>
+
+#include "locker.h"
+
+using namespace std;
+
+// One timed stage of a request
+struct trace_event {
+    const char *name;
+    unsigned long long trace_id;
+    unsigned long long start_ns;
+    unsigned long long dur_ns;
+    int tid;
+};
+
+// Ring of committed events owned by one thread, older events are overwritten
+struct trace_ring {
+    static const int SIZE = 1 << 14;
+    trace_event events[SIZE];
+    // Number of events ever written, published with release ordering
+    unsigned long long head;
+    int tid;
+};
+
+// Request tracing in Chrome trace-event format. Requests are picked 1-in-N at their start, and with a slow
+// threshold every request is recorded and kept only if it took longer. Committed spans go to a lock-free
+// ring of the committing thread, and the rings are merged into JSON when /debug/trace is read.
+class tracer {
+public:
+    // sample_every 0 disables sampling, slow_ms 0 disables slow request capture
+    static void configure(int sample_every, int slow_ms);
+    static bool enabled() { return m_sample_every > 0 || m_slow_ns > 0; }
+    static unsigned long long now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+    static int tid();
+    // New trace id, sampled is set when the request is picked by 1-in-N sampling
+    static unsigned long long next_id(bool &sampled);
+    static unsigned long long slow_ns() { return m_slow_ns; }
+    static void commit(const trace_event *events, int n);
+    // Append the Chrome trace-event JSON of every buffered event
+    static void render(string &out);
+
+private:
+    static trace_ring *ring();
+    // Thread exit hook, the ring goes to the next thread that commits and its events stay readable
+    static void release_ring(void *ring);
+    static void create_key();
+
+    static int m_sample_every;
+    static unsigned long long m_slow_ns;
+    static unsigned long long m_next_id;
+    static __thread trace_ring *t_ring;
+    static __thread int t_tid;
+    static vector<trace_ring *> m_rings;
+    // Rings of exited threads
+    static vector<trace_ring *> m_free;
+    static pthread_key_t m_exit_key;
+    static pthread_once_t m_key_once;
+    static locker m_mutex;
+};
+
+// Spans of one request, filled by whichever thread runs each stage and committed when the response is written.
+// Stages of one request never run concurrently, so no locking is needed.
+class request_trace {
+public:
+    static const int MAX_SPANS = 16;
+
+    request_trace() : m_id(0), m_begin_ns(0), m_mark_ns(0), m_sampled(false), m_recording(false), m_count(0) {}
+
+    // Start tracing the next request on the connection
+    void start() {
+        m_count = 0;
+        m_begin_ns = 0;
+        m_mark_ns = 0;
+        m_recording = false;
+        if (tracer::enabled()) {
+            m_id = tracer::next_id(m_sampled);
+            m_recording = m_sampled || tracer::slow_ns() > 0;
+        }
+    }
+    // Timestamp for a later span, 0 when the request is not recorded
+    unsigned long long now() const { return m_recording ? tracer::now() : 0; }
+    // Record a span from start to now, ignored for start 0
+    void span(const char *name, unsigned long long start) {
+        if (!start || !m_recording || m_count == MAX_SPANS) {
+            return;
+        }
+        if (!m_begin_ns) {
+            m_begin_ns = start;
+        }
+        trace_event &ev = m_events[m_count++];
+        ev.name = name;
+        ev.trace_id = m_id;
+        ev.start_ns = start;
+        ev.dur_ns = tracer::now() - start;
+        ev.tid = tracer::tid();
+    }
+    // Remember when the request left one stage, e.g. was queued for a worker
+    void mark() { m_mark_ns = now(); }
+    unsigned long long marked() const { return m_mark_ns; }
+    // Response written: keep the spans if sampled or slower than the threshold
+    void finish() {
+        if (m_recording && m_count > 0 &&
+            (m_sampled || (tracer::slow_ns() > 0 && tracer::now() - m_begin_ns >= tracer::slow_ns()))) {
+            tracer::commit(m_events, m_count);
+        }
+        m_recording = false;
+    }
+
+    // Trace of the request the calling worker is processing, for stages outside the handler such as the database
+    static request_trace *current() { return t_current; }
+    static void set_current(request_trace *trace) { t_current = trace; }
+
+private:
+    unsigned long long m_id;
+    unsigned long long m_begin_ns;
+    unsigned long long m_mark_ns;
+    bool m_sampled;
+    bool m_recording;
+    int m_count;
+    trace_event m_events[MAX_SPANS];
+    static __thread request_trace *t_current;
+};
+
+// Timestamp and span for the request processed by the calling thread, if any
+#define TRACE_NOW() (request_trace::current() ? request_trace::current()->now() : 0ULL)
+#define TRACE_SPAN(name, start)                       \
+    do {                                              \
+        if (request_trace::current())                 \
+            request_trace::current()->span(name, start); \
+    } while (0)
+
+#endif
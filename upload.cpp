@@ -0,0 +1,325 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "upload.h"
+#include "log.h"
+#include "metrics.h"
+
+int upload::s_dirfd = -1;
+long long upload::s_max_bytes = 0;
+// Names files get while they are linked in, before the rename over their final name
+static unsigned int temp_sequence = 0;
+// Pieces of form bodies read off pipes, one per worker thread, allocated on its first form and freed when the
+// thread exits
+static __thread char *t_form_buffer = NULL;
+static pthread_key_t form_buffer_key;
+static pthread_once_t form_buffer_once = PTHREAD_ONCE_INIT;
+
+static void freeFormBuffer(void *buffer) {
+    t_form_buffer = NULL;
+    delete[] (char *)buffer;
+}
+
+static void createFormBufferKey() {
+    pthread_key_create(&form_buffer_key, freeFormBuffer);
+}
+
+// A file name of the upload directory: no path separators, control characters or leading dot
+static bool validName(const char *name) {
+    if (name[0] == '\0' || name[0] == '.') {
+        return false;
+    }
+    for (const char *p = name; *p; ++p) {
+        if (*p == '/' || *p == '\\' || (unsigned char)*p < 0x20 || *p == 0x7f) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool upload::configure(const char *dir, long long max_bytes) {
+    int dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) {
+        return false;
+    }
+    int fd = openat(dirfd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG_ERROR("cannot create unnamed files in %s, errno %d", dir, errno);
+        close(dirfd);
+        return false;
+    }
+    close(fd);
+    s_dirfd = dirfd;
+    s_max_bytes = max_bytes;
+    return true;
+}
+
+upload::~upload() {
+    if (m_file >= 0) {
+        close(m_file);
+    }
+    if (m_pipe[0] >= 0) {
+        close(m_pipe[0]);
+        close(m_pipe[1]);
+    }
+}
+
+int upload::failure(int error) {
+    LOG_WARN("upload failed, errno %d", error);
+    switch (error) {
+        case ENOSPC:
+        case EDQUOT:
+            return 507;
+        case EACCES:
+        case EPERM:
+        case EROFS:
+        case EISDIR:
+            return 403;
+        default:
+            return 500;
+    }
+}
+
+char *upload::formBuffer() {
+    if (!t_form_buffer) {
+        t_form_buffer = new char[multipart_scanner::MAX_CARRY + FORM_BUFFER_SIZE];
+        pthread_once(&form_buffer_once, createFormBufferKey);
+        pthread_setspecific(form_buffer_key, t_form_buffer);
+    }
+    return t_form_buffer;
+}
+
+int upload::startPut(const char *url, long long length) {
+    const char *name = strrchr(url, '/') + 1;
+    size_t len = strcspn(name, "?#");
+    if (len >= sizeof(m_name)) {
+        return 400;
+    }
+    memcpy(m_name, name, len);
+    m_name[len] = '\0';
+    if (!validName(m_name)) {
+        return 400;
+    }
+    if (length > s_max_bytes) {
+        return 413;
+    }
+    m_length = length;
+    if (pipe2(m_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        return failure(errno);
+    }
+    fcntl(m_pipe[1], F_SETPIPE_SZ, PIPE_SIZE);
+    return openFile();
+}
+
+int upload::startForm(const char *content_type, long long length) {
+    if (!m_scanner.init(content_type)) {
+        return 400;
+    }
+    if (length > s_max_bytes) {
+        return 413;
+    }
+    m_form = true;
+    m_length = length;
+    if (pipe2(m_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        return failure(errno);
+    }
+    fcntl(m_pipe[1], F_SETPIPE_SZ, PIPE_SIZE);
+    return 0;
+}
+
+int upload::openFile() {
+    m_file = openat(s_dirfd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+    if (m_file < 0) {
+        return failure(errno);
+    }
+    m_stored = 0;
+    return 0;
+}
+
+int upload::writeFile(const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(m_file, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return failure(errno);
+        }
+        data += n;
+        len -= n;
+        m_stored += n;
+    }
+    return 0;
+}
+
+int upload::storeFile() {
+    // An unnamed file is linked through its /proc path, AT_EMPTY_PATH would take CAP_DAC_READ_SEARCH. linkat
+    // does not replace, so the file gets a temporary name first and is renamed over the old one.
+    char proc[32];
+    char temp[64];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", m_file);
+    snprintf(temp, sizeof(temp), ".upload-%d-%u", (int)getpid(), __atomic_add_fetch(&temp_sequence, 1, __ATOMIC_RELAXED));
+    if (linkat(AT_FDCWD, proc, s_dirfd, temp, AT_SYMLINK_FOLLOW) < 0) {
+        return failure(errno);
+    }
+    struct stat st;
+    bool created = fstatat(s_dirfd, m_name, &st, AT_SYMLINK_NOFOLLOW) < 0;
+    if (renameat(s_dirfd, temp, s_dirfd, m_name) < 0) {
+        int error = errno;
+        unlinkat(s_dirfd, temp, 0);
+        return failure(error);
+    }
+    close(m_file);
+    m_file = -1;
+    m_created |= created;
+    char line[320];
+    snprintf(line, sizeof(line), "%s %lld\n", m_name, m_stored);
+    m_report += line;
+    METRICS_ADD(M_UPLOAD_FILES, 1);
+    return 0;
+}
+
+int upload::consume(const char *data, size_t len) {
+    m_received += len;
+    METRICS_ADD(M_UPLOAD_BYTES, len);
+    if (!m_form) {
+        return writeFile(data, len);
+    }
+    char *buffer = formBuffer();
+    while (len > 0) {
+        size_t n = len < (size_t)FORM_BUFFER_SIZE ? len : FORM_BUFFER_SIZE;
+        memcpy(buffer + m_carry_len, data, n);
+        int status = scan(buffer, m_carry_len + n);
+        if (status) {
+            return status;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int upload::scan(char *data, size_t len) {
+    // The carried tail goes in front of the new bytes, the caller left room for it
+    memcpy(data, m_carry, m_carry_len);
+    size_t offset = 0;
+    while (true) {
+        size_t used;
+        const char *part;
+        size_t part_len;
+        multipart_scanner::event event = m_scanner.next(data + offset, len - offset, &used, &part, &part_len);
+        offset += used;
+        int status = 0;
+        switch (event) {
+            case multipart_scanner::PART: {
+                // Fields that are not files are skipped, a file keeps the last component of its name
+                const char *name = m_scanner.filename();
+                if (name[0] == '\0') {
+                    break;
+                }
+                const char *slash = strrchr(name, '/');
+                name = slash ? slash + 1 : name;
+                const char *backslash = strrchr(name, '\\');
+                name = backslash ? backslash + 1 : name;
+                if (!validName(name)) {
+                    return 400;
+                }
+                snprintf(m_name, sizeof(m_name), "%s", name);
+                status = openFile();
+                break;
+            }
+            case multipart_scanner::DATA:
+                if (m_file >= 0) {
+                    status = writeFile(part, part_len);
+                }
+                break;
+            case multipart_scanner::PART_END:
+                if (m_file >= 0) {
+                    status = storeFile();
+                }
+                break;
+            case multipart_scanner::END:
+                break;
+            case multipart_scanner::MALFORMED:
+                return 400;
+            case multipart_scanner::NEED_MORE:
+                m_carry_len = len - offset;
+                if (m_carry_len > sizeof(m_carry)) {
+                    return 400;
+                }
+                memcpy(m_carry, data + offset, m_carry_len);
+                return 0;
+        }
+        if (status) {
+            return status;
+        }
+    }
+}
+
+long upload::receive(int sockfd) {
+    long moved = 0;
+    while (m_buffered < PIPE_SIZE && m_received < m_length) {
+        long long want = m_length - m_received;
+        if (want > PIPE_SIZE - m_buffered) {
+            want = PIPE_SIZE - m_buffered;
+        }
+        // EAGAIN is the socket drained or the pipe full, a pipe left at its default size fills up early
+        ssize_t n = splice(sockfd, NULL, m_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        m_buffered += n;
+        m_received += n;
+        moved += n;
+    }
+    METRICS_ADD(M_UPLOAD_BYTES, moved);
+    return moved;
+}
+
+int upload::drain() {
+    while (m_buffered > 0) {
+        ssize_t n;
+        if (!m_form) {
+            n = splice(m_pipe[0], NULL, m_file, NULL, m_buffered, SPLICE_F_MOVE);
+            if (n > 0) {
+                m_stored += n;
+            }
+        } else {
+            n = read(m_pipe[0], formBuffer() + m_carry_len, m_buffered < FORM_BUFFER_SIZE ? m_buffered : FORM_BUFFER_SIZE);
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return failure(n < 0 ? errno : EIO);
+        }
+        m_buffered -= n;
+        if (m_form) {
+            int status = scan(formBuffer(), m_carry_len + n);
+            if (status) {
+                return status;
+            }
+        }
+    }
+    if (m_received < m_length) {
+        return 0;
+    }
+    if (!m_form) {
+        int status = storeFile();
+        if (status) {
+            return status;
+        }
+    } else if (!m_scanner.finished() || m_file >= 0) {
+        // The body ended inside a part
+        return 400;
+    }
+    return m_created ? 201 : 200;
+}
@@ -0,0 +1,91 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <string>
+
+#include "multipart.h"
+
+using namespace std;
+
+// A request body streamed into files under the upload directory (-U). The body of a PUT becomes the file named
+// by the last segment of its URL, each file part of a multipart/form-data POST the file named by its
+// filename. The reactor splices what the socket holds into the pipe of the upload. A worker then empties the
+// pipe: a PUT goes into its file with splice again, and a form goes through a buffer of the worker's thread
+// and multipart_scanner. The body is never held by the process. An upload costs a pipe of PIPE_SIZE bytes
+// and one open file, whatever its size. The socket is not read again until the pipe is empty, so a disk
+// slower than the client fills the client's TCP window instead of memory. Files are written unnamed
+// (O_TMPFILE) and linked into place once complete, so an upload cut short leaves nothing behind and a
+// replaced file changes all at once.
+class upload {
+public:
+    static const int PIPE_SIZE = 256 << 10;
+    // Bytes a worker reads off the pipe at a time for the scanner
+    static const int FORM_BUFFER_SIZE = 64 << 10;
+
+    // Store uploads in dir, refusing bodies longer than max_bytes, false when dir cannot take unnamed files
+    static bool configure(const char *dir, long long max_bytes);
+    static bool enabled() { return s_dirfd >= 0; }
+    static long long maxBytes() { return s_max_bytes; }
+
+    upload() : m_form(false), m_length(0), m_received(0), m_buffered(0), m_stored(0), m_file(-1),
+               m_created(false), m_carry_len(0) {
+        m_pipe[0] = m_pipe[1] = -1;
+        m_name[0] = '\0';
+    }
+    // Closes the pipe, and a file not yet linked disappears with its descriptor
+    ~upload();
+
+    // Start a PUT of length bytes to url, or a multipart/form-data POST with content_type. Return 0, or the
+    // status of the response when the upload is refused.
+    int startPut(const char *url, long long length);
+    int startForm(const char *content_type, long long length);
+    // Take len body bytes that arrived with the headers, 0 or the status of a failed upload
+    int consume(const char *data, size_t len);
+    // Reactor side: splice what the socket holds into the pipe, as much as the pipe and the body have room
+    // for. Bytes moved, 0 when none were ready, -1 when the client closed or the socket failed.
+    long receive(int sockfd);
+    // Worker side: move the pipe into the files. 0 while body bytes are still to come, otherwise the status
+    // of the response, 201 or 200 when the files were stored.
+    int drain();
+    // Body bytes not received yet
+    long long remaining() const { return m_length - m_received; }
+    // Body of the response, a line with the name and size of each file stored
+    const string &report() const { return m_report; }
+
+private:
+    // Open an unnamed file in the upload directory for the file m_name
+    int openFile();
+    // Give the open file its name, replacing a file of that name, and close it
+    int storeFile();
+    // Write len bytes of the current part or PUT into the open file
+    int writeFile(const char *data, size_t len);
+    // Feed len bytes, behind the carried ones, to the scanner, and carry what it leaves
+    int scan(char *data, size_t len);
+    // The form buffer of the calling thread, MAX_CARRY bytes for the carried tail and FORM_BUFFER_SIZE after it
+    static char *formBuffer();
+    // Status of the response for a failure with errno error
+    static int failure(int error);
+
+private:
+    static int s_dirfd;
+    static long long s_max_bytes;
+
+    bool m_form;
+    multipart_scanner m_scanner;
+    long long m_length;
+    long long m_received;
+    // Bytes in the pipe
+    long m_buffered;
+    long long m_stored;
+    int m_pipe[2];
+    int m_file;
+    char m_name[256];
+    // Set once a file was stored under a name that was free
+    bool m_created;
+    string m_report;
+    // Unconsumed tail of the last piece fed to the scanner
+    char m_carry[multipart_scanner::MAX_CARRY];
+    size_t m_carry_len;
+};
+
+#endif
@@ -0,0 +1,312 @@
+#include <mysql/mysql.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "user_store.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+#include "alloc_stats.h"
+
+bool mysql_user_store::load() {
+    MYSQL *mysql = NULL;
+    connectionRAII mysqlcon(&mysql, m_connPool);
+    if (!mysql) {
+        LOG_ERROR("%s", "no MySQL connection to load the user table");
+        return false;
+    }
+
+    if (mysql_query(mysql, "SELECT username, passwd FROM user")) {
+        LOG_ERROR("SELECT error:%s\n", mysql_error(mysql));
+        return false;
+    }
+
+    MYSQL_RES *result = mysql_store_result(mysql);
+    if (!result) {
+        return false;
+    }
+    m_lock.lock();
+    while (MYSQL_ROW row = mysql_fetch_row(result)) {
+        m_users[string(row[0])] = string(row[1]);
+    }
+    m_lock.unlock();
+    mysql_free_result(result);
+    return true;
+}
+
+bool mysql_user_store::verify(const char *name, const char *passwd) {
+    ALLOC_SCOPE(A_STORE);
+    m_lock.lock();
+    map<string, string, less<> >::iterator it = m_users.find(name);
+    bool ok = it != m_users.end() && it->second == passwd;
+    m_lock.unlock();
+    return ok;
+}
+
+bool mysql_user_store::exists(const char *name) {
+    ALLOC_SCOPE(A_STORE);
+    m_lock.lock();
+    bool found = m_users.find(name) != m_users.end();
+    m_lock.unlock();
+    return found;
+}
+
+user_store::ADD_RESULT mysql_user_store::add(const char *name, const char *passwd) {
+    ALLOC_SCOPE(A_STORE);
+    MYSQL *mysql = NULL;
+    unsigned long long acquire = TRACE_NOW();
+    connectionRAII mysqlcon(&mysql, m_connPool);
+    TRACE_SPAN("db_acquire", acquire);
+    if (!mysql) {
+        return FAILED;
+    }
+    char sql_insert[256];
+    snprintf(sql_insert, sizeof(sql_insert), "INSERT INTO user(username, passwd) VALUES('%s', '%s')", name, passwd);
+
+    // The lock serializes the check and the insert, the table has no unique key on username
+    ADD_RESULT ret = ADDED;
+    m_lock.lock();
+    if (m_users.find(name) != m_users.end() || m_reserved.find(name) != m_reserved.end()) {
+        ret = TAKEN;
+    } else {
+        unsigned long long start = METRICS_NOW();
+        unsigned long long traced = TRACE_NOW();
+        int err = mysql_query(mysql, sql_insert);
+        METRICS_RECORD(H_DB_QUERY, METRICS_NOW() - start);
+        TRACE_SPAN("db_query", traced);
+        if (err) {
+            LOG_ERROR("INSERT error:%s", mysql_error(mysql));
+            ret = FAILED;
+        } else {
+            m_users.insert(pair<string, string>(name, passwd));
+        }
+    }
+    m_lock.unlock();
+    return ret;
+}
+
+bool mysql_user_store::reserve(const char *name) {
+    m_lock.lock();
+    bool ok = m_users.find(name) == m_users.end() && m_reserved.insert(name).second;
+    m_lock.unlock();
+    return ok;
+}
+
+void mysql_user_store::settle(const char *name, const char *passwd, bool inserted) {
+    m_lock.lock();
+    set<string, less<> >::iterator it = m_reserved.find(name);
+    if (it != m_reserved.end()) {
+        m_reserved.erase(it);
+    }
+    if (inserted) {
+        m_users.insert(pair<string, string>(name, passwd));
+    }
+    m_lock.unlock();
+}
+
+local_user_store::local_user_store(const char *path) : m_path(path), m_fd(-1), m_size(0), m_lock("user_store.local"),
+                                                       m_synced_cond("user_store.synced"), m_written_cond("user_store.written"),
+                                                       m_written(0), m_synced(0), m_stop(false),
+                                                       m_syncing(false) {}
+
+local_user_store::~local_user_store() {
+    if (m_syncing) {
+        m_lock.lock();
+        m_stop = true;
+        m_lock.unlock();
+        m_written_cond.broadcast();
+        pthread_join(m_syncer, NULL);
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+unsigned int local_user_store::checksum(const char *data, size_t len, unsigned int hash) {
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+const string &local_user_store::key(const char *name) {
+    static thread_local string buf;
+    buf.assign(name);
+    return buf;
+}
+
+bool local_user_store::load() {
+    m_fd = open(m_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (m_fd < 0) {
+        LOG_ERROR("cannot open user store %s, errno is:%d", m_path.c_str(), errno);
+        return false;
+    }
+    struct stat st;
+    if (fstat(m_fd, &st) < 0) {
+        return false;
+    }
+
+    // Replay the log straight from the page cache, the last valid record ends the recovered state
+    off_t valid = 0;
+    if (st.st_size > 0) {
+        char *base = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+        if (base == MAP_FAILED) {
+            LOG_ERROR("cannot map user store %s", m_path.c_str());
+            return false;
+        }
+        madvise(base, st.st_size, MADV_SEQUENTIAL);
+        while (valid + (off_t)sizeof(record) <= st.st_size) {
+            record rec;
+            memcpy(&rec, base + valid, sizeof(rec));
+            off_t end = valid + sizeof(rec) + rec.name_len + rec.passwd_len;
+            if (rec.name_len == 0 || end > st.st_size) {
+                break;
+            }
+            const char *name = base + valid + sizeof(rec);
+            const char *passwd = name + rec.name_len;
+            if (checksum(passwd, rec.passwd_len, checksum(name, rec.name_len)) != rec.checksum) {
+                break;
+            }
+            m_users[string(name, rec.name_len)] = string(passwd, rec.passwd_len);
+            valid = end;
+        }
+        munmap(base, st.st_size);
+    }
+    if (valid < st.st_size) {
+        LOG_WARN("user store %s: dropping %lld bytes of torn records", m_path.c_str(), (long long)(st.st_size - valid));
+        if (ftruncate(m_fd, valid) < 0) {
+            return false;
+        }
+    }
+    m_size = valid;
+    LOG_INFO("user store %s: recovered %d users", m_path.c_str(), (int)m_users.size());
+
+    if (pthread_create(&m_syncer, NULL, syncer, this) != 0) {
+        return false;
+    }
+    m_syncing = true;
+    return true;
+}
+
+bool local_user_store::verify(const char *name, const char *passwd) {
+    ALLOC_SCOPE(A_STORE);
+    m_lock.lock();
+    unordered_map<string, string>::iterator it = m_users.find(key(name));
+    bool ok = it != m_users.end() && it->second == passwd;
+    m_lock.unlock();
+    return ok;
+}
+
+bool local_user_store::exists(const char *name) {
+    ALLOC_SCOPE(A_STORE);
+    m_lock.lock();
+    bool found = m_users.find(key(name)) != m_users.end();
+    m_lock.unlock();
+    return found;
+}
+
+// The user is indexed as soon as its record is written, so a concurrent registration of the same name fails,
+// the caller only gets ADDED once the record is durable. When the sync fails the user is taken out of the
+// index again, the record left in the log may still come back when it is replayed.
+user_store::ADD_RESULT local_user_store::add(const char *name, const char *passwd) {
+    ALLOC_SCOPE(A_STORE);
+    size_t name_len = strlen(name);
+    size_t passwd_len = strlen(passwd);
+    if (name_len == 0 || name_len > 0xffff || passwd_len > 0xffff) {
+        return FAILED;
+    }
+    char buf[sizeof(record) + 512];
+    string big;
+    char *data = buf;
+    size_t len = sizeof(record) + name_len + passwd_len;
+    if (len > sizeof(buf)) {
+        big.resize(len);
+        data = &big[0];
+    }
+    record rec;
+    rec.name_len = name_len;
+    rec.passwd_len = passwd_len;
+    rec.checksum = checksum(passwd, passwd_len, checksum(name, name_len));
+    memcpy(data, &rec, sizeof(rec));
+    memcpy(data + sizeof(rec), name, name_len);
+    memcpy(data + sizeof(rec) + name_len, passwd, passwd_len);
+
+    unsigned long long traced = TRACE_NOW();
+    m_lock.lock();
+    if (m_users.find(key(name)) != m_users.end()) {
+        m_lock.unlock();
+        return TAKEN;
+    }
+    if (pwrite(m_fd, data, len, m_size) != (ssize_t)len) {
+        LOG_ERROR("user store write error, errno is:%d", errno);
+        // Cut a partial record off so the following ones stay replayable
+        if (ftruncate(m_fd, m_size) < 0) {
+            LOG_ERROR("user store truncate error, errno is:%d", errno);
+        }
+        m_lock.unlock();
+        return FAILED;
+    }
+    m_size += len;
+    m_users[name] = passwd;
+    unsigned long long seq = ++m_written;
+    m_written_cond.signal();
+    while (m_synced < seq) {
+        m_synced_cond.wait(m_lock);
+    }
+    ADD_RESULT ret = ADDED;
+    if (syncFailed(seq)) {
+        m_users.erase(key(name));
+        ret = FAILED;
+    }
+    m_lock.unlock();
+    TRACE_SPAN("store_append", traced);
+    return ret;
+}
+
+void *local_user_store::syncer(void *arg) {
+    local_user_store *store = (local_user_store *)arg;
+    store->sync();
+    return NULL;
+}
+
+// Group commit: one fdatasync covers every record written before it started
+void local_user_store::sync() {
+    m_lock.lock();
+    while (true) {
+        while (m_synced == m_written && !m_stop) {
+            m_written_cond.wait(m_lock);
+        }
+        if (m_synced == m_written && m_stop) {
+            break;
+        }
+        unsigned long long target = m_written;
+        m_lock.unlock();
+        int ret = fdatasync(m_fd);
+        m_lock.lock();
+        if (ret < 0) {
+            LOG_ERROR("user store fdatasync error, errno is:%d", errno);
+            failed_batch batch = {m_synced + 1, target, target - m_synced};
+            m_failed.push_back(batch);
+        }
+        m_synced = target;
+        m_synced_cond.broadcast();
+    }
+    m_lock.unlock();
+}
+
+bool local_user_store::syncFailed(unsigned long long seq) {
+    for (size_t i = 0; i < m_failed.size(); i++) {
+        if (seq >= m_failed[i].first && seq <= m_failed[i].last) {
+            if (--m_failed[i].waiting == 0) {
+                m_failed.erase(m_failed.begin() + i);
+            }
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,117 @@
+#ifndef USER_STORE_H
+#define USER_STORE_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "locker.h"
+#include "connection_pool.h"
+
+using namespace std;
+
+// Storage of user credentials behind login and registration
+class user_store {
+public:
+    enum ADD_RESULT {
+        ADDED = 0,  // stored durably
+        TAKEN,      // user name already registered
+        FAILED      // storage error
+    };
+
+    virtual ~user_store() {}
+
+    // Load or recover the stored users, called once before serving
+    virtual bool load() = 0;
+    // True when name is registered with passwd
+    virtual bool verify(const char *name, const char *passwd) = 0;
+    // True when name is registered
+    virtual bool exists(const char *name) = 0;
+    // Register a new user
+    virtual ADD_RESULT add(const char *name, const char *passwd) = 0;
+};
+
+// Users in the MySQL user table, cached in memory at start-up so login needs no round trip
+class mysql_user_store : public user_store {
+public:
+    mysql_user_store(connection_pool *connPool) : m_connPool(connPool), m_lock("user_store.mysql") {}
+
+    bool load();
+    bool verify(const char *name, const char *passwd);
+    bool exists(const char *name);
+    ADD_RESULT add(const char *name, const char *passwd);
+    // Claim name for a registration run as a non-blocking query, false when it is registered or claimed
+    // already. The claim stands in for the lock add holds across its INSERT.
+    bool reserve(const char *name);
+    // Settle the claim on name once its INSERT completed, caching the user when it was stored
+    void settle(const char *name, const char *passwd, bool inserted);
+
+private:
+    connection_pool *m_connPool;
+    // Transparent comparator, lookups by const char * build no temporary string
+    map<string, string, less<> > m_users;
+    // Names claimed by registrations whose INSERT is in flight
+    set<string, less<> > m_reserved;
+    locker m_lock;
+};
+
+// Embedded store for single-node deployments: an append-only log of user records, indexed in memory.
+// The log is replayed through mmap at start-up, a torn record at its tail is cut off. Registrations append
+// their record and wait until a background thread has fdatasync'ed it, records written while a sync is in
+// progress share the next one.
+class local_user_store : public user_store {
+public:
+    local_user_store(const char *path);
+    ~local_user_store();
+
+    bool load();
+    bool verify(const char *name, const char *passwd);
+    bool exists(const char *name);
+    ADD_RESULT add(const char *name, const char *passwd);
+
+private:
+    // Record header in the log, followed by the name and password bytes
+    struct record {
+        unsigned short name_len;
+        unsigned short passwd_len;
+        unsigned int checksum;      // FNV-1a over name and password
+    };
+
+    static unsigned int checksum(const char *data, size_t len, unsigned int hash = 2166136261u);
+    // name copied into a per-thread string whose capacity is reused, so lookups do not allocate a key
+    static const string &key(const char *name);
+    static void *syncer(void *arg);
+    void sync();
+    // True when the record with sequence number seq was in a batch whose fdatasync failed, lock held
+    bool syncFailed(unsigned long long seq);
+
+private:
+    string m_path;
+    int m_fd;
+    // End of the last complete record
+    off_t m_size;
+    unordered_map<string, string> m_users;
+    locker m_lock;
+    cond m_synced_cond;
+    cond m_written_cond;
+    // Sequence numbers of the last record written and the last record made durable
+    unsigned long long m_written;
+    unsigned long long m_synced;
+    // Batches of records whose fdatasync failed: their first and last sequence numbers, and how many of their
+    // registrations have yet to see the failure. A failure only fails its own batch, later ones may succeed.
+    struct failed_batch {
+        unsigned long long first;
+        unsigned long long last;
+        unsigned long long waiting;
+    };
+    vector<failed_batch> m_failed;
+    bool m_stop;
+    bool m_syncing;
+    pthread_t m_syncer;
+};
+
+#endif
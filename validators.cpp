@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "validators.h"
+
+static const char *month_names[12] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                      "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+void http_date(time_t t, char *buf, size_t size) {
+    static const char *day_names[7] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    snprintf(buf, size, "%s, %02d %s %04d %02d:%02d:%02d GMT", day_names[tm.tm_wday], tm.tm_mday,
+             month_names[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+bool parse_http_date(const char *text, time_t *t) {
+    char day[4], month[4];
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    int used = 0;
+    if (sscanf(text, "%3s, %2d %3s %4d %2d:%2d:%2d GMT%n", day, &tm.tm_mday, month, &tm.tm_year, &tm.tm_hour,
+               &tm.tm_min, &tm.tm_sec, &used) != 7 || used == 0 || text[used] != '\0') {
+        return false;
+    }
+    tm.tm_mon = -1;
+    for (int i = 0; i < 12; ++i) {
+        if (strcmp(month, month_names[i]) == 0) {
+            tm.tm_mon = i;
+        }
+    }
+    if (tm.tm_mon < 0 || tm.tm_mday < 1 || tm.tm_mday > 31 || tm.tm_hour > 23 || tm.tm_min > 59 || tm.tm_sec > 60) {
+        return false;
+    }
+    tm.tm_year -= 1900;
+    *t = timegm(&tm);
+    return true;
+}
+
+bool etag_list_matches(const char *list, const char *etag) {
+    size_t etag_len = strlen(etag);
+    const char *p = list;
+    while (*p) {
+        p += strspn(p, " \t,");
+        if (*p == '*') {
+            return true;
+        }
+        if (strncmp(p, "W/", 2) == 0) {
+            p += 2;
+        }
+        // An entity tag is a quoted string without inner quotes
+        if (*p != '"') {
+            return false;
+        }
+        const char *end = strchr(p + 1, '"');
+        if (!end) {
+            return false;
+        }
+        if ((size_t)(end + 1 - p) == etag_len && strncmp(p, etag, etag_len) == 0) {
+            return true;
+        }
+        p = end + 1;
+    }
+    return false;
+}
+
+validator_cache::validator_cache() {
+    memset(m_entries, 0, sizeof(m_entries));
+}
+
+void validator_cache::lookup(const struct stat &st, char *etag, char *last_modified) {
+    unsigned long long hash = ((unsigned long long)st.st_ino ^ ((unsigned long long)st.st_dev << 32)) *
+                              0x9E3779B97F4A7C15ULL;
+    int slot = (int)(hash >> 54) & (SLOTS - 1);
+    stripe &s = m_stripes[slot & (STRIPES - 1)];
+    entry &e = m_entries[slot];
+    s.lock.lock();
+    if (!e.used || e.dev != st.st_dev || e.ino != st.st_ino || e.size != st.st_size ||
+        e.mtime.tv_sec != st.st_mtim.tv_sec || e.mtime.tv_nsec != st.st_mtim.tv_nsec) {
+        e.dev = st.st_dev;
+        e.ino = st.st_ino;
+        e.size = st.st_size;
+        e.mtime = st.st_mtim;
+        e.used = true;
+        snprintf(e.etag, ETAG_LEN, "\"%llx-%llx-%llx\"", (unsigned long long)st.st_ino,
+                 (unsigned long long)st.st_size,
+                 (unsigned long long)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec);
+        http_date(st.st_mtim.tv_sec, e.last_modified, DATE_LEN);
+    }
+    memcpy(etag, e.etag, ETAG_LEN);
+    memcpy(last_modified, e.last_modified, DATE_LEN);
+    s.lock.unlock();
+}
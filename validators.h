@@ -0,0 +1,58 @@
+#ifndef VALIDATORS_H
+#define VALIDATORS_H
+
+#include <sys/stat.h>
+#include <time.h>
+
+#include "locker.h"
+
+// Format t as an HTTP date, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+void http_date(time_t t, char *buf, size_t size);
+// Parse an HTTP date in the IMF-fixdate form above, false for anything else
+bool parse_http_date(const char *text, time_t *t);
+// True when the If-None-Match list names etag or is "*", comparing weakly as RFC 7232 asks for GET
+bool etag_list_matches(const char *list, const char *etag);
+
+// ETag and Last-Modified of files by inode, formatted once for every version of a file so that revalidating
+// costs a stat and a lookup. The strong ETag is "inode-size-mtime" in hex, with mtime in nanoseconds.
+// Direct mapped behind striped locks: a file hashing to a taken slot replaces its entry, and an entry whose
+// size or mtime no longer match the stat is formatted again.
+class validator_cache {
+public:
+    static const int ETAG_LEN = 64;
+    static const int DATE_LEN = 32;
+
+    static validator_cache *get_instance() {
+        static validator_cache instance;
+        return &instance;
+    }
+
+    // Copy the validators of the file st describes into etag[ETAG_LEN] and last_modified[DATE_LEN]
+    void lookup(const struct stat &st, char *etag, char *last_modified);
+
+private:
+    static const int SLOTS = 1024;
+    static const int STRIPES = 16;
+
+    struct entry {
+        dev_t dev;
+        ino_t ino;
+        off_t size;
+        struct timespec mtime;
+        bool used;
+        char etag[ETAG_LEN];
+        char last_modified[DATE_LEN];
+    };
+
+    validator_cache();
+
+    struct stripe {
+        stripe() : lock("validators") {}
+        locker lock;
+    };
+
+    entry m_entries[SLOTS];
+    stripe m_stripes[STRIPES];
+};
+
+#endif
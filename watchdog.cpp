@@ -0,0 +1,111 @@
+#include <execinfo.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "watchdog.h"
+#include "log.h"
+
+reactor_watchdog *reactor_watchdog::get_instance() {
+    static reactor_watchdog instance;
+    return &instance;
+}
+
+reactor_watchdog::reactor_watchdog() : m_running(false), m_stop(false), m_threshold_ns(0), m_iteration_start(0),
+                                       m_busy_since(0), m_iterations(0), m_dispatch("idle"), m_dispatch_since(0),
+                                       m_depth(0), m_captured(0) {}
+
+bool reactor_watchdog::init(int threshold_ms) {
+    m_reactor = pthread_self();
+    if (threshold_ms <= 0) {
+        return true;
+    }
+    m_threshold_ns = threshold_ms * 1000000ULL;
+
+    // The first backtrace() loads libgcc, which allocates, so it must not happen inside the handler
+    void *frame;
+    backtrace(&frame, 1);
+
+    struct sigaction sa;
+    memset(&sa, '\0', sizeof(sa));
+    sa.sa_handler = on_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGUSR2, &sa, NULL) < 0) {
+        return false;
+    }
+    if (pthread_create(&m_thread, NULL, worker, this) != 0) {
+        return false;
+    }
+    m_running = true;
+    return true;
+}
+
+void reactor_watchdog::stop() {
+    if (m_running) {
+        m_stop = true;
+        pthread_join(m_thread, NULL);
+        m_running = false;
+    }
+}
+
+void reactor_watchdog::on_signal(int) {
+    int save_errno = errno;
+    reactor_watchdog *wd = get_instance();
+    wd->m_depth = backtrace(wd->m_frames, MAX_FRAMES);
+    wd->m_captured = 1;
+    errno = save_errno;
+}
+
+void *reactor_watchdog::worker(void *arg) {
+    ((reactor_watchdog *)arg)->run();
+    return NULL;
+}
+
+// Poll at a quarter of the threshold, so a stall is caught at most 25% late. Each stalled iteration is
+// reported once however long it lasts.
+void reactor_watchdog::run() {
+    unsigned long long reported = (unsigned long long)-1;
+    useconds_t interval = m_threshold_ns / 4000;
+    while (!m_stop) {
+        usleep(interval);
+        unsigned long long since = __atomic_load_n(&m_busy_since, __ATOMIC_ACQUIRE);
+        unsigned long long iteration = __atomic_load_n(&m_iterations, __ATOMIC_RELAXED);
+        if (!since || iteration == reported) {
+            continue;
+        }
+        unsigned long long now = METRICS_NOW();
+        if (now > since && now - since >= m_threshold_ns) {
+            reported = iteration;
+            METRICS_ADD(M_REACTOR_STALLS, 1);
+            report(now - since);
+        }
+    }
+}
+
+void reactor_watchdog::report(unsigned long long busy) {
+    const char *kind = __atomic_load_n(&m_dispatch, __ATOMIC_RELAXED);
+    unsigned long long in_handler = METRICS_NOW() - __atomic_load_n(&m_dispatch_since, __ATOMIC_RELAXED);
+
+    m_captured = 0;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    pthread_kill(m_reactor, SIGUSR2);
+    for (int i = 0; i < 100 && !m_captured; ++i) {
+        usleep(1000);
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    LOG_WARN("reactor stalled: iteration busy for %llu ms, %llu ms in %s", busy / 1000000, in_handler / 1000000, kind);
+    if (m_captured) {
+        char **symbols = backtrace_symbols(m_frames, m_depth);
+        // Frame 0 is the signal handler and frame 1 the signal trampoline
+        for (int i = 2; symbols && i < m_depth; ++i) {
+            LOG_WARN("  #%d %s", i - 2, symbols[i]);
+        }
+        free(symbols);
+    } else {
+        LOG_WARN("%s", "  no backtrace, the reactor did not take the signal");
+    }
+    Log::get_instance()->flush();
+}
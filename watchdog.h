@@ -0,0 +1,74 @@
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <pthread.h>
+#include <signal.h>
+
+#include "metrics.h"
+
+// Stall detector for the reactor thread. The event loop stamps every iteration and every event it
+// dispatches, which feeds the loop histograms. A watchdog thread polls the stamps, and when one iteration
+// has been busy longer than the threshold it interrupts the reactor with SIGUSR2 to capture a backtrace
+// of whatever is blocking it, then logs the stalled handler and the symbolized frames. The handler is
+// installed with SA_RESTART, calls that are never restarted (sleeps, epoll_wait) return early with EINTR.
+class reactor_watchdog {
+public:
+    static const int MAX_FRAMES = 48;
+
+    static reactor_watchdog *get_instance();
+
+    // Watch the calling thread, which must be the reactor. threshold_ms 0 keeps the histograms and
+    // starts no watchdog thread.
+    bool init(int threshold_ms);
+    void stop();
+
+    // epoll_wait returned, the loop is busy until end_iteration
+    void begin_iteration() {
+        m_iteration_start = METRICS_NOW();
+        __atomic_store_n(&m_busy_since, m_iteration_start, __ATOMIC_RELEASE);
+    }
+    // About to handle one event or the timer, kind names it in stall reports. The time since the iteration
+    // started is the lag this event saw behind the ones dispatched before it.
+    void dispatch(const char *kind) {
+        unsigned long long now = METRICS_NOW();
+        METRICS_RECORD(H_REACTOR_LAG, now - m_iteration_start);
+        __atomic_store_n(&m_dispatch, kind, __ATOMIC_RELAXED);
+        __atomic_store_n(&m_dispatch_since, now, __ATOMIC_RELAXED);
+    }
+    // Going back to epoll_wait
+    void end_iteration() {
+        METRICS_RECORD(H_REACTOR_ITERATION, METRICS_NOW() - m_iteration_start);
+        __atomic_store_n(&m_busy_since, 0ULL, __ATOMIC_RELEASE);
+        __atomic_store_n(&m_iterations, m_iterations + 1, __ATOMIC_RELAXED);
+    }
+
+private:
+    reactor_watchdog();
+
+    static void *worker(void *arg);
+    void run();
+    // Interrupt the reactor and log its stack, busy is how long the iteration has run so far
+    void report(unsigned long long busy);
+    static void on_signal(int sig);
+
+private:
+    pthread_t m_reactor;
+    pthread_t m_thread;
+    bool m_running;
+    volatile bool m_stop;
+    unsigned long long m_threshold_ns;
+
+    // Written by the reactor, read by the watchdog
+    unsigned long long m_iteration_start;
+    unsigned long long m_busy_since;      // 0 while blocked in epoll_wait
+    unsigned long long m_iterations;
+    const char *m_dispatch;
+    unsigned long long m_dispatch_since;
+
+    // Filled by the signal handler on the reactor thread
+    void *m_frames[MAX_FRAMES];
+    int m_depth;
+    volatile sig_atomic_t m_captured;
+};
+
+#endif